@@ -33,7 +33,8 @@ static const char * versions[] = {
     "2.12", "2.13", "2.13", "2.14", "3.0.6", "3.1.0", // 76-81
     "3.1.0", "3.1.0", "3.1.0", "3.1.0", "3.1.0", "3.1.0", // 82-87
     "3.1.1", "3.1.3", "3.1.3", "3.1.3", "3.1.3", "3.2.0", // 88-93
-    "3.2.0", "3.2.0", "3.2.0", "3.2.0"
+    "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0", // 94-99
+    "3.2.0", "3.2.0", "3.2.0"
 };
 static int nv = sizeof( versions ) / sizeof( versions[0] );
 
@@ -426,54 +427,63 @@ struct TunableIndex {
     bool writing;
     bool reading;
     bool advanced;
+    bool fullText;
 } tunableIndices[] = {
     { "pn_b", "part_numbers",
       "CREATE INDEX pn_b ON part_numbers "
       "USING btree (bodypart)",
-      false, true, true },
+      false, true, true, true },
     { "af_mp", "address_fields",
       "CREATE INDEX af_mp ON address_fields "
       "USING btree (message, part)",
-      false, true, true },
+      false, true, true, true },
     { "fl_mu", "flags",
       "CREATE INDEX fl_mu ON flags "
       "USING btree (mailbox, uid)",
-      false, true, true },
+      false, true, true, true },
     { "dm_mud", "deleted_messages",
       "CREATE INDEX dm_mud ON deleted_messages "
       "USING btree (mailbox, uid, deleted_at)",
-      false, true, true },
+      false, true, true, true },
     { "mm_m", "mailbox_messages",
       "CREATE INDEX mm_m ON mailbox_messages "
       "USING btree (message)",
-      false, true, true },
+      false, true, true, true },
     { "dm_m", "deleted_messages",
       "CREATE INDEX dm_m ON deleted_messages "
       "USING btree (message)",
-      false, true, true },
+      false, true, true, true },
     { "df_m", "date_fields",
       "CREATE INDEX df_m ON date_fields "
       "USING btree (message)",
-      false, true, true },
+      false, true, true, true },
     { "hf_msgid", "header_fields",
       "CREATE INDEX hf_msgid ON header_fields "
       "USING btree (value) WHERE (field = 13)",
-      false, true, true },
+      false, true, true, true },
     { "dm_mm", "deleted_messages",
       "CREATE INDEX dm_mm ON deleted_messages "
       "USING btree (mailbox, modseq)",
-      false, true, true },
+      false, true, true, true },
     { "b_text", "bodyparts",
       "CREATE INDEX b_text ON bodyparts "
       "USING gin (to_tsvector('simple'::regconfig, text)) "
       "WHERE (octet_length(text) < (640000))",
-      false, false, true },
+      false, false, true, true },
     { "hf_subject", "header_fields",
       "CREATE INDEX hf_subject ON header_fields "
       "USING gin (to_tsvector('simple'::regconfig, value)) "
       "WHERE (octet_length(value) < (640000) and field=20)",
-      false, false, true },
-    { 0, 0, 0, false, false, false }
+      false, false, true, true },
+    { "b_trgm", "bodyparts",
+      "CREATE INDEX b_trgm ON bodyparts "
+      "USING gin (text gin_trgm_ops)",
+      false, false, false, true },
+    { "hf_trgm", "header_fields",
+      "CREATE INDEX hf_trgm ON header_fields "
+      "USING gin (value gin_trgm_ops)",
+      false, false, false, true },
+    { 0, 0, 0, false, false, false, false }
 };
 
 
@@ -481,28 +491,41 @@ class TuneDatabaseData
     : public Garbage
 {
 public:
-    TuneDatabaseData(): mode( Reading ), t( 0 ), find( 0 ), set( false ) {}
+    TuneDatabaseData()
+        : mode( Reading ), t( 0 ), find( 0 ), set( false ),
+          online( false ), create( 0 ), notify( 0 )
+    {}
     enum Mode {
-        Writing, Reading, Advanced
+        Writing, Reading, Advanced, FullText
     };
     Mode mode;
     Transaction * t;
     Query * find;
     bool set;
+    bool online;
+    List<Query> creates;
+    Query * create;
+    Query * notify;
 };
 
 
 static AoxFactory<TuneDatabase>
 f5( "tune", "database", "Adds or removes indices.",
-    "    Synopsis: aox tune database <mode>\n\n"
-    "    There are three modes: mostly-writing, mostly-reading and\n"
-    "    advanced-reading.\n"
+    "    Synopsis: aox tune database [-o] <mode>\n\n"
+    "    There are four modes: mostly-writing, mostly-reading,\n"
+    "    advanced-reading and full-text.\n"
     "    Mode mostly-writing tunes the database for fast message\n"
     "    injection at the cost of reading.\n"
     "    Mode mostly-reading tunes the database for message reading,\n"
     "    but without full-text indexing.\n"
     "    Mode advanced-reading tunes the database for fast message\n"
-    "    searching and reading, at the cost of injection speed.\n" );
+    "    searching and reading, at the cost of injection speed.\n"
+    "    Mode full-text additionally adds trigram indices (using the\n"
+    "    pg_trgm extension), so that substring searches in bodies and\n"
+    "    header fields can use an index.\n\n"
+    "    The -o flag builds new indices online, using CREATE INDEX\n"
+    "    CONCURRENTLY, so that Archiveopteryx can keep running while\n"
+    "    the indices are built.\n" );
 
 /*! \class TuneDatabase db.h
     This class handles the "aox tune database" command.
@@ -519,6 +542,7 @@ void TuneDatabase::execute()
 {
     if ( !d->t ) {
         parseOptions();
+        d->online = opt( 'o' ) > 0;
         EString mode = next().lower();
         if ( mode == "mostly-writing" )
             d->mode = TuneDatabaseData::Writing;
@@ -526,10 +550,12 @@ void TuneDatabase::execute()
             d->mode = TuneDatabaseData::Reading;
         else if ( mode == "advanced-reading" )
             d->mode = TuneDatabaseData::Advanced;
+        else if ( mode == "full-text" )
+            d->mode = TuneDatabaseData::FullText;
         else
             error( "Unknown database mode.\n"
-                   "Supported: mostly-writing, mostly-reading and "
-                   "advanced-reading" );
+                   "Supported: mostly-writing, mostly-reading, "
+                   "advanced-reading and full-text" );
         database( true );
 
         d->t = new Transaction( this );
@@ -568,6 +594,7 @@ void TuneDatabase::execute()
             if ( tunableIndices[i].name )
                 present.append( tunableIndices[i].name );
         }
+        bool trigrams = false;
         uint i = 0;
         while ( tunableIndices[i].name ) {
             bool wanted = false;
@@ -581,7 +608,12 @@ void TuneDatabase::execute()
             case TuneDatabaseData::Advanced:
                 wanted = tunableIndices[i].advanced;
                 break;
+            case TuneDatabaseData::FullText:
+                wanted = tunableIndices[i].fullText;
+                break;
             }
+            EString definition( tunableIndices[i].definition );
+            bool trigram = definition.contains( "gin_trgm_ops" );
             Query * q = 0;
             if ( wanted && !present.find( tunableIndices[i].name ) ) {
                 if ( EString( tunableIndices[i].name ) == "b_text" &&
@@ -589,9 +621,28 @@ void TuneDatabase::execute()
                     printf( "Error: "
                             "Full-text indexing needs PostgreSQL 8.3\n" );
                 }
+                else if ( trigram && Postgres::version() < 90100 ) {
+                    printf( "Error: "
+                            "Trigram indexing needs PostgreSQL 9.1\n" );
+                }
                 else {
-                    q = new Query( tunableIndices[i].definition, 0 );
-                    printf( "Executing %s;\n", tunableIndices[i].definition );
+                    if ( trigram && !trigrams ) {
+                        d->t->enqueue( "create extension if not exists "
+                                       "pg_trgm" );
+                        trigrams = true;
+                    }
+                    if ( d->online ) {
+                        // CREATE INDEX CONCURRENTLY cannot run inside
+                        // a transaction, so these wait until later.
+                        definition = "CREATE INDEX CONCURRENTLY " +
+                                     definition.mid( 13 );
+                        d->creates.append( new Query( definition, this ) );
+                        printf( "Will execute %s;\n", definition.cstr() );
+                    }
+                    else {
+                        q = new Query( definition, 0 );
+                        printf( "Executing %s;\n", definition.cstr() );
+                    }
                 }
             }
             else if ( present.find( tunableIndices[i].name ) && !wanted ) {
@@ -612,6 +663,32 @@ void TuneDatabase::execute()
     if ( !d->t->done() )
         return;
 
+    if ( d->t->failed() )
+        error( "Cannot tune database: " + d->t->error() );
+
+    while ( d->create || !d->creates.isEmpty() ) {
+        if ( d->create ) {
+            if ( !d->create->done() )
+                return;
+            if ( d->create->failed() )
+                error( "Couldn't create index: " + d->create->error() );
+            d->create = 0;
+        }
+        if ( !d->creates.isEmpty() ) {
+            d->create = d->creates.shift();
+            printf( "Executing %s;\n", d->create->string().cstr() );
+            d->create->execute();
+            d->notify = new Query( "notify database_retuned", this );
+        }
+    }
+
+    if ( d->notify ) {
+        if ( d->notify->state() == Query::Inactive )
+            d->notify->execute();
+        if ( !d->notify->done() )
+            return;
+    }
+
     finish();
 }
 
@@ -8,6 +8,7 @@
 #include "query.h"
 #include "ustring.h"
 #include "address.h"
+#include "injector.h"
 #include "transaction.h"
 #include "helperrowcreator.h"
 
@@ -44,7 +45,8 @@ public:
           threader( 0 ),
           messages( 0 ), byMessageId( 0 ),
           report( 0 ), temp( 0 ), update( 0 ),
-          sofar( 0 ), threading( true )
+          findKeys( 0 ), keys( 0 ),
+          sofar( 0 ), sorted( 0 ), threading( true )
         {}
 
     Transaction * t;
@@ -57,7 +59,11 @@ public:
     Query * temp;
     Query * update;
 
+    Query * findKeys;
+    Query * keys;
+
     uint sofar;
+    uint sorted;
 
     bool threading;
 };
@@ -70,7 +76,9 @@ f( "update", "database", "Update the database contents.",
    "    slow for inclusion in \"aox upgrade schema\". This command is\n"
    "    meant to be used while the server is running. It does its\n"
    "    work in small chunks, so it can be restarted at any time,\n"
-   "    and is tolerant of interruptions.\n" );
+   "    and is tolerant of interruptions.\n\n"
+   "    It threads messages which have no thread root, and adds the\n"
+   "    SORT keys for messages injected before those were stored.\n" );
 
 
 /*! \class UpdateDatabase updatedb.h
@@ -85,9 +93,19 @@ UpdateDatabase::UpdateDatabase( EStringList * args )
 
 void UpdateDatabase::execute()
 {
+    if ( d->threading )
+        thread();
     if ( !d->threading )
-        return;
+        addSortKeys();
+}
+
+
+/*! Threads up to 4096 messages at a time, until all messages have a
+    thread root.
+*/
 
+void UpdateDatabase::thread()
+{
     if ( !d->report ) {
         database( true );
         d->report
@@ -171,7 +189,9 @@ void UpdateDatabase::execute()
     if ( d->messages->isEmpty() ) {
         d->threading = false;
         printf( "All messages are now threaded.\n" );
-        finish();
+        d->t->commit();
+        d->t = 0;
+        d->sofar = 0;
         return;
     }
 
@@ -251,3 +271,126 @@ void UpdateDatabase::execute()
         d->t->commit();
     }
 }
+
+
+// Returns the address in the name, localpart and domain columns of r
+// prefixed by p, or a null pointer if the message has no such address.
+
+static Address * sortAddress( Row * r, const EString & p )
+{
+    EString localpart = p + "localpart";
+    if ( r->isNull( localpart.cstr() ) )
+        return 0;
+    EString name = p + "name";
+    UString n;
+    if ( !r->isNull( name.cstr() ) )
+        n = r->getUString( name.cstr() );
+    EString domain = p + "domain";
+    return new Address( n, r->getUString( localpart.cstr() ),
+                        r->getUString( domain.cstr() ) );
+}
+
+
+/*! Adds the sort_keys rows for up to 4096 messages at a time, until
+    all messages have them. The keys are computed by the Injector's
+    code, so old messages sort exactly like new ones.
+*/
+
+void UpdateDatabase::addSortKeys()
+{
+    if ( d->t && d->t->done() ) {
+        if ( d->t->failed() )
+            error( "Transaction failed: " + d->t->error() );
+        d->t = 0;
+        printf( "Added sort keys for %d messages.\nCommitted transaction.\n",
+                d->sorted );
+    }
+
+    if ( !d->t ) {
+        printf( "Looking for 4096 more messages without sort keys.\n" );
+        d->t = new Transaction( this );
+        // the first Subject field and the first address in the first
+        // From, To and Cc fields, as the Injector uses
+        d->findKeys
+            = new Query( "select distinct on (m.id) m.id, m.idate, "
+                         "hf.value as subject, "
+                         "fa.name as fname, fa.localpart as flocalpart, "
+                         "fa.domain as fdomain, "
+                         "ta.name as tname, ta.localpart as tlocalpart, "
+                         "ta.domain as tdomain, "
+                         "ca.name as cname, ca.localpart as clocalpart, "
+                         "ca.domain as cdomain, "
+                         "extract(epoch from df.value)::integer as sent "
+                         "from messages m "
+                         "left join sort_keys sk on (sk.message=m.id) "
+                         "left join header_fields hf on "
+                         "(hf.message=m.id and hf.part='' and hf.field=$2) "
+                         "left join address_fields faf on "
+                         "(faf.message=m.id and faf.part='' and "
+                         "faf.number=0 and faf.field=$3) "
+                         "left join addresses fa on (faf.address=fa.id) "
+                         "left join address_fields taf on "
+                         "(taf.message=m.id and taf.part='' and "
+                         "taf.number=0 and taf.field=$4) "
+                         "left join addresses ta on (taf.address=ta.id) "
+                         "left join address_fields caf on "
+                         "(caf.message=m.id and caf.part='' and "
+                         "caf.number=0 and caf.field=$5) "
+                         "left join addresses ca on (caf.address=ca.id) "
+                         "left join date_fields df on (df.message=m.id) "
+                         "where sk.message is null and m.id>$1 "
+                         "order by m.id, hf.position, faf.position, "
+                         "taf.position, caf.position "
+                         "limit 4096", this );
+        d->findKeys->bind( 1, d->sofar );
+        d->findKeys->bind( 2, HeaderField::Subject );
+        d->findKeys->bind( 3, HeaderField::From );
+        d->findKeys->bind( 4, HeaderField::To );
+        d->findKeys->bind( 5, HeaderField::Cc );
+        d->t->enqueue( d->findKeys );
+        d->t->execute();
+        d->keys = 0;
+    }
+
+    if ( !d->findKeys->done() || d->keys )
+        return;
+
+    d->keys = new Query( "copy sort_keys (message,subject,"
+                         "from_address,from_display,"
+                         "to_address,to_display,"
+                         "cc_address,sent) "
+                         "from stdin with binary", this );
+    d->sorted = 0;
+    Row * r;
+    while ( (r=d->findKeys->nextRow()) != 0 ) {
+        uint id = r->getInt( "id" );
+        if ( id > d->sofar )
+            d->sofar = id;
+
+        UString subject;
+        if ( !r->isNull( "subject" ) )
+            subject = r->getUString( "subject" );
+
+        Address * from = sortAddress( r, "f" );
+        Address * to = sortAddress( r, "t" );
+        Address * cc = sortAddress( r, "c" );
+
+        uint sent = r->getInt( "idate" );
+        if ( !r->isNull( "sent" ) )
+            sent = r->getInt( "sent" );
+
+        Injector::addSortKeys( d->keys, id, subject, from, to, cc, sent );
+        d->sorted++;
+    }
+
+    if ( !d->sorted ) {
+        printf( "All messages have sort keys.\n" );
+        d->t->commit();
+        finish();
+        return;
+    }
+
+    printf( "Computing sort keys for %d messages.\n", d->sorted );
+    d->t->enqueue( d->keys );
+    d->t->commit();
+}
@@ -14,6 +14,9 @@ public:
     void execute();
 
 private:
+    void thread();
+    void addSortKeys();
+
     class UpdateDatabaseData * d;
 };
 
@@ -106,3 +106,23 @@ int AsciiCasemap::compare( const UString & a, const UString & b ) const
         i++;
     }
 }
+
+
+/*! Returns true, since this collation compares one character at a
+    time.
+*/
+
+bool AsciiCasemap::isCharacterwise() const
+{
+    return true;
+}
+
+
+/*! Returns \a c, mapped to upper case if it's an ASCII letter. */
+
+uint AsciiCasemap::fold( uint c ) const
+{
+    if ( c >= 'a' && c <= 'z' )
+        return 'A'+(c-'a');
+    return c;
+}
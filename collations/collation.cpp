@@ -53,6 +53,29 @@ Collation::~Collation()
     1 if \a a is greater, than \a b.
 */
 
+/*! Returns true if this Collation compares strings character by
+    character after mapping each character using fold(), so that
+    equals() and contains() give the same results as comparing the
+    folded strings exactly. This lets SieveMatcher match many keys in
+    one pass. The default implementation returns false.
+*/
+
+bool Collation::isCharacterwise() const
+{
+    return false;
+}
+
+
+/*! Returns the canonical form of the character \a c, as described in
+    isCharacterwise(). The default implementation returns \a c.
+*/
+
+uint Collation::fold( uint c ) const
+{
+    return c;
+}
+
+
 /*! Returns a pointer to a newly-created Collation object corresponding
     to \a s, or 0 if no such collation is recognised.
 */
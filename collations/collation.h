@@ -19,6 +19,9 @@ public:
     virtual bool contains( const UString &, const UString & ) const = 0;
     virtual int compare( const UString &, const UString & ) const = 0;
 
+    virtual bool isCharacterwise() const;
+    virtual uint fold( uint ) const;
+
     static Collation * create( const UString & );
 
     static class EStringList * supported();
@@ -95,3 +95,11 @@ int Octet::compare( const UString & a, const UString & b ) const
         i++;
     }
 }
+
+
+/*! Returns true, since this collation compares characters exactly. */
+
+bool Octet::isCharacterwise() const
+{
+    return true;
+}
@@ -24,6 +24,9 @@
 
 #include <errno.h>
 
+// pthread_mutex_lock etc.
+#include <pthread.h>
+
 
 // the heuristics in adminLikelyHappy() will probably need changing
 // if BlockShift changes
@@ -43,38 +46,47 @@ public:
         }
     }
 
+    // find() may run in any thread without taking mapLock, so the
+    // writers below store each pointer to a new node, and each
+    // Allocator, with release semantics, and find() loads them with
+    // acquire semantics. A reader which sees a pointer thus also
+    // sees the node or Allocator it points to.
+
     static Allocator * find( const void * address ) {
         Allocator::ulong v = ((Allocator::ulong)address) >> BlockShift;
-        AllocatorMapTable * t = root;
+        AllocatorMapTable * t = __atomic_load_n( &root, __ATOMIC_ACQUIRE );
         if ( v & ( ((Allocator::ulong)-1) << ( t->l + Slice ) ) )
             return 0;
         while ( t && t->l )
-            t = t->children[(v >> t->l) & Mask];
+            t = __atomic_load_n( &t->children[(v >> t->l) & Mask],
+                                 __ATOMIC_ACQUIRE );
         if ( !t )
             return 0;
-        return t->data[v & Mask];
+        return __atomic_load_n( &t->data[v & Mask], __ATOMIC_ACQUIRE );
     }
     static AllocatorMapTable * provide( Allocator::ulong v ) {
         if ( !root ) {
-            root = new AllocatorMapTable;
+            AllocatorMapTable * nroot = new AllocatorMapTable;
             uint rv = v;
             while ( rv & ~Mask ) {
                 rv = rv >> Slice;
-                root->l += Slice;
+                nroot->l += Slice;
             }
+            __atomic_store_n( &root, nroot, __ATOMIC_RELEASE );
         }
         while ( v & ( ((Allocator::ulong)-1) << ( root->l + Slice ) ) ) {
             AllocatorMapTable * nroot = new AllocatorMapTable;
             nroot->l = root->l + Slice;
             nroot->children[0] = root;
-            root = nroot;
+            __atomic_store_n( &root, nroot, __ATOMIC_RELEASE );
         }
         AllocatorMapTable * t = root;
         while ( t->l ) {
             uint i = ( v >> t->l ) & Mask;
             if ( !t->children[i] ) {
-                t->children[i] = new AllocatorMapTable;
-                t->children[i]->l = t->l - Slice;
+                AllocatorMapTable * c = new AllocatorMapTable;
+                c->l = t->l - Slice;
+                __atomic_store_n( &t->children[i], c, __ATOMIC_RELEASE );
             }
             t = t->children[i];
         }
@@ -82,7 +94,8 @@ public:
     }
 
     static void insert( Allocator::ulong v, Allocator * a ) {
-        provide( v )->data[v & Mask] = a;
+        __atomic_store_n( &provide( v )->data[v & Mask], a,
+                          __ATOMIC_RELEASE );
     }
     static void insert( Allocator * a ) {
         Allocator::ulong v = ((Allocator::ulong)a->buffer) >> BlockShift;
@@ -96,7 +109,8 @@ public:
     static void remove( Allocator::ulong v, Allocator * a ) {
         AllocatorMapTable * t = provide( v );
         if ( t && t->data[v & Mask] == a )
-            t->data[v & Mask] = 0;
+            __atomic_store_n( &t->data[v & Mask], (Allocator *)0,
+                              __ATOMIC_RELEASE );
     }
     static void remove( Allocator * a ) {
         Allocator::ulong v = ((Allocator::ulong)a->buffer) >> BlockShift;
@@ -125,6 +139,58 @@ private:
 AllocatorMapTable * AllocatorMapTable::root = 0;
 
 
+// Each thread which allocates memory has its own set of Allocator
+// objects, so that it can allocate without locking. The event loop
+// thread uses mainArena, other threads get theirs from enter().
+
+struct AllocatorArena // NOT a Garbage class
+{
+    AllocatorArena(): allocated( 0 ), blocks( 0 ), busy( false ), next( 0 ) {
+        uint i = 0;
+        while ( i < 32 )
+            allocators[i++] = 0;
+    }
+
+    Allocator * allocators[32];
+    uint allocated; // written by the owning thread, or by free() while
+    uint blocks;    // collecting, with relaxed atomic stores
+    bool busy;
+    AllocatorArena * next;
+};
+
+
+static AllocatorArena mainArena;
+static __thread AllocatorArena * threadArena;
+
+// arenaLock guards the list of arenas, their busy flags and
+// collecting. While collecting is set, no other thread uses or
+// creates an arena, so free() may look at them all. mapLock serialises changes to the AllocatorMapTable,
+// which is read without locking.
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arenaChanged = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t mapLock = PTHREAD_MUTEX_INITIALIZER;
+static bool collecting;
+
+
+// Ends what free() started, letting other threads use the heap again.
+
+static void resume()
+{
+    pthread_mutex_lock( &arenaLock );
+    collecting = false;
+    pthread_cond_broadcast( &arenaChanged );
+    pthread_mutex_unlock( &arenaLock );
+}
+
+
+static AllocatorArena * currentArena()
+{
+    if ( threadArena )
+        return threadArena;
+    return &mainArena;
+}
+
+
 
 
 struct AllocationBlock
@@ -144,7 +210,6 @@ const uint SizeLimit = 512 * 1024 * 1024;
 
 
 static int total;
-static uint allocated;
 static uint objects;
 static uint marked;
 static uint tos;
@@ -183,10 +248,12 @@ void * Allocator::alloc( uint s, uint n )
     while ( a->taken == a->capacity && a->next )
         a = a->next;
     void * p = a->allocate( s, n );
-    if ( ( ( ::total + ::allocated + s ) & 0xfff00000 ) >
-         ( ( ::total + ::allocated ) & 0xfff00000 ) )
+    AllocatorArena * ar = a->arena;
+    if ( ( ( ::total + ar->allocated + s ) & 0xfff00000 ) >
+         ( ( ::total + ar->allocated ) & 0xfff00000 ) )
         ::oneMegabyteAllocated();
-    ::allocated += a->chunkSize();
+    __atomic_store_n( &ar->allocated, ar->allocated + a->chunkSize(),
+                      __ATOMIC_RELAXED );
     return p;
 }
 
@@ -197,13 +264,15 @@ void * Allocator::alloc( uint s, uint n )
     of objects are allocated and deallocated, it may be beneficial.
     This function exists because it was beneficial in
     EString::reserve().
+
+    Objects allocated by another thread are left for free().
 */
 
 
 void Allocator::dealloc( void * p )
 {
     Allocator * a = AllocatorMapTable::find( p );
-    if ( a )
+    if ( a && a->arena == currentArena() )
         a->deallocate( p );
 }
 
@@ -213,9 +282,6 @@ const uint bits = 8 * sizeof(void*);
 const uint magic = 0x7d34;
 
 
-static Allocator * allocators[32];
-
-
 static const uint maxRoots = 4096;
 
 static struct {
@@ -242,6 +308,7 @@ Allocator * Allocator::allocator( uint size )
         b = 16;
     while ( size + bytes > b << i )
         i++;
+    Allocator ** allocators = currentArena()->allocators;
     if ( !allocators[i] )
         allocators[i] = new Allocator( b << i );
     return allocators[i];
@@ -265,6 +332,13 @@ Allocator * Allocator::allocator( uint size )
     reachable. It can be called whenever there are no pointers into
     the heap, ie. only during the main event loop.
 
+    Other threads may allocate memory too, provided they call enter()
+    before and leave() afterwards. Each thread allocates from its own
+    arena of Allocator objects, so allocation needs no locking. free()
+    waits until no thread is between enter() and leave(), and then
+    marks and sweeps all the arenas. Anything a thread allocates must
+    be reachable from a root by the time it calls leave().
+
     Each single instance of the Allocator class allocates memory blocks
     of a given size. There are static functions to the heavy loading,
     such as free() to free all unreachable memory, allocate() to
@@ -285,7 +359,7 @@ Allocator * Allocator::allocator( uint size )
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
       used( 0 ), marked( 0 ), buffer( 0 ),
-      next( 0 )
+      next( 0 ), arena( currentArena() )
 {
     if ( s < ( BlockSize ) )
         capacity = ( BlockSize ) / ( s );
@@ -328,7 +402,10 @@ Allocator::Allocator( uint s )
     if ( !marked )
         die( Memory );
 
+    pthread_mutex_lock( &mapLock );
     AllocatorMapTable::insert( this );
+    pthread_mutex_unlock( &mapLock );
+    __atomic_store_n( &arena->blocks, arena->blocks + 1, __ATOMIC_RELAXED );
 }
 
 
@@ -337,7 +414,10 @@ Allocator::Allocator( uint s )
 
 Allocator::~Allocator()
 {
+    pthread_mutex_lock( &mapLock );
     AllocatorMapTable::remove( this );
+    pthread_mutex_unlock( &mapLock );
+    __atomic_store_n( &arena->blocks, arena->blocks - 1, __ATOMIC_RELAXED );
     uint l = capacity * step;
     l = ( ( l-1 ) | 4095 ) + 1;
     ::munmap( buffer, l );
@@ -420,8 +500,9 @@ void Allocator::deallocate( void * p )
 
     if ( base > i )
         base = i;
-    if ( ::allocated > step )
-        ::allocated -= step;
+    if ( arena->allocated > step )
+        __atomic_store_n( &arena->allocated, arena->allocated - step,
+                          __ATOMIC_RELAXED );
 }
 
 
@@ -553,6 +634,22 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
     Cache::clearAllCaches( false );
 
+    // wait until the other threads aren't using the heap, and keep
+    // them from starting until we're done
+    pthread_mutex_lock( &arenaLock );
+    collecting = true;
+    AllocatorArena * ar = mainArena.next;
+    while ( ar ) {
+        if ( ar->busy ) {
+            pthread_cond_wait( &arenaChanged, &arenaLock );
+            ar = mainArena.next;
+        }
+        else {
+            ar = ar->next;
+        }
+    }
+    pthread_mutex_unlock( &arenaLock );
+
     total = 0;
     peak = 0;
     uint freed = 0;
@@ -592,34 +689,39 @@ Garbage * Allocator::free( List<Garbage> * entries )
     gettimeofday( &afterMark, 0 );
 
     // and sweep
-    i = 0;
     uint blocks = 0;
-    while ( i < 32 ) {
-        Allocator * a = allocators[i];
-        while ( a ) {
-            uint taken = a->taken;
-            if ( a->taken )
-                a->sweep();
-            freed = freed + ( taken - a->taken ) * a->step;
-            total = total + a->taken * a->step;
-            a = a->next;
-        }
-        Allocator * s = 0;
-        a = allocators[i];
-        while ( a ) {
-            Allocator * n = a->next;
-            if ( a->taken ) {
-                a->next = s;
-                s = a;
-                blocks++;
+    ar = &mainArena;
+    while ( ar ) {
+        Allocator ** allocators = ar->allocators;
+        i = 0;
+        while ( i < 32 ) {
+            Allocator * a = allocators[i];
+            while ( a ) {
+                uint taken = a->taken;
+                if ( a->taken )
+                    a->sweep();
+                freed = freed + ( taken - a->taken ) * a->step;
+                total = total + a->taken * a->step;
+                a = a->next;
             }
-            else {
-                delete a;
+            Allocator * s = 0;
+            a = allocators[i];
+            while ( a ) {
+                Allocator * n = a->next;
+                if ( a->taken ) {
+                    a->next = s;
+                    s = a;
+                    blocks++;
+                }
+                else {
+                    delete a;
+                }
+                a = n;
             }
-            a = n;
+            allocators[i] = s;
+            i++;
         }
-        allocators[i] = s;
-        i++;
+        ar = ar->next;
     }
     gettimeofday( &afterSweep, 0 );
 
@@ -633,13 +735,15 @@ Garbage * Allocator::free( List<Garbage> * entries )
     }
     // dumpRandomObject();
 
-    if ( !freed )
+    if ( !freed ) {
+        resume();
         return biggest;
+    }
 
-    if ( verbose && ( ::allocated >= 4*1024*1024 ||
+    if ( verbose && ( allocated() >= 4*1024*1024 ||
                       timeToMark + timeToSweep >= 10000 ) )
         log( "Allocator: allocated " +
-             EString::humanNumber( ::allocated ) +
+             EString::humanNumber( allocated() ) +
              " then freed " +
              EString::humanNumber( freed ) +
              " bytes, leaving " +
@@ -661,18 +765,23 @@ Garbage * Allocator::free( List<Garbage> * entries )
         while ( i < 32 ) {
             uint n = 0;
             uint max = 0;
-            Allocator * a = allocators[i];
-            while ( a ) {
-                n = n + a->taken;
-                max = max + a->capacity;
-                a = a->next;
+            uint size = 0;
+            ar = &mainArena;
+            while ( ar ) {
+                Allocator * a = ar->allocators[i];
+                while ( a ) {
+                    n = n + a->taken;
+                    max = max + a->capacity;
+                    size = a->step;
+                    a = a->next;
+                }
+                ar = ar->next;
             }
             if ( n ) {
                 if ( objects.isEmpty() )
                     objects = "Objects:";
                 else
                     objects.append( "," );
-                uint size = allocators[i]->step;
                 objects.append( " size " + fn( size-bytes ) + ": " +
                                 fn( n ) + " (" +
                                 EString::humanNumber( size * n ) + " used, " +
@@ -702,7 +811,12 @@ Garbage * Allocator::free( List<Garbage> * entries )
             i++;
         }
     }
-    ::allocated = 0;
+    ar = &mainArena;
+    while ( ar ) {
+        __atomic_store_n( &ar->allocated, 0, __ATOMIC_RELAXED );
+        ar = ar->next;
+    }
+    resume();
     return biggest;
 }
 
@@ -865,11 +979,65 @@ void Allocator::setReporting( bool report )
 
 
 
-/*! Returns the number of bytes allocated since the last memory sweep. */
+/*! Returns the number of bytes allocated since the last memory sweep,
+    by all threads.
+*/
 
 uint Allocator::allocated()
 {
-    return ::allocated;
+    uint n = 0;
+    pthread_mutex_lock( &arenaLock );
+    AllocatorArena * ar = &mainArena;
+    while ( ar ) {
+        n += __atomic_load_n( &ar->allocated, __ATOMIC_RELAXED );
+        ar = ar->next;
+    }
+    pthread_mutex_unlock( &arenaLock );
+    return n;
+}
+
+
+/*! Records that the calling thread is about to allocate or use
+    collectible memory, and waits if free() is running. Each call must
+    be matched by a call to leave().
+
+    The event loop thread, which calls free(), must not call this
+    function. Other threads must call it before they call alloc() (or
+    create any Garbage) and must not hold any pointers into the heap
+    that aren't reachable from a root once they've called leave().
+
+    The first call in a thread gives the thread its own arena, from
+    which it then allocates without locking.
+*/
+
+void Allocator::enter()
+{
+    pthread_mutex_lock( &arenaLock );
+    while ( collecting )
+        pthread_cond_wait( &arenaChanged, &arenaLock );
+    if ( !threadArena ) {
+        threadArena = new AllocatorArena;
+        threadArena->next = mainArena.next;
+        mainArena.next = threadArena;
+    }
+    threadArena->busy = true;
+    pthread_mutex_unlock( &arenaLock );
+}
+
+
+/*! Records that the calling thread has stopped using collectible
+    memory, so that free() may proceed. Everything the thread
+    allocated since enter() must be reachable from a root by now, or
+    it will be freed.
+*/
+
+void Allocator::leave()
+{
+    pthread_mutex_lock( &arenaLock );
+    if ( threadArena )
+        threadArena->busy = false;
+    pthread_cond_broadcast( &arenaChanged );
+    pthread_mutex_unlock( &arenaLock );
 }
 
 
@@ -897,45 +1065,50 @@ void pointers( void * p )
     if ( !p )
         return;
 
-    uint bi = 0;
-    while ( bi < 32 ) {
-        Allocator * a = allocators[bi];
-        while ( a ) {
-            uint b = 0;
-            while ( b * bits < a->capacity ) {
-                uint i = 0;
-                while ( i < 32 ) {
-                    if ( (a->used[b] & (1UL<<i)) &&
-                         !(a->marked[b] & (1UL<<i)) ) {
-                        AllocationBlock * m
-                            = (AllocationBlock *)a->block( b * bits + i );
-                        if ( m ) {
-                            uint number = m->x.number;
-                            if ( number == 127 )
-                                number = ( a->step - bytes ) / sizeof( void* );
-                            uint n = 0;
-                            while ( n < number ) {
-                                if ( m->payload[n] == p ) {
-                                    fprintf( stderr,
-                                             "Pointer at 0x%p (in 0x%p, "
-                                             "size <= %d, %u pointers)\n",
-                                             &m->payload[n],
-                                             &m->payload[0],
-                                             a->step - bytes,
-                                             number );
-                                    number = 0;
+    AllocatorArena * ar = &mainArena;
+    while ( ar ) {
+        uint bi = 0;
+        while ( bi < 32 ) {
+            Allocator * a = ar->allocators[bi];
+            while ( a ) {
+                uint b = 0;
+                while ( b * bits < a->capacity ) {
+                    uint i = 0;
+                    while ( i < 32 ) {
+                        if ( (a->used[b] & (1UL<<i)) &&
+                             !(a->marked[b] & (1UL<<i)) ) {
+                            AllocationBlock * m
+                                = (AllocationBlock *)a->block( b * bits + i );
+                            if ( m ) {
+                                uint number = m->x.number;
+                                if ( number == 127 )
+                                    number = ( a->step - bytes ) /
+                                             sizeof( void* );
+                                uint n = 0;
+                                while ( n < number ) {
+                                    if ( m->payload[n] == p ) {
+                                        fprintf( stderr,
+                                                 "Pointer at 0x%p (in 0x%p, "
+                                                 "size <= %d, %u pointers)\n",
+                                                 &m->payload[n],
+                                                 &m->payload[0],
+                                                 a->step - bytes,
+                                                 number );
+                                        number = 0;
+                                    }
+                                    n++;
                                 }
-                                n++;
                             }
                         }
+                        i++;
                     }
-                    i++;
+                    b++;
                 }
-                b++;
+                a = a->next;
             }
-            a = a->next;
+            bi++;
         }
-        bi++;
+        ar = ar->next;
     }
 }
 
@@ -958,15 +1131,13 @@ Allocator * Allocator::owner( const void * p )
 uint Allocator::allocatedFromOS()
 {
     int r = 0;
-    int i = 0;
-    while ( i < 32 ) {
-        Allocator * a = allocators[i];
-        while ( a ) {
-            r += BlockSize;
-            a = a->next;
-        }
-        ++i;
+    pthread_mutex_lock( &arenaLock );
+    AllocatorArena * ar = &mainArena;
+    while ( ar ) {
+        r += __atomic_load_n( &ar->blocks, __ATOMIC_RELAXED ) * BlockSize;
+        ar = ar->next;
     }
+    pthread_mutex_unlock( &arenaLock );
 
     return r;
 }
@@ -31,6 +31,9 @@ public:
     static uint allocated();
     static uint inUse();
 
+    static void enter();
+    static void leave();
+
     static void * alloc( uint, uint = UINT_MAX );
     static void dealloc( void * );
 
@@ -56,6 +59,7 @@ private:
     ulong * marked;
     void * buffer;
     Allocator * next;
+    struct AllocatorArena * arena;
 
     friend void pointers( void * );
     friend class AllocatorMapTable;
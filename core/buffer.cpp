@@ -19,6 +19,9 @@
 static const uint bufsiz = 8192;
 static char buffer[bufsiz];
 
+// strings at least this long are referenced rather than copied
+static const uint shareable = 16384;
+
 
 
 /*! \class Buffer buffer.h
@@ -34,6 +37,11 @@ static char buffer[bufsiz];
     calls remove() etc. However, its owner has the option of putting
     things into the buffer and later removing them. One class does use
     that: IMAPS.
+
+    Long EString objects appended to an uncompressed Buffer are not
+    copied; the Buffer refers to the string's own data until it has
+    been written. This lets e.g. FETCH send large literals without
+    holding two copies of each.
 */
 
 /*! Creates an empty Buffer. */
@@ -140,7 +148,8 @@ void Buffer::append2( const char * s, uint l )
 
     }
 
-    // Then we use a new vector for the rest.
+    // Then we use a new vector for the rest. (A shared vector is
+    // always full, so we never copy into one.)
     if ( copied < l ) {
         int remains = l - copied;
         Vector *f = new Vector;
@@ -171,8 +180,36 @@ void Buffer::append2( const char * s, uint l )
 
 void Buffer::append( const EString &s )
 {
-    if ( s.length() > 0 )
-        append( s.data(), s.length() );
+    Vector * last = vecs.last();
+    if ( s.length() < shareable || filter != None ||
+         ( last && last->len - firstfree >= s.length() ) ) {
+        if ( s.length() > 0 )
+            append( s.data(), s.length() );
+        return;
+    }
+
+    // copying the EString marks its data as shared, so noone will
+    // modify or free it while we refer to it.
+    Vector * v = new Vector;
+    v->data = new EString( s );
+    v->base = (char*)v->data->data();
+    v->len = s.length();
+    v->shared = true;
+
+    if ( last && firstfree < last->len ) {
+        // the last vector isn't full, but every vector except the
+        // last must be. copy what fits and put the rest aside.
+        uint n = last->len - firstfree;
+        memmove( last->base + firstfree, v->base, n );
+        v->base += n;
+        v->len -= n;
+        bytes += n;
+    }
+    if ( vecs.isEmpty() )
+        firstused = 0;
+    vecs.append( v );
+    firstfree = v->len;
+    bytes += v->len;
 }
 
 
@@ -241,7 +278,7 @@ void Buffer::remove( uint n )
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
         vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        if ( v && !v->shared && ( v->len > 100 && v->len < 20000 ) )
             vecs.append( v );
         return;
     }
@@ -337,6 +374,32 @@ EString Buffer::string( uint num ) const
 }
 
 
+/*! Returns a pointer to the first byte in the Buffer, and sets \a n
+    to the number of bytes which can be read contiguously from there.
+    This may be less than size(), but is never 0 unless the Buffer is
+    empty, in which case the return value is a null pointer.
+
+    The pointer is valid until the Buffer is next modified. This lets
+    a reader scan large amounts of input without copying it first;
+    typical usage is to process some or all of the returned bytes,
+    remove() them and ask again.
+*/
+
+const char * Buffer::firstBytes( uint & n ) const
+{
+    n = 0;
+    Vector * v = vecs.firstElement();
+    if ( !v || !bytes )
+        return 0;
+
+    if ( vecs.count() == 1 )
+        n = firstfree - firstused;
+    else
+        n = v->len - firstused;
+    return v->base + firstused;
+}
+
+
 /*! This function removes a line (terminated by LF or CRLF) of at most
     \a s bytes from the Buffer, and returns a pointer to a EString with
     the line ending removed. If the Buffer does not contain a complete
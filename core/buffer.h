@@ -29,6 +29,7 @@ public:
     uint size() const { return bytes; }
     void remove( uint );
     EString string( uint ) const;
+    const char * firstBytes( uint & ) const;
     EString * removeLine( uint = 0 );
 
     char operator[]( uint i ) const {
@@ -55,12 +56,14 @@ private:
     struct Vector
         : public Garbage
     {
-        Vector() : base( 0 ), len( 0 ) {
+        Vector() : base( 0 ), data( 0 ), len( 0 ), shared( false ) {
             setFirstNonPointer( &len );
         }
         char *base;
+        EString *data;
         // no pointers after this line
         uint len;
+        bool shared;
     };
 
     List< Vector > vecs;
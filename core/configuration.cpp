@@ -164,7 +164,11 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "smarthost-connections", Configuration::SmartHostConnections, 4 },
+    { "dns-port", Configuration::DnsPort, 53 },
+    { "domain-connections", Configuration::DomainConnections, 2 },
+    { "worker-threads", Configuration::WorkerThreads, 2 }
 };
 
 
@@ -211,7 +215,9 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "search-index-directory", Configuration::SearchIndexDir, "" },
+    { "dns-server", Configuration::DnsServer, "" }
 };
 
 
@@ -243,7 +249,8 @@ static struct {
     { "use-statistics", Configuration::UseStatistics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "use-imap-quota", Configuration::UseImapQuota, true }
+    { "use-imap-quota", Configuration::UseImapQuota, true },
+    { "direct-delivery", Configuration::DirectDelivery, false }
 };
 
 
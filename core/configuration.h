@@ -57,6 +57,10 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        SmartHostConnections,
+        DnsPort,
+        DomainConnections,
+        WorkerThreads,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -102,6 +106,8 @@ public:
         AddressSeparator,
         StatisticsAddress,
         LdapServerAddress,
+        SearchIndexDir,
+        DnsServer,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -134,6 +140,7 @@ public:
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
+        DirectDelivery,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
@@ -41,19 +41,31 @@ public:
     UDict(): PatriciaTree<T>() {}
 
     T * find( const UString & s ) const {
-        return PatriciaTree<T>::find( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        char b[KeySize];
+        uint l;
+        const char * k = s.key( b, KeySize, &l );
+        return PatriciaTree<T>::find( k, l );
     }
     void insert( const UString & s, T* r ) {
-        PatriciaTree<T>::insert( (const char *)s.data(), s.length() * 8 * sizeof( uint ), r );
+        char b[KeySize];
+        uint l;
+        const char * k = s.key( b, KeySize, &l );
+        PatriciaTree<T>::insert( k, l, r );
     }
     T* remove( const UString & s ) {
-        return PatriciaTree<T>::remove( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        char b[KeySize];
+        uint l;
+        const char * k = s.key( b, KeySize, &l );
+        return PatriciaTree<T>::remove( k, l );
     }
     bool contains( const UString & s ) const {
         return find( s ) != 0;
     }
 
 private:
+    // keys for wide strings are built on the stack if they fit
+    enum { KeySize = 256 };
+
     // operators explicitly undefined because there is no single
     // correct way to implement them.
     UDict< T > &operator =( const UDict< T > & ) { return *this; }
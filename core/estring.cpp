@@ -3,13 +3,23 @@
 #include "estring.h"
 
 #include "allocator.h"
+#include "stringkernel.h"
 
 // stderr, fprintf
 #include <stdio.h>
-// strlen
+// strlen, memcpy
 #include <string.h>
 
 
+// Returns true if c is whitespace as far as simplified() and trimmed()
+// are concerned.
+
+static inline bool isWhitespace( char c )
+{
+    return c == 9 || c == 10 || c == 13 || c == 32;
+}
+
+
 /*! \class EStringData estring.h
 
     This private helper class contains the actual string data. It has
@@ -234,13 +244,11 @@ const char * EString::cstr() const
 EString EString::lower() const
 {
     EString result( *this );
-    uint i = 0;
-    while ( i < result.length() ) {
-        if ( result[i] >= 'A' && result[i] <= 'Z' ) {
-            result.detach();
-            result.d->str[i] = result.d->str[i] + 32;
-        }
-        i++;
+    int i = StringKernel::findUpper( data(), length() );
+    if ( i >= 0 ) {
+        result.detach();
+        StringKernel::lower( result.d->str + i, result.d->str + i,
+                             result.d->len - i );
     }
     return result;
 }
@@ -252,13 +260,11 @@ EString EString::lower() const
 EString EString::upper() const
 {
     EString result( *this );
-    uint i = 0;
-    while ( i < result.length() ) {
-        if ( result[i] >= 'a' && result[i] <= 'z' ) {
-            result.detach();
-            result.d->str[i] = result.d->str[i] - 32;
-        }
-        i++;
+    int i = StringKernel::findLower( data(), length() );
+    if ( i >= 0 ) {
+        result.detach();
+        StringKernel::upper( result.d->str + i, result.d->str + i,
+                             result.d->len - i );
     }
     return result;
 }
@@ -304,11 +310,14 @@ EString EString::headerCased() const
 
 int EString::find( char c, int i ) const
 {
-    while ( i < (int)length() && at( i ) != c )
-        i++;
-    if ( i < (int)length() )
-        return i;
-    return -1;
+    if ( i < 0 )
+        i = 0;
+    if ( i >= (int)length() )
+        return -1;
+    int r = StringKernel::find( d->str + i, d->len - i, c );
+    if ( r < 0 )
+        return -1;
+    return i + r;
 }
 
 
@@ -318,19 +327,17 @@ int EString::find( char c, int i ) const
 
 int EString::find( const EString & s, int i ) const
 {
-    uint j = 0;
-    while ( j < s.length() && i+j < length() ) {
-        if ( d->str[i+j] == s.d->str[j] ) {
-            j++;
-        }
-        else {
-            j = 0;
-            i++;
-        }
-    }
-    if ( j == s.length() )
+    if ( s.isEmpty() )
         return i;
-    return -1;
+    if ( i < 0 )
+        i = 0;
+    if ( i >= (int)length() )
+        return -1;
+    int r = StringKernel::find( d->str + i, d->len - i,
+                                s.d->str, s.d->len );
+    if ( r < 0 )
+        return -1;
+    return i + r;
 }
 
 
@@ -694,53 +701,44 @@ bool EString::boring( Boring b ) const
 
 EString EString::simplified() const
 {
-    // scan for the first nonwhitespace character
-    uint i = 0;
+    // find the first and last nonwhitespace characters
     uint first = 0;
-    while ( i < length() && first == i ) {
-        char c = d->str[i];
-        if ( c == 9 || c == 10 || c == 13 || c == 32 )
-            first++;
-        i++;
-    }
-    // scan on to find the last nonwhitespace character and detect any
-    // sequences of two or more whitespace characters within the
-    // string.
-    uint last = first;
-    uint spaces = 0;
+    uint last = length();
+    while ( first < last && isWhitespace( d->str[first] ) )
+        first++;
+    while ( last > first && isWhitespace( d->str[last-1] ) )
+        last--;
+
+    // detect any sequences of two or more whitespace characters
+    // within the string.
     bool identity = true;
-    while ( identity && i < length() ) {
-        char c = d->str[i];
-        if ( c == 9 || c == 10 || c == 13 || c == 32 ) {
-            spaces++;
-        }
-        else {
-            if ( spaces > 1 )
-                identity = false;
-            spaces = 0;
-            last = i;
-        }
-        i++;
+    uint i = first;
+    while ( identity && i < last ) {
+        int w = StringKernel::findWhitespace( d->str + i, last - i );
+        if ( w < 0 )
+            break;
+        i += w + 1;
+        if ( isWhitespace( d->str[i] ) )
+            identity = false;
     }
     if ( identity )
-        return mid( first, last+1-first );
+        return mid( first, last-first );
 
+    // copy each run of nonwhitespace, with a space between each two
     EString result;
-    result.reserve( length() );
-    i = 0;
-    spaces = 0;
-    while ( i < length() ) {
-        char c = d->str[i];
-        if ( c == 9 || c == 10 || c == 13 || c == 32 ) {
-            spaces++;
-        }
-        else {
-            if ( spaces && !result.isEmpty() )
+    result.reserve( last - first );
+    i = first;
+    while ( i < last ) {
+        int w = StringKernel::findWhitespace( d->str + i, last - i );
+        uint n = last - i;
+        if ( w >= 0 )
+            n = w;
+        if ( n ) {
+            if ( !result.isEmpty() )
                 result.append( ' ' );
-            spaces = 0;
-            result.append( c );
+            result.append( d->str + i, n );
         }
-        i++;
+        i += n + 1;
     }
     return result;
 }
@@ -752,22 +750,15 @@ EString EString::simplified() const
 
 EString EString::trimmed() const
 {
-    uint i = 0;
-    uint first = length();
-    uint last = 0;
-    while ( i < length() ) {
-        char c = d->str[i];
-        if ( c != 9 && c != 10 && c != 13 && c != 32 ) {
-            if ( i < first )
-                first = i;
-            if ( i > last )
-                last = i;
-        }
-        i++;
-    }
+    uint first = 0;
+    uint last = length();
+    while ( first < last && isWhitespace( d->str[first] ) )
+        first++;
+    while ( last > first && isWhitespace( d->str[last-1] ) )
+        last--;
 
-    if ( last >= first )
-        return mid( first, last + 1 - first );
+    if ( last > first )
+        return mid( first, last - first );
 
     EString empty;
     return empty;
@@ -1176,6 +1167,15 @@ EString EString::de64() const
     uint p = 0;
     bool done = false;
     while ( p < length() && !done ) {
+        if ( m == 0 ) {
+            // decode complete groups in bulk, until something odd
+            uint n = StringKernel::decode64( result.d->str + bp,
+                                             d->str + p, length() - p );
+            p += n;
+            bp += n / 4 * 3;
+            if ( p >= length() )
+                break;
+        }
         uint c = d->str[p++];
         if ( c <= 'z' )
             c = from64[c];
@@ -1229,24 +1229,40 @@ static char to64[65] =
 
 EString EString::e64( uint lineLength ) const
 {
-    // this code comes from mailchen, adapted for EString
-    int l = length();
-    int i = 0;
+    uint l = length();
+    uint full = l / 3;
+
+    // each line holds perLine groups of four characters, so we know
+    // exactly how much space we need.
+    uint perLine = full;
+    uint size = ( l + 2 ) / 3 * 4;
+    if ( lineLength > 0 ) {
+        perLine = ( lineLength + 3 ) / 4;
+        size += 2 * ( full / perLine );
+        if ( full % perLine )
+            size += 2;
+    }
+
     EString r;
-    r.reserve( l*2 );
-    int p = 0;
-    uint c = 0;
-    while ( i <= l-3 ) {
-        r.d->str[p++] = to64[ ((d->str[i]>>2))&63 ];
-        r.d->str[p++] = to64[ ((d->str[i]<<4)&48) + ((d->str[i+1]>>4)&15) ];
-        r.d->str[p++] = to64[ ((d->str[i+1]<<2)&60) + ((d->str[i+2]>>6)&3) ];
-        r.d->str[p++] = to64[ (d->str[i+2]&63) ];
-        i += 3;
-        c += 4;
-        if ( lineLength > 0 && c >= lineLength ) {
-            r.d->str[p++] = 13;
-            r.d->str[p++] = 10;
-            c = 0;
+    r.reserve( size );
+    char * o = r.d->str;
+    uint i = 0;
+    bool crlf = false;
+    while ( i < full * 3 ) {
+        uint n = full * 3 - i;
+        if ( n > perLine * 3 )
+            n = perLine * 3;
+        StringKernel::encode64( o, d->str + i, n );
+        o += n / 3 * 4;
+        i += n;
+        if ( lineLength > 0 ) {
+            if ( n == perLine * 3 ) {
+                *o++ = 13;
+                *o++ = 10;
+            }
+            else {
+                crlf = true;
+            }
         }
     }
     if ( i < l ) {
@@ -1254,22 +1270,22 @@ EString EString::e64( uint lineLength ) const
         i0 = d->str[i];
         i1 = i+1 < l ? d->str[i+1] : 0;
         i2 = i+2 < l ? d->str[i+2] : 0;
-        r.d->str[p++] = to64[ ((i0>>2))&63 ];
-        r.d->str[p++] = to64[ ((i0<<4)&48) + ((i1>>4)&15) ];
+        *o++ = to64[ ((i0>>2))&63 ];
+        *o++ = to64[ ((i0<<4)&48) + ((i1>>4)&15) ];
         if ( i+1 < l )
-            r.d->str[p++] = to64[ ((i1<<2)&60) + ((i2>>6)&3) ];
+            *o++ = to64[ ((i1<<2)&60) + ((i2>>6)&3) ];
         else
-            r.d->str[p++] = '=';
+            *o++ = '=';
         if ( i+2 < l )
-            r.d->str[p++] = to64[ (i2&63) ];
+            *o++ = to64[ (i2&63) ];
         else
-            r.d->str[p++] = '=';
+            *o++ = '=';
     }
-    if ( lineLength > 0 && c > 0 ) {
-        r.d->str[p++] = 13;
-        r.d->str[p++] = 10;
+    if ( crlf ) {
+        *o++ = 13;
+        *o++ = 10;
     }
-    r.d->len = p;
+    r.d->len = o - r.d->str;
     return r;
 }
 
@@ -1289,10 +1305,24 @@ EString EString::deQP( bool underscore ) const
     r.reserve( length() );
     while ( i < length() ) {
         if ( d->str[i] != '=' ) {
-            char c = d->str[i++];
-            if ( underscore && c == '_' )
-                c = ' ';
-            r.d->str[r.d->len++] = c;
+            // copy everything up to the next '=' at once
+            int e = StringKernel::find( d->str + i, d->len - i, '=' );
+            uint n = d->len - i;
+            if ( e >= 0 )
+                n = e;
+            char * o = r.d->str + r.d->len;
+            memcpy( o, d->str + i, n );
+            if ( underscore ) {
+                uint u = 0;
+                int f = StringKernel::find( o, n, '_' );
+                while ( f >= 0 ) {
+                    u += f;
+                    o[u++] = ' ';
+                    f = StringKernel::find( o + u, n - u, '_' );
+                }
+            }
+            r.d->len += n;
+            i += n;
         }
         else {
             // are we looking at = followed by end-of-line?
@@ -1472,8 +1502,17 @@ EString EString::eQP( bool underscore, bool from ) const
             else if ( ( d->str[i] >= ' ' && d->str[i] < 127 &&
                         d->str[i] != '=' ) ||
                       ( d->str[i] == '\t' ) ) {
-                r.d->str[r.d->len++] = d->str[i];
-                c++;
+                // copy as much as fits on the line without quoting
+                uint n = 1;
+                if ( !underscore ) {
+                    n = StringKernel::qpSafeSpan( d->str + i, d->len - i );
+                    if ( n > 73 - c )
+                        n = 73 - c;
+                }
+                memcpy( r.d->str + r.d->len, d->str + i, n );
+                r.d->len += n;
+                c += n;
+                i += n - 1;
             }
             else {
                 r.d->str[r.d->len++] = '=';
@@ -1806,12 +1845,11 @@ EString EString::crlf() const
         copy = false;
     uint i = 0;
     while ( copy && i < d->len ) {
-        if ( d->str[i] == 13 && i < d->len && d->str[i+1] == 10 )
+        i += StringKernel::findLineEnd( d->str + i, d->len - i );
+        if ( d->str[i] == 13 && i + 1 < d->len && d->str[i+1] == 10 )
             i += 2;
-        else if ( d->str[i] == 13 || d->str[i] == 10 )
-            copy = false;
         else
-            i++;
+            copy = false;
     }
     if ( copy )
         return *this;
@@ -1824,6 +1862,14 @@ EString EString::crlf() const
     if ( d )
         len = d->len;
     while ( i < len ) {
+        int e = StringKernel::findLineEnd( d->str + i, len - i );
+        if ( e < 0 ) {
+            r.append( d->str + i, len - i );
+            lf = false;
+            break;
+        }
+        r.append( d->str + i, e );
+        i += e;
         lf = false;
         char c = d->str[i++];
 
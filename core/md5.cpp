@@ -116,12 +116,37 @@ void MD5::add( const EString &s )
 /*! Returns the 16-byte MD5 hash of the bytes add()ed so far. */
 
 EString MD5::hash()
+{
+    finalise();
+    return EString( (char *)buf, 16 );
+}
+
+
+/*! \overload
+
+    Copies the 16-byte MD5 hash of the bytes add()ed so far to \a
+    digest. Unlike the other hash() functions, this one allocates no
+    memory.
+*/
+
+void MD5::hash( char * digest )
+{
+    finalise();
+    memcpy( digest, (char *)buf, 16 );
+}
+
+
+/*! Pads the input and computes the final hash, unless that has
+    already been done.
+*/
+
+void MD5::finalise()
 {
     uint count;
     char *p;
 
     if ( finalised )
-        return EString( (char *)buf, 16 );
+        return;
 
     /* Compute number of bytes mod 64. */
     count = (bits[0] >> 3) & 0x3F;
@@ -156,7 +181,6 @@ EString MD5::hash()
     swapBytes( (char *)buf, 4 );
 
     finalised = true;
-    return EString( (char *)buf, 16 );
 }
 
 
@@ -20,6 +20,7 @@ public:
     void add( const EString & );
 
     EString hash();
+    void hash( char * );
     static EString hash( const EString & );
     static EString hash( const Buffer & );
     static EString HMAC( const EString &, const EString & );
@@ -31,6 +32,7 @@ private:
     char in[64];
 
     void init();
+    void finalise();
     void transform();
 };
 
@@ -130,6 +130,14 @@ public:
                 else
                     d = true;
             }
+            // likewise the last bits of k, if k is the shorter
+            if ( !d && b < l && l < n->length ) {
+                uint mask = ( 0xff00 >> (l%8) ) & 0xff;
+                if ( ( k[b/8] & mask ) == ( n->key[b/8] & mask ) )
+                    b = l;
+                else
+                    d = true;
+            }
             // if we found a difference, then set b to the first
             // differing bit
             if ( d && b < n->length && b < l ) {
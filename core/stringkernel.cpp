@@ -0,0 +1,878 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "stringkernel.h"
+
+// memchr, memcmp, memcpy
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    ( defined(__x86_64__) || defined(__i386__) )
+#define SK_SSE2
+// _mm_*
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ > 4 || \
+    ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 )
+#define SK_TARGETS
+#include <immintrin.h>
+#endif
+#endif
+
+
+/*! \class StringKernel stringkernel.h
+
+    The StringKernel class provides the byte-scanning loops underneath
+    EString and UString.
+
+    Each function works on a plain array and length, so that callers
+    can use them without creating new strings. On x86 the scans use
+    SSE2, and SSSE3 or AVX2 when the CPU supports them (this is checked
+    once, at runtime). Elsewhere they use portable code that looks at eight
+    bytes at a time where possible. Single-byte searches use memchr(),
+    which the C library already implements well.
+
+    All the find functions return the index of the first match, or -1
+    if there is none.
+*/
+
+
+#if defined(SK_TARGETS)
+
+enum Feature { Ssse3 = 1, Avx2 = 2 };
+
+static int features = -1;
+
+
+// Records which instruction set extensions the CPU supports.
+
+static void detect()
+{
+    int f = 0;
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "ssse3" ) )
+        f |= Ssse3;
+    if ( __builtin_cpu_supports( "avx2" ) )
+        f |= Avx2;
+    features = f;
+}
+
+
+// Returns true if the CPU supports the instruction set extension f.
+
+static inline bool has( Feature f )
+{
+    if ( features < 0 )
+        detect();
+    return ( features & f ) != 0;
+}
+
+#endif
+
+
+/*! Checks which instruction set extensions the CPU supports, if that
+    hasn't been done yet. The scans do this when first used, so this
+    only needs to be called before starting threads which may use
+    them; after that, the threads only read the answer. WorkPool does
+    this.
+*/
+
+void StringKernel::setup()
+{
+#if defined(SK_TARGETS)
+    if ( features < 0 )
+        detect();
+#endif
+}
+
+
+// Returns true if c is one of the four whitespace characters EString
+// cares about.
+
+static inline bool isWs( char c )
+{
+    return c == 9 || c == 10 || c == 13 || c == 32;
+}
+
+
+#if defined(SK_SSE2)
+
+// Returns the index of the lowest set bit in m, which must not be 0.
+
+static inline uint lowest( uint m )
+{
+    return __builtin_ctz( m );
+}
+
+
+// Returns a mask of the bytes in v which are in the range [a,a+n].
+
+static inline __m128i inRange( __m128i v, char a, char n )
+{
+    __m128i t = _mm_sub_epi8( v, _mm_set1_epi8( a ) );
+    return _mm_cmpeq_epi8( _mm_min_epu8( t, _mm_set1_epi8( n ) ), t );
+}
+
+#endif
+
+
+#if defined(SK_TARGETS)
+
+__attribute__((target("avx2")))
+static int findAvx2( const char * h, uint hl, const char * n, uint nl )
+{
+    __m256i first = _mm256_set1_epi8( n[0] );
+    __m256i last = _mm256_set1_epi8( n[nl-1] );
+    uint i = 0;
+    while ( i + nl - 1 + 32 <= hl ) {
+        __m256i a = _mm256_loadu_si256( (const __m256i *)( h + i ) );
+        __m256i b = _mm256_loadu_si256( (const __m256i *)( h + i + nl - 1 ) );
+        uint m = _mm256_movemask_epi8(
+            _mm256_and_si256( _mm256_cmpeq_epi8( a, first ),
+                              _mm256_cmpeq_epi8( b, last ) ) );
+        while ( m ) {
+            uint j = i + lowest( m );
+            if ( !memcmp( h + j + 1, n + 1, nl - 2 ) )
+                return j;
+            m &= m - 1;
+        }
+        i += 32;
+    }
+    return -(int)i - 2;
+}
+
+
+__attribute__((target("avx2")))
+static int findLineEndAvx2( const char * s, uint l )
+{
+    __m256i cr = _mm256_set1_epi8( 13 );
+    __m256i lf = _mm256_set1_epi8( 10 );
+    uint i = 0;
+    while ( i + 32 <= l ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)( s + i ) );
+        uint m = _mm256_movemask_epi8(
+            _mm256_or_si256( _mm256_cmpeq_epi8( v, cr ),
+                             _mm256_cmpeq_epi8( v, lf ) ) );
+        if ( m )
+            return i + lowest( m );
+        i += 32;
+    }
+    return -(int)i - 2;
+}
+
+
+__attribute__((target("avx2")))
+static uint is7BitAvx2( const char * s, uint l )
+{
+    uint i = 0;
+    while ( i + 32 <= l ) {
+        __m256i v = _mm256_loadu_si256( (const __m256i *)( s + i ) );
+        if ( _mm256_movemask_epi8( v ) )
+            return l + 1;
+        i += 32;
+    }
+    return i;
+}
+
+
+// Decodes 16 base64 characters at s into 12 bytes at d, writing 16
+// bytes. Returns false without writing anything if any of the 16
+// isn't in the base64 alphabet.
+
+__attribute__((target("ssse3")))
+static bool decode64Ssse3( char * d, const char * s )
+{
+    __m128i v = _mm_loadu_si128( (const __m128i *)s );
+    __m128i hi = _mm_and_si128( _mm_srli_epi32( v, 4 ),
+                                _mm_set1_epi8( 0x0f ) );
+    // the valid range of each high nibble, with '/' handled apart
+    __m128i lower = _mm_shuffle_epi8(
+        _mm_setr_epi8( 1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70,
+                       1, 1, 1, 1, 1, 1, 1, 1 ), hi );
+    __m128i upper = _mm_shuffle_epi8(
+        _mm_setr_epi8( 0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a,
+                       0, 0, 0, 0, 0, 0, 0, 0 ), hi );
+    __m128i slash = _mm_cmpeq_epi8( v, _mm_set1_epi8( '/' ) );
+    __m128i outside = _mm_andnot_si128(
+        slash, _mm_or_si128( _mm_cmplt_epi8( v, lower ),
+                             _mm_cmpgt_epi8( v, upper ) ) );
+    if ( _mm_movemask_epi8( outside ) )
+        return false;
+
+    __m128i shift = _mm_shuffle_epi8(
+        _mm_setr_epi8( 0, 0, 0x3e - 0x2b, 0x34 - 0x30,
+                       0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+                       0, 0, 0, 0, 0, 0, 0, 0 ), hi );
+    v = _mm_add_epi8( _mm_add_epi8( v, shift ),
+                      _mm_and_si128( slash, _mm_set1_epi8( -3 ) ) );
+
+    // pack four six-bit values into each three bytes
+    v = _mm_maddubs_epi16( v, _mm_set1_epi32( 0x01400140 ) );
+    v = _mm_madd_epi16( v, _mm_set1_epi32( 0x00011000 ) );
+    v = _mm_shuffle_epi8( v, _mm_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                            14, 13, 12, -1, -1, -1, -1 ) );
+    _mm_storeu_si128( (__m128i *)d, v );
+    return true;
+}
+
+
+// Encodes the first 12 of the 16 bytes at s as 16 base64 characters
+// at d.
+
+__attribute__((target("ssse3")))
+static void encode64Ssse3( char * d, const char * s )
+{
+    __m128i v = _mm_loadu_si128( (const __m128i *)s );
+    v = _mm_shuffle_epi8( v, _mm_set_epi8( 10, 11, 9, 10, 7, 8, 6, 7,
+                                           4, 5, 3, 4, 1, 2, 0, 1 ) );
+    __m128i t0 = _mm_mulhi_epu16( _mm_and_si128( v,
+                                                 _mm_set1_epi32( 0x0fc0fc00 ) ),
+                                  _mm_set1_epi32( 0x04000040 ) );
+    __m128i t1 = _mm_mullo_epi16( _mm_and_si128( v,
+                                                 _mm_set1_epi32( 0x003f03f0 ) ),
+                                  _mm_set1_epi32( 0x01000010 ) );
+    __m128i indices = _mm_or_si128( t0, t1 );
+
+    // map each six-bit value to its character by adding an offset
+    // which depends on which range it's in
+    __m128i r = _mm_subs_epu8( indices, _mm_set1_epi8( 51 ) );
+    __m128i less = _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), indices );
+    r = _mm_or_si128( r, _mm_and_si128( less, _mm_set1_epi8( 13 ) ) );
+    r = _mm_shuffle_epi8(
+        _mm_setr_epi8( 'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                       '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                       '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                       '/' - 63, 'A', 0, 0 ), r );
+    _mm_storeu_si128( (__m128i *)d, _mm_add_epi8( r, indices ) );
+}
+
+#endif
+
+
+/*! Returns the index of the first \a c in the \a l bytes at \a s. */
+
+int StringKernel::find( const char * s, uint l, char c )
+{
+    if ( !l )
+        return -1;
+    const char * p = (const char *)memchr( s, c, l );
+    if ( !p )
+        return -1;
+    return p - s;
+}
+
+
+/*! Returns the index of the first occurence of the \a nl bytes at \a
+    n within the \a hl bytes at \a h. If \a nl is 0, find() returns 0.
+
+    The vector versions compare the first and last byte of \a n with
+    a block of \a h at once, and only call memcmp() for the candidates
+    that match both.
+*/
+
+int StringKernel::find( const char * h, uint hl, const char * n, uint nl )
+{
+    if ( !nl )
+        return 0;
+    if ( nl > hl )
+        return -1;
+    if ( nl == 1 )
+        return find( h, hl, n[0] );
+
+    uint i = 0;
+#if defined(SK_TARGETS)
+    if ( has( Avx2 ) ) {
+        int r = findAvx2( h, hl, n, nl );
+        if ( r >= 0 )
+            return r;
+        i = -( r + 2 );
+    }
+#endif
+#if defined(SK_SSE2)
+    __m128i first = _mm_set1_epi8( n[0] );
+    __m128i last = _mm_set1_epi8( n[nl-1] );
+    while ( i + nl - 1 + 16 <= hl ) {
+        __m128i a = _mm_loadu_si128( (const __m128i *)( h + i ) );
+        __m128i b = _mm_loadu_si128( (const __m128i *)( h + i + nl - 1 ) );
+        uint m = _mm_movemask_epi8(
+            _mm_and_si128( _mm_cmpeq_epi8( a, first ),
+                           _mm_cmpeq_epi8( b, last ) ) );
+        while ( m ) {
+            uint j = i + lowest( m );
+            if ( !memcmp( h + j + 1, n + 1, nl - 2 ) )
+                return j;
+            m &= m - 1;
+        }
+        i += 16;
+    }
+#endif
+
+    uint end = hl - nl + 1;
+    while ( i < end ) {
+        const char * p = (const char *)memchr( h + i, n[0], end - i );
+        if ( !p )
+            return -1;
+        i = p - h;
+        if ( !memcmp( p + 1, n + 1, nl - 1 ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the index of the first CR or LF in the \a l bytes at \a
+    s.
+*/
+
+int StringKernel::findLineEnd( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_TARGETS)
+    if ( has( Avx2 ) ) {
+        int r = findLineEndAvx2( s, l );
+        if ( r >= 0 )
+            return r;
+        i = -( r + 2 );
+    }
+#endif
+#if defined(SK_SSE2)
+    __m128i cr = _mm_set1_epi8( 13 );
+    __m128i lf = _mm_set1_epi8( 10 );
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        uint m = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, cr ),
+                                                  _mm_cmpeq_epi8( v, lf ) ) );
+        if ( m )
+            return i + lowest( m );
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        if ( s[i] == 13 || s[i] == 10 )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the index of the first tab, CR, LF or space in the \a l
+    bytes at \a s.
+*/
+
+int StringKernel::findWhitespace( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    __m128i sp = _mm_set1_epi8( 32 );
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        // 9, 10 and 13 are all in [9,13]; 11 and 12 are weeded out below
+        uint m = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, sp ),
+                                                  inRange( v, 9, 4 ) ) );
+        while ( m ) {
+            uint j = i + lowest( m );
+            if ( isWs( s[j] ) )
+                return j;
+            m &= m - 1;
+        }
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        if ( isWs( s[i] ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the index of the first ASCII upper-case letter in the \a
+    l bytes at \a s.
+*/
+
+int StringKernel::findUpper( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        uint m = _mm_movemask_epi8( inRange( v, 'A', 25 ) );
+        if ( m )
+            return i + lowest( m );
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        if ( s[i] >= 'A' && s[i] <= 'Z' )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the index of the first ASCII lower-case letter in the \a
+    l bytes at \a s.
+*/
+
+int StringKernel::findLower( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        uint m = _mm_movemask_epi8( inRange( v, 'a', 25 ) );
+        if ( m )
+            return i + lowest( m );
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        if ( s[i] >= 'a' && s[i] <= 'z' )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns true if none of the \a l bytes at \a s has the high bit
+    set, and false otherwise.
+*/
+
+bool StringKernel::is7Bit( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_TARGETS)
+    if ( has( Avx2 ) ) {
+        i = is7BitAvx2( s, l );
+        if ( i > l )
+            return false;
+    }
+#endif
+#if defined(SK_SSE2)
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        if ( _mm_movemask_epi8( v ) )
+            return false;
+        i += 16;
+    }
+#endif
+    while ( i + 8 <= l ) {
+        unsigned long long w;
+        memcpy( &w, s + i, 8 );
+        if ( w & 0x8080808080808080ULL )
+            return false;
+        i += 8;
+    }
+    while ( i < l ) {
+        if ( s[i] & 0x80 )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+
+/*! Copies the \a l bytes at \a s to \a d, changing ASCII upper-case
+    letters to lower case. \a s and \a d may be the same.
+*/
+
+void StringKernel::lower( char * d, const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    __m128i bit = _mm_set1_epi8( 32 );
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        v = _mm_or_si128( v, _mm_and_si128( inRange( v, 'A', 25 ), bit ) );
+        _mm_storeu_si128( (__m128i *)( d + i ), v );
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        char c = s[i];
+        if ( c >= 'A' && c <= 'Z' )
+            c += 32;
+        d[i] = c;
+        i++;
+    }
+}
+
+
+/*! Copies the \a l bytes at \a s to \a d, changing ASCII lower-case
+    letters to upper case. \a s and \a d may be the same.
+*/
+
+void StringKernel::upper( char * d, const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    __m128i bit = _mm_set1_epi8( 32 );
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        v = _mm_xor_si128( v, _mm_and_si128( inRange( v, 'a', 25 ), bit ) );
+        _mm_storeu_si128( (__m128i *)( d + i ), v );
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        char c = s[i];
+        if ( c >= 'a' && c <= 'z' )
+            c -= 32;
+        d[i] = c;
+        i++;
+    }
+}
+
+
+/*! Returns the index of the first \a c in the \a l code points at \a
+    s.
+*/
+
+int StringKernel::find( const uint * s, uint l, uint c )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    __m128i k = _mm_set1_epi32( c );
+    while ( i + 4 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        uint m = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( v, k ) ) );
+        if ( m )
+            return i + lowest( m );
+        i += 4;
+    }
+#endif
+    while ( i < l ) {
+        if ( s[i] == c )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the index of the first occurence of the \a nl code points
+    at \a n within the \a hl code points at \a h. If \a nl is 0,
+    find() returns 0.
+*/
+
+int StringKernel::find( const uint * h, uint hl, const uint * n, uint nl )
+{
+    if ( !nl )
+        return 0;
+    if ( nl > hl )
+        return -1;
+    uint end = hl - nl + 1;
+    uint i = 0;
+    while ( i < end ) {
+        int f = find( h + i, end - i, n[0] );
+        if ( f < 0 )
+            return -1;
+        i += f;
+        if ( !memcmp( h + i + 1, n + 1, ( nl - 1 ) * sizeof( uint ) ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns true if each of the \a l code points at \a s is tab, CR,
+    LF or printable ASCII, and false otherwise. This is the definition
+    used by UString::isAscii().
+*/
+
+bool StringKernel::isAscii( const uint * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    // SSE2 only has signed comparisons, so flip the sign bits first
+    __m128i sign = _mm_set1_epi32( (int)0x80000000 );
+    __m128i high = _mm_set1_epi32( (int)( 127 ^ 0x80000000 ) );
+    __m128i low = _mm_set1_epi32( (int)( 32 ^ 0x80000000 ) );
+    while ( i + 4 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        __m128i f = _mm_xor_si128( v, sign );
+        __m128i control = _mm_andnot_si128(
+            _mm_or_si128( _mm_cmpeq_epi32( v, _mm_set1_epi32( 9 ) ),
+                          _mm_or_si128(
+                              _mm_cmpeq_epi32( v, _mm_set1_epi32( 10 ) ),
+                              _mm_cmpeq_epi32( v, _mm_set1_epi32( 13 ) ) ) ),
+            _mm_cmplt_epi32( f, low ) );
+        __m128i bad = _mm_or_si128( _mm_cmpgt_epi32( f, high ), control );
+        if ( _mm_movemask_epi8( bad ) )
+            return false;
+        i += 4;
+    }
+#endif
+    while ( i < l ) {
+        if ( s[i] >= 128 ||
+             ( s[i] < 32 && s[i] != 9 && s[i] != 10 && s[i] != 13 ) )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+
+
+/*! Returns the index of the first \a c in the \a l code points at \a
+    s, each of which is stored in 16 bits.
+*/
+
+int StringKernel::find( const ushort * s, uint l, uint c )
+{
+    if ( c > 0xffff )
+        return -1;
+    uint i = 0;
+#if defined(SK_SSE2)
+    __m128i k = _mm_set1_epi16( (short)c );
+    while ( i + 8 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        uint m = _mm_movemask_epi8( _mm_cmpeq_epi16( v, k ) );
+        if ( m )
+            return i + lowest( m ) / 2;
+        i += 8;
+    }
+#endif
+    while ( i < l ) {
+        if ( s[i] == c )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the index of the first occurence of the \a nl 16-bit code
+    points at \a n within the \a hl at \a h. If \a nl is 0, find()
+    returns 0.
+*/
+
+int StringKernel::find( const ushort * h, uint hl,
+                        const ushort * n, uint nl )
+{
+    if ( !nl )
+        return 0;
+    if ( nl > hl )
+        return -1;
+    uint end = hl - nl + 1;
+    uint i = 0;
+    while ( i < end ) {
+        int f = find( h + i, end - i, n[0] );
+        if ( f < 0 )
+            return -1;
+        i += f;
+        if ( !memcmp( h + i + 1, n + 1, ( nl - 1 ) * sizeof( ushort ) ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+/*! Returns the number of leading bytes among the \a l at \a s which
+    are tab, CR, LF or printable ASCII. Codec uses this to find runs
+    which need no decoding.
+*/
+
+uint StringKernel::asciiSpan( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        // everything in [32,127] is fine, the rest needs a closer look
+        uint m = ~_mm_movemask_epi8( inRange( v, 32, 95 ) ) & 0xffff;
+        while ( m ) {
+            char c = s[i + lowest( m )];
+            if ( c != 9 && c != 10 && c != 13 )
+                return i + lowest( m );
+            m &= m - 1;
+        }
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        unsigned char c = s[i];
+        if ( c >= 128 || ( c < 32 && c != 9 && c != 10 && c != 13 ) )
+            return i;
+        i++;
+    }
+    return l;
+}
+
+
+/*! Returns true if each of the \a l code points at \a s (stored in
+    eight bits each) is tab, CR, LF or printable ASCII, and false
+    otherwise.
+*/
+
+bool StringKernel::isAscii( const char * s, uint l )
+{
+    return asciiSpan( s, l ) == l;
+}
+
+
+/*! Returns true if each of the \a l code points at \a s (stored in
+    16 bits each) is tab, CR, LF or printable ASCII, and false
+    otherwise.
+*/
+
+bool StringKernel::isAscii( const ushort * s, uint l )
+{
+    uint i = 0;
+    while ( i < l ) {
+        uint c = s[i];
+        if ( c >= 128 || ( c < 32 && c != 9 && c != 10 && c != 13 ) )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+static const char to64[65] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+// The value of each base64 character, or 255 for other characters.
+
+static const unsigned char from64[256] = {
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255,  62, 255, 255, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,
+     60,  61, 255, 255, 255, 255, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,
+      7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,
+     23,  24,  25, 255, 255, 255, 255, 255,
+    255,  26,  27,  28,  29,  30,  31,  32,
+     33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,
+     49,  50,  51, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255
+};
+
+
+/*! Decodes base64 from the \a l bytes at \a s into \a d, for as long
+    as the input consists of complete groups of four characters from
+    the base64 alphabet. Stops at the first group containing anything
+    else (white space, padding or garbage), and returns the number of
+    input bytes consumed, which is a multiple of four. Three bytes are
+    written for each four consumed.
+
+    This may write up to four bytes beyond the end of the decoded
+    output, so \a d needs a little slack.
+*/
+
+uint StringKernel::decode64( char * d, const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_TARGETS)
+    if ( has( Ssse3 ) ) {
+        while ( i + 16 <= l && decode64Ssse3( d, s + i ) ) {
+            d += 12;
+            i += 16;
+        }
+    }
+#endif
+    while ( i + 4 <= l ) {
+        uint a = from64[(unsigned char)s[i]];
+        uint b = from64[(unsigned char)s[i+1]];
+        uint c = from64[(unsigned char)s[i+2]];
+        uint e = from64[(unsigned char)s[i+3]];
+        if ( ( a | b | c | e ) > 63 )
+            return i;
+        uint w = ( a << 18 ) | ( b << 12 ) | ( c << 6 ) | e;
+        d[0] = w >> 16;
+        d[1] = ( w >> 8 ) & 255;
+        d[2] = w & 255;
+        d += 3;
+        i += 4;
+    }
+    return i;
+}
+
+
+/*! Encodes the \a l bytes at \a s as base64 into \a d, which must
+    have room for 4*\a l/3 bytes. \a l must be a multiple of three.
+    No padding or line breaks are written.
+*/
+
+void StringKernel::encode64( char * d, const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_TARGETS)
+    if ( has( Ssse3 ) ) {
+        while ( i + 16 <= l ) {
+            encode64Ssse3( d, s + i );
+            d += 16;
+            i += 12;
+        }
+    }
+#endif
+    while ( i < l ) {
+        uint w = ( (unsigned char)s[i] << 16 ) |
+                 ( (unsigned char)s[i+1] << 8 ) |
+                 (unsigned char)s[i+2];
+        d[0] = to64[w >> 18];
+        d[1] = to64[( w >> 12 ) & 63];
+        d[2] = to64[( w >> 6 ) & 63];
+        d[3] = to64[w & 63];
+        d += 4;
+        i += 3;
+    }
+}
+
+
+/*! Returns the number of leading bytes among the \a l bytes at \a s
+    which quoted-printable can leave as they are: tab and printable
+    ASCII except '='.
+*/
+
+uint StringKernel::qpSafeSpan( const char * s, uint l )
+{
+    uint i = 0;
+#if defined(SK_SSE2)
+    __m128i eq = _mm_set1_epi8( '=' );
+    __m128i tab = _mm_set1_epi8( 9 );
+    while ( i + 16 <= l ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( s + i ) );
+        __m128i ok = _mm_andnot_si128( _mm_cmpeq_epi8( v, eq ),
+                                       inRange( v, 32, 126 - 32 ) );
+        ok = _mm_or_si128( ok, _mm_cmpeq_epi8( v, tab ) );
+        uint m = ~_mm_movemask_epi8( ok ) & 0xffff;
+        if ( m )
+            return i + lowest( m );
+        i += 16;
+    }
+#endif
+    while ( i < l ) {
+        char c = s[i];
+        if ( ( c < 32 || c > 126 || c == '=' ) && c != 9 )
+            return i;
+        i++;
+    }
+    return l;
+}
@@ -0,0 +1,41 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef STRINGKERNEL_H
+#define STRINGKERNEL_H
+
+#include "global.h"
+
+
+class StringKernel
+    : public Garbage
+{
+public:
+    static void setup();
+
+    static int find( const char *, uint, char );
+    static int find( const char *, uint, const char *, uint );
+    static int findLineEnd( const char *, uint );
+    static int findWhitespace( const char *, uint );
+    static int findUpper( const char *, uint );
+    static int findLower( const char *, uint );
+    static bool is7Bit( const char *, uint );
+    static uint asciiSpan( const char *, uint );
+
+    static void lower( char *, const char *, uint );
+    static void upper( char *, const char *, uint );
+
+    static uint decode64( char *, const char *, uint );
+    static void encode64( char *, const char *, uint );
+    static uint qpSafeSpan( const char *, uint );
+
+    static int find( const ushort *, uint, uint );
+    static int find( const ushort *, uint, const ushort *, uint );
+    static int find( const uint *, uint, uint );
+    static int find( const uint *, uint, const uint *, uint );
+    static bool isAscii( const char *, uint );
+    static bool isAscii( const ushort *, uint );
+    static bool isAscii( const uint *, uint );
+};
+
+
+#endif
@@ -5,6 +5,7 @@
 #include "allocator.h"
 #include "scope.h"
 #include "estring.h"
+#include "stringkernel.h"
 
 #include "../encodings/utf.h"
 
@@ -14,9 +15,15 @@
 /*! \class UStringData ustring.h
 
     This private helper class contains the actual string data. It has
-    three fields, all accessible only to UString. The only noteworthy
-    field is max, which is 0 in the case of a shared/read-only string,
-    and nonzero in the case of a string which can be modified.
+    four fields, all accessible only to UString. The noteworthy fields
+    are max, which is 0 in the case of a shared/read-only string, and
+    nonzero in the case of a string which can be modified, and width.
+
+    width is the number of bytes used to store each code point: 1 if
+    all code points are below 256, 2 if they're all in the BMP, and 4
+    otherwise. A string is never narrower than its code points require,
+    but may be wider, e.g. after truncate() or mid(). len and max count
+    code points, not bytes.
 */
 
 
@@ -28,16 +35,170 @@
 /*! Creates a new EString with \a words capacity. */
 
 UStringData::UStringData( int words )
-    : str( 0 ), len( 0 ), max( words )
+    : str( 0 ), len( 0 ), max( words ), width( 1 )
 {
     if ( str )
-        str = (uint*)Allocator::alloc( words*sizeof(uint), 0 );
+        str = (char*)Allocator::alloc( words*sizeof(uint), 0 );
 }
 
 
+/*! Allocates a UStringData object followed by \a extra bytes. */
+
 void * UStringData::operator new( size_t ownSize, uint extra )
 {
-    return Allocator::alloc( ownSize + extra*sizeof(uint), 1 );
+    return Allocator::alloc( ownSize + extra, 1 );
+}
+
+
+// Returns the number of bytes needed to store cp.
+
+static inline uint widthOf( uint cp )
+{
+    if ( cp < 0x100 )
+        return 1;
+    if ( cp < 0x10000 )
+        return 2;
+    return 4;
+}
+
+
+// Stores cp as the i'th code point of s, which is w bytes wide.
+
+static inline void put( char * s, uint w, uint i, uint cp )
+{
+    if ( w == 1 )
+        ((unsigned char *)s)[i] = cp;
+    else if ( w == 2 )
+        ((ushort *)s)[i] = cp;
+    else
+        ((uint *)s)[i] = cp;
+}
+
+
+// Copies n code points from f, which is fw bytes wide, to t, which is
+// tw bytes wide and must be at least as wide as needed.
+
+static void convert( char * t, uint tw, const char * f, uint fw, uint n )
+{
+    if ( tw == fw ) {
+        memmove( t, f, n * tw );
+        return;
+    }
+    uint i = 0;
+    if ( fw == 1 && tw == 2 ) {
+        while ( i < n ) {
+            ((ushort *)t)[i] = ((const unsigned char *)f)[i];
+            i++;
+        }
+    }
+    else if ( fw == 1 ) {
+        while ( i < n ) {
+            ((uint *)t)[i] = ((const unsigned char *)f)[i];
+            i++;
+        }
+    }
+    else if ( fw == 2 && tw == 4 ) {
+        while ( i < n ) {
+            ((uint *)t)[i] = ((const ushort *)f)[i];
+            i++;
+        }
+    }
+    else {
+        while ( i < n ) {
+            uint cp;
+            if ( fw == 2 )
+                cp = ((const ushort *)f)[i];
+            else
+                cp = ((const uint *)f)[i];
+            put( t, tw, i, cp );
+            i++;
+        }
+    }
+}
+
+
+// Returns the number of leading code points a and b have in common,
+// looking at no more than n. The loop is instantiated for each pair
+// of widths, so that it needn't ask UStringData::at() each time.
+
+template< typename A, typename B >
+static uint same( const A * a, const B * b, uint n )
+{
+    uint i = 0;
+    while ( i < n && (uint)a[i] == (uint)b[i] )
+        i++;
+    return i;
+}
+
+
+template< typename A >
+static uint same( const A * a, const char * b, uint bw, uint n )
+{
+    if ( bw == 1 )
+        return same( a, (const unsigned char *)b, n );
+    if ( bw == 2 )
+        return same( a, (const ushort *)b, n );
+    return same( a, (const uint *)b, n );
+}
+
+
+static uint same( const char * a, uint aw, const char * b, uint bw, uint n )
+{
+    if ( aw == 1 )
+        return same( (const unsigned char *)a, b, bw, n );
+    if ( aw == 2 )
+        return same( (const ushort *)a, b, bw, n );
+    return same( (const uint *)a, b, bw, n );
+}
+
+
+// Returns true if the n code points in s are the same as the n
+// Latin-1 characters in l.
+
+template< typename C >
+static bool matches( const C * s, const char * l, uint n )
+{
+    return same( s, (const unsigned char *)l, n ) == n;
+}
+
+
+static bool matches( const char * s, uint w, const char * l, uint n )
+{
+    if ( w == 1 )
+        return !memcmp( s, l, n );
+    if ( w == 2 )
+        return matches( (const ushort *)s, l, n );
+    return matches( (const uint *)s, l, n );
+}
+
+
+// Returns the narrowest width that can store the n code points in s.
+
+template< typename C >
+static uint narrowest( const C * s, uint n )
+{
+    uint w = 1;
+    uint i = 0;
+    while ( i < n ) {
+        uint cp = s[i];
+        if ( cp >= 0x10000 )
+            return 4;
+        if ( cp >= 0x100 )
+            w = 2;
+        i++;
+    }
+    return w;
+}
+
+
+// Returns UString::isSpace( cp ), but quickly for the printable ASCII
+// and C1 characters, none of which is a space.
+
+static inline bool space( uint cp )
+{
+    if ( cp > ' ' && cp < 0xa0 )
+        return false;
+    return UString::isSpace( cp );
 }
 
 
@@ -54,6 +215,13 @@ void * UStringData::operator new( size_t ownSize, uint extra )
     functionality is intentionally kept to a minimum, to lighten the
     testing burden.
 
+    Internally, UString stores each code point in one, two or four
+    bytes, whichever is enough for the widest code point in the
+    string. Most strings are ASCII or Latin-1, so this saves a great
+    deal of memory, and utf8(), compare(), find() and titlecased() are
+    faster for narrow strings. The width is not visible through the
+    API.
+
     Two functions note particular mention are ascii() and the equality
     operator. ascii() returns something that's useful for logging, but
     which can often not be converted back to unicode.
@@ -181,8 +349,13 @@ void UString::append( const UString & other )
         *this = other;
         return;
     }
-    reserve( length() + other.length() );
-    memmove( d->str+d->len, other.d->str, sizeof(uint)*other.d->len );
+    uint n = length() + other.length();
+    if ( d->width < other.d->width )
+        reserve2( d->max > n ? d->max : n, other.d->width );
+    else
+        reserve( n );
+    convert( d->str + d->len * d->width, d->width,
+             other.d->str, other.d->width, other.d->len );
     d->len += other.d->len;
 }
 
@@ -191,8 +364,14 @@ void UString::append( const UString & other )
 
 void UString::append( const uint cp )
 {
-    reserve( length() + 1 );
-    d->str[d->len] = cp;
+    uint w = widthOf( cp );
+    if ( !d )
+        reserve2( 1, w );
+    else if ( d->width < w )
+        reserve2( d->max > d->len ? d->max : d->len + 1, w );
+    else
+        reserve( length() + 1 );
+    put( d->str, d->width, d->len, cp );
     d->len++;
 }
 
@@ -205,9 +384,22 @@ void UString::append( const char * s )
 {
     if ( !s || !*s )
         return;
-    reserve( length() + strlen( s ) );
-    while ( s && *s )
-        d->str[d->len++] = (uint)*s++; // I feel naughty today
+    append( s, strlen( s ) );
+}
+
+
+/*! Appends the \a l ISO 8859-1 characters at \a s to the end of this
+    string. Each byte becomes one code point, so this is also suitable
+    for ASCII.
+*/
+
+void UString::append( const char * s, uint l )
+{
+    if ( !s || !l )
+        return;
+    reserve( length() + l );
+    convert( d->str + d->len * d->width, d->width, s, 1, l );
+    d->len += l;
 }
 
 
@@ -221,37 +413,41 @@ void UString::reserve( uint num )
     if ( !num )
         num = 1;
     if ( !d || d->max < num )
-        reserve2( num );
+        reserve2( num, d ? d->width : 1 );
 }
 
 
-/*! Equivalent to reserve(). reserve( \a num ) calls this function to
-    do the heavy lifting. This function is not inline, while reserve()
-    is, and calls to this function should be interesting wrt. memory
-    allocation statistics.
+/*! Equivalent to reserve(), except that the string is also made at
+    least \a width bytes wide. reserve( \a num ) calls this function
+    to do the heavy lifting. This function is not inline, while
+    reserve() is, and calls to this function should be interesting
+    wrt. memory allocation statistics.
 
-    Noone except reserve() should call reserve2().
+    Noone except reserve(), widen() and append() should call
+    reserve2().
 */
 
-void UString::reserve2( uint num )
+void UString::reserve2( uint num, uint width )
 {
+    if ( d && d->width > width )
+        width = d->width;
     const uint std = sizeof( UStringData );
-    const uint si = sizeof( uint );
-    num = ( Allocator::rounded( num * si + std ) - std ) / si;
+    num = ( Allocator::rounded( num * width + std ) - std ) / width;
 
     UStringData * freeable = 0;
     if ( d && d->max )
         freeable = d;
 
-    UStringData * nd = new( num ) UStringData( 0 );
+    UStringData * nd = new( num * width ) UStringData( 0 );
     nd->max = num;
-    nd->str = (uint*)(std + (char*)nd);
+    nd->width = width;
+    nd->str = std + (char*)nd;
     if ( d )
         nd->len = d->len;
     if ( nd->len > num )
         nd->len = num;
     if ( d && d->len )
-        memmove( nd->str, d->str, nd->len*si );
+        convert( nd->str, width, d->str, d->width, nd->len );
     d = nd;
 
     if ( freeable )
@@ -259,6 +455,32 @@ void UString::reserve2( uint num )
 }
 
 
+/*! Makes this string modifiable and at least \a width bytes wide,
+    keeping its capacity.
+*/
+
+void UString::widen( uint width )
+{
+    if ( d && d->max && d->width >= width )
+        return;
+    uint num = length();
+    if ( d && d->max > num )
+        num = d->max;
+    reserve2( num ? num : 1, width );
+}
+
+
+/*! Changes code point \a i of this string to \a cp, detaching and
+    widening as necessary. \a i must be less than length().
+*/
+
+void UString::set( uint i, uint cp )
+{
+    widen( widthOf( cp ) );
+    put( d->str, d->width, i, cp );
+}
+
+
 /*! Truncates this string to \a l characters. If the string is shorter,
     truncate() does nothing. If \a l is 0 (the default), the string will
     be empty after this function is called.
@@ -282,15 +504,28 @@ bool UString::isAscii() const
 {
     if ( isEmpty() )
         return true;
+    if ( d->width == 1 )
+        return StringKernel::isAscii( d->str, d->len );
+    if ( d->width == 2 )
+        return StringKernel::isAscii( (const ushort *)d->str, d->len );
+    return StringKernel::isAscii( (const uint *)d->str, d->len );
+}
+
+
+// Appends the n code points in s to r as ascii() describes.
+
+template< typename C >
+static void printable( EString & r, const C * s, uint n )
+{
     uint i = 0;
-    while ( i < d->len ) {
-        if ( d->str[i] >= 128 ||
-             ( d->str[i] < 32 &&
-               d->str[i] != 9 && d->str[i] != 10 && d->str[i] != 13 ) )
-            return false;
+    while ( i < n ) {
+        uint c = s[i];
+        if ( c >= ' ' && c < 127 )
+            r.append( (char)c );
+        else
+            r.append( '?' );
         i++;
     }
-    return true;
 }
 
 
@@ -308,13 +543,13 @@ EString UString::ascii() const
 {
     EString r;
     r.reserve( length() );
-    uint i = 0;
-    while ( i < length() ) {
-        if ( d->str[i] >= ' ' && d->str[i] < 127 )
-            r.append( (char)(d->str[i]) );
+    if ( !isEmpty() ) {
+        if ( d->width == 1 )
+            printable( r, (const unsigned char *)d->str, d->len );
+        else if ( d->width == 2 )
+            printable( r, (const ushort *)d->str, d->len );
         else
-            r.append( '?' );
-        i++;
+            printable( r, (const uint *)d->str, d->len );
     }
     r.append( (char)0 );
     r.truncate( r.length() - 1 );
@@ -342,8 +577,9 @@ UString UString::mid( uint start, uint num ) const
 
     d->max = 0;
     result.d = new UStringData;
-    result.d->str = d->str + start;
+    result.d->str = d->str + start * d->width;
     result.d->len = num;
+    result.d->width = d->width;
     return result;
 }
 
@@ -380,56 +616,49 @@ bool UString::isSpace( uint c )
 }
 
 
-/*! Returns a copy of this string where each run of whitespace is
-    compressed to a single space character, and where leading and
-    trailing whitespace is removed altogether. Most spaces are mapped
-    to U+0020, but the Ogham space dominates and ZWNBSP recedes.
-
-    Unicode space characters are as listed in
-    http://en.wikipedia.org/wiki/Space_character
-*/
+// Finds the first and last nonwhitespace characters among the n in
+// s, and returns false if there's a sequence of two or more
+// whitespace characters between them, true if simplified() can use
+// that part of s as it is.
 
-UString UString::simplified() const
+template< typename C >
+static bool simple( const C * s, uint n, uint & first, uint & last )
 {
-    // scan for the first nonwhitespace character
     uint i = 0;
-    uint first = 0;
-    while ( i < length() && first == i ) {
-        if ( isSpace( d->str[i] ) )
-            first++;
+    while ( i < n && space( s[i] ) )
         i++;
-    }
-
-    // scan on to find the last nonwhitespace character and detect any
-    // sequences of two or more whitespace characters within the
-    // string.
-    uint last = first;
+    first = i;
+    last = first;
     uint spaces = 0;
-    bool identity = true;
-    while ( identity && i < length() ) {
-        if ( isSpace( d->str[i] ) ) {
+    while ( i < n ) {
+        if ( space( s[i] ) ) {
             spaces++;
         }
         else {
             if ( spaces > 1 )
-                identity = false;
+                return false;
             spaces = 0;
             last = i;
         }
         i++;
     }
-    if ( identity )
-        return mid( first, last+1-first );
+    return true;
+}
 
-    UString result;
-    result.reserve( length() );
-    i = 0;
-    spaces = 0;
+
+// Appends the n code points in s to r, with whitespace compressed as
+// simplified() describes.
+
+template< typename C >
+static void simplify( UString & r, const C * s, uint n )
+{
+    uint i = 0;
+    uint spaces = 0;
     bool ogham = false;
     bool zwnbsp = true;
-    while ( i < length() ) {
-        int c = d->str[i];
-        if ( isSpace( c ) ) {
+    while ( i < n ) {
+        uint c = s[i];
+        if ( space( c ) ) {
             if ( c == 0x1680 )
                 ogham = true;
             else if ( c != 0xFEFF )
@@ -437,49 +666,96 @@ UString UString::simplified() const
             spaces++;
         }
         else {
-            if ( spaces && !result.isEmpty() ) {
+            if ( spaces && !r.isEmpty() ) {
                 if ( ogham )
-                    result.append( 0x1680 );
+                    r.append( 0x1680 );
                 else if ( zwnbsp )
-                    result.append( 0xFEFF );
+                    r.append( 0xFEFF );
                 else
-                    result.append( ' ' );
+                    r.append( ' ' );
             }
             spaces = 0;
-            result.append( c );
+            r.append( c );
             ogham = false;
             zwnbsp = true;
         }
         i++;
     }
+}
+
+
+/*! Returns a copy of this string where each run of whitespace is
+    compressed to a single space character, and where leading and
+    trailing whitespace is removed altogether. Most spaces are mapped
+    to U+0020, but the Ogham space dominates and ZWNBSP recedes.
+
+    Unicode space characters are as listed in
+    http://en.wikipedia.org/wiki/Space_character
+*/
+
+UString UString::simplified() const
+{
+    if ( isEmpty() )
+        return *this;
+
+    uint first = 0;
+    uint last = 0;
+    bool identity;
+    if ( d->width == 1 )
+        identity = simple( (const unsigned char *)d->str, d->len,
+                           first, last );
+    else if ( d->width == 2 )
+        identity = simple( (const ushort *)d->str, d->len, first, last );
+    else
+        identity = simple( (const uint *)d->str, d->len, first, last );
+    if ( identity )
+        return mid( first, last+1-first );
+
+    UString result;
+    result.reserve( length() );
+    if ( d->width == 1 )
+        simplify( result, (const unsigned char *)d->str, d->len );
+    else if ( d->width == 2 )
+        simplify( result, (const ushort *)d->str, d->len );
+    else
+        simplify( result, (const uint *)d->str, d->len );
     return result;
 }
 
 
+// Finds the part of the n code points in s which has no leading or
+// trailing whitespace, starting at first and ending before end.
+
+template< typename C >
+static void trim( const C * s, uint n, uint & first, uint & end )
+{
+    first = 0;
+    while ( first < n && space( s[first] ) )
+        first++;
+    end = n;
+    while ( end > first && space( s[end-1] ) )
+        end--;
+}
+
+
 /*! Returns a copy of this string without leading or trailing
     whitespace.
 */
 
 UString UString::trimmed() const
 {
-    uint i = 0;
-    uint first = length();
-    uint last = 0;
-    while ( i < length() ) {
-        if ( !isSpace( d->str[i] ) ) {
-            if ( i < first )
-                first = i;
-            if ( i > last )
-                last = i;
-        }
-        i++;
-    }
-
-    if ( last >= first )
-        return mid( first, last + 1 - first );
+    if ( isEmpty() )
+        return *this;
 
-    UString empty;
-    return empty;
+    uint first = 0;
+    uint end = 0;
+    if ( d->width == 1 )
+        trim( (const unsigned char *)d->str, d->len, first, end );
+    else if ( d->width == 2 )
+        trim( (const ushort *)d->str, d->len, first, end );
+    else
+        trim( (const uint *)d->str, d->len, first, end );
+    return mid( first, end - first );
 }
 
 
@@ -491,8 +767,31 @@ UString UString::trimmed() const
 EString UString::utf8() const
 {
     EString s;
-    Utf8Codec u;
-    s = u.fromUnicode( *this );
+    if ( d && d->width == 1 ) {
+        if ( StringKernel::is7Bit( d->str, d->len ) ) {
+            s.reserve( d->len + 1 );
+            s.append( d->str, d->len );
+        }
+        else {
+            s.reserve( d->len * 2 + 1 );
+            uint i = 0;
+            while ( i < d->len ) {
+                uint c = ((const unsigned char *)d->str)[i];
+                if ( c < 0x80 ) {
+                    s.append( (char)c );
+                }
+                else {
+                    s.append( (char)( 0xc0 | ( c >> 6 ) ) );
+                    s.append( (char)( 0x80 | ( c & 0x3f ) ) );
+                }
+                i++;
+            }
+        }
+    }
+    else {
+        Utf8Codec u;
+        s = u.fromUnicode( *this );
+    }
     s.append( (char)0 );
     s.truncate( s.length() - 1 );
     return s;
@@ -511,22 +810,50 @@ int UString::compare( const UString & other ) const
 {
     if ( d == other.d )
         return 0;
+    uint n = length();
+    if ( other.length() < n )
+        n = other.length();
     uint i = 0;
-    while ( i < length() && i < other.length() &&
-            d->str[i] == other.d->str[i] )
-        i++;
+    if ( n && d->width == 1 && other.d->width == 1 ) {
+        int r = memcmp( d->str, other.d->str, n );
+        if ( r < 0 )
+            return -1;
+        if ( r > 0 )
+            return 1;
+        i = n;
+    }
+    else if ( n ) {
+        i = same( d->str, d->width, other.d->str, other.d->width, n );
+    }
     if ( i >= length() && i >= other.length() )
         return 0;
     if ( i >= length() )
         return -1;
     if ( i >= other.length() )
         return 1;
-    if ( d->str[i] < other.d->str[i] )
+    if ( d->at( i ) < other.d->at( i ) )
         return -1;
     return 1;
 }
 
 
+/*! Returns true if \a s1 and \a s2 contain the same code points, and
+    false if not.
+*/
+
+bool operator==( const UString & s1, const UString & s2 )
+{
+    uint l = s1.length();
+    if ( l != s2.length() )
+        return false;
+    if ( !l || s1.d == s2.d )
+        return true;
+    if ( s1.d->width == s2.d->width )
+        return !memcmp( s1.d->str, s2.d->str, l * s1.d->width );
+    return same( s1.d->str, s1.d->width, s2.d->str, s2.d->width, l ) == l;
+}
+
+
 bool UString::operator<( const UString & other ) const
 {
     return compare( other ) < 0;
@@ -570,16 +897,10 @@ bool UString::startsWith( const char * prefix ) const
 {
     if ( !prefix || !*prefix )
         return true;
-    if ( !length() )
-        return false;
-    uint i = 0;
-    while ( i < d->len && prefix[i] && prefix[i] == d->str[i] )
-        i++;
-    if ( i > d->len )
-        return false;
-    if ( prefix[i] )
+    uint l = strlen( prefix );
+    if ( l > length() )
         return false;
-    return true;
+    return matches( d->str, d->width, prefix, l );
 }
 
 
@@ -603,14 +924,12 @@ bool UString::endsWith( const char * suffix ) const
     if ( !suffix )
         return true;
     uint l = strlen( suffix );
+    if ( !l )
+        return true;
     if ( l > length() )
         return false;
-    uint i = 0;
-    while ( i < l && suffix[i] == d->str[d->len - l + i] )
-        i++;
-    if ( i < l )
-        return false;
-    return true;
+    return matches( d->str + ( d->len - l ) * d->width, d->width, suffix,
+                    l );
 }
 
 
@@ -620,11 +939,22 @@ bool UString::endsWith( const char * suffix ) const
 
 int UString::find( char c, int i ) const
 {
-    while ( i < (int)length() && d->str[i] != c )
-        i++;
-    if ( i < (int)length() )
-        return i;
-    return -1;
+    if ( i < 0 )
+        i = 0;
+    if ( i >= (int)length() )
+        return -1;
+    int r;
+    if ( d->width == 1 )
+        r = StringKernel::find( d->str + i, d->len - i, c );
+    else if ( d->width == 2 )
+        r = StringKernel::find( (const ushort *)d->str + i, d->len - i,
+                                (uint)(unsigned char)c );
+    else
+        r = StringKernel::find( (const uint *)d->str + i, d->len - i,
+                                (uint)(unsigned char)c );
+    if ( r < 0 )
+        return -1;
+    return i + r;
 }
 
 
@@ -634,19 +964,41 @@ int UString::find( char c, int i ) const
 
 int UString::find( const UString & s, int i ) const
 {
-    uint j = 0;
-    while ( j < s.length() && i+j < length() ) {
-        if ( d->str[i+j] == s.d->str[j] ) {
+    if ( s.isEmpty() )
+        return i;
+    if ( i < 0 )
+        i = 0;
+    if ( i >= (int)length() )
+        return -1;
+
+    // make the needle as wide as the haystack
+    uint w = d->width;
+    const char * n = s.d->str;
+    if ( s.d->width != w ) {
+        char * t = (char*)Allocator::alloc( s.d->len * w, 0 );
+        uint j = 0;
+        while ( j < s.d->len ) {
+            uint cp = s.d->at( j );
+            if ( widthOf( cp ) > w )
+                return -1;
+            put( t, w, j, cp );
             j++;
         }
-        else {
-            j = 0;
-            i++;
-        }
+        n = t;
     }
-    if ( j == s.length() )
-        return i;
-    return -1;
+
+    int r;
+    if ( w == 1 )
+        r = StringKernel::find( d->str + i, d->len - i, n, s.d->len );
+    else if ( w == 2 )
+        r = StringKernel::find( (const ushort *)d->str + i, d->len - i,
+                                (const ushort *)n, s.d->len );
+    else
+        r = StringKernel::find( (const uint *)d->str + i, d->len - i,
+                                (const uint *)n, s.d->len );
+    if ( r < 0 )
+        return -1;
+    return i + r;
 }
 
 
@@ -676,14 +1028,10 @@ bool UString::contains( const char * s ) const
 {
     if ( !s || !*s )
         return true;
+    uint l = strlen( s );
     int i = find( *s );
-    while ( i >= 0 ) {
-        uint l = strlen( s );
-        uint j = 0;
-        while ( j < l && i + j < length() &&
-                d->str[i+j] == s[j] )
-            j++;
-        if ( j == l )
+    while ( i >= 0 && i + l <= length() ) {
+        if ( matches( d->str + i * d->width, d->width, s, l ) )
             return true;
         i = find( *s, i+1 );
     }
@@ -694,28 +1042,155 @@ bool UString::contains( const char * s ) const
 #include "unicode-titlecase.inc"
 
 
+// Titlecases code points i and onwards of the n in s, and returns
+// the position of the first one whose titlecase doesn't fit in a C,
+// or n if all did.
+
+template< typename C >
+static uint titlecase( C * s, uint i, uint n )
+{
+    while ( i < n ) {
+        uint cp = s[i];
+        if ( cp < numTitlecaseCodepoints &&
+             titlecaseCodepoints[cp] &&
+             cp != titlecaseCodepoints[cp] ) {
+            uint t = titlecaseCodepoints[cp];
+            if ( (uint)(C)t != t )
+                return i;
+            s[i] = t;
+        }
+        i++;
+    }
+    return n;
+}
+
+
 /*! Returns a titlecased version of this string. Usable for
     case-insensitive comparison, not much else.
 */
 
 UString UString::titlecased() const
 {
+    if ( d && d->width == 1 && StringKernel::is7Bit( d->str, d->len ) ) {
+        if ( StringKernel::findLower( d->str, d->len ) < 0 )
+            return *this;
+        UString r;
+        r.reserve( d->len );
+        StringKernel::upper( r.d->str, d->str, d->len );
+        r.d->len = d->len;
+        return r;
+    }
+
     UString r = *this;
+    r.detach();
     uint i = 0;
-    while ( i < length() ) {
-        uint cp = d->str[i];
-        if ( cp < numTitlecaseCodepoints &&
-             titlecaseCodepoints[cp] &&
-             cp != titlecaseCodepoints[cp] ) {
-            r.detach();
-            r.d->str[i] = titlecaseCodepoints[cp];
+    while ( i < r.d->len ) {
+        if ( r.d->width == 1 )
+            i = titlecase( (unsigned char *)r.d->str, i, r.d->len );
+        else if ( r.d->width == 2 )
+            i = titlecase( (ushort *)r.d->str, i, r.d->len );
+        else
+            i = titlecase( (uint *)r.d->str, i, r.d->len );
+        if ( i < r.d->len ) {
+            // widen, and go on at the new width
+            r.set( i, titlecaseCodepoints[r.d->at( i )] );
+            i++;
         }
-        i++;
     }
     return r;
 }
 
 
+/*! Returns a string of bytes which is the same for all UString
+    objects that compare equal, and different for all others,
+    regardless of how wide each string's storage is. UDict uses this.
+*/
+
+EString UString::key() const
+{
+    EString k;
+    if ( !d || !d->len )
+        return k;
+    uint w = narrowest();
+    k.reserve( d->len * w + 1 );
+    if ( w == 1 && d->width == 1 ) {
+        k.append( d->str, d->len * w );
+    }
+    else {
+        uint i = 0;
+        while ( i < d->len ) {
+            uint cp = d->at( i );
+            uint b = 0;
+            while ( b < w ) {
+                k.append( (char)( cp >> ( 8 * b ) ) );
+                b++;
+            }
+            i++;
+        }
+    }
+    k.append( (char)w );
+    return k;
+}
+
+
+/*! Returns a pointer to a key for this string and sets \a *bits to
+    its length in bits. Like key(), the key is the same for all
+    UString objects that compare equal and different for all others,
+    but this function allocates memory only if it must. UDict uses
+    this.
+
+    If the string is stored one byte wide, the key is the string's own
+    storage. Otherwise the key is built in \a buffer if it fits in \a
+    size bytes, and in newly allocated memory if not.
+
+    The key of a string which needs more than one byte per code point
+    is one (for two-byte strings) or two (for four-byte strings) bits
+    longer than its bytes, so that it differs from every other key in
+    length, if not in content.
+*/
+
+const char * UString::key( char * buffer, uint size, uint * bits ) const
+{
+    if ( !d || !d->len ) {
+        *bits = 0;
+        return buffer;
+    }
+    if ( d->width == 1 ) {
+        *bits = d->len * 8;
+        return d->str;
+    }
+
+    uint w = narrowest();
+    uint n = d->len * w;
+    char * k = buffer;
+    if ( n + 1 > size )
+        k = (char*)Allocator::alloc( n + 1, 0 );
+    convert( k, w, d->str, d->width, d->len );
+    // PatriciaTree may look at the first bit of the last byte
+    k[n] = 0;
+    *bits = n * 8;
+    if ( w == 2 )
+        *bits += 1;
+    else if ( w == 4 )
+        *bits += 2;
+    return k;
+}
+
+
+/*! Returns the narrowest width (1, 2 or 4) which can store each code
+    point in this string.
+*/
+
+uint UString::narrowest() const
+{
+    if ( !d || d->width == 1 )
+        return 1;
+    if ( d->width == 2 )
+        return ::narrowest( (const ushort *)d->str, d->len );
+    return ::narrowest( (const uint *)d->str, d->len );
+}
+
+
 #include "unicode-isalnum.inc"
 
 
@@ -12,7 +12,7 @@ class UStringData
     : public Garbage
 {
 private:
-    UStringData(): str( 0 ), len( 0 ), max( 0 ) {
+    UStringData(): str( 0 ), len( 0 ), max( 0 ), width( 1 ) {
         setFirstNonPointer( &len );
     }
     UStringData( int );
@@ -23,9 +23,18 @@ private:
     void * operator new( size_t, uint );
     void * operator new( size_t s ) { return Garbage::operator new( s); }
 
-    uint * str;
+    uint at( uint i ) const {
+        if ( width == 1 )
+            return ((const unsigned char *)str)[i];
+        if ( width == 2 )
+            return ((const ushort *)str)[i];
+        return ((const uint *)str)[i];
+    }
+
+    char * str;
     uint len;
     uint max;
+    uint width;
 };
 
 
@@ -46,7 +55,7 @@ public:
     uint operator[]( uint i ) const {
         if ( !d || i >= d->len )
             return 0;
-        return d->str[i];
+        return d->at( i );
     }
 
     bool isEmpty() const { return !d || d->len == 0; }
@@ -55,6 +64,7 @@ public:
     void append( const UString & );
     void append( const uint );
     void append( const char * );
+    void append( const char *, uint );
 
     void reserve( uint );
     void truncate( uint = 0 );
@@ -77,7 +87,8 @@ public:
     UString simplified() const;
     UString trimmed() const;
 
-    inline const uint * data() const { return d ? (const uint*)d->str : 0; }
+    EString key() const;
+    const char * key( char *, uint, uint * ) const;
 
     UString titlecased() const;
 
@@ -104,26 +115,20 @@ public:
     static bool isSpace( uint );
 
 private:
-    void reserve2( uint );
+    void reserve2( uint, uint );
+    void widen( uint );
+    void set( uint, uint );
+    uint narrowest() const;
 
 
 private:
     class UStringData * d;
+
+    friend bool operator==( const UString &, const UString & );
 };
 
 
-inline bool operator==( const UString & s1, const UString & s2 )
-{
-    if ( s1.length() != s2.length() )
-        return false;
-    uint i = 0;
-    while ( i < s1.length() ) {
-        if ( s1[i] != s2[i] )
-            return false;
-        i++;
-    }
-    return true;
-}
+extern bool operator==( const UString &, const UString & );
 
 
 inline bool operator!=( const UString & s1, const UString & s2 )
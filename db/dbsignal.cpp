@@ -10,6 +10,7 @@
 
 
 static List<DatabaseSignal> * signals = 0;
+static EString * payload = 0;
 
 
 class DatabaseSignalData
@@ -57,11 +58,16 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name. While they run, payload() returns \a p.
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name, const EString & p )
 {
+    if ( !::payload ) {
+        ::payload = new EString;
+        Allocator::addEternal( ::payload, "database notify payload" );
+    }
+    *::payload = p;
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
@@ -69,6 +75,20 @@ void DatabaseSignal::notifyAll( const EString & name )
         if ( name == s->d->n && s->d->o )
             s->d->o->notify();
     }
+    ::payload->truncate();
+}
+
+
+/*! Returns the payload of the signal currently being delivered by
+    notifyAll(), as given to the NOTIFY command. Returns an empty
+    string if there is none, or if no signal is being delivered.
+*/
+
+EString DatabaseSignal::payload()
+{
+    if ( !::payload )
+        return "";
+    return *::payload;
 }
 
 
@@ -1304,7 +1304,7 @@ EString PgNotificationResponse::name() const
 }
 
 
-/*! Returns the notification source, usually an empty string. */
+/*! Returns the notification payload, usually an empty string. */
 
 EString PgNotificationResponse::source() const
 {
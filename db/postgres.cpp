@@ -631,7 +631,7 @@ void Postgres::process( char type )
                 s = " (" + msg.source() + ")";
             log( "Received notify " + msg.name().quoted() +
                  " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -592,6 +592,14 @@ bool Schema::singleStep()
         c = stepTo97(); break;
     case 97:
         c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4420,3 +4428,91 @@ bool Schema::stepTo98()
     d->t->enqueue( "alter table mailboxes add flag text" );
     return true;
 }
+
+
+/*! Add sort_keys, so that SORT can use precomputed keys. The
+    Injector fills it for new messages, and "aox update database"
+    computes the same keys for existing ones.
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding sort_keys to speed up SORT." );
+    d->t->enqueue( "create table sort_keys ("
+                   "message integer not null primary key "
+                   "references messages(id) on delete cascade, "
+                   "subject text, "
+                   "from_address text, from_display text, "
+                   "to_address text, to_display text, "
+                   "cc_address text, "
+                   "sent integer)" );
+    return true;
+}
+
+
+/*! Notify aliases_updated whenever aliases, scripts or users change,
+    so that Sieve can cache its alias lookups.
+*/
+
+bool Schema::stepTo100()
+{
+    describeStep( "Adding triggers to notify alias changes." );
+    d->t->enqueue( "create or replace function notify_aliases() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "notify aliases_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger aliases_trigger "
+                   "after insert or update or delete on aliases "
+                   "for each statement execute procedure notify_aliases()" );
+    d->t->enqueue( "create trigger scripts_aliases_trigger "
+                   "after insert or update or delete on scripts "
+                   "for each statement execute procedure notify_aliases()" );
+    d->t->enqueue( "create trigger users_aliases_trigger "
+                   "after update or delete on users "
+                   "for each statement execute procedure notify_aliases()" );
+    return true;
+}
+
+
+/*! Make autoresponses unique per sender, recipient and handle, so
+    that Sieve can upsert rows instead of accumulating duplicates.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Removing duplicate autoresponses." );
+    d->t->enqueue( "delete from autoresponses a using autoresponses b "
+                   "where a.sent_from=b.sent_from and a.sent_to=b.sent_to "
+                   "and a.handle=b.handle "
+                   "and (a.expires_at<b.expires_at or "
+                   "(a.expires_at=b.expires_at and a.id<b.id))" );
+    d->t->enqueue( "create unique index ar_fth on "
+                   "autoresponses(sent_from,sent_to,handle)" );
+    return true;
+}
+
+
+/*! Add scripts.revision, which a trigger increments whenever a
+    script's text changes, so that Sieve can tell whether its cached
+    copy of a script is current without fetching the text.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding scripts.revision." );
+    d->t->enqueue( "alter table scripts "
+                   "add revision integer not null default 1" );
+    d->t->enqueue( "create or replace function bump_script_revision() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "if new.script is distinct from old.script then "
+                   "new.revision := old.revision+1; "
+                   "end if; "
+                   "return new; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger scripts_revision_trigger "
+                   "before update on scripts "
+                   "for each row execute procedure bump_script_revision()" );
+    return true;
+}
@@ -16,6 +16,7 @@
 #include "user.h"
 #include "log.h"
 #include "utf.h"
+#include "dict.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -24,6 +25,14 @@
 #include <time.h>
 // all the exit codes
 #include <sysexits.h>
+// opendir, readdir, closedir
+#include <dirent.h>
+// read
+#include <unistd.h>
+// poll
+#include <poll.h>
+// errno
+#include <errno.h>
 
 
 static void quit( uint s, const EString & m )
@@ -140,6 +149,443 @@ public:
 };
 
 
+class BatchMessage
+    : public Garbage
+{
+public:
+    BatchMessage(): m( 0 ), mb( 0 ), p( 0 ), status( 0 ), stored( false ) {}
+
+    EString id;
+    EString file;
+    EString recipient;
+    Injectee * m;
+    Mailbox * mb;
+    Permissions * p;
+    uint status;
+    bool stored;
+    EString result;
+};
+
+
+class BatchDeliverator
+    : public EventHandler
+{
+public:
+    List<BatchMessage> batch;
+    List<BatchMessage> injecting;
+    EStringList files;
+    EString dir;
+    EString un;
+    UString mbn;
+    Query * q;
+    Injector * i;
+    Dict<Permissions> permissions;
+    uint count;
+    uint status;
+    bool eof;
+    bool alone;
+    int verbose;
+    EString input;
+
+    BatchDeliverator( const EString & directory,
+                      const UString & mailbox, const EString & user,
+                      int v )
+        : dir( directory ), un( user ), mbn( mailbox ),
+          q( 0 ), i( 0 ), count( 0 ), status( 0 ), eof( false ),
+          alone( false ), verbose( v )
+    {
+        Allocator::addEternal( this, "batch deliver object" );
+        if ( !dir.isEmpty() ) {
+            readDirectory( "new" );
+            readDirectory( "cur" );
+        }
+        execute();
+    }
+
+    virtual ~BatchDeliverator()
+    {
+        quit( EX_TEMPFAIL, "Delivery object unexpectedly deleted" );
+    }
+
+    void execute()
+    {
+        while ( true ) {
+            if ( batch.isEmpty() ) {
+                read();
+                if ( batch.isEmpty() ) {
+                    EventLoop::shutdown();
+                    return;
+                }
+                lookup();
+            }
+
+            if ( q && !q->done() )
+                return;
+
+            if ( q ) {
+                resolve();
+                q = 0;
+            }
+
+            List<BatchMessage>::Iterator b( batch );
+            while ( b ) {
+                if ( b->p && !b->p->ready() )
+                    return;
+                ++b;
+            }
+
+            if ( i && !i->done() )
+                return;
+            if ( i )
+                injected();
+
+            inject();
+            if ( i )
+                return;
+
+            report();
+        }
+    }
+
+    // Lists the messages in the subdirectory sub of the maildir
+    // drop directory.
+
+    void readDirectory( const EString & sub )
+    {
+        DIR * dp = opendir( ( dir + "/" + sub ).cstr() );
+        if ( !dp )
+            return;
+        struct dirent * de = readdir( dp );
+        while ( de ) {
+            if ( de->d_name[0] != '.' )
+                files.append( sub + "/" + de->d_name );
+            de = readdir( dp );
+        }
+        closedir( dp );
+    }
+
+    // Reads the next batch of messages, either from the maildir or
+    // from stdin, and parses each. The batch ends early if reading
+    // stdin would block, so that a sender which waits for each
+    // message's status before sending the next gets it.
+
+    void read()
+    {
+        uint size = 0;
+        while ( batch.count() < 128 && size < 16 * 1024 * 1024 ) {
+            if ( dir.isEmpty() && !batch.isEmpty() && !eof &&
+                 input.find( '\n' ) < 0 && !readable() )
+                return;
+            BatchMessage * b = new BatchMessage;
+            EString contents;
+            if ( !dir.isEmpty() ) {
+                if ( files.isEmpty() )
+                    return;
+                b->file = *files.shift();
+                b->id = b->file;
+                b->recipient = un;
+                File f( dir + "/" + b->file );
+                if ( !f.valid() ) {
+                    // someone else delivered it meanwhile
+                    continue;
+                }
+                contents = f.contents();
+            }
+            else if ( !readRecord( b, contents ) ) {
+                return;
+            }
+            size += contents.length();
+            batch.append( b );
+
+            b->m = new Injectee;
+            b->m->parse( contents );
+            if ( !b->m->error().isEmpty() )
+                fail( b, EX_DATAERR,
+                      "Message parsing failed: " + b->m->error() );
+            else if ( b->recipient.isEmpty() )
+                fail( b, EX_USAGE, "No recipient" );
+        }
+    }
+
+    // Reads one length-prefixed record from stdin into b and
+    // contents. Each record is a line containing the message length
+    // and optionally a recipient, followed by exactly that many
+    // bytes of message. Returns false at the end of input.
+
+    bool readRecord( BatchMessage * b, EString & contents )
+    {
+        if ( eof )
+            return false;
+        int nl = input.find( '\n' );
+        while ( nl < 0 && fill() )
+            nl = input.find( '\n' );
+        if ( nl < 0 ) {
+            eof = true;
+            if ( input.isEmpty() )
+                return false;
+            nl = input.length();
+        }
+        EString l = input.mid( 0, nl ).simplified();
+        input = input.mid( nl + 1 );
+        int space = l.find( ' ' );
+        bool ok = false;
+        uint length = 0;
+        if ( space < 0 ) {
+            length = l.number( &ok );
+            b->recipient = un;
+        }
+        else {
+            length = l.mid( 0, space ).number( &ok );
+            b->recipient = l.mid( space + 1 );
+        }
+        b->id = fn( ++count );
+        if ( !ok ) {
+            eof = true;
+            fprintf( stderr, "aoxdeliver: Bad record header: %s\n",
+                     l.cstr() );
+            status = EX_DATAERR;
+            return false;
+        }
+        if ( input.length() < length )
+            input.reserve( length + 65536 );
+        while ( input.length() < length ) {
+            if ( !fill() ) {
+                eof = true;
+                fprintf( stderr,
+                         "aoxdeliver: Input ends within message %s\n",
+                         b->id.cstr() );
+                status = EX_DATAERR;
+                return false;
+            }
+        }
+        contents = input.mid( 0, length );
+        input = input.mid( length );
+        return true;
+    }
+
+    // Appends whatever stdin has to offer to input, waiting for it if
+    // need be. Returns false at the end of input.
+
+    bool fill()
+    {
+        char buf[65536];
+        ssize_t r = ::read( 0, buf, sizeof( buf ) );
+        while ( r < 0 && errno == EINTR )
+            r = ::read( 0, buf, sizeof( buf ) );
+        if ( r <= 0 )
+            return false;
+        input.append( buf, r );
+        return true;
+    }
+
+    // Returns true if reading stdin would not block, ie. if there is
+    // more input or stdin is at its end.
+
+    bool readable()
+    {
+        struct pollfd p;
+        p.fd = 0;
+        p.events = POLLIN;
+        p.revents = 0;
+        return ::poll( &p, 1, 0 ) > 0;
+    }
+
+    // Looks up all the recipients in the current batch with a single
+    // query.
+
+    void lookup()
+    {
+        EStringList localparts;
+        EStringList domains;
+        EStringList logins;
+        List<BatchMessage>::Iterator b( batch );
+        while ( b ) {
+            if ( !b->status ) {
+                EString r = b->recipient;
+                int at = r.find( '@' );
+                if ( at > 0 ) {
+                    localparts.append( r.mid( 0, at ) );
+                    domains.append( r.mid( at + 1 ) );
+                }
+                logins.append( r.lower() );
+            }
+            ++b;
+        }
+        if ( logins.isEmpty() )
+            return;
+
+        q = new Query( "select al.mailbox, n.name as namespace, u.login, "
+                       "a.localpart, a.domain "
+                       "from aliases al "
+                       "join addresses a on (al.address=a.id) "
+                       "left join users u on (al.id=u.alias) "
+                       "left join namespaces n on (u.parentspace=n.id) "
+                       "where (a.localpart=any($1::citext[]) "
+                       "and a.domain=any($2::citext[])) "
+                       "or (lower(u.login)=any($3::text[]))", this );
+        localparts.removeDuplicates();
+        domains.removeDuplicates();
+        logins.removeDuplicates();
+        q->bind( 1, localparts );
+        q->bind( 2, domains );
+        q->bind( 3, logins );
+        q->execute();
+    }
+
+    // Matches the rows returned by lookup() to the messages in the
+    // batch, and finds the mailbox for each message.
+
+    void resolve()
+    {
+        Dict<Row> rows;
+        Row * r = q->nextRow();
+        while ( r ) {
+            EString a = r->getUString( "localpart" ).utf8() + "@" +
+                        r->getUString( "domain" ).utf8();
+            rows.insert( a.lower(), r );
+            if ( !r->isNull( "login" ) )
+                rows.insert( r->getUString( "login" ).utf8().lower(), r );
+            r = q->nextRow();
+        }
+
+        List<BatchMessage>::Iterator b( batch );
+        while ( b ) {
+            if ( !b->status ) {
+                r = rows.find( b->recipient.lower() );
+                if ( !r )
+                    fail( b, EX_NOUSER, "No such user: " + b->recipient );
+                else if ( !r->isNull( "login" ) &&
+                          r->getEString( "login" ) == "anonymous" )
+                    fail( b, EX_DATAERR,
+                          "Cannot deliver to the anonymous user" );
+                else
+                    findMailbox( b, r );
+            }
+            ++b;
+        }
+    }
+
+    // Finds the mailbox for b, whose recipient is described by
+    // r, and checks that "anyone" may post to it if it was named
+    // explicitly.
+
+    void findMailbox( BatchMessage * b, Row * r )
+    {
+        if ( mbn.isEmpty() ) {
+            b->mb = Mailbox::find( r->getInt( "mailbox" ) );
+        }
+        else {
+            UString pre;
+            if ( !r->isNull( "namespace" ) && !mbn.startsWith( "/" ) )
+                pre = r->getUString( "namespace" ) + "/" +
+                      r->getUString( "login" ) + "/";
+            b->mb = Mailbox::find( pre + mbn );
+            if ( b->mb ) {
+                EString k = b->mb->name().utf8();
+                b->p = permissions.find( k );
+                if ( !b->p ) {
+                    User * u = new User;
+                    UString anyone;
+                    anyone.append( "anyone" );
+                    u->setLogin( anyone );
+                    b->p = new Permissions( b->mb, u, this );
+                    permissions.insert( k, b->p );
+                }
+            }
+        }
+        if ( !b->mb )
+            fail( b, EX_CANTCREAT, "No such mailbox" );
+    }
+
+    // Injects the messages in the batch that can be delivered and
+    // haven't been yet, using a single Injector. After a failed
+    // injection the remaining messages are injected one at a time,
+    // so that each gets its own status.
+
+    void inject()
+    {
+        List<Injectee> messages;
+        List<BatchMessage>::Iterator b( batch );
+        while ( b && !( alone && !messages.isEmpty() ) ) {
+            if ( !b->status && b->p &&
+                 !b->p->allowed( Permissions::Post ) )
+                fail( b, EX_NOPERM,
+                      "User 'anyone' does not have 'p' right on mailbox " +
+                      mbn.ascii().quoted( '\'' ) );
+            if ( !b->status && !b->stored ) {
+                EStringList x;
+                b->m->setFlags( b->mb, &x );
+                messages.append( b->m );
+                injecting.append( b );
+            }
+            ++b;
+        }
+        if ( messages.isEmpty() )
+            return;
+        i = new Injector( this );
+        i->addInjection( &messages );
+        i->execute();
+    }
+
+    // Records the outcome of the injection that has just finished.
+
+    void injected()
+    {
+        if ( !i->failed() ) {
+            List<BatchMessage>::Iterator b( injecting );
+            while ( b ) {
+                b->stored = true;
+                ++b;
+            }
+        }
+        else if ( injecting.count() > 1 ) {
+            alone = true;
+        }
+        else {
+            fail( injecting.first(), EX_TEMPFAIL,
+                  "Injection error: " + i->error() );
+        }
+        injecting.clear();
+        i = 0;
+    }
+
+    // Reports the outcome for each message in the batch on stdout,
+    // removes the delivered messages from the maildir, and discards
+    // the batch.
+
+    void report()
+    {
+        while ( !batch.isEmpty() ) {
+            BatchMessage * b = batch.shift();
+            if ( !b->status ) {
+                b->result = "Stored in " + b->mb->name().utf8() +
+                            " as UID " + fn( b->m->uid( b->mb ) );
+                if ( !b->file.isEmpty() )
+                    File::unlink( dir + "/" + b->file );
+            }
+            fprintf( stdout, "%s %d %s\n",
+                     b->id.cstr(), b->status, b->result.cstr() );
+            if ( verbose && b->status )
+                fprintf( stderr, "aoxdeliver: %s: %s\n",
+                         b->id.cstr(), b->result.cstr() );
+        }
+        fflush( stdout );
+        alone = false;
+    }
+
+    // Records that b could not be delivered, with exit status s
+    // and explanation e.
+
+    void fail( BatchMessage * b, uint s, const EString & e )
+    {
+        b->status = s;
+        b->result = e;
+        if ( !status )
+            status = s;
+    }
+};
+
+
 int main( int argc, char *argv[] )
 {
     Scope global;
@@ -148,7 +594,9 @@ int main( int argc, char *argv[] )
     UString mailbox;
     EString recipient;
     EString filename;
+    EString directory;
     int verbose = 0;
+    bool batch = false;
     bool error = false;
 
     int n = 1;
@@ -160,6 +608,15 @@ int main( int argc, char *argv[] )
                     sender = argv[++n];
                 break;
 
+            case 'b':
+                batch = true;
+                break;
+
+            case 'd':
+                if ( argc - n > 1 )
+                    directory = argv[++n];
+                break;
+
             case 't':
                 if ( argc - n > 1 ) {
                     Utf8Codec c;
@@ -198,12 +655,38 @@ int main( int argc, char *argv[] )
         n++;
     }
 
-    if ( error || recipient.isEmpty() ) {
+    if ( !directory.isEmpty() )
+        batch = true;
+    if ( batch && !filename.isEmpty() )
+        error = true;
+    if ( !directory.isEmpty() && recipient.isEmpty() )
+        error = true;
+
+    if ( error || ( !batch && recipient.isEmpty() ) ) {
         fprintf( stderr,
-                 "Syntax: aoxdeliver [-v] [-f sender] recipient [filename]\n" );
+                 "Syntax: aoxdeliver [-v] [-f sender] recipient [filename]\n"
+                 "        aoxdeliver [-v] [-t mailbox] -b [recipient]\n"
+                 "        aoxdeliver [-v] [-t mailbox] -d maildir recipient\n" );
         exit( -1 );
     }
 
+    if ( batch ) {
+        Configuration::setup( "archiveopteryx.conf" );
+        EventLoop::setup();
+        Database::setup( 1 );
+        Log * l = new Log;
+        Allocator::addEternal( l, "delivery log" );
+        global.setLog( l );
+        Allocator::addEternal( new StderrLogger( "aoxdeliver", verbose ),
+                               "log object" );
+        Configuration::report();
+        Mailbox::setup();
+        BatchDeliverator * b
+            = new BatchDeliverator( directory, mailbox, recipient, verbose );
+        EventLoop::global()->start();
+        return b->status;
+    }
+
     EString contents;
     if ( filename.isEmpty() ) {
         char s[128];
@@ -5,6 +5,7 @@
 #include "estring.h"
 #include "ustring.h"
 #include "estringlist.h"
+#include "stringkernel.h"
 
 #include "cp.h"
 #include "koi.h"
@@ -496,8 +497,11 @@ Codec * Codec::byString( const EString & s )
   Codecs which map 0x80-0x9F to U+0080-0x009F consider any strings
   which contain 0x80-0x9F badly formed.
 
-  At the moment, the fromUnicode function is rather slow. This may
-  need fixing later.
+  Most of these character sets are supersets of ASCII. For those,
+  toUnicode() and fromUnicode() pass ASCII through in bulk and only
+  look up the remaining characters in the table. fromUnicode() is
+  still rather slow for the other characters. This may need fixing
+  later.
 */
 
 
@@ -507,6 +511,25 @@ Codec * Codec::byString( const EString & s )
 */
 
 
+/*! Returns true if \a table maps tab, CR, LF and printable ASCII to
+    themselves, so that such text can be copied without looking at the
+    table.
+*/
+
+bool TableCodec::isAsciiCompatible( const uint * table )
+{
+    if ( table[9] != 9 || table[10] != 10 || table[13] != 13 )
+        return false;
+    uint c = 32;
+    while ( c < 128 ) {
+        if ( table[c] != c )
+            return false;
+        c++;
+    }
+    return true;
+}
+
+
 /*! Converts \a u from Unicode to the subclass' character encoding. All
     Unicode code points which cannot be representated in that encoding
     are converted to '?'.
@@ -518,8 +541,15 @@ EString TableCodec::fromUnicode( const UString & u )
     s.reserve( u.length() );
     uint i = 0;
     while ( i < u.length() ) {
+        uint c = u[i];
+        if ( ascii && c < 128 &&
+             ( c >= 32 || c == 9 || c == 10 || c == 13 ) ) {
+            s.append( (char)c );
+            i++;
+            continue;
+        }
         uint j = 0;
-        while ( j < 256 && t[j] != u[i] )
+        while ( j < 256 && t[j] != c )
             j++;
         if ( j < 256 )
             s.append( (char)j );
@@ -540,6 +570,11 @@ UString TableCodec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        if ( ascii ) {
+            i = appendAscii( u, s, i );
+            if ( i >= s.length() )
+                break;
+        }
         uint c = s[i];
         if ( !t[c] ) {
             recordError( i, c );
@@ -618,6 +653,29 @@ void Codec::append( UString & u, uint c )
 }
 
 
+/*! Appends the run of tab, CR, LF and printable ASCII characters
+    starting at position \a i of \a s to \a u, and returns the
+    position of the first byte after that run. If \a s[\a i] isn't
+    one of those characters, appendAscii() returns \a i and does
+    nothing.
+
+    Codecs for supersets of ASCII call this so that most of their
+    input is scanned and copied in bulk rather than a byte at a time.
+*/
+
+uint Codec::appendAscii( UString & u, const EString & s, uint i )
+{
+    if ( i >= s.length() )
+        return i;
+    uint n = StringKernel::asciiSpan( s.data() + i, s.length() - i );
+    if ( !n )
+        return i;
+    mangleTrailingSurrogate( u );
+    u.append( s.data() + i, n );
+    return i + n;
+}
+
+
 /*! Checks whether the last codepoint in \a u is a leading surrogate,
     and flags an error if so.
 */
@@ -680,6 +738,9 @@ UString AsciiCodec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        i = appendAscii( u, s, i );
+        if ( i >= s.length() )
+            break;
         if ( s[i] == 0 || s[i] > 127 ) {
             recordError( i, s[i] );
             append( u, 0xFFFD );
@@ -40,6 +40,7 @@ public:
     EString name() const { return n; }
 
     void append( UString &, uint );
+    uint appendAscii( UString &, const EString &, uint );
     void mangleTrailingSurrogate( UString & );
 
     static class EStringList * allCodecNames();
@@ -55,14 +56,17 @@ private:
 class TableCodec: public Codec {
 protected:
     TableCodec( const uint * table, const char * cs )
-        : Codec( cs ), t( table ) {}
+        : Codec( cs ), t( table ), ascii( isAsciiCompatible( table ) ) {}
 
 public:
     EString fromUnicode( const UString & );
     UString toUnicode( const EString & );
 
 private:
+    static bool isAsciiCompatible( const uint * );
+
     const uint * t;
+    bool ascii;
 };
 
 
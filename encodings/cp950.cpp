@@ -40,7 +40,7 @@ EString Cp950Codec::fromUnicode( const UString &u )
         if ( n < 128 ) {
             s.append( (char)n );
         }
-        else if ( toE[n] != 0 ) {
+        else if ( n < 65536 && toE[n] != 0 ) {
             n = toE[n];
             if ( n >> 8 != 0 )
                 s.append( n >> 8 );
@@ -64,6 +64,10 @@ UString Cp950Codec::toUnicode( const EString &s )
 
     uint n = 0;
     while ( n < s.length() ) {
+        n = appendAscii( u, s, n );
+        if ( n >= s.length() )
+            break;
+
         char c = s[n];
 
         if ( c < 128 ) {
@@ -83,6 +83,10 @@ UString EucJpCodec::toUnicode( const EString &s )
 
     uint n = 0;
     while ( n < s.length() ) {
+        n = appendAscii( u, s, n );
+        if ( n >= s.length() )
+            break;
+
         char c = s[n];
 
         if ( c < 128 ) {
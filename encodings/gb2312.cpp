@@ -65,6 +65,10 @@ UString Gb2312Codec::toUnicode( const EString &s )
 
     uint n = 0;
     while ( n < s.length() ) {
+        n = appendAscii( u, s, n );
+        if ( n >= s.length() )
+            break;
+
         char c = s[n];
         char d = s[n + 1];
 
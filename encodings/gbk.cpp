@@ -64,6 +64,10 @@ UString GbkCodec::toUnicode( const EString &s )
 
     uint n = 0;
     while ( n < s.length() ) {
+        n = appendAscii( u, s, n );
+        if ( n >= s.length() )
+            break;
+
         char c = s[n];
 
         if ( c < 128 ) {
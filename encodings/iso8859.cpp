@@ -4,6 +4,7 @@
 
 #include "estring.h"
 #include "ustring.h"
+#include "stringkernel.h"
 
 #include "utf.h"
 
@@ -47,10 +48,11 @@ EString Iso88591Codec::fromUnicode( const UString & u )
 UString Iso88591Codec::toUnicode( const EString & s )
 {
     UString u;
-    u.reserve( s.length() );
+    u.append( s.data(), s.length() );
+    if ( StringKernel::is7Bit( s.data(), s.length() ) )
+        return u;
     uint i = 0;
     while ( i < s.length() ) {
-        u.append( s[i] );
         if ( s[i] >= 0x80 && s[i] < 0xA0 )
             setState( BadlyFormed );
         i++;
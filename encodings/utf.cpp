@@ -120,6 +120,9 @@ UString Utf8Codec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        i = appendAscii( u, s, i );
+        if ( i >= s.length() )
+            break;
         int c = 0;
         if ( s[i] < 0x80 ) {
             // 0000 0000-0000 007F   0xxxxxxx
@@ -4,7 +4,8 @@
 #define ENTITIES_H
 
 
-/* A complete list of entity names from HTML 4.0, sorted lexically. */
+/* A complete list of entity names from HTML 4.0, sorted lexically.
+   Run mkentities.pl after changing it. */
 
 const struct entity {
     const char *name;
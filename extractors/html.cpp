@@ -7,90 +7,296 @@
 #include "ustring.h"
 #include "entities.h"
 
-#include <ctype.h>
+
+// we hold back at most this many characters at the end of a chunk,
+// waiting for the next one. a longer character reference isn't one.
+static const uint MaxHeldBack = 32;
+
+
+#include "entity-hash.inc"
+
+
+// Returns the code point for the named entity h[start...end), or 0 if
+// there is no such entity. mkentities.pl uses the same hash function.
+
+static uint entity( const UString & h, uint start, uint end )
+{
+    uint x = 2166136261U;
+    uint i = start;
+    while ( i < end )
+        x = ( x ^ h[i++] ) * 16777619U;
+
+    uint b = ( x >> 24 ) % numEntityBuckets;
+    uint n = entitySlots[( x + entityDisplacements[b] ) % numEntitySlots];
+    if ( !n )
+        return 0;
+
+    const char * name = entities[n-1].name;
+    i = start;
+    while ( i < end && h[i] == (uint)name[i-start] )
+        i++;
+    if ( i < end || name[i-start] )
+        return 0;
+    return entities[n-1].chr;
+}
+
+
+static bool isDigit( uint c )
+{
+    return c >= '0' && c <= '9';
+}
+
+
+static bool isHexDigit( uint c )
+{
+    return isDigit( c ) ||
+        ( c >= 'a' && c <= 'f' ) || ( c >= 'A' && c <= 'F' );
+}
+
+
+static bool isLetter( uint c )
+{
+    return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' );
+}
+
+
+// Returns the position after the longest run of characters starting
+// at i which could be part of a character reference, but at most
+// MaxHeldBack characters after i.
+
+static uint referenceEnd( const UString & h, uint i )
+{
+    uint e = i + MaxHeldBack;
+    if ( e > h.length() )
+        e = h.length();
+    i++;
+    if ( h[i] == '#' ) {
+        i++;
+        if ( ( h[i] | 0x20 ) == 'x' )
+            i++;
+    }
+    while ( i < e && ( isDigit( h[i] ) || isLetter( h[i] ) ) )
+        i++;
+    return i;
+}
+
+
+// Returns true if c is ordinary text outside tags, ie. it needs no
+// special treatment by HTML::process().
+
+static bool isText( uint c )
+{
+    switch ( c ) {
+    case '<':
+    case '>':
+    case '&':
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        return false;
+    }
+    return c < 0xD800 || c > 0xDFFF;
+}
+
+
+// Returns true if t is name, ignoring case.
+
+static bool is( const UString & t, const char * name )
+{
+    uint i = 0;
+    while ( name[i] && ( t[i] | 0x20 ) == (uint)name[i] )
+        i++;
+    return !name[i] && i == t.length();
+}
+
+
+class HTMLData
+    : public Garbage
+{
+public:
+    HTMLData()
+        : skip( 0 ), last( 0 ), quote( 0 ),
+          tag( false ), tagname( false ), sgml( false ), quoted( false )
+    {}
+
+    UString input;
+    UString r;
+    UString s;
+    UString t;
+    AsciiCodec dc; // just a dummy so we can use Codec::append()
+
+    const char * skip;  // inside <script> or <style>
+    uint last;
+    uint quote;
+    bool tag;           // inside <...>
+    bool tagname;       // inside tag, before whitespace
+    bool sgml;          // inside <[!?]...>
+    bool quoted;        // inside <foo bar="...">
+};
 
 
 /*! \class HTML html.h
     This class is responsible for extracting indexable text from HTML.
     Its interface is subject to change once there are other classes to
     do the same thing for other formats.
+
+    The HTML can be given to parse() in chunks of any size. Apart from
+    the text() extracted so far, an HTML object keeps only a few
+    characters of input and a short tag name between chunks. The
+    contents of script and style elements are skipped, and entity
+    names are looked up using a perfect hash table generated by
+    mkentities.pl.
+
+    asText() is a convenience function that does all of that for a
+    single string.
+*/
+
+
+/*! Constructs an empty HTML text extractor. */
+
+HTML::HTML()
+    : d( new HTMLData )
+{
+}
+
+
+/*! Extracts text from \a s, which is the next chunk of HTML input.
+    The end of \a s may be held back until the next call to parse() or
+    finish(), if it might be the start of a character reference or an
+    end tag.
+*/
+
+void HTML::parse( const UString & s )
+{
+    if ( d->input.isEmpty() ) {
+        d->input = s;
+    }
+    else {
+        UString i;
+        i.reserve( d->input.length() + s.length() );
+        i.append( d->input );
+        i.append( s );
+        d->input = i;
+    }
+    process( false );
+}
+
+
+/*! Processes whatever input parse() held back. Call this after the
+    last chunk.
 */
 
+void HTML::finish()
+{
+    process( true );
+    d->dc.mangleTrailingSurrogate( d->r );
+    // we ignore d->dc.state()
+}
+
+
+/*! Returns the text extracted so far. */
+
+UString HTML::text() const
+{
+    return d->r;
+}
+
 
 /*! Returns indexable text extracted from \a h. */
 
-UString HTML::asText( const UString &h )
+UString HTML::asText( const UString & h )
 {
-    UString r;
-    UString t, s, qs, a;
-    char last = 0;
-    char quote = 0;
-    char c;
-    uint mark = 0;
-    AsciiCodec dc; // just a dummy so we can use Codec::append()
+    HTML html;
+    html.parse( h );
+    html.finish();
+    return html.text();
+}
+
+
+/*! Processes as much of the pending input as possible, and keeps the
+    rest for later. If \a final is true, the input is processed
+    completely.
+*/
 
-    int tag = 0;        /* 1 inside <...> */
-    int tagname = 0;    /* 1 inside tag, before whitespace */
-    int sgml = 0;       /* 1 inside <[!?]...> */
-    int quoted = 0;     /* 1 inside <foo bar="..."> */
+void HTML::process( bool final )
+{
+    UString h = d->input;
+    uint l = h.length();
+    uint mark = 0;
+    uint c;
 
     uint i = 0;
-    while ( i < h.length() ) {
+    while ( i < l ) {
+        if ( d->skip ) {
+            i = skip( h, i, final );
+            if ( d->skip )
+                break;
+            continue;
+        }
+
         /* Each case below sets i to the position of the last character
            it processed. */
-        switch ( h[i] ) {
+        c = h[i];
+        switch ( c ) {
         case '<':
-            if ( quoted )
+            if ( d->quoted )
                 goto next;
+            if ( !final && i + 1 == l )
+                goto wait;
             if ( h[i+1] == '!' || h[i+1] == '?' ) {
-                sgml = 1;
+                d->sgml = true;
                 i++;
             }
-            tag = 1;
-            tagname = 1;
-            t.truncate();
+            d->tag = true;
+            d->tagname = true;
+            d->t.truncate();
             break;
 
         case '>':
-            if ( quoted )
+            if ( d->quoted )
                 goto next;
-            if ( tag ) {
-                //t = t.lower();
-                if ( t == "p" ) {
-                    s.append( '\n' );
-                    s.append( '\n' );
+            if ( d->tag ) {
+                if ( d->t == "p" ) {
+                    d->s.append( '\n' );
+                    d->s.append( '\n' );
+                }
+                else if ( d->t == "br" ) {
+                    d->s.append( '\n' );
                 }
-                else if ( t == "br" ) {
-                    s.append( '\n' );
+                else if ( d->t == "body" ) {
+                    d->r.truncate();
                 }
-                else if ( t == "body" ) {
-                    r.truncate();
+                else if ( is( d->t, "script" ) ) {
+                    d->skip = "script";
                 }
-                sgml = tag = 0;
+                else if ( is( d->t, "style" ) ) {
+                    d->skip = "style";
+                }
+                d->sgml = d->tag = false;
             }
             break;
 
         case '-':
-            if ( !sgml )
+            if ( !d->sgml )
                 goto unspecial;
-            if ( quoted && quote != '-' )
+            if ( d->quoted && d->quote != '-' )
                 goto next;
-            if ( last == '-' ) {
-                quote = '-';
-                quoted = !quoted;
+            if ( d->last == '-' ) {
+                d->quote = '-';
+                d->quoted = !d->quoted;
             }
             break;
 
         case '"':
         case '\'':
-            if ( !tag )
+            if ( !d->tag )
                 goto unspecial;
-            if ( quoted && quote == h[i] ) {
-                quoted = 0;
-            } else if ( !quoted && last == '=' ) {
-                quoted = 1;
-                quote = h[i];
-                qs.truncate();
+            if ( d->quoted && d->quote == c ) {
+                d->quoted = false;
+            } else if ( !d->quoted && d->last == '=' ) {
+                d->quoted = true;
+                d->quote = c;
             }
             break;
 
@@ -100,28 +306,35 @@ UString HTML::asText( const UString &h )
         case '\n':
             /* Whitespace shouldn't appear in last, and we compress it
                to one space. */
-            if ( !tag && s.isEmpty() )
-                s.append( ' ' );
-            tagname = false;
-            a.truncate();
+            if ( !d->tag && d->s.isEmpty() )
+                d->s.append( ' ' );
+            d->tagname = false;
             i++;
             continue;
             break;
 
         case '&':
             /* May be a character reference. */
-            if ( ( c = h[i+1] ) == '#' ) {
-                char d = h[i+2] | 0x20;
+            mark = referenceEnd( h, i );
+            if ( mark == l && !final && mark - i < MaxHeldBack )
+                goto wait;
+            if ( mark - i >= MaxHeldBack ) {
+                /* Too long to be a reference. */
+                d->r.append( d->s );
+                d->r.append( '&' );
+                d->s.truncate();
+            } else if ( ( c = h[i+1] ) == '#' ) {
+                c = h[i+2];
 
-                if ( isdigit( d ) ) {
+                if ( isDigit( c ) ) {
                     /* Decimal numeric reference: &#[0-9]+;? */
                     i += 2;
                     mark = i++;
-                    while ( isdigit( h[i] ) )
+                    while ( isDigit( h[i] ) )
                         i++;
-                    r.append( s );
-                    dc.append( r, h.mid( mark, i-mark ).number( 0 ) );
-                    s.truncate();
+                    d->r.append( d->s );
+                    d->dc.append( d->r, h.mid( mark, i-mark ).number( 0 ) );
+                    d->s.truncate();
 
                     /* The terminating semicolon is required only
                        where the next character would otherwise be
@@ -129,16 +342,17 @@ UString HTML::asText( const UString &h )
                     if ( h[i] != ';' )
                         i--;
                 }
-                else if ( d == 'x' ) {
+                else if ( ( c | 0x20 ) == 'x' ) {
                     /* Hexadecimal numeric reference: &#[xX][0-9A-Za-z]+;? */
                     i += 2;
                     mark = ++i;
-                    while ( isxdigit( h[i] ) )
+                    while ( isHexDigit( h[i] ) )
                         i++;
                     if ( i != mark ) {
-                        r.append( s );
-                        dc.append( r, h.mid( mark, i-mark ).number( 0, 16 ) );
-                        s.truncate();
+                        d->r.append( d->s );
+                        d->dc.append( d->r,
+                                      h.mid( mark, i-mark ).number( 0, 16 ) );
+                        d->s.truncate();
                     }
                     if ( h[i] != ';' )
                         i--;
@@ -146,73 +360,104 @@ UString HTML::asText( const UString &h )
                 else {
                     /* Not a reference. */
                     i++;
-                    r.append( s );
-                    r.append( '&' );
-                    r.append( '#' );
-                    s.truncate();
+                    d->r.append( d->s );
+                    d->r.append( '&' );
+                    d->r.append( '#' );
+                    d->s.truncate();
                 }
-            } else if ( isalpha( c ) ) {
+            } else if ( isLetter( c ) ) {
                 /* Entity reference: &[a-zA-Z0-9]+;? */
                 i++;
                 mark = i++;
-                while ( isalnum( h[i] ) )
+                while ( isDigit( h[i] ) || isLetter( h[i] ) )
                     i++;
-                UString ent( h.mid( mark, i-mark ) );
+                c = entity( h, mark, i );
                 if ( h[i] != ';' )
                     i--;
 
-                int n = 0;
-                while ( n < ents ) {
-                    uint l = 0;
-                    bool match = true;
-                    while ( l < ent.length() ) {
-                        if ( ent[l] != entities[n].name[l] ) {
-                            match = false;
-                            break;
-                        }
-                        l++;
-                    }
-
-                    if ( match && entities[n].name[l] == '\0' ) {
-                        r.append( s );
-                        r.append( entities[n].chr );
-                        s.truncate();
-                        break;
-                    }
-
-                    n++;
+                if ( c ) {
+                    d->r.append( d->s );
+                    d->r.append( c );
+                    d->s.truncate();
                 }
             }
             else {
                 /* Not a reference. */
-                r.append( s );
-                r.append( '&' );
-                s.truncate();
+                d->r.append( d->s );
+                d->r.append( '&' );
+                d->s.truncate();
             }
             break;
 
     unspecial:
         default:
-            if ( !tag ) {
-                r.append( s );
-                dc.append( r, h[i] );
-                s.truncate();
-            } else if ( tagname ) {
-                t.append( h[i] );
-            } else if ( !quoted && h[i] == '=' ) {
-                a.truncate();
-            } else {
-                a.append( h[i] );
+            if ( !d->tag ) {
+                /* Ordinary text is copied a run at a time, and the
+                   codec checks only what might be a surrogate. */
+                uint e = i;
+                while ( e < l && isText( h[e] ) )
+                    e++;
+                d->r.append( d->s );
+                d->s.truncate();
+                if ( e > i ) {
+                    d->dc.mangleTrailingSurrogate( d->r );
+                    d->r.reserve( d->r.length() + e - i );
+                    while ( i < e )
+                        d->r.append( h[i++] );
+                    i--;
+                }
+                else {
+                    d->dc.append( d->r, c );
+                }
+            } else if ( d->tagname ) {
+                // we only look at short tag names
+                if ( d->t.length() < 8 )
+                    d->t.append( c );
             }
             break;
         }
 
     next:
-        last = h[i];
+        d->last = h[i];
         i++;
     }
 
-    dc.mangleTrailingSurrogate( r );
-    // we ignore dc.state()
-    return r;
+wait:
+    d->input = h.mid( i );
+}
+
+
+/*! Skips the contents of a script or style element in \a h, starting
+    at \a i. Returns the position of the end tag, or if it's not in \a
+    h, the position from which the input must be held back (all of \a
+    h if \a final is true).
+*/
+
+uint HTML::skip( const UString & h, uint i, bool final )
+{
+    uint l = h.length();
+    while ( i < l ) {
+        if ( h[i] == '<' && h[i+1] == '/' ) {
+            uint n = 0;
+            while ( d->skip[n] &&
+                    ( h[i+2+n] | 0x20 ) == (uint)d->skip[n] )
+                n++;
+            if ( !d->skip[n] ) {
+                uint c = h[i+2+n];
+                if ( c == '>' || c == '/' || c == ' ' || c == '\t' ||
+                     c == '\r' || c == '\n' ||
+                     ( final && i+2+n == l ) ) {
+                    d->skip = 0;
+                    return i;
+                }
+            }
+            if ( !final && i+2+n >= l )
+                return i;
+        }
+        else if ( h[i] == '<' && !final && i + 1 == l ) {
+            return i;
+        }
+        i++;
+    }
+    return l;
 }
@@ -10,7 +10,20 @@ class HTML
     : public Garbage
 {
 public:
+    HTML();
+
+    void parse( const UString & );
+    void finish();
+
+    UString text() const;
+
     static UString asText( const UString & );
+
+private:
+    class HTMLData * d;
+
+    void process( bool );
+    uint skip( const UString &, uint, bool );
 };
 
 
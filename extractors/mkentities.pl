@@ -0,0 +1,79 @@
+#!/usr/bin/perl
+
+# Reads the entity list in entities.h and writes entity-hash.inc, a
+# perfect hash table for it. The hash function must match
+# entity() in html.cpp.
+
+$buckets = 64;
+$slots = 512;
+
+open( I, "< entities.h" ) || die;
+while ( <I> ) {
+    #    { "AElig"	,  198 },
+    push( @names, $1 ) if ( /^\s*\{ "(\w+)"\s*,\s*\d+ \},/ );
+}
+
+sub fnv {
+    my ( $s ) = @_;
+    my $h = 2166136261;
+    foreach $c ( unpack( "C*", $s ) ) {
+        $h = ( ( $h ^ $c ) * 16777619 ) % 4294967296;
+    }
+    return $h;
+}
+
+# the top bits of the hash pick a bucket, and each bucket has a
+# displacement which moves all its names to free slots. the buckets
+# with most names are placed first.
+
+$i = 0;
+while ( $i <= $#names ) {
+    push( @{$bucket[( fnv( $names[$i] ) >> 24 ) % $buckets]}, $i );
+    $i++;
+}
+
+foreach $b ( sort { $#{$bucket[$b]} <=> $#{$bucket[$a]} || $a <=> $b }
+             ( 0 .. $buckets-1 ) ) {
+    next unless ( defined( $bucket[$b] ) );
+    $d = 0;
+    while ( 1 ) {
+        die "no displacement for bucket $b" if ( $d > 255 );
+        %used = ();
+        $ok = 1;
+        foreach $i ( @{$bucket[$b]} ) {
+            $s = ( fnv( $names[$i] ) + $d ) % $slots;
+            $ok = 0 if ( defined( $slot[$s] ) || $used{$s} );
+            $used{$s} = 1;
+        }
+        last if ( $ok );
+        $d++;
+    }
+    $displacement[$b] = $d;
+    foreach $i ( @{$bucket[$b]} ) {
+        $slot[( fnv( $names[$i] ) + $d ) % $slots] = $i;
+    }
+}
+
+open( O, "> entity-hash.inc" ) || die;
+print O '// Generated by $Id$', "\n",
+        "static const uint numEntityBuckets = $buckets;\n",
+        "static const uint numEntitySlots = $slots;\n",
+        "static const unsigned char entityDisplacements[$buckets] = {\n";
+$i = 0;
+while ( $i < $buckets ) {
+    printf( O "    %d,\n", $displacement[$i] || 0 );
+    $i++;
+}
+print O "};\n",
+        "// each slot holds 1 + the index of an entity, or 0\n",
+        "static const unsigned char entitySlots[$slots] = {\n";
+$i = 0;
+while ( $i < $slots ) {
+    if ( defined( $slot[$i] ) ) {
+        printf( O "    %d, // %s\n", $slot[$i] + 1, $names[$slot[$i]] );
+    } else {
+        print O "    0,\n";
+    }
+    $i++;
+}
+print O "};\n";
@@ -1162,6 +1162,25 @@ EString Command::imapQuoted( const EString & s, const QuoteMode mode )
          !( s.length() == 3 && s.lower() == "nil" ) )
         return s;
 
+    EString r = literalPrefix( s );
+    if ( r.isEmpty() )
+        return s.quoted( '"' );
+    r.reserve( r.length() + s.length() );
+    r.append( s );
+    return r;
+}
+
+
+/*! Returns an empty string if \a s can be sent as a quoted string, and
+    otherwise the start of the literal (or literal8, if \a s contains
+    a null byte) that must precede \a s. imapQuoted() uses this, and
+    so can callers that want to send \a s without copying it.
+*/
+
+EString Command::literalPrefix( const EString & s )
+{
+    EString r;
+
     // will quoted do?
     uint i = 0;
     while ( i < s.length() &&
@@ -1169,17 +1188,14 @@ EString Command::imapQuoted( const EString & s, const QuoteMode mode )
             s[i] != '\\' && s[i] != '"' )
         i++;
     if ( i >= s.length() ) // yes
-        return s.quoted( '"' );
+        return r;
 
-    EString r;
-    r.reserve( s.length() + 20 );
     // if there's a null byte, we need to send a literal8
     if ( s.contains( 0 ) )
         r.append( '~' );
     r.append( '{' );
     r.appendNumber( s.length() );
     r.append( "}\r\n" );
-    r.append( s );
     return r;
 }
 
@@ -93,6 +93,7 @@ public:
     static EString imapQuoted( const EString &,
                                const QuoteMode = PlainString );
     EString imapQuoted( Mailbox *, Mailbox * = 0 );
+    static EString literalPrefix( const EString & );
 
     void shrink( IntegerSet * );
 
@@ -19,6 +19,7 @@
 #include "listext.h"
 #include "fetcher.h"
 #include "iso8859.h"
+#include "buffer.h"
 #include "codec.h"
 #include "query.h"
 #include "scope.h"
@@ -61,7 +62,8 @@ public:
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
-          annotationFetcher( 0 ), modseqFetcher( 0 )
+          annotationFetcher( 0 ), modseqFetcher( 0 ),
+          fetcher( 0 )
     {}
 
     int state;
@@ -115,6 +117,7 @@ public:
     Query * flagFetcher;
     Query * annotationFetcher;
     Query * modseqFetcher;
+    Fetcher * fetcher;
 };
 
 
@@ -856,6 +859,13 @@ void Fetch::execute()
     if ( d->processed < d->set.largest() )
         return;
 
+    if ( d->fetcher && d->fetcher->batches() )
+        log( "Fetched message data in " + fn( d->fetcher->batches() ) +
+             " batches of about " + fn( d->fetcher->averageBatchSize() ) +
+             " messages, waited " + fn( d->fetcher->databaseWait() ) +
+             "ms for the database and " + fn( d->fetcher->clientWait() ) +
+             "ms for the client", Log::Debug );
+
     if ( !d->expunged.isEmpty() ) {
         s->recordExpungedFetch( d->expunged );
         error( No, "UID(s) " + d->expunged.set() + " has/have been expunged" );
@@ -895,6 +905,7 @@ void Fetch::sendFetchQueries()
     }
 
     Fetcher * f = new Fetcher( l, this, imap() );
+    d->fetcher = f;
     if ( d->needsAddresses && !haveAddresses )
         f->fetch( Fetcher::Addresses );
     if ( d->needsHeader && !haveHeader )
@@ -1083,33 +1094,60 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 }
 
 
-/* This function returns the response data for an element in
-   d->sections, to be included in the FETCH response by
-   fetchResponses() below. If \a unicode is false, the result will be
-   downgraded rather than contain unicode.
+/* This function appends the response data for an element in
+   d->sections to \a w, as part of the FETCH response written by
+   makeFetchResponse() below. If \a unicode is false, the result will
+   be downgraded rather than contain unicode.
+
+   Literals are appended as they are, so Buffer can refer to the
+   section data instead of copying it once more.
 */
 
-static EString sectionResponse( Section * s, Message * m, bool unicode )
+static void sectionResponse( Buffer * w, Section * s, Message * m,
+                             bool unicode )
 {
     EString data( Fetch::sectionData( s, m, unicode ) );
-    if ( !s->item.startsWith( "BINARY.SIZE" ) )
-        data = Command::imapQuoted( data, Command::NString );
-    EString r;
-    r.reserve( data.length() + s->item.length() + 1 );
-    r.append( s->item );
-    r.append( " " );
-    r.append( data );
-    return r;
+    w->append( s->item );
+    w->append( " ", 1 );
+    if ( s->item.startsWith( "BINARY.SIZE" ) ) {
+        w->append( data );
+        return;
+    }
+
+    EString l = Command::literalPrefix( data );
+    if ( l.isEmpty() ) {
+        w->append( Command::imapQuoted( data, Command::NString ) );
+        return;
+    }
+
+    w->append( l );
+    w->append( data );
 }
 
 
-/*! Emits a single FETCH response for the message \a m, which is
+/*! Returns a single FETCH response for the message \a m, which is
     trusted to have UID \a uid and MSN \a msn.
 
     The message must have all necessary content.
 */
 
 EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
+{
+    Buffer b;
+    makeFetchResponse( &b, m, uid, msn );
+    return b.string( b.size() );
+}
+
+
+/*! Writes a single FETCH response for the message \a m, which is
+    trusted to have UID \a uid and MSN \a msn, to \a w. Unlike the
+    other makeFetchResponse(), this writes neither "* " nor the final
+    CRLF.
+
+    The message must have all necessary content.
+*/
+
+void Fetch::makeFetchResponse( Buffer * w, Message * m, uint uid, uint msn )
 {
     EStringList l;
     if ( d->uid )
@@ -1139,21 +1177,26 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
             l.append( "MODSEQ (" + fn( dd->modseq ) + ")" );
     }
 
-    List< Section >::Iterator it( d->sections );
-    bool unicode = imap()->clientSupports( IMAP::Unicode );
-    while ( it ) {
-        l.append( sectionResponse( it, m, unicode ) );
-        ++it;
-    }
-
     EString r;
     EString payload = l.join( " " );
     r.reserve( payload.length() + 30 );
     r.appendNumber( msn );
     r.append( " FETCH (" );
     r.append( payload );
-    r.append( ")" );
-    return r;
+    w->append( r );
+
+    List< Section >::Iterator it( d->sections );
+    bool unicode = imap()->clientSupports( IMAP::Unicode );
+    bool space = !payload.isEmpty();
+    while ( it ) {
+        if ( space )
+            w->append( " ", 1 );
+        sectionResponse( w, it, m, unicode );
+        space = true;
+        ++it;
+    }
+
+    w->append( ")", 1 );
 }
 
 
@@ -1723,6 +1766,12 @@ void Fetch::pickup()
     bool ok = true;
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
+        // don't let the output pile up: wait until the client has
+        // read most of what's been written.
+        if ( imap()->writeBufferFull() ) {
+            imap()->notifyWhenWritten( this );
+            break;
+        }
         uint uid = d->remaining.smallest();
         Message * m = d->messages.find( uid );
         if ( d->needsAddresses && !m->hasAddresses() )
@@ -1741,13 +1790,13 @@ void Fetch::pickup()
             d->remaining.remove( uid );
             done++;
             waitFor( new ImapFetchResponse( s, this, uid ) );
+            imap()->emitResponses();
         }
     }
 
     if ( !done )
         return;
     log( "Processed " + fn( done ) + " messages", Log::Debug );
-    imap()->emitResponses();
 }
 
 
@@ -1779,6 +1828,23 @@ EString ImapFetchResponse::text() const
 }
 
 
+/*! This reimplementation writes the response straight into \a w,
+    without building it as a string first. Large literals are thus
+    referred to, not copied.
+*/
+
+bool ImapFetchResponse::write( Buffer * w ) const
+{
+    uint msn = session()->msn( u );
+    if ( !u || !msn )
+        return false;
+    w->append( "* ", 2 );
+    f->makeFetchResponse( w, f->message( u ), u, msn );
+    w->append( "\r\n", 2 );
+    return true;
+}
+
+
 /*! This reimplementation of setSent() frees up memory... that
     shouldn't be necessary when using garbage collection, but in this
     case it's important to remove messages from the data structures
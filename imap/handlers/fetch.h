@@ -34,6 +34,7 @@ public:
                        const EStringList &, const EStringList & );
 
     EString makeFetchResponse( Message *, uint, uint );
+    void makeFetchResponse( class Buffer *, Message *, uint, uint );
 
     Message * message( uint ) const;
     void forget( uint );
@@ -67,6 +68,7 @@ class ImapFetchResponse
 public:
     ImapFetchResponse( ImapSession *, Fetch *, uint );
     EString text() const;
+    bool write( class Buffer * ) const;
     void setSent();
 
 private:
@@ -14,7 +14,12 @@ class SortData
     : public Garbage
 {
 public:
-    SortData(): Garbage(), s( 0 ), q( 0 ), u( false ) {}
+    SortData()
+        : Garbage(), s( 0 ), q( 0 ), count( 0 ), u( false ),
+          esort( false ),
+          returnMin( false ), returnMax( false ),
+          returnCount( false ), returnAll( false ),
+          low( 0 ), high( 0 ), windowed( false ) {}
 
     enum SortCriterionType {
         Arrival,
@@ -49,15 +54,33 @@ public:
 
     Selector * s;
     Query * q;
+    Query * count;
     bool u;
 
+    bool esort;
+    bool returnMin;
+    bool returnMax;
+    bool returnCount;
+    bool returnAll;
+    uint low;
+    uint high;
+    bool windowed;
+
     bool usingCriterionType( SortCriterionType );
 
     void addCondition( EString &, class SortCriterion * );
-    void addJoin( EString &, const EString &, const EString &, bool );
+    void addJoin( EString &, const EString & );
+    void addOrder( EString &, const EString &, bool );
+    void addColumn( EString &, const EString & );
 };
 
 
+static const char * sortKeys =
+    "left join sort_keys ssk on (ssk.message=mm.message) ";
+static const char * sortMessages =
+    "join messages sm on (sm.id=mm.message) ";
+
+
 /*! \class Sort sort.h
 
     The Sort class implements the IMAP SORT extension, which is
@@ -66,6 +89,15 @@ public:
     This class subclasses Search in order to take advantage of its
     parser, and operates quite nastily on the Query generated by
     Selector.
+
+    Most sort criteria use the sort_keys table, which the Injector
+    fills in when each message is injected, so sorting never needs
+    to look at header_fields or address_fields.
+
+    ESORT (RFC 5267) is supported, including PARTIAL. If PARTIAL is
+    the only thing that needs the sorted list, the database sorts
+    only as far as needed and returns just the requested window.
+    CONTEXT=SORT's UPDATE is not supported.
 */
 
 
@@ -83,8 +115,54 @@ Sort::Sort( bool u )
 
 void Sort::parse()
 {
-    // sort-criteria
     space();
+    if ( present( "return" ) ) {
+        // RFC 5267 reuses the RETURN options from RFC 4731 and
+        // adds PARTIAL.
+        d->esort = true;
+        space();
+        require( "(" );
+        bool any = false;
+        while ( ok() && nextChar() != ')' &&
+                nextChar() >= 'A' && nextChar() <= 'z' ) {
+            EString modifier = letters( 3, 7 ).lower();
+            any = true;
+            if ( modifier == "all" ) {
+                d->returnAll = true;
+            }
+            else if ( modifier == "min" ) {
+                d->returnMin = true;
+            }
+            else if ( modifier == "max" ) {
+                d->returnMax = true;
+            }
+            else if ( modifier == "count" ) {
+                d->returnCount = true;
+            }
+            else if ( modifier == "partial" ) {
+                space();
+                d->low = nzNumber();
+                require( ":" );
+                d->high = nzNumber();
+                if ( d->low > d->high ) {
+                    uint x = d->low;
+                    d->low = d->high;
+                    d->high = x;
+                }
+            }
+            else {
+                error( Bad, "Unknown sort modifier option: " + modifier );
+            }
+            if ( nextChar() != ')' )
+                space();
+        }
+        require( ")" );
+        if ( !any )
+            d->returnAll = true;
+        space();
+    }
+
+    // sort-criteria
     require( "(" );
     bool x = true;
     while ( x ) {
@@ -184,6 +262,14 @@ void Sort::execute()
         d->q = d->s->query( imap()->user(), session()->mailbox(),
                             session(), this, true );
         EString t = d->q->string();
+        EString matches = t;
+        uint matchArgs = 0;
+        Query::InputLine::Iterator a( d->q->values() );
+        while ( a ) {
+            if ( a->position() > matchArgs )
+                matchArgs = a->position();
+            ++a;
+        }
         List<SortData::SortCriterion>::Iterator c( d->c );
         while ( c ) {
             if ( c->t == SortData::Annotation ) {
@@ -197,21 +283,81 @@ void Sort::execute()
             d->addCondition( t, c );
             ++c;
         }
+
+        // If the client wants only a window of the sorted list, the
+        // database can do a top-N sort instead of sorting it all.
+        if ( d->low && !d->returnMin && !d->returnMax && !d->returnAll ) {
+            d->windowed = true;
+            t.append( " limit " );
+            t.appendNumber( d->high - d->low + 1 );
+            t.append( " offset " );
+            t.appendNumber( d->low - 1 );
+        }
+
         d->q->setString( t );
         d->q->execute();
+
+        // The count doesn't depend on the order, so it's taken from
+        // the search alone, without the sort keys and the order by.
+        // The search's joins can yield several rows per message.
+        if ( d->windowed && d->returnCount ) {
+            int o = matches.find( " order by " );
+            if ( o >= 0 )
+                matches.truncate( o );
+            d->count = new Query( "select count(distinct uid)::bigint "
+                                  "as total from (" + matches +
+                                  ") matches", this );
+            Query::InputLine::Iterator v( d->q->values() );
+            while ( v ) {
+                if ( v->position() > matchArgs )
+                    ; // an annotation name or owner, not used here
+                else if ( v->length() < 0 )
+                    d->count->bindNull( v->position() );
+                else
+                    d->count->bind( v->position(), v->data(), v->format() );
+                ++v;
+            }
+            d->count->execute();
+        }
     }
 
     if ( !d->q->done() )
         return;
 
+    if ( d->count && !d->count->done() )
+        return;
+
     List<uint> * result = new List<uint>;
+    uint total = 0;
     Row * r;
     while ( (r=d->q->nextRow()) != 0 ) {
         uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
         *tmp = r->getInt( "uid" );
         result->append( tmp );
     }
-    waitFor( new ImapSortResponse( session(), result, d->u ) );
+
+    if ( d->count ) {
+        r = d->count->nextRow();
+        if ( r )
+            total = r->getBigint( "total" );
+    }
+
+    if ( !d->esort ) {
+        waitFor( new ImapSortResponse( session(), result, d->u ) );
+    }
+    else {
+        uint offset = 0;
+        if ( d->windowed )
+            offset = d->low - 1;
+        else
+            total = result->count();
+        ImapSortResponse * sr
+            = new ImapSortResponse( session(), result, d->u );
+        sr->setEsort( tag(), d->returnMin, d->returnMax,
+                      d->returnCount, d->returnAll,
+                      d->low, d->high, offset, total );
+        waitFor( sr );
+    }
     finish();
 }
 
@@ -220,84 +366,42 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
 {
     switch ( c->t ) {
     case Arrival:
-        addJoin( t, "join messages marrdt on (marrdt.id=mm.message) ",
-                 "marrdt.idate", c->reverse );
+        addJoin( t, sortMessages );
+        addOrder( t, "sm.idate", c->reverse );
         break;
     case Cc:
-        addJoin( t,
-                 "left join address_fields sccaf on "
-                 "(mm.message=sccaf.message and "
-                 " sccaf.part='' and sccaf.number=0 and"
-                 " sccaf.field=" + fn( HeaderField::Cc ) + ") "
-                 "left join addresses scca on (sccaf.address=scca.id) ",
-                 "scca.localpart",
-                 c->reverse );
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.cc_address", c->reverse );
         break;
     case Date:
-        addJoin( t,
-                 "left join date_fields sddf on (mm.message=sddf.message) ",
-                 "sddf.value",
-                 c->reverse );
+        // the Injector stores the internal date if there's no usable
+        // Date field, as RFC 5256 says
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.sent", c->reverse );
         break;
     case From:
-        addJoin( t,
-                 "left join address_fields sfaf on "
-                 "(mm.message=sfaf.message and "
-                 " sfaf.part='' and sfaf.number=0 and"
-                 " sfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sfa on (sfaf.address=sfa.id) ",
-                 "sfa.localpart",
-                 c->reverse );
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.from_address", c->reverse );
         break;
     case DisplayFrom:
-        addJoin( t,
-                 "left join address_fields sdfaf on "
-                 "(mm.message=sdfaf.message and "
-                 " sdfaf.part='' and sdfaf.number=0 and"
-                 " sdfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sdfa on (sdfaf.address=sdfa.id) ",
-                 "case "
-                 "when sdfa.name='' then sdfa.localpart||'@'||sdfa.domain "
-                 "else sdfa.name "
-                 "end",
-                 c->reverse );
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.from_display", c->reverse );
         break;
     case DisplayTo:
-        addJoin( t,
-                 "left join address_fields sdtaf on "
-                 "(mm.message=sdtaf.message and "
-                 " sdtaf.part='' and sdtaf.number=0 and"
-                 " sdtaf.field=" + fn( HeaderField::To ) + ") "
-                 "join addresses sdta on (sdtaf.address=sdta.id) ",
-                 "case "
-                 "when sdta.name='' then sdta.localpart||'@'||sdta.domain "
-                 "else sdta.name "
-                 "end",
-                 c->reverse );
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.to_display", c->reverse );
         break;
     case Size:
-        addJoin( t,
-                 "join messages m on (m.id=mm.message) ",
-                 "m.rfc822size",
-                 c->reverse );
+        addJoin( t, sortMessages );
+        addOrder( t, "sm.rfc822size", c->reverse );
         break;
     case Subject:
-        addJoin( t,
-                 "left join header_fields sshf on "
-                 "(mm.message=sshf.message and sshf.field=" +
-                 fn( HeaderField::Subject ) + ") ",
-                 "sshf.value",
-                 c->reverse );
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.subject", c->reverse );
         break;
     case To:
-        addJoin( t,
-                 "left join address_fields staf on "
-                 "(mm.message=staf.message and "
-                 " staf.part='' and staf.number=0 and"
-                 " staf.field=" + fn( HeaderField::To ) + ") "
-                 "left join addresses sta on (staf.address=sta.id) ",
-                 "sta.localpart",
-                 c->reverse );
+        addJoin( t, sortKeys );
+        addOrder( t, "ssk.to_address", c->reverse );
         break;
     case Annotation:
         if ( c->priv )
@@ -306,18 +410,15 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
                      "(mm.mailbox=saa.mailbox and mm.uid=saa.uid and"
                      " owner=$" + fn( c->b2 ) + " and name="
                      "(select id from annotation_names where lower(name)=$" +
-                     fn( c->b1 ) + ")) ",
-                     "saa.value",
-                     c->reverse );
+                     fn( c->b1 ) + ")) " );
         else
             addJoin( t,
                      "left join annotations saa on "
                      "(mm.mailbox=saa.mailbox and mm.uid=saa.uid and"
                      " owner is null and name="
                      "(select id from annotation_names where lower(name)=$" +
-                     fn( c->b1 ) + ")) ",
-                     "saa.value",
-                     c->reverse );
+                     fn( c->b1 ) + ")) " );
+        addOrder( t, "saa.value", c->reverse );
         break;
     case Unknown:
         break;
@@ -325,14 +426,28 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
 }
 
 
-void SortData::addJoin( EString & t,
-                        const EString & join, const EString & orderby,
-                        bool desc )
+/*! Adds \a join to \a t, unless an earlier criterion has already
+    added it.
+*/
+
+void SortData::addJoin( EString & t, const EString & join )
 {
+    if ( t.contains( join ) )
+        return;
     int w = t.find( " where " );
     if ( w < 0 )
         return;
     t = t.mid( 0, w+1 ) + join + t.mid( w+1 );
+}
+
+
+/*! Adds \a orderby to the order by clause of \a t, after all
+    earlier sort criteria but before the final uid. If \a desc is
+    true, the order is reversed.
+*/
+
+void SortData::addOrder( EString & t, const EString & orderby, bool desc )
+{
     int o = t.find( " order by " );
     if ( o < 0 )
         return;
@@ -351,11 +466,19 @@ void SortData::addJoin( EString & t,
 
     // and include orderby in the return list so select distinct
     // doesn't complain. why does select distinct do that anyway?
+    addColumn( t, orderby );
+}
+
+
+/*! Adds \a column to the select list of \a t. */
+
+void SortData::addColumn( EString & t, const EString & column )
+{
     int s = t.find( "mm.uid" );
     if ( s < 0 )
         return;
     s += 6;
-    t = t.mid( 0, s ) + ", " + orderby + t.mid( s );
+    t = t.mid( 0, s ) + ", " + column + t.mid( s );
 }
 
 
@@ -372,8 +495,8 @@ bool SortData::usingCriterionType( SortCriterionType t )
 
 /*! \class ImapSortResponse sort.h
 
-    The ImapSortResponse models the SORT response, and has to make
-    sure old MSNs aren't accidentally included.
+    The ImapSortResponse models the SORT and ESORT responses, and has
+    to make sure old MSNs aren't accidentally included.
 */
 
 
@@ -384,17 +507,88 @@ bool SortData::usingCriterionType( SortCriterionType t )
 
 ImapSortResponse::ImapSortResponse( ImapSession * session,
                                     List<uint> * result, bool uid )
-    : ImapResponse( session ),r( result ), u( uid )
+    : ImapResponse( session ), r( result ), u( uid ),
+      esort( false ), min( false ), max( false ), count( false ),
+      all( false ), low( 0 ), high( 0 ), offset( 0 ), total( 0 )
 {
 }
 
 
+/*! Makes this an ESORT response (RFC 5267) for the command tagged \a
+    tag. \a rmin, \a rmax, \a rcount and \a rall correspond to the
+    RETURN options of the same names, \a rlow and \a rhigh to
+    PARTIAL (both are 0 if PARTIAL wasn't used).
+
+    The result list starts at position \a roffset of the complete
+    sorted result, which has \a rtotal entries.
+*/
+
+void ImapSortResponse::setEsort( const EString & tag,
+                                 bool rmin, bool rmax,
+                                 bool rcount, bool rall,
+                                 uint rlow, uint rhigh,
+                                 uint roffset, uint rtotal )
+{
+    esort = true;
+    t = tag;
+    min = rmin;
+    max = rmax;
+    count = rcount;
+    all = rall;
+    low = rlow;
+    high = rhigh;
+    offset = roffset;
+    total = rtotal;
+}
+
+
+/*! Appends the message numbers or UIDs in \a l to \a result, in
+    order. Ascending runs are compressed into ranges, the rest is
+    separated by commas.
+*/
+
+static void appendSortedSet( EString & result, List<uint> * l )
+{
+    bool first = true;
+    uint start = 0;
+    uint prev = 0;
+    List<uint>::Iterator i( l );
+    while ( i ) {
+        uint x = *i;
+        ++i;
+        if ( start && x == prev + 1 ) {
+            prev = x;
+            continue;
+        }
+        if ( start ) {
+            if ( !first )
+                result.append( "," );
+            first = false;
+            result.appendNumber( start );
+            if ( prev != start ) {
+                result.append( ":" );
+                result.appendNumber( prev );
+            }
+        }
+        start = x;
+        prev = x;
+    }
+    if ( start ) {
+        if ( !first )
+            result.append( "," );
+        result.appendNumber( start );
+        if ( prev != start ) {
+            result.append( ":" );
+            result.appendNumber( prev );
+        }
+    }
+}
+
+
 EString ImapSortResponse::text() const
 {
     Session * s = session();
-    EString result;
-    result.reserve( r->count() * 10 );
-    result.append( "SORT" );
+    List<uint> numbers;
     List<uint>::Iterator i( r );
     while ( i ) {
         uint x = *i;
@@ -402,9 +596,69 @@ EString ImapSortResponse::text() const
         if ( !u )
             x = s->msn( x );
         if ( x ) {
+            uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
+            *tmp = x;
+            numbers.append( tmp );
+        }
+    }
+
+    EString result;
+    if ( !esort ) {
+        result.reserve( numbers.count() * 10 );
+        result.append( "SORT" );
+        List<uint>::Iterator n( numbers );
+        while ( n ) {
             result.append( " " );
-            result.appendNumber( x );
+            result.appendNumber( *n );
+            ++n;
+        }
+        return result;
+    }
+
+    result.reserve( numbers.count() * 8 );
+    result.append( "ESEARCH (tag " );
+    result.append( t.quoted() );
+    result.append( ")" );
+    if ( u )
+        result.append( " uid" );
+    if ( count ) {
+        result.append( " count " );
+        result.appendNumber( total );
+    }
+    if ( !numbers.isEmpty() ) {
+        if ( min ) {
+            result.append( " min " );
+            result.appendNumber( *numbers.firstElement() );
         }
+        if ( max ) {
+            result.append( " max " );
+            result.appendNumber( *numbers.lastElement() );
+        }
+        if ( all ) {
+            result.append( " all " );
+            appendSortedSet( result, &numbers );
+        }
+    }
+    if ( low ) {
+        List<uint> window;
+        uint p = offset + 1;
+        List<uint>::Iterator n( numbers );
+        while ( n && p <= high ) {
+            if ( p >= low )
+                window.append( n );
+            ++p;
+            ++n;
+        }
+        result.append( " partial (" );
+        result.appendNumber( low );
+        result.append( ":" );
+        result.appendNumber( high );
+        result.append( " " );
+        if ( window.isEmpty() )
+            result.append( "NIL" );
+        else
+            appendSortedSet( result, &window );
+        result.append( ")" );
     }
     return result;
 }
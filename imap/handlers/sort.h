@@ -25,11 +25,19 @@ class ImapSortResponse
 {
 public:
     ImapSortResponse( ImapSession *, List<uint> *, bool );
+
+    void setEsort( const EString &, bool, bool, bool, bool,
+                   uint, uint, uint, uint );
+
     EString text() const;
 
 private:
     List<uint> * r;
     bool u;
+    bool esort;
+    EString t;
+    bool min, max, count, all;
+    uint low, high, offset, total;
 };
 
 
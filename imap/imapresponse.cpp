@@ -4,6 +4,7 @@
 
 #include "imapsession.h"
 #include "imap.h"
+#include "buffer.h"
 
 
 
@@ -145,6 +146,27 @@ EString ImapResponse::text() const
 }
 
 
+/*! Appends this response, including the leading "* " and trailing
+    CRLF, to \a w. Returns true if anything was written, and false if
+    text() was empty and the response should be discarded.
+
+    The default implementation writes text(). Subclasses whose
+    responses may be very large can reimplement this to write their
+    response piecemeal, so that it's never all in memory at once.
+*/
+
+bool ImapResponse::write( Buffer * w ) const
+{
+    EString t = text();
+    if ( t.isEmpty() )
+        return false;
+    w->append( "* ", 2 );
+    w->append( t );
+    w->append( "\r\n", 2 );
+    return true;
+}
+
+
 /*! Returns true if this response has meaning, and false if it may be
     discarded.
 
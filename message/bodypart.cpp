@@ -51,6 +51,10 @@ public:
     numEncodedBytes() and numEncodedLines() of data it contains, and can
     present itself asText().
 
+    A text part whose UTF-8 form is the same as its (decoded) content
+    keeps that UTF-8 as data() rather than keeping text(), and text()
+    decodes it when first called.
+
     This class is also responsible for parsing bodyparts in messages.
 */
 
@@ -157,7 +161,8 @@ EString::Encoding Bodypart::contentTransferEncoding() const
 
 
 /*! Returns this Bodypart's content, provided it has an 8-bit type. If
-    this Bodypart is a text part, data() returns an empty string.
+    this Bodypart is a text part, data() returns either an empty
+    string or the text() in UTF-8.
 */
 
 EString Bodypart::data() const
@@ -186,7 +191,9 @@ UString Bodypart::text() const
         return d->text;
 
     Utf8Codec c;
-    return c.toUnicode( d->data );
+    d->text = c.toUnicode( d->data );
+    d->hasText = true;
+    return d->text;
 }
 
 
@@ -722,6 +729,15 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
         body = c->fromUnicode( bp->d->text );
         bool qp = body.needsQP();
 
+        if ( c->valid() && !body.contains( '\0' ) &&
+             ( c->name() == "UTF-8" || c->name() == "US-ASCII" ) ) {
+            // body is exactly what the database wants, so keep that
+            // and let text() decode it again if anyone asks
+            bp->d->data = body;
+            bp->d->text = UString();
+            bp->d->hasText = false;
+        }
+
         if ( cte ) {
             if ( !qp ) {
                 h->removeField( HeaderField::ContentTransferEncoding );
@@ -796,7 +812,7 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
     if ( cte )
         body = body.encoded( cte->encoding(), 72 );
     bp->d->numEncodedBytes = body.length();
-    if ( bp->d->hasText ||
+    if ( ct->type() == "text" ||
          ( ct->type() == "message" && ct->subtype() == "rfc822" ) ) {
         uint n = 0;
         uint i = 0;
@@ -3,6 +3,7 @@
 #include "date.h"
 
 #include "parser.h"
+#include "cache.h"
 
 // time_t
 #include <time.h>
@@ -277,6 +278,85 @@ static uint month( const EString & name )
 }
 
 
+// Parses the canonical RFC 5322 form of a date, "Tue, 1 Jul 2003
+// 10:52:37 +0200" (with or without the day of the week). Returns true
+// and sets d if s is in exactly that form. Otherwise, returns false
+// without changing d, so that setRfc822() can try harder.
+
+static bool parseCanonical( DateData * d, const EString & s )
+{
+    const char * p = s.data();
+    uint l = s.length();
+    if ( l < 25 )
+        return false;
+
+    uint i = 0;
+    if ( ( p[0] | 0x20 ) >= 'a' && ( p[0] | 0x20 ) <= 'z' &&
+         ( p[1] | 0x20 ) >= 'a' && ( p[1] | 0x20 ) <= 'z' &&
+         ( p[2] | 0x20 ) >= 'a' && ( p[2] | 0x20 ) <= 'z' &&
+         p[3] == ',' && p[4] == ' ' )
+        i = 5;
+
+    uint day = 0;
+    uint n = 0;
+    while ( n < 2 && i < l && p[i] >= '0' && p[i] <= '9' ) {
+        day = day * 10 + p[i++] - '0';
+        n++;
+    }
+    if ( !n || l - i != 24 || p[i] != ' ' )
+        return false;
+    i++;
+
+    uint month = 0;
+    while ( month < 12 && ( p[i] != months[month][0] ||
+                            p[i+1] != months[month][1] ||
+                            p[i+2] != months[month][2] ) )
+        month++;
+    if ( month == 12 || p[i+3] != ' ' )
+        return false;
+    month++;
+    i += 4;
+
+    // now we have exactly "yyyy hh:mm:ss +zzzz" left
+    const char * t = p + i;
+    if ( t[4] != ' ' || t[7] != ':' || t[10] != ':' || t[13] != ' ' ||
+         ( t[14] != '+' && t[14] != '-' ) )
+        return false;
+    static const uint digits[] = { 0, 1, 2, 3, 5, 6, 8, 9, 11, 12,
+                                   15, 16, 17, 18 };
+    n = 0;
+    while ( n < 14 && t[digits[n]] >= '0' && t[digits[n]] <= '9' )
+        n++;
+    if ( n < 14 || t[0] == '0' )
+        return false;
+
+    uint year = ( t[0] - '0' ) * 1000 + ( t[1] - '0' ) * 100 +
+                ( t[2] - '0' ) * 10 + t[3] - '0';
+    uint hour = ( t[5] - '0' ) * 10 + t[6] - '0';
+    uint minute = ( t[8] - '0' ) * 10 + t[9] - '0';
+    uint second = ( t[11] - '0' ) * 10 + t[12] - '0';
+    uint zh = ( t[15] - '0' ) * 10 + t[16] - '0';
+    uint zm = ( t[17] - '0' ) * 10 + t[18] - '0';
+    if ( hour > 23 || minute > 59 || second > 60 ||
+         zh >= 14 || zm > 59 )
+        return false;
+
+    d->day = day;
+    d->month = month;
+    d->year = year;
+    d->hour = hour;
+    d->minute = minute;
+    d->second = second;
+    d->tz = zh * 60 + zm;
+    if ( t[14] == '-' ) {
+        d->tz = -d->tz;
+        if ( !d->tz )
+            d->minus0 = true;
+    }
+    return true;
+}
+
+
 // return true if this may possibly be a weekday.
 static bool weekday( const EString & name )
 {
@@ -298,16 +378,23 @@ static bool weekday( const EString & name )
 /*! Sets this date object to reflect the RFC 2822-format date \a s. If
     there are any syntax errors, the date is set to be invalid.
 
-    A number of common syntax errors are accepted.
+    A number of common syntax errors are accepted. Dates in the
+    canonical form are recognised without using EmailParser.
 */
 
 void Date::setRfc822( const EString & s )
 {
+    d->reset();
+
+    if ( ::parseCanonical( d, s ) ) {
+        d->valid = true;
+        checkHarder();
+        return;
+    }
+
     EmailParser p( s );
     EString a;
 
-    d->reset();
-
     // we'll understand 2822, but a bit kinder.
 
     // perhaps this is all bad. perhaps we should scan the string for
@@ -580,6 +667,135 @@ static int abs( int i )
     return -i;
 }
 
+
+// Writes the last w digits of n to p, and returns a pointer to the
+// first byte after them.
+
+static char * digits( char * p, uint n, uint w )
+{
+    uint i = w;
+    while ( i ) {
+        p[--i] = '0' + n % 10;
+        n = n / 10;
+    }
+    return p + w;
+}
+
+
+// Writes n to p without any leading zeroes, and returns a pointer to
+// the first byte after it.
+
+static char * number( char * p, uint n )
+{
+    uint w = 1;
+    uint m = n;
+    while ( m >= 10 ) {
+        m = m / 10;
+        w++;
+    }
+    return digits( p, n, w );
+}
+
+
+// Writes the zone offset as "+hhmm" or "-hhmm" to p, and returns a
+// pointer to the first byte after it.
+
+static char * zone( char * p, const DateData * d )
+{
+    if ( d->minus0 || d->tz < 0 )
+        *p++ = '-';
+    else
+        *p++ = '+';
+    p = digits( p, abs( d->tz ) / 60, 2 );
+    return digits( p, abs( d->tz ) % 60, 2 );
+}
+
+
+// Each ENVELOPE and INTERNALDATE needs a date rendered, and the same
+// dates are often rendered again and again, so we keep the latest
+// rendering of a few hundred dates.
+
+class DateCache
+    : public Cache
+{
+public:
+    DateCache(): Cache( 8 ) { clear(); }
+
+    void clear() {
+        uint i = 0;
+        while ( i < Size )
+            entries[i++] = 0;
+    }
+
+    struct Entry
+        : public Garbage
+    {
+        Entry(): imap( false ) {}
+
+        DateData date;
+        bool imap;
+        EString result;
+    };
+
+    static const uint Size = 512;
+    Entry * entries[Size];
+
+    static Entry * find( const DateData *, bool );
+    static void insert( const DateData *, bool, const EString & );
+};
+
+
+static DateCache * cache;
+
+
+static uint hash( const DateData * d, bool imap )
+{
+    uint h = d->year;
+    h = h * 13 + d->month;
+    h = h * 32 + d->day;
+    h = h * 24 + d->hour;
+    h = h * 60 + d->minute;
+    h = h * 61 + d->second;
+    h = h * 31 + d->tz;
+    h = h ^ ( h >> 15 );
+    h = h * 2 + ( imap ? 1 : 0 );
+    return h % DateCache::Size;
+}
+
+
+// Returns the cached rendering of d in IMAP or RFC 822 form, or a
+// null pointer if there's none.
+
+DateCache::Entry * DateCache::find( const DateData * d, bool imap )
+{
+    if ( !::cache )
+        return 0;
+    Entry * e = ::cache->entries[hash( d, imap )];
+    if ( !e || e->imap != imap ||
+         e->date.year != d->year || e->date.month != d->month ||
+         e->date.day != d->day || e->date.hour != d->hour ||
+         e->date.minute != d->minute || e->date.second != d->second ||
+         e->date.tz != d->tz || e->date.minus0 != d->minus0 ||
+         e->date.tzn != d->tzn )
+        return 0;
+    return e;
+}
+
+
+// Records that d renders as r in IMAP or RFC 822 form.
+
+void DateCache::insert( const DateData * d, bool imap, const EString & r )
+{
+    if ( !::cache )
+        ::cache = new DateCache;
+    Entry * e = new Entry;
+    e->date = *d;
+    e->imap = imap;
+    e->result = r;
+    ::cache->entries[hash( d, imap )] = e;
+}
+
+
 /*! Returns the date in RFC 822 format. If it's too far into the past
   or future, the weekday is omitted (as is legal).
 
@@ -592,32 +808,37 @@ EString Date::rfc822() const
     if ( !valid() )
         return r;
 
+    DateCache::Entry * e = DateCache::find( d, false );
+    if ( e )
+        return e->result;
+
+    char buffer[64];
+    char * p = buffer;
     if ( d->year > 1925 && d->year < 2100 ) {
-        int wd = dow( d->year, d->month, d->day );
-        r.append( weekdays[wd] );
-        r.append( ", " );
+        const char * wd = weekdays[dow( d->year, d->month, d->day )];
+        *p++ = wd[0];
+        *p++ = wd[1];
+        *p++ = wd[2];
+        *p++ = ',';
+        *p++ = ' ';
     }
 
-    r.appendNumber( d->day );
-    r.append( " " );
-    r.append( months[d->month-1] );
-    r.append( " " );
-    r.appendNumber( d->year );
-    r.append( " " );
-    r.append( zeroPrefixed( d->hour, 2 ) );
-    r.append( ":" );
-    r.append( zeroPrefixed( d->minute, 2 ) );
-    r.append( ":" );
-    r.append( zeroPrefixed( d->second, 2 ) );
-    r.append( " " );
-
-    if ( d->minus0 || d->tz < 0 )
-        r.append( "-" );
-    else
-        r.append( "+" );
-
-    r.append( zeroPrefixed( abs( d->tz ) / 60, 2 ) );
-    r.append( zeroPrefixed( abs( d->tz ) % 60, 2 ) );
+    p = number( p, d->day );
+    *p++ = ' ';
+    *p++ = months[d->month-1][0];
+    *p++ = months[d->month-1][1];
+    *p++ = months[d->month-1][2];
+    *p++ = ' ';
+    p = number( p, d->year );
+    *p++ = ' ';
+    p = digits( p, d->hour, 2 );
+    *p++ = ':';
+    p = digits( p, d->minute, 2 );
+    *p++ = ':';
+    p = digits( p, d->second, 2 );
+    *p++ = ' ';
+    p = zone( p, d );
+    r.append( buffer, p - buffer );
 
     if ( !d->minus0 && d->tzn.length() > 0 ) {
         r.append( " (" );
@@ -625,6 +846,7 @@ EString Date::rfc822() const
         r.append( ")" );
     }
 
+    DateCache::insert( d, false, r );
     return r;
 }
 
@@ -642,27 +864,30 @@ EString Date::imap() const
     if ( !d->valid )
         return r;
 
-    r.append( zeroPrefixed( d->day, 2 ) );
-    r.append( "-" );
-    r.append( months[ d->month-1 ] );
-    r.append( "-" );
-    r.append( zeroPrefixed( d->year, 4 ) );
-    r.append( " " );
-    r.append( zeroPrefixed( d->hour, 2 ) );
-    r.append( ":" );
-    r.append( zeroPrefixed( d->minute, 2 ) );
-    r.append( ":" );
-    r.append( zeroPrefixed( d->second, 2 ) );
-    r.append( " " );
-
-    if ( d->minus0 || d->tz < 0 )
-        r.append( "-" );
-    else
-        r.append( "+" );
-
-    r.append( zeroPrefixed( abs( d->tz ) / 60, 2 ) );
-    r.append( zeroPrefixed( abs( d->tz ) % 60, 2 ) );
-
+    DateCache::Entry * e = DateCache::find( d, true );
+    if ( e )
+        return e->result;
+
+    char buffer[32];
+    char * p = buffer;
+    p = digits( p, d->day, 2 );
+    *p++ = '-';
+    *p++ = months[d->month-1][0];
+    *p++ = months[d->month-1][1];
+    *p++ = months[d->month-1][2];
+    *p++ = '-';
+    p = digits( p, d->year, 4 );
+    *p++ = ' ';
+    p = digits( p, d->hour, 2 );
+    *p++ = ':';
+    p = digits( p, d->minute, 2 );
+    *p++ = ':';
+    p = digits( p, d->second, 2 );
+    *p++ = ' ';
+    p = zone( p, d );
+    r.append( buffer, p - buffer );
+
+    DateCache::insert( d, true, r );
     return r;
 }
 
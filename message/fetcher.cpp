@@ -11,21 +11,47 @@
 #include "postgres.h"
 #include "mailbox.h"
 #include "message.h"
+#include "header.h"
 #include "ustring.h"
 #include "buffer.h"
 #include "query.h"
 #include "scope.h"
-#include "timer.h"
 #include "utf.h"
 #include "map.h"
 #include "log.h"
 
-#include <time.h> // time()
+#include <sys/time.h> // gettimeofday, struct timeval
 
 
 enum State { NotStarted, Fetching, Done };
 
 
+// we never keep more than this many batches in flight
+static const uint maxDepth = 3;
+
+
+static int64 milliseconds()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+class FetcherBatch
+    : public Garbage
+{
+public:
+    FetcherBatch(): started( 0 ), finished( 0 ), size( 0 ) {}
+
+    Map< List<Message> > messages;
+    List<Query> queries;
+    int64 started;
+    int64 finished;
+    uint size;
+};
+
+
 class FetcherData
     : public Garbage
 {
@@ -39,7 +65,9 @@ public:
           maxBatchSize( 32768 ),
           batchSize( 0 ),
           uniqueDatabaseIds( true ),
-          lastBatchStarted( 0 ),
+          timed( 0 ),
+          depth( 1 ), throttled( 0 ),
+          batches( 0 ), fetched( 0 ), waited( 0 ), drained( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
           partnumbers( 0 ),
@@ -47,7 +75,7 @@ public:
     {}
 
     List<Message> messages;
-    Map< List<Message> > batch;
+    List<FetcherBatch> inFlight;
     EventHandler * owner;
     List<Query> * q;
     Transaction * transaction;
@@ -57,14 +85,21 @@ public:
     uint maxBatchSize;
     uint batchSize;
     bool uniqueDatabaseIds;
-    uint lastBatchStarted;
+    FetcherBatch * timed;
+    uint depth;
+    int64 throttled;
+
+    uint batches;
+    uint fetched;
+    uint waited;
+    uint drained;
 
     class Decoder
         : public EventHandler
     {
     public:
         Decoder( FetcherData * fd )
-            : q( 0 ), d( fd ) {
+            : d( fd ) {
             setLog( new Log );
         }
         void execute();
@@ -72,7 +107,7 @@ public:
         virtual void decode( Message *, List<Row> * ) = 0;
         virtual void setDone( Message * ) = 0;
         virtual bool isDone( Message * ) const = 0;
-        Query * q;
+        List<Query> queries;
         FetcherData * d;
         List<Row> mr;
     };
@@ -151,6 +186,11 @@ public:
     an SQL select for them. Typically the select ends with
     "mailbox=$71 and uid in any($72). When the Fetcher isn't useful
     any more, its owner drops it on the floor.
+
+    Up to three batches may be in flight at once. The Fetcher starts
+    with one, adds another whenever a batch completes while the client
+    is keeping up, and falls back to one if the client's write buffer
+    grows. Batches are decoded strictly in order.
 */
 
 
@@ -303,14 +343,13 @@ void Fetcher::start()
         d->batchSize = d->batchSize * 3 / 4;
 
     d->state = Fetching;
-    prepareBatch();
-    makeQueries();
+    startBatches();
 }
 
 
-/*! Checks whether all queries and decoders are done. When the
-    decoders are, then the Fetcher may or may not be. Perhaps it's
-    time to start another batch, perhaps it's time to notify the
+/*! Checks whether the oldest batches' queries and decoders are
+    done. When they are, then the Fetcher may or may not be. Perhaps
+    it's time to start another batch, perhaps it's time to notify the
     owner.
 */
 
@@ -329,31 +368,58 @@ void Fetcher::waitForEnd()
     if ( d->partnumbers )
         decoders.append( d->partnumbers );
 
-    List<FetcherData::Decoder>::Iterator i( decoders );
-    while ( i ) {
-        if ( i->q && !i->q->done() )
-            return;
-        ++i;
+    if ( d->throttled && !d->throttler->writeBufferFull() ) {
+        d->drained += (uint)( milliseconds() - d->throttled );
+        d->throttled = 0;
     }
 
-    Map< List<Message> >::Iterator bi( d->batch );
-    while ( bi ) {
-        List<Message>::Iterator li( *bi );
-        ++bi;
-        while ( li ) {
-            Message * m = li;
-            ++li;
+    bool progress = false;
+    while ( !d->inFlight.isEmpty() ) {
+        FetcherBatch * b = d->inFlight.firstElement();
+        List<Query>::Iterator q( b->queries );
+        while ( q && q->done() )
+            ++q;
+        if ( q )
+            break;
 
-            List<FetcherData::Decoder>::Iterator di( decoders );
-            while ( di ) {
-                di->setDone( m );
-                ++di;
+        Map< List<Message> >::Iterator bi( b->messages );
+        while ( bi ) {
+            List<Message>::Iterator li( *bi );
+            ++bi;
+            while ( li ) {
+                Message * m = li;
+                ++li;
+
+                List<FetcherData::Decoder>::Iterator di( decoders );
+                while ( di ) {
+                    di->setDone( m );
+                    ++di;
+                }
             }
         }
+
+        d->inFlight.shift();
+        b->finished = milliseconds();
+        d->timed = b;
+        d->batches++;
+        d->fetched += b->size;
+        d->waited += (uint)( b->finished - b->started );
+        progress = true;
+
+        // if the client is slow, one batch at a time is enough. if
+        // the client is waiting for us, and the next batch isn't
+        // ready either, then the database is the bottleneck and we
+        // may as well keep it busier.
+        if ( d->throttler && d->throttler->writeBuffer() &&
+             d->throttler->writeBuffer()->size() > 256 * 1024 )
+            d->depth = 1;
+        else if ( d->depth < maxDepth )
+            d->depth++;
     }
 
-    if ( d->messages.isEmpty() ) {
+    if ( d->messages.isEmpty() && d->inFlight.isEmpty() ) {
         d->state = Done;
+        progress = true;
         if ( d->transaction )
             d->transaction->commit();
     }
@@ -361,46 +427,63 @@ void Fetcher::waitForEnd()
         d->messages.clear();
         d->throttler = 0;
     }
-    else if ( d->throttler &&
-              d->throttler->writeBuffer() &&
-              d->throttler->writeBuffer()->size() > 1024*1024 ) {
-        (void)new Timer( this, 2 );
-    }
     else {
-        prepareBatch();
-        makeQueries();
+        startBatches();
     }
-    if ( d->owner )
+    if ( progress && d->owner )
         d->owner->notify();
 }
 
 
+/*! Starts new batches until depth() batches are in flight, unless
+    the connection we're fetching for has too much unwritten output,
+    in which case we wait for it to drain first.
+*/
+
+void Fetcher::startBatches()
+{
+    while ( !d->messages.isEmpty() && d->inFlight.count() < d->depth ) {
+        if ( d->throttler && d->throttler->writeBufferFull() ) {
+            if ( !d->throttled )
+                d->throttled = milliseconds();
+            if ( d->inFlight.isEmpty() )
+                d->throttler->notifyWhenWritten( this );
+            return;
+        }
+        prepareBatch();
+        makeQueries( d->inFlight.lastElement() );
+    }
+}
+
+
 /*! Messages are fetched in batches, so that we can deliver some rows
-    early on. This function adjusts the size of the batches so we'll
-    get about one batch every 6 seconds, and updates the tables so we
-    have a batch ready for reading.
+    early on. This function adjusts the size of the batches so each
+    takes about 6 seconds from start to completion, judging by the
+    most recently completed batch, and updates the tables so we have
+    a batch ready for reading.
 */
 
 
 void Fetcher::prepareBatch()
 {
-    uint now = (uint)time( 0 );
-    if ( d->lastBatchStarted ) {
+    FetcherBatch * t = d->timed;
+    d->timed = 0;
+    if ( t ) {
         uint prevBatchSize = d->batchSize;
-        if ( now == d->lastBatchStarted ) {
-            // if we took zero time, let's do a small batch size
-            // increase, because that's suspiciously fast.
-            d->batchSize = d->batchSize * 2;
-        }
-        else if ( now < d->lastBatchStarted ) {
+        int64 diff = t->finished - t->started;
+        if ( diff < 0 ) {
             // if time went backwards we're very, very careful.
             d->batchSize = 128;
         }
+        else if ( diff < 1000 ) {
+            // if it took less than a second, let's do a small batch
+            // size increase, because that's suspiciously fast.
+            d->batchSize = t->size * 2;
+        }
         else {
             // we adjust the batch size so the next batch could take
             // something in the approximate region of 6 seconds.
-            uint diff = now - d->lastBatchStarted;
-            d->batchSize = d->batchSize * 6 / diff;
+            d->batchSize = (uint)( (int64)t->size * 6000 / diff );
         }
 
         // the batch size can't increase too much
@@ -434,40 +517,61 @@ void Fetcher::prepareBatch()
             d->batchSize = batchSizeLimit;
 
         if ( prevBatchSize != d->batchSize )
-            log( "Batch time was " + fn ( now - d->lastBatchStarted ) +
-                 " for " + fn( prevBatchSize ) + " messages, adjusting to " +
+            log( "Batch time was " + fn( (uint)diff ) + "ms for " +
+                 fn( t->size ) + " messages, adjusting to " +
                  fn( d->batchSize ), Log::Debug );
     }
-    d->lastBatchStarted = now;
+
+    // if we're fetching bodies for a client, we don't want to fetch
+    // much more than it can swallow soon. 40k per message is as
+    // dreadful an estimate here as above.
+    if ( d->body && d->throttler && d->throttler->writeBuffer() ) {
+        uint room = 4 * 1024 * 1024;
+        uint buffered = d->throttler->writeBuffer()->size();
+        if ( buffered < room )
+            room -= buffered;
+        else
+            room = 0;
+        uint outputLimit = room / ( 40 * 1024 );
+        if ( outputLimit < 32 )
+            outputLimit = 32;
+        if ( d->batchSize > outputLimit )
+            d->batchSize = outputLimit;
+    }
 
     // Find out which messages we're going to fetch, and fill in the
     // batch array so we can tie responses to the Message objects.
     d->uniqueDatabaseIds = true;
-    d->batch.clear();
+    FetcherBatch * b = new FetcherBatch;
     uint n = 0;
     while ( !d->messages.isEmpty() && n < d->batchSize ) {
         Message * m = d->messages.shift();
-        List<Message> * l = d->batch.find( m->databaseId() );
+        List<Message> * l = b->messages.find( m->databaseId() );
         if ( !l ) {
             l = new List<Message>;
-            d->batch.insert( m->databaseId(), l );
+            b->messages.insert( m->databaseId(), l );
         }
         l->append( m );
         n++;
     }
+    b->size = n;
+    b->started = milliseconds();
+    d->inFlight.append( b );
 }
 
 
 
 
-/*! Finds out which messages need information of \a type, and binds a
-    list of their database IDs to parameter \a n of \a query.
+/*! Finds out which messages in \a batch need information of \a
+    type, and binds a list of their database IDs to parameter \a n of
+    \a query.
 */
 
-void Fetcher::bindIds( Query * query, uint n, Type type )
+void Fetcher::bindIds( Query * query, uint n, Type type,
+                       FetcherBatch * batch )
 {
     IntegerSet l;
-    Map< List<Message> >::Iterator bi( d->batch );
+    Map< List<Message> >::Iterator bi( batch->messages );
     while ( bi ) {
         List<Message>::Iterator li( *bi );
         ++bi;
@@ -505,12 +609,12 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
 }
 
 
-/*! Issues the necessary selects to retrieve data and feed the
-    decoders. This function does some optimisation of the generated
-    SQL.
+/*! Issues the necessary selects to retrieve data for \a b and feed
+    the decoders. This function does some optimisation of the
+    generated SQL.
 */
 
-void Fetcher::makeQueries()
+void Fetcher::makeQueries( FetcherBatch * b )
 {
     EStringList wanted;
     wanted.append( "mailbox" );
@@ -526,18 +630,20 @@ void Fetcher::makeQueries()
                        "from part_numbers where message=any($1) "
                        "order by message, part",
                        d->partnumbers );
-        bindIds( q, 1, PartNumbers );
+        bindIds( q, 1, PartNumbers, b );
         submit( q );
-        d->partnumbers->q = q;
+        d->partnumbers->queries.append( q );
+        b->queries.append( q );
     }
 
     if ( d->trivia ) {
         // don't need to order this - just one row per message
         q = new Query( "select id as message, idate, rfc822size, thread_root "
                        "from messages where id=any($1)", d->trivia );
-        bindIds( q, 1, Trivia );
+        bindIds( q, 1, Trivia, b );
         submit( q );
-        d->trivia->q = q;
+        d->trivia->queries.append( q );
+        b->queries.append( q );
     }
 
     if ( d->addresses ) {
@@ -549,9 +655,10 @@ void Fetcher::makeQueries()
                        "where af.message=any($1) "
                        "order by af.message, af.part, af.field, af.number",
                        d->addresses );
-        bindIds( q, 1, Addresses );
+        bindIds( q, 1, Addresses, b );
         submit( q );
-        d->addresses->q = q;
+        d->addresses->queries.append( q );
+        b->queries.append( q );
     }
 
     if ( d->otherheader ) {
@@ -561,9 +668,10 @@ void Fetcher::makeQueries()
                        "where hf.message=any($1) "
                        "order by hf.message, hf.part",
                        d->otherheader );
-        bindIds( q, 1, OtherHeader );
+        bindIds( q, 1, OtherHeader, b );
         submit( q );
-        d->otherheader->q = q;
+        d->otherheader->queries.append( q );
+        b->queries.append( q );
     }
 
     if ( d->body ) {
@@ -574,9 +682,10 @@ void Fetcher::makeQueries()
                        "where pn.message=any($1) "
                        "order by pn.message, pn.part",
                        d->body );
-        bindIds( q, 1, Body );
+        bindIds( q, 1, Body, b );
         submit( q );
-        d->body->q = q;
+        d->body->queries.append( q );
+        b->queries.append( q );
     }
 
     if ( d->transaction )
@@ -587,22 +696,31 @@ void Fetcher::makeQueries()
 void FetcherData::Decoder::execute()
 {
     Scope x( log() );
-    int mid = 0;
-    if ( !mr.isEmpty() )
-        mid = mr.firstElement()->getInt( "message" );
-    while ( q->hasResults() ) {
-        Row * r = q->nextRow();
-        int id = r->getInt( "message" );
-        if ( mid != id ) {
-            process();
-            mid = id;
+    // we decode the batches in order, so that the rows for one
+    // message are never mixed up with those of another batch.
+    bool finished = false;
+    while ( !queries.isEmpty() ) {
+        Query * q = queries.firstElement();
+        int mid = 0;
+        if ( !mr.isEmpty() )
+            mid = mr.firstElement()->getInt( "message" );
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            int id = r->getInt( "message" );
+            if ( mid != id ) {
+                process();
+                mid = id;
+            }
+            mr.append( r );
         }
-        mr.append( r );
+        if ( !q->done() )
+            break;
+        process();
+        queries.shift();
+        finished = true;
     }
-    if ( !q->done() )
-        return;
-    process();
-    d->f->execute();
+    if ( finished )
+        d->f->execute();
 }
 
 void FetcherData::Decoder::process()
@@ -610,17 +728,18 @@ void FetcherData::Decoder::process()
     if ( mr.isEmpty() )
         return;
     uint id = mr.firstElement()->getInt( "message" );
-    List<Message> * l = d->batch.find( id );
-    if ( !l )
-        return;
-    List<Message>::Iterator i( l );
-    while ( i ) {
-        Message * m = i;
-        ++i;
-        if ( m && !isDone( m ) ) {
-            decode( m, &mr );
-            setDone( m );
+    List<FetcherBatch>::Iterator b( d->inFlight );
+    while ( b ) {
+        List<Message>::Iterator i( b->messages.find( id ) );
+        while ( i ) {
+            Message * m = i;
+            ++i;
+            if ( m && !isDone( m ) ) {
+                decode( m, &mr );
+                setDone( m );
+            }
         }
+        ++b;
     }
     mr.clear();
 }
@@ -663,6 +782,18 @@ void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
 void FetcherData::HeaderDecoder::setDone( Message * m )
 {
     m->setHeadersFetched();
+
+    // the message will probably sit in the MessageCache for a while
+    if ( m->header() )
+        m->header()->compact();
+    List<Bodypart>::Iterator b( m->allBodyparts() );
+    while ( b ) {
+        if ( b->header() )
+            b->header()->compact();
+        if ( b->message() && b->message()->header() )
+            b->message()->header()->compact();
+        ++b;
+    }
 }
 
 
@@ -927,3 +1058,44 @@ void Fetcher::submit( Query * q )
     else
         q->execute();
 }
+
+
+/*! Returns the number of batches this Fetcher has completed so far. */
+
+uint Fetcher::batches() const
+{
+    return d->batches;
+}
+
+
+/*! Returns the average number of messages in each batch completed so
+    far, or 0 if no batches have been completed.
+*/
+
+uint Fetcher::averageBatchSize() const
+{
+    if ( !d->batches )
+        return 0;
+    return d->fetched / d->batches;
+}
+
+
+/*! Returns the total time, in milliseconds, from when each completed
+    batch was issued until the database had delivered all of it. Since
+    batches overlap, this may exceed the Fetcher's lifetime.
+*/
+
+uint Fetcher::databaseWait() const
+{
+    return d->waited;
+}
+
+
+/*! Returns the time, in milliseconds, this Fetcher has spent waiting
+    for the client to read what has already been fetched.
+*/
+
+uint Fetcher::clientWait() const
+{
+    return d->drained;
+}
@@ -12,6 +12,7 @@ class Query;
 class Message;
 class Mailbox;
 class Connection;
+class FetcherBatch;
 class IntegerSet;
 class PreparedStatement;
 
@@ -44,16 +45,22 @@ public:
 
     void setTransaction( class Transaction * );
 
+    uint batches() const;
+    uint averageBatchSize() const;
+    uint databaseWait() const;
+    uint clientWait() const;
+
 private:
     class FetcherData * d;
 
 private:
     void start();
+    void startBatches();
     void prepareBatch();
-    void makeQueries();
+    void makeQueries( FetcherBatch * );
     void waitForEnd();
     void submit( Query * );
-    void bindIds( Query *, uint, Type );
+    void bindIds( Query *, uint, Type, FetcherBatch * );
 };
 
 
@@ -12,6 +12,9 @@
 #include "ustringlist.h"
 #include "estringlist.h"
 #include "parser.h"
+#include "stringkernel.h"
+#include "allocator.h"
+#include "dict.h"
 #include "utf.h"
 
 static struct {
@@ -54,11 +57,67 @@ static struct {
 };
 
 
+// Field names are interned, so that all the Received fields in all
+// the cached messages share a single "Received". Names of type Other
+// are interned as they're seen, up to a limit, so that spam full of
+// random X- fields can't make the table grow without bound.
+
+struct FieldName
+    : public Garbage
+{
+    FieldName( const EString & n, HeaderField::Type t )
+        : name( n ), type( t ) {}
+
+    EString name;
+    HeaderField::Type type;
+};
+
+
+static Dict<FieldName> * names;
+static FieldName * knownNames[HeaderField::Other];
+static uint otherNames;
+static const uint MaxOtherNames = 4096;
+
+
+static void setupNames()
+{
+    names = new Dict<FieldName>;
+    Allocator::addEternal( names, "interned header field names" );
+    uint i = 0;
+    while ( fieldNames[i].name ) {
+        FieldName * n = new FieldName( fieldNames[i].name,
+                                       fieldNames[i].type );
+        names->insert( n->name, n );
+        knownNames[n->type] = n;
+        i++;
+    }
+}
+
+
+// Returns the interned FieldName for the header-cased name \a n.
+
+static FieldName * interned( const EString & n )
+{
+    if ( !names )
+        setupNames();
+    FieldName * f = names->find( n );
+    if ( f )
+        return f;
+    f = new FieldName( n, HeaderField::Other );
+    if ( otherNames < MaxOtherNames ) {
+        names->insert( n, f );
+        otherNames++;
+    }
+    return f;
+}
+
+
 class HeaderFieldData
     : public Garbage
 {
 public:
-    HeaderFieldData() : type( HeaderField::Other ), position( (uint)-1 ) {}
+    HeaderFieldData()
+        : type( HeaderField::Other ), position( (uint)-1 ), raw( false ) {}
 
     HeaderField::Type type;
     EString name;
@@ -66,6 +125,8 @@ public:
     EString unparsed;
     EString error;
     uint position;
+    bool raw;
+    EString ascii;
 };
 
 
@@ -78,6 +139,17 @@ public:
     parse() field values, e.g. parseText()).
 
     Users may obtain HeaderField objects only via create().
+
+    Unstructured fields which contain only ASCII (most Received
+    fields, all the X- fields, DKIM signatures, etc.) aren't decoded,
+    neither when the message is parsed nor when it's fetched from the
+    database. Such a field keeps only its ASCII form, value() decodes
+    it on each call, and databaseValue() returns it unchanged. This
+    keeps cached messages small, and Header::compact() makes them
+    smaller still.
+
+    Field names are interned process-wide, so all fields with the same
+    name() share one string.
 */
 
 
@@ -87,12 +159,8 @@ public:
 
 HeaderField *HeaderField::fieldNamed( const EString &name )
 {
-    int i = 0;
-    EString n = name.headerCased();
-    while ( fieldNames[i].name && n != fieldNames[i].name )
-        i++;
-
-    HeaderField::Type t = fieldNames[i].type;
+    FieldName * n = interned( name.headerCased() );
+    HeaderField::Type t = n->type;
     HeaderField * hf = 0;
 
     switch ( t ) {
@@ -106,10 +174,10 @@ HeaderField *HeaderField::fieldNamed( const EString &name )
     case ContentLocation:
     case ContentMd5:
     case Other:
-        if ( n == "List-Id" )
+        if ( n->name == "List-Id" )
             hf = new ListIdField;
         else
-            hf = new HeaderField( fieldNames[i].type );
+            hf = new HeaderField( t );
         break;
 
     case From:
@@ -154,7 +222,7 @@ HeaderField *HeaderField::fieldNamed( const EString &name )
         break;
     }
 
-    hf->setName( n );
+    hf->setName( n->name );
     return hf;
 }
 
@@ -207,6 +275,8 @@ HeaderField *HeaderField::assemble( const EString &name,
          hf->type() == ContentLanguage ||
          hf->type() == ContentDisposition )
         hf->parse( data.utf8() );
+    else if ( hf->isUnstructured() && data.isAscii() )
+        hf->setAsciiValue( data.utf8() );
     else
         hf->setValue( data );
     return hf;
@@ -243,13 +313,18 @@ HeaderField::Type HeaderField::type() const
 
 EString HeaderField::name() const
 {
-    if ( d->type != Other )
-        return fieldName( d->type );
+    if ( d->type != Other ) {
+        if ( !names )
+            setupNames();
+        return knownNames[d->type]->name;
+    }
     return d->name;
 }
 
 
-/*! Sets the name of this HeaderField to \a n. */
+/*! Sets the name of this HeaderField to \a n, which should be
+    header-cased.
+*/
 
 void HeaderField::setName( const EString &n )
 {
@@ -278,13 +353,17 @@ EString HeaderField::rfc822( bool avoidUtf8 ) const
 
     if ( d->type == Other ) {
         if ( avoidUtf8 )
-            return encodeText( d->value );
+            return encodeText( value() );
+        else if ( d->raw )
+            return d->ascii;
         else
             return d->value.utf8();
     }
 
     // We assume that, for most fields, we can use the database
     // representation in an RFC 822 message.
+    if ( d->raw )
+        return d->ascii;
     return d->value.utf8();
 }
 
@@ -302,10 +381,75 @@ EString HeaderField::rfc822( bool avoidUtf8 ) const
 
 UString HeaderField::value() const
 {
+    if ( d->raw ) {
+        UString u;
+        u.append( d->ascii.data(), d->ascii.length() );
+        return u;
+    }
     return d->value;
 }
 
 
+/*! Returns value() encoded as PgUtf8Codec would encode it for the
+    database. If the field's value is undecoded ASCII, this is the
+    field's slice of the message, and no conversion is necessary.
+*/
+
+EString HeaderField::databaseValue() const
+{
+    if ( d->raw )
+        return d->ascii;
+    PgUtf8Codec c;
+    return c.fromUnicode( value() );
+}
+
+
+/*! Sets the value of this HeaderField to the ASCII string \a s,
+    which is kept undecoded until value() is called, and clears the
+    error(). \a s must not contain 8-bit characters or NULs.
+*/
+
+void HeaderField::setAsciiValue( const EString & s )
+{
+    setValue( UString() );
+    d->raw = true;
+    d->ascii = s;
+}
+
+
+/*! Returns true if value() is kept as undecoded ASCII (see
+    setAsciiValue()), and false otherwise.
+*/
+
+bool HeaderField::hasAsciiValue() const
+{
+    return d->raw;
+}
+
+
+/*! Returns true if this field is handled as unstructured text by
+    parse(), ie. if its value is the field's text with nothing but
+    unfolding done, and false otherwise.
+*/
+
+bool HeaderField::isUnstructured() const
+{
+    switch ( d->type ) {
+    case InReplyTo:
+    case Keywords:
+    case Received:
+    case ContentMd5:
+        return true;
+    case Other:
+        return d->name != "Content-Base" && d->name != "Errors-To" &&
+            d->name != "List-Id";
+    default:
+        break;
+    }
+    return false;
+}
+
+
 /*! Sets the parsed representation of this HeaderField to \a s and
     clears the error().
 */
@@ -313,6 +457,8 @@ UString HeaderField::value() const
 void HeaderField::setValue( const UString &s )
 {
     d->value = s;
+    d->raw = false;
+    d->ascii = EString();
     d->error.truncate();
 }
 
@@ -484,10 +630,18 @@ void HeaderField::parseText( const EString &s )
 /*! Tries to parses any (otherwise uncovered and presumably
     unstructured) field in \a s, and records an error if it contains
     NULs or 8-bit characters.
+
+    If \a s is valid, decoding it is left for value() to do.
 */
 
 void HeaderField::parseOther( const EString &s )
 {
+    if ( StringKernel::is7Bit( s.data(), s.length() ) &&
+         !s.contains( '\0' ) ) {
+        setAsciiValue( s );
+        return;
+    }
+
     AsciiCodec a;
     setValue( a.toUnicode( s ) );
     if ( a.valid() )
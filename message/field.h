@@ -56,6 +56,10 @@ public:
 
     virtual UString value() const;
     void setValue( const UString & );
+    void setAsciiValue( const EString & );
+    bool hasAsciiValue() const;
+    EString databaseValue() const;
+    bool isUnstructured() const;
 
     EString unparsedValue() const;
     void setUnparsedValue( const EString & );
@@ -1991,3 +1991,47 @@ bool Header::needsUnicode() const
     }
     return false;
 }
+
+
+/*! Moves the values of all the fields which keep undecoded ASCII
+    (see HeaderField::setAsciiValue()) into a single string, so that
+    each such field refers to a slice of that string instead of having
+    a buffer of its own.
+
+    This is meant for headers which will be kept for a while, such as
+    those in the MessageCache. It does nothing useful for headers
+    which are about to be changed.
+*/
+
+void Header::compact()
+{
+    uint n = 0;
+    List<HeaderField>::Iterator i( d->fields );
+    while ( i ) {
+        if ( i->hasAsciiValue() )
+            n += i->databaseValue().length();
+        ++i;
+    }
+    if ( !n )
+        return;
+
+    EString values;
+    values.reserve( n );
+    i = d->fields.first();
+    while ( i ) {
+        if ( i->hasAsciiValue() )
+            values.append( i->databaseValue() );
+        ++i;
+    }
+
+    uint offset = 0;
+    i = d->fields.first();
+    while ( i ) {
+        if ( i->hasAsciiValue() ) {
+            uint l = i->databaseValue().length();
+            i->setAsciiValue( values.mid( offset, l ) );
+            offset += l;
+        }
+        ++i;
+    }
+}
@@ -56,6 +56,7 @@ public:
     void repair();
     void repair( class Multipart *, const EString & );
     void fix8BitFields( class Codec * );
+    void compact();
 
     EString asText( bool ) const;
 
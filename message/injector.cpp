@@ -7,6 +7,8 @@
 #include "flag.h"
 #include "query.h"
 #include "timer.h"
+#include "workpool.h"
+#include "eventloop.h"
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
@@ -22,6 +24,7 @@
 #include "postgres.h"
 #include "session.h"
 #include "scope.h"
+#include "searchindex.h"
 #include "graph.h"
 #include "html.h"
 #include "md5.h"
@@ -38,7 +41,7 @@ struct BodypartRow
     : public Garbage
 {
     BodypartRow()
-        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 )
+        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 ), decoded( false )
     {}
 
     uint id;
@@ -47,6 +50,80 @@ struct BodypartRow
     EString * data;
     uint bytes;
     List<Bodypart> bodyparts;
+
+    // copied from the bodypart on the main thread, for the worker
+    EString source;
+    UString unicode;
+    bool decoded;
+};
+
+
+// Fills in the text, data and hash of a list of new bodypart rows on
+// a worker thread. Each row has a single bodypart, and empty text
+// and/or data strings to say what needs to be stored. The worker uses
+// only the copies in the row, never the bodypart, since
+// Bodypart::text() caches what it decodes. If the worker decodes the
+// text, insertBodyparts() gives it to the bodypart afterwards. Nothing
+// else touches the rows until the WorkPool says we're done.
+
+class BodypartPreparer
+    : public WorkItem
+{
+public:
+    BodypartPreparer( EventHandler * owner, List<BodypartRow> * l )
+        : WorkItem( owner ), rows( l )
+    {}
+
+    void work()
+    {
+        List<BodypartRow>::Iterator i( rows );
+        while ( i ) {
+            prepare( i );
+            ++i;
+        }
+    }
+
+    void prepare( BodypartRow * br )
+    {
+        PgUtf8Codec u;
+
+        if ( br->text ) {
+            // a text part which needed no conversion keeps its UTF-8
+            // as data(), which we can copy as-is.
+            EString s;
+            if ( br->source.isEmpty() )
+                s = u.fromUnicode( br->unicode );
+            else
+                s = br->source;
+
+            // For certain content types (whose names are
+            // "text/html"), we store the contents as data and a
+            // plaintext representation as text.
+
+            if ( br->data ) {
+                *br->data = s;
+                if ( !br->source.isEmpty() ) {
+                    Utf8Codec c;
+                    br->unicode = c.toUnicode( br->source );
+                    br->decoded = true;
+                }
+                *br->text = u.fromUnicode( HTML::asText( br->unicode ) );
+            }
+            else {
+                *br->text = s;
+            }
+        }
+        else {
+            *br->data = br->source;
+        }
+
+        if ( br->data )
+            br->hash = MD5::hash( *br->data ).hex();
+        else
+            br->hash = MD5::hash( *br->text ).hex();
+    }
+
+    List<BodypartRow> * rows;
 };
 
 
@@ -77,7 +154,7 @@ public:
           mailboxesCreated( 0 ),
           fieldNameCreator( 0 ), flagCreator( 0 ), annotationNameCreator( 0 ),
           lockUidnext( 0 ), select( 0 ), insert( 0 ),
-          substate( 0 ), subtransaction( 0 ),
+          substate( 0 ), subtransaction( 0 ), preparer( 0 ),
           findParents( 0 ), findReferences( 0 ),
           findBlah( 0 ), findMessagesInOutlookThreads( 0 ),
           threads( 0 )
@@ -138,6 +215,8 @@ public:
 
     Dict<BodypartRow> hashes;
     List<BodypartRow> bodyparts;
+    List<BodypartRow> candidates;
+    BodypartPreparer * preparer;
 
     // for convertInReplyTo()
     Dict< List<Message> > outlooks;
@@ -408,6 +487,8 @@ void Injector::execute()
             }
             else {
                 ::successes->tick();
+                if ( SearchIndex::enabled() )
+                    indexMessages();
             }
 
             next();
@@ -1126,17 +1207,51 @@ void Injector::insertBodyparts()
         last = d->substate;
 
         if ( d->substate == 0 ) {
-            List<Injectee>::Iterator it( d->messages );
-            while ( it ) {
-                Message * m = it;
-                List<Bodypart>::Iterator bi( m->allBodyparts() );
-                while ( bi ) {
-                    addBodypartRow( bi );
-                    ++bi;
+            if ( !d->preparer ) {
+                List<Injectee>::Iterator it( d->messages );
+                while ( it ) {
+                    Message * m = it;
+                    List<Bodypart>::Iterator bi( m->allBodyparts() );
+                    while ( bi ) {
+                        addBodypartRow( bi );
+                        ++bi;
+                    }
+                    ++it;
                 }
-                ++it;
+
+                // converting and hashing are the CPU-bound parts, so
+                // we let the WorkPool do them, and it calls execute()
+                // when done
+                d->preparer = new BodypartPreparer( this, &d->candidates );
+                EventLoop::global()->workPool()->submit( d->preparer );
             }
 
+            if ( !d->preparer->done() )
+                return;
+
+            // Now we know where each bodypart fits in the list of
+            // bodyparts we know already. Either we've seen it before
+            // (in which case we add it to the list of bodyparts in the
+            // appropriate BodypartRow entry), or we haven't (in which
+            // case we add a new BodypartRow).
+
+            List<BodypartRow>::Iterator i( d->candidates );
+            while ( i ) {
+                BodypartRow * r = i;
+                if ( r->decoded )
+                    r->bodyparts.first()->setText( r->unicode );
+                BodypartRow * br = d->hashes.find( r->hash );
+                if ( br ) {
+                    br->bodyparts.append( r->bodyparts.first() );
+                }
+                else {
+                    d->hashes.insert( r->hash, r );
+                    d->bodyparts.append( r );
+                }
+                ++i;
+            }
+            d->candidates.clear();
+
             if ( d->bodyparts.isEmpty() )
                 d->substate = 5;
             else
@@ -1257,6 +1372,66 @@ void Injector::insertBodyparts()
 }
 
 
+/*! Hands the text of each new message to the SearchIndex, once
+    the transaction has committed. The bodypart texts are the ones we
+    stored in the database, so that the index and the database agree.
+*/
+
+void Injector::indexMessages()
+{
+    Map<EString> texts;
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        if ( bi->text ) {
+            List<Bodypart>::Iterator it( bi->bodyparts );
+            while ( it ) {
+                if ( it->id() )
+                    texts.insert( it->id(), bi->text );
+                ++it;
+            }
+        }
+        ++bi;
+    }
+
+    List<Injectee>::Iterator imi( d->injectables );
+    while ( imi ) {
+        Injectee * m = imi;
+        ++imi;
+
+        EString text;
+        List<Header> headers;
+        headers.append( m->header() );
+        List<Bodypart>::Iterator it( m->allBodyparts() );
+        while ( it ) {
+            if ( it->header() )
+                headers.append( it->header() );
+            EString * t = texts.find( it->id() );
+            if ( t ) {
+                text.append( *t );
+                text.append( "\n" );
+            }
+            ++it;
+        }
+        List<Header>::Iterator hi( headers );
+        while ( hi ) {
+            List<HeaderField>::Iterator fi( hi->fields() );
+            while ( fi ) {
+                text.append( fi->value().utf8() );
+                text.append( "\n" );
+                ++fi;
+            }
+            ++hi;
+        }
+
+        List<Mailbox>::Iterator mi( m->mailboxes() );
+        while ( mi ) {
+            SearchIndex::add( mi, m->uid( mi ), text );
+            ++mi;
+        }
+    }
+}
+
+
 /*! Returns a new Query to select \a num nextval()s as "id" from the
     named \a sequence. */
 
@@ -1270,7 +1445,10 @@ Query * Injector::selectNextvals( const EString & sequence, uint num )
 }
 
 
-/*! Adds \a b to the list of bodyparts if it's not there already. */
+/*! Creates a BodypartRow for \a b, if \a b needs to be stored at
+    all, and adds it to the list of rows which insertBodyparts() has
+    a BodypartPreparer fill in.
+*/
 
 void Injector::addBodypartRow( Bodypart * b )
 {
@@ -1301,50 +1479,19 @@ void Injector::addBodypartRow( Bodypart * b )
     if ( !( storeText || storeData ) )
         return;
 
-    // Yes. What exactly do we need to store?
-
-    EString * s;
-    EString hash;
-    EString * text = 0;
-    EString * data = 0;
-    PgUtf8Codec u;
-
-    if ( storeText ) {
-        text = s = new EString( u.fromUnicode( b->text() ) );
-
-        // For certain content types (whose names are "text/html"), we
-        // store the contents as data and a plaintext representation as
-        // text. (This code may need to move if we want to treat other
-        // content types this way. But where to?)
-
-        if ( storeData ) {
-            data = s;
-            text =
-                new EString( u.fromUnicode( HTML::asText( b->text() ) ) );
-        }
-    }
-    else {
-        data = s = new EString( b->data() );
-    }
-    hash = MD5::hash( *s ).hex();
-
-    // And where does it fit in the list of bodyparts we know already?
-    // Either we've seen it before (in which case we add it to the list
-    // of bodyparts in the appropriate BodypartRow entry), or we haven't
-    // (in which case we add a new BodypartRow).
+    // Yes. BodypartPreparer fills in what exactly.
 
-    BodypartRow * br = d->hashes.find( hash );
-
-    if ( !br ) {
-        br = new BodypartRow;
-        br->hash = hash;
-        br->text = text;
-        br->data = data;
-        br->bytes = b->numBytes();
-        d->hashes.insert( hash, br );
-        d->bodyparts.append( br );
-    }
+    BodypartRow * br = new BodypartRow;
+    if ( storeText )
+        br->text = new EString;
+    if ( storeData )
+        br->data = new EString;
+    br->bytes = b->numBytes();
     br->bodyparts.append( b );
+    br->source = b->data();
+    if ( storeText && br->source.isEmpty() )
+        br->unicode = b->text();
+    d->candidates.append( br );
 }
 
 
@@ -1536,6 +1683,11 @@ void Injector::insertMessages()
                    "from stdin with binary", 0 );
     Query * qd =
         new Query( "copy date_fields (message,value) from stdin", 0 );
+    Query * qk =
+        new Query( "copy sort_keys (message,subject,"
+                   "from_address,from_display,to_address,to_display,"
+                   "cc_address,sent) "
+                   "from stdin with binary", 0 );
 
     Query * qm =
         new Query( "copy mailbox_messages "
@@ -1567,6 +1719,7 @@ void Injector::insertMessages()
 
         addPartNumber( qp, mid, "" );
         addHeader( qh, qa, qd, mid, "", m->header() );
+        addSortKeys( qk, mid, m->header(), internalDate( m ) );
 
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
@@ -1648,6 +1801,7 @@ void Injector::insertMessages()
     d->transaction->enqueue( qh );
     d->transaction->enqueue( qa );
     d->transaction->enqueue( qd );
+    d->transaction->enqueue( qk );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
@@ -1727,7 +1881,7 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
             qh->bind( 2, part );
             qh->bind( 3, hf->position() );
             qh->bind( 4, t );
-            qh->bind( 5, hf->value() );
+            qh->bind( 5, hf->databaseValue() );
             qh->submitLine();
 
             if ( part.isEmpty() && hf->type() == HeaderField::Date ) {
@@ -1743,6 +1897,98 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
 }
 
 
+/*! Binds the RFC 5256 sort key for the address \a a to columns \a n
+    (the mailbox) and \a n+1 (the display name, if \a display is
+    true) of \a q. The display name falls back to the address if \a a
+    has no name.
+*/
+
+static void bindSortAddress( Query * q, uint n, bool display, Address * a )
+{
+    if ( !a ||
+         ( a->type() != Address::Normal && a->type() != Address::Local ) ) {
+        q->bindNull( n );
+        if ( display )
+            q->bindNull( n + 1 );
+        return;
+    }
+    q->bind( n, a->localpart().titlecased() );
+    if ( !display )
+        return;
+    UString name = a->uname();
+    if ( name.isEmpty() ) {
+        name = a->localpart();
+        if ( !a->domain().isEmpty() ) {
+            name.append( '@' );
+            name.append( a->domain() );
+        }
+    }
+    q->bind( n + 1, name.simplified().titlecased() );
+}
+
+
+// Returns the first address in the field t of h, or a null pointer.
+
+static Address * firstAddress( Header * h, HeaderField::Type t )
+{
+    List<Address> * l = h->addresses( t );
+    if ( !l )
+        return 0;
+    return l->firstElement();
+}
+
+
+/*! Adds the sort_keys row for the message with id \a mid, whose
+    top-level header is \a h and whose internal date is \a idate, to
+    \a q.
+*/
+
+void Injector::addSortKeys( Query * q, uint mid, Header * h, uint idate )
+{
+    UString subject;
+    HeaderField * s = h->field( HeaderField::Subject );
+    if ( s )
+        subject = s->value();
+
+    uint sent = idate;
+    Date * date = h->date();
+    if ( date && date->valid() )
+        sent = date->unixTime();
+
+    addSortKeys( q, mid, subject,
+                 firstAddress( h, HeaderField::From ),
+                 firstAddress( h, HeaderField::To ),
+                 firstAddress( h, HeaderField::Cc ),
+                 sent );
+}
+
+
+/*! Adds a sort_keys row to \a q, which must be a "copy sort_keys
+    (message,subject,from_address,from_display,to_address,to_display,
+    cc_address,sent)" query. \a mid is the message's id, \a subject
+    its Subject field (empty if there is none), \a from, \a to and \a
+    cc the first addresses in those fields (or null pointers) and \a
+    sent its Date field, or the internal date if it has none.
+
+    This is public so that "aox update database" can add keys for
+    messages injected before sort_keys existed, and sort them exactly
+    like new messages.
+*/
+
+void Injector::addSortKeys( Query * q, uint mid, const UString & subject,
+                            Address * from, Address * to, Address * cc,
+                            uint sent )
+{
+    q->bind( 1, mid );
+    q->bind( 2, Message::baseSubject( subject ) );
+    bindSortAddress( q, 3, true, from );
+    bindSortAddress( q, 5, true, to );
+    bindSortAddress( q, 7, false, cc );
+    q->bind( 8, sent );
+    q->submitLine();
+}
+
+
 /*! Adds a mailbox_messages row for the message \a m in mailbox \a mb to
     the query \a q. */
 
@@ -1893,10 +2139,12 @@ void Injector::insertDeliveries()
              " for delivery to " + fn( n ) +
              " remote recipients", Log::Significant );
 
+        d->transaction->enqueue(
+            new Query( "notify deliveries_updated, '" +
+                       fn( di->message->databaseId() ) + "'", 0 ) );
+
         ++di;
     }
-
-    d->transaction->enqueue( new Query( "notify deliveries_updated", 0 ) );
 }
 
 
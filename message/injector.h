@@ -66,6 +66,9 @@ public:
     void addAddress( Address * );
     uint addressId( Address * );
 
+    static void addSortKeys( Query *, uint, const UString &,
+                             Address *, Address *, Address *, uint );
+
 private:
     class InjectorData * d;
 
@@ -88,7 +91,9 @@ private:
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
     void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
+    void addSortKeys( Query *, uint, Header *, uint );
     void addMailbox( Query *, Injectee *, Mailbox * );
+    void indexMessages();
     uint addFlags( Query *, Injectee *, Mailbox * );
     uint addAnnotations( Query *, Injectee *, Mailbox * );
     void logDescription();
@@ -193,6 +193,21 @@ void Message::recomputeError()
 }
 
 
+// Returns true if s consists only of whitespace.
+
+static bool isBlank( const EString & s )
+{
+    uint i = 0;
+    while ( i < s.length() ) {
+        char c = s[i];
+        if ( c != ' ' && c != '\t' && c != '\r' && c != '\n' )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+
 /*! Creates and returns a Header in mode \a m by parsing the part of
     \a rfc2822 from index \a i to index \a end, not including \a
     end. \a i is changed to the index of the first unparsed character.
@@ -237,18 +252,25 @@ Header * Message::parseHeader( uint & i, uint end,
             i++;
             while ( rfc2822[i] == ' ' || rfc2822[i] == '\t' )
                 i++;
+            // the value ends at the first LF not followed by
+            // whitespace
             j = i;
-            // this isn't at all pretty, is it...
-            while ( j < rfc2822.length() &&
-                    ( rfc2822[j] != '\n' ||
-                      ( rfc2822[j] == '\n' &&
-                        ( rfc2822[j+1] == ' ' || rfc2822[j+1] == '\t' ) ) ) )
+            while ( j < rfc2822.length() ) {
+                int lf = rfc2822.find( '\n', j );
+                if ( lf < 0 )
+                    j = rfc2822.length();
+                else
+                    j = lf;
+                if ( rfc2822[j+1] != ' ' && rfc2822[j+1] != '\t' )
+                    break;
                 j++;
+            }
             if ( j && rfc2822[j-1] == '\r' )
                 j--;
             EString value = rfc2822.mid( i, j-i );
-            if ( !value.simplified().isEmpty() ||
-                 name.lower().startsWith( "x-" ) ) {
+            if ( !isBlank( value ) ||
+                 ( ( name[0] == 'x' || name[0] == 'X' ) &&
+                   name[1] == '-' ) ) {
                 HeaderField * f = HeaderField::create( name, value );
                 h->add( f );
             }
@@ -14,6 +14,9 @@
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
+#include "allocator.h"
+#include "dnsquery.h"
+#include "dict.h"
 // time
 #include <time.h>
 
@@ -28,7 +31,11 @@ public:
           wbt( 0 ), wbs( 0 ),
           enhancedstatuscodes( false ),
           unicode( false ),
-          size( false )
+          size( false ),
+          pipelining( false ),
+          chunking( false ),
+          ahead( 0 ), unreachable( false ),
+          closeTimer( 0 ), timerCloser( 0 )
     {}
 
     enum State { Invalid,
@@ -52,6 +59,11 @@ public:
     bool enhancedstatuscodes;
     bool unicode;
     bool size;
+    bool pipelining;
+    bool chunking;
+    uint ahead;
+    EString domain;
+    bool unreachable;
     Timer * closeTimer;
     class TimerCloser
         : public EventHandler
@@ -62,6 +74,31 @@ public:
         SmtpClient * t;
     };
     TimerCloser * timerCloser;
+
+    class MxResolver
+        : public EventHandler
+    {
+    public:
+        MxResolver( SmtpClient *, SmtpClientData * );
+        void execute();
+
+        SmtpClient * client;
+        SmtpClientData * data;
+        DnsQuery * mx;
+        List<DnsQuery> hosts;
+        Timer * timer;
+    };
+};
+
+
+class SmtpDomainState
+    : public Garbage
+{
+public:
+    SmtpDomainState(): failures( 0 ), until( 0 ) {}
+
+    uint failures;
+    uint until;
 };
 
 
@@ -70,25 +107,168 @@ public:
     The SmtpClient class provides an SMTP client, as the alert reader
     will have inferred from its name.
 
-    Archiveopteryx uses it to send outgoing messages to a smarthost.
-
+    Archiveopteryx uses it to send outgoing messages to a smarthost,
+    or, if direct-delivery is enabled, to the MX hosts of each
+    recipient's domain. A client which delivers directly handles only
+    the recipients in its domain().
+
+    The clients form a small pool per destination, whose size is
+    limited by the smarthost-connections and domain-connections
+    configuration variables; provide() hands out idle clients, makes
+    new ones while the pool has room, and otherwise asks the caller to
+    wait. Domains whose servers can't be reached are left alone for a
+    while; see backingOff().
+
+    If the smarthost offers PIPELINING, MAIL FROM, all RCPT TO and
+    DATA are sent in one go, and the replies are matched up as they
+    arrive. If it offers CHUNKING, the message is sent using a single
+    BDAT instead of DATA, which saves the round-trip to wait for 354
+    and the dot-escaping.
 */
 
+
+static List<SmtpClient> * pool = 0;
+static List<EventHandler> * waiters = 0;
+static Dict<SmtpDomainState> * domains = 0;
+
+
 /*! Constructs an SMTP client which will immediately connect to \a
-    address and introduce itself, and then wait politely for something
-    to do.
+    port on \a address and introduce itself, and then wait politely
+    for something to do. If \a address is a domain name, it is looked
+    up without blocking.
 */
 
-SmtpClient::SmtpClient( const Endpoint & address )
-    : Connection( Connection::socket( address.protocol() ),
-                  Connection::SmtpClient ),
+SmtpClient::SmtpClient( const EString & address, uint port )
+    : Connection( -1, Connection::SmtpClient ),
       d( new SmtpClientData )
 {
-    connect( address );
+    connect( address, port );
     EventLoop::global()->addConnection( this );
     setTimeoutAfter( 4 );
-    log( "Connecting to " + address.string() );
+    log( "Connecting to " + address + " port " + fn( port ) );
+    addToPool();
+}
+
+
+/*! Constructs an SMTP client which will deliver mail directly to \a
+    domain. It looks up the MX hosts for \a domain (or the domain
+    itself, if there are none), connects to the first one which
+    answers, and then behaves like any other SmtpClient.
+*/
+
+SmtpClient::SmtpClient( const EString & domain )
+    : Connection( -1, Connection::SmtpClient ),
+      d( new SmtpClientData )
+{
+    d->domain = domain;
+    EventLoop::global()->addConnection( this );
+    log( "Looking up mail servers for " + domain );
+    addToPool();
+    (void)new SmtpClientData::MxResolver( this, d );
+}
+
+
+/*! This private helper adds a newly constructed client to the pool. */
+
+void SmtpClient::addToPool()
+{
     d->timerCloser = new SmtpClientData::TimerCloser( this );
+    if ( !::pool ) {
+        ::pool = new List<SmtpClient>;
+        Allocator::addEternal( ::pool, "smtp client pool" );
+    }
+    ::pool->append( this );
+}
+
+
+SmtpClientData::MxResolver::MxResolver( SmtpClient * c,
+                                        SmtpClientData * cd )
+    : client( c ), data( cd ), mx( 0 ), timer( 0 )
+{
+    // the client isn't in the EventLoop until it has a socket, so
+    // its own timeout can't free its place in the pool meanwhile.
+    timer = new Timer( this, 60 );
+    mx = new DnsQuery( data->domain, DnsQuery::Mx, this );
+    mx->execute();
+    execute();
+}
+
+
+void SmtpClientData::MxResolver::execute()
+{
+    if ( !client )
+        return;
+
+    if ( !timer->active() ) {
+        data->error = "Timed out looking up the mail servers for " +
+                      data->domain;
+        SmtpClient * c = client;
+        client = 0;
+        c->connect( EStringList(), 25 );
+        return;
+    }
+
+    if ( !mx->done() )
+        return;
+
+    if ( hosts.isEmpty() ) {
+        if ( mx->failed() ) {
+            data->error = mx->error();
+            SmtpClient * c = client;
+            client = 0;
+            delete timer;
+            c->connect( EStringList(), 25 );
+            return;
+        }
+        EStringList names( mx->answers() );
+        if ( names.isEmpty() )
+            names.append( data->domain ); // the implicit MX
+        EStringList::Iterator n( names );
+        while ( n ) {
+            if ( Configuration::toggle( Configuration::UseIPv6 ) )
+                hosts.append( new DnsQuery( *n, DnsQuery::Aaaa, this ) );
+            if ( Configuration::toggle( Configuration::UseIPv4 ) )
+                hosts.append( new DnsQuery( *n, DnsQuery::A, this ) );
+            ++n;
+        }
+        List<DnsQuery>::Iterator q( hosts );
+        while ( q ) {
+            q->execute();
+            ++q;
+        }
+    }
+
+    List<DnsQuery>::Iterator q( hosts );
+    while ( q && q->done() )
+        ++q;
+    if ( q )
+        return;
+
+    EStringList addresses;
+    bool failed = false;
+    List<DnsQuery>::Iterator h( hosts );
+    while ( h ) {
+        addresses.append( h->answers() );
+        if ( h->failed() )
+            failed = true;
+        ++h;
+    }
+    if ( addresses.isEmpty() && failed ) {
+        data->error = "Could not look up the mail servers for " +
+                      data->domain;
+    }
+    else if ( addresses.isEmpty() ) {
+        data->error = "Found no mail server for " + data->domain;
+        data->unreachable = true;
+    }
+
+    SmtpClient * c = client;
+    client = 0;
+    delete timer;
+    c->connect( addresses, 25 );
+    // SerialConnector gives up on each address by itself, but a
+    // single address would otherwise have no timeout at all
+    c->setTimeoutAfter( 60 );
 }
 
 
@@ -134,6 +314,9 @@ void SmtpClient::react( Event e )
         }
         log( "SMTP server timed out", Log::Error );
         d->error = "Server timeout.";
+        if ( d->state == SmtpClientData::Invalid ||
+             d->state == SmtpClientData::Connected )
+            recordReachability( false );
         finish( "4.4.1" );
         close();
         break;
@@ -146,8 +329,14 @@ void SmtpClient::react( Event e )
     case Error:
     case Close:
         if ( state() == Connecting ) {
-            d->error = "Connection refused by SMTP/LMTP server";
-            finish( "4.4.1" );
+            if ( d->error.isEmpty() )
+                d->error = "Connection refused by SMTP/LMTP server";
+            log( d->error, Log::Error );
+            recordReachability( false );
+            if ( d->unreachable )
+                finish( "5.1.2" );
+            else
+                finish( "4.4.1" );
         }
         else if ( d->state != SmtpClientData::Invalid &&
                   d->sent != "quit" ) {
@@ -169,6 +358,18 @@ void SmtpClient::react( Event e )
 }
 
 
+/*! Closes the connection and makes room in the pool for another
+    client, if anyone is waiting for one.
+*/
+
+void SmtpClient::close()
+{
+    Connection::close();
+    if ( ::pool && ::pool->remove( this ) )
+        wakeWaiters();
+}
+
+
 /*! Reads and reacts to SMTP/LMTP responses. Sends new commands. */
 
 void SmtpClient::parse()
@@ -192,17 +393,38 @@ void SmtpClient::parse()
                 recordExtension( *s );
             }
         }
+        else if ( (*s)[3] == ' ' && d->ahead &&
+                  d->state == SmtpClientData::Rset ) {
+            // the reply to a pipelined command we've since abandoned.
+            // RFC 2920 says the server may accept DATA even if it
+            // rejected every RCPT TO, and then we have to end the
+            // (empty) message before we can send RSET.
+            d->ahead--;
+            if ( response == 354 ) {
+                log( "Sending: .", Log::Debug );
+                enqueue( ".\r\n" );
+                d->ahead++;
+            }
+            else if ( !d->ahead ) {
+                log( "Sending: " + d->sent, Log::Debug );
+                enqueue( d->sent + "\r\n" );
+                setTimeoutAfter( 300 );
+            }
+        }
         else if ( (*s)[3] == ' ' ) {
             switch ( response/100 ) {
             case 1:
                 d->error = "Server sent 1xx response: " + *s;
                 break;
             case 2:
-                if ( d->state == SmtpClientData::Connected )
+                if ( d->state == SmtpClientData::Connected ) {
                     d->state = SmtpClientData::Banner;
+                    recordReachability( true );
+                }
                 if ( d->state == SmtpClientData::Hello )
                     recordExtension( *s );
-                SmtpHelo::setUnicodeSupported( d->unicode );
+                if ( d->domain.isEmpty() )
+                    SmtpHelo::setUnicodeSupported( d->unicode );
                 if ( d->rcptTo )
                     d->accepted.append( d->rcptTo );
                 sendCommand();
@@ -228,6 +450,8 @@ void SmtpClient::parse()
                 handleFailure( *s );
                 if ( response == 421 ) {
                     log( "Closing because the SMTP server sent 421" );
+                    if ( d->state == SmtpClientData::Connected )
+                        recordReachability( false );
                     close();
                     d->state = SmtpClientData::Invalid;
                 }
@@ -248,11 +472,14 @@ void SmtpClient::parse()
 }
 
 
-/*! Sends a single SMTP command. */
+/*! Sends a single SMTP command, or several if the server permits
+    pipelining.
+*/
 
 void SmtpClient::sendCommand()
 {
     EString send;
+    bool pipelined = d->ahead > 0;
 
     switch( d->state ) {
     case SmtpClientData::Invalid:
@@ -280,16 +507,36 @@ void SmtpClient::sendCommand()
         if ( d->dsn->message()->needsUnicode() ) {
             send.append( " smtputf8" );
             if ( d->dotted.isEmpty() )
-                d->dotted = dotted( d->dsn->message()->rfc822( false ) );
+                d->dotted = dotted( d->dsn->message()->rfc822( false ),
+                                    !d->chunking );
         }
         else if ( d->dotted.isEmpty() ) {
-            d->dotted = dotted( d->dsn->message()->rfc822( true ) );
+            d->dotted = dotted( d->dsn->message()->rfc822( true ),
+                                !d->chunking );
         }
         if ( d->size ) {
             send.append( " size=" );
             send.append( fn( d->dotted.length() ) );
         }
 
+        if ( d->pipelining ) {
+            // send the commands whose replies we can predict at once,
+            // and let the state machine below skip them later
+            List<Recipient>::Iterator i( d->dsn->recipients() );
+            while ( i ) {
+                if ( i->action() == Recipient::Unknown && handles( i ) ) {
+                    send.append( "\r\nrcpt to:<" +
+                                 i->finalRecipient()->lpdomain() + ">" );
+                    d->ahead++;
+                }
+                ++i;
+            }
+            if ( !d->chunking ) {
+                send.append( "\r\ndata" );
+                d->ahead++;
+            }
+        }
+
         d->state = SmtpClientData::MailFrom;
         break;
 
@@ -302,13 +549,18 @@ void SmtpClient::sendCommand()
         else {
             ++d->rcptTo;
         }
-        while ( d->rcptTo && d->rcptTo->action() != Recipient::Unknown )
+        while ( d->rcptTo && ( d->rcptTo->action() != Recipient::Unknown ||
+                               !handles( d->rcptTo ) ) )
             ++d->rcptTo;
         if ( d->rcptTo ) {
             send = "rcpt to:<" + d->rcptTo->finalRecipient()->lpdomain() + ">";
         }
         else {
-            if ( !d->accepted.isEmpty() ) {
+            if ( !d->accepted.isEmpty() && d->chunking ) {
+                send = "bdat " + fn( d->dotted.length() ) + " last";
+                d->state = SmtpClientData::Body;
+            }
+            else if ( !d->accepted.isEmpty() ) {
                 send = "data";
                 d->state = SmtpClientData::Data;
             }
@@ -341,7 +593,11 @@ void SmtpClient::sendCommand()
     case SmtpClientData::Rset:
         finish( "4.5.0" );
         delete d->closeTimer;
-        if ( idleClient() == this )
+        d->closeTimer = 0;
+        wakeWaiters();
+        if ( d->dsn )
+            return;
+        if ( idleClient( d->domain ) == this )
             d->closeTimer = new Timer( d->timerCloser, 298 );
         else
             d->closeTimer = new Timer( d->timerCloser, 15 );
@@ -361,19 +617,39 @@ void SmtpClient::sendCommand()
     if ( send.isEmpty() )
         return;
 
+    d->sent = send;
+    if ( pipelined && d->state != SmtpClientData::Rset ) {
+        // we pipelined this one already
+        d->ahead--;
+        return;
+    }
+    if ( pipelined ) {
+        // parse() sends the RSET once the pipelined commands have
+        // been answered, since one of them may be a DATA which the
+        // server accepts
+        return;
+    }
+
     log( "Sending: " + send, Log::Debug );
     enqueue( send + "\r\n" );
-    d->sent = send;
+    if ( d->state == SmtpClientData::Body && !d->dotted.isEmpty() ) {
+        log( "Sending body.", Log::Debug );
+        enqueue( d->dotted );
+        d->dotted.truncate();
+        d->wbs = writeBuffer()->size();
+        d->wbt = (uint)::time( 0 );
+    }
     setTimeoutAfter( 300 );
 }
 
 
-/*! Returns a dot-escaped version of \a s, with a dot-cr-lf
-    appended. This function probably should change lone CR or LF
-    characters to CRLF, but it doesn't yet.
+/*! Returns a version of \a s with CRLF line endings. If \a stuff is
+    true (the default), leading dots are escaped and a dot-cr-lf is
+    appended, as DATA requires. If it's false, the result is suitable
+    for BDAT.
 */
 
-EString SmtpClient::dotted( const EString & s )
+EString SmtpClient::dotted( const EString & s, bool stuff )
 {
     EString r;
     uint i = 0;
@@ -390,7 +666,7 @@ EString SmtpClient::dotted( const EString & s )
             r.append( "\r\n" );
         }
         else {
-            if ( sol && s[i] == '.' )
+            if ( stuff && sol && s[i] == '.' )
                 r.append( '.' );
             r.append( s[i] );
             sol = false;
@@ -399,7 +675,8 @@ EString SmtpClient::dotted( const EString & s )
     }
     if ( !sol )
         r.append( "\r\n" );
-    r.append( ".\r\n" );
+    if ( stuff )
+        r.append( ".\r\n" );
 
     return r;
 }
@@ -524,7 +801,7 @@ void SmtpClient::handleFailure( const EString & line )
         if ( d->dsn )
             i = d->dsn->recipients();
         while ( i ) {
-            if ( i->action() == Recipient::Unknown ) {
+            if ( i->action() == Recipient::Unknown && handles( i ) ) {
                 if ( permanent )
                     i->setAction( Recipient::Failed, status );
                 else
@@ -543,7 +820,7 @@ void SmtpClient::handleFailure( const EString & line )
 
 bool SmtpClient::ready() const
 {
-    if ( d->dsn )
+    if ( d->dsn || d->ahead )
         return false;
     if ( d->state == SmtpClientData::Invalid ||
          d->state == SmtpClientData::Connected ||
@@ -571,7 +848,10 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
     Scope x( d->log );
 
     EString s( "Sending message to " );
-    s.append(  peer().address() );
+    if ( d->domain.isEmpty() )
+        s.append( peer().address() );
+    else
+        s.append( d->domain );
     if ( !dsn->message()->header()->messageId().isEmpty() ) {
         s.append( ", message-id " );
         s.append( dsn->message()->header()->messageId() );
@@ -586,6 +866,7 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
 
     d->dsn = dsn;
     d->dotted.truncate();
+    d->accepted.clear();
     d->owner = user;
     d->sentMail = false;
     delete d->closeTimer;
@@ -606,8 +887,12 @@ void SmtpClient::finish( const char * status )
     if ( d->dsn ) {
         List<Recipient>::Iterator i( d->dsn->recipients() );
         while ( i ) {
-            if ( i->action() == Recipient::Unknown )
-                i->setAction( Recipient::Delayed, status );
+            if ( i->action() == Recipient::Unknown && handles( i ) ) {
+                if ( status[0] == '5' )
+                    i->setAction( Recipient::Failed, status );
+                else
+                    i->setAction( Recipient::Delayed, status );
+            }
             ++i;
         }
     }
@@ -640,9 +925,16 @@ void SmtpClient::recordExtension( const EString & line )
     else if ( w == "smtputf8" ) {
         d->unicode = true;
     }
+    else if ( w == "pipelining" ) {
+        d->pipelining = true;
+    }
+    else if ( w == "chunking" ) {
+        d->chunking = true;
+    }
     else if ( w == "size" ) {
         d->size = true;
-        ::observedSize = l.section( " ", 2 ).number( 0 );
+        if ( d->domain.isEmpty() )
+            ::observedSize = l.section( " ", 2 ).number( 0 );
     }
 }
 
@@ -682,21 +974,156 @@ EString SmtpClient::error() const
 }
 
 
-/*! Provides an SMTP client.
+/*! Provides an SMTP client which sends to \a domain, or to the
+    smarthost if \a domain is empty.
 
     If one is idly waiting now, provide() returns its address. If not,
-    provide() makes one and then returns it.
+    and the pool has room for another connection, provide() makes one
+    and then returns it. If the pool is full, provide() returns a null
+    pointer and notifies \a user later, when a client may have become
+    available.
+
+    \a domain must be in lower case.
 */
 
-SmtpClient * SmtpClient::provide()
+SmtpClient * SmtpClient::provide( EventHandler * user,
+                                  const EString & domain )
 {
-    SmtpClient * c = idleClient();
+    SmtpClient * c = idleClient( domain );
     if ( c )
         return c;
 
-    Endpoint e( Configuration::SmartHostAddress,
-                Configuration::SmartHostPort );
-    return new SmtpClient( e );
+    uint n = 0;
+    List<SmtpClient>::Iterator i( ::pool );
+    while ( i ) {
+        if ( i->d->domain == domain )
+            n++;
+        ++i;
+    }
+    if ( n < poolSize( domain ) ) {
+        if ( !domain.isEmpty() )
+            return new SmtpClient( domain );
+        return new SmtpClient(
+            Configuration::text( Configuration::SmartHostAddress ),
+            Configuration::scalar( Configuration::SmartHostPort ) );
+    }
+
+    if ( !::waiters ) {
+        ::waiters = new List<EventHandler>;
+        Allocator::addEternal( ::waiters, "smtp client waiters" );
+    }
+    EventHandler * w = ::waiters->find( user );
+    if ( !w )
+        ::waiters->append( user );
+    return 0;
+}
+
+
+/*! Returns the largest number of SmtpClient objects provide() will
+    keep for \a domain, as configured by smarthost-connections or
+    domain-connections.
+*/
+
+uint SmtpClient::poolSize( const EString & domain )
+{
+    uint n = Configuration::scalar( Configuration::SmartHostConnections );
+    if ( !domain.isEmpty() )
+        n = Configuration::scalar( Configuration::DomainConnections );
+    if ( !n )
+        n = 1;
+    return n;
+}
+
+
+/*! Notifies the event handlers which are waiting for provide(). Each
+    will call provide() again, and wait again if its destination is
+    still busy.
+*/
+
+void SmtpClient::wakeWaiters()
+{
+    if ( !::waiters || ::waiters->isEmpty() )
+        return;
+    List<EventHandler> w;
+    while ( !::waiters->isEmpty() )
+        w.append( ::waiters->shift() );
+    List<EventHandler>::Iterator i( w );
+    while ( i ) {
+        i->notify();
+        ++i;
+    }
+}
+
+
+/*! Returns true if mail to \a domain should not be attempted now,
+    because recent attempts to connect to its servers have failed.
+    The wait starts at a minute and doubles with each failure, up to
+    an hour.
+*/
+
+bool SmtpClient::backingOff( const EString & domain )
+{
+    if ( !::domains )
+        return false;
+    SmtpDomainState * s = ::domains->find( domain );
+    return s && s->until > (uint)::time( 0 );
+}
+
+
+/*! Records whether this client's server could be reached, for
+    backingOff(). \a ok is true if the server greeted us and false if
+    not. Does nothing for smarthost clients.
+*/
+
+void SmtpClient::recordReachability( bool ok )
+{
+    if ( d->domain.isEmpty() )
+        return;
+    if ( !::domains ) {
+        ::domains = new Dict<SmtpDomainState>;
+        Allocator::addEternal( ::domains, "smtp domain states" );
+    }
+    SmtpDomainState * s = ::domains->find( d->domain );
+    if ( ok ) {
+        if ( s )
+            ::domains->remove( d->domain );
+        return;
+    }
+    if ( !s ) {
+        s = new SmtpDomainState;
+        ::domains->insert( d->domain, s );
+    }
+    uint delay = 3600;
+    if ( s->failures < 6 )
+        delay = 60 << s->failures;
+    if ( delay > 3600 )
+        delay = 3600;
+    s->failures++;
+    s->until = (uint)::time( 0 ) + delay;
+    log( "Not trying " + d->domain + " again for " + fn( delay ) +
+         " seconds" );
+}
+
+
+/*! Returns the domain to which this client delivers, or an empty
+    string if it delivers to the smarthost.
+*/
+
+EString SmtpClient::domain() const
+{
+    return d->domain;
+}
+
+
+/*! Returns true if this client should deliver to \a r, and false if
+    \a r belongs to another client.
+*/
+
+bool SmtpClient::handles( Recipient * r ) const
+{
+    if ( d->domain.isEmpty() )
+        return true;
+    return r->finalRecipient()->domain().utf8().lower() == d->domain;
 }
 
 
@@ -720,20 +1147,17 @@ DSN * SmtpClient::sending() const
 }
 
 
-/*! This private helper returns a pointer to an idle SMTP client, or a
-    null pointer if none are idle.
+/*! This private helper returns a pointer to an idle SMTP client for
+    \a domain, or a null pointer if none are idle.
 */
 
-SmtpClient * SmtpClient::idleClient()
+SmtpClient * SmtpClient::idleClient( const EString & domain )
 {
-    List<Connection>::Iterator c( EventLoop::global()->connections() );
+    List<SmtpClient>::Iterator c( ::pool );
     while ( c ) {
-        if ( c->type() == Connection::SmtpClient ) {
-            Connection * tmp = c;
-            SmtpClient * sc = (SmtpClient*)tmp;
-            if ( sc->d->state == SmtpClientData::Rset )
-                return sc;
-        }
+        if ( c->d->state == SmtpClientData::Rset && !c->d->dsn &&
+             !c->d->ahead && c->d->domain == domain )
+            return c;
         ++c;
     }
     return 0;
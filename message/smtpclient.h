@@ -18,11 +18,16 @@ class SmtpClient
     : public Connection
 {
 public:
-    SmtpClient( const Endpoint & );
+    SmtpClient( const EString &, uint );
+    SmtpClient( const EString & );
 
     void react( Event );
+    void close();
 
-    static SmtpClient * provide();
+    static SmtpClient * provide( EventHandler *, const EString & );
+    static bool backingOff( const EString & );
+
+    EString domain() const;
 
     bool ready() const;
     void send( DSN *, EventHandler * );
@@ -43,10 +48,15 @@ private:
     void handleFailure( const EString & );
     void finish( const char * status );
     void recordExtension( const EString & );
+    void addToPool();
+    bool handles( Recipient * ) const;
+    void recordReachability( bool );
 
-    static EString dotted( const EString & );
+    static EString dotted( const EString &, bool = true );
 
-    static SmtpClient * idleClient();
+    static SmtpClient * idleClient( const EString & );
+    static uint poolSize( const EString & );
+    static void wakeWaiters();
 };
 
 
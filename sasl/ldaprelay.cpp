@@ -50,13 +50,13 @@ public:
 /*! Constructs an LdapRelay to verify whatever \a mechanism needs. */
 
 LdapRelay::LdapRelay( SaslMechanism * mechanism )
-    : Connection( Connection::socket( server().protocol() ),
-                  Connection::LdapRelay ),
+    : Connection( -1, Connection::LdapRelay ),
       d ( new LdapRelayData )
 {
     d->mechanism = mechanism;
     setTimeoutAfter( 30 );
-    connect( server() );
+    connect( Configuration::text( Configuration::LdapServerAddress ),
+             Configuration::scalar( Configuration::LdapServerPort ) );
     EventLoop::global()->addConnection( this );
 }
 
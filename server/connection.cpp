@@ -5,6 +5,7 @@
 #include "tlsthread.h"
 
 #include "log.h"
+#include "list.h"
 #include "file.h"
 #include "user.h"
 #include "scope.h"
@@ -13,8 +14,10 @@
 #include "estring.h"
 #include "endpoint.h"
 #include "eventloop.h"
+#include "event.h"
 #include "allocator.h"
 #include "resolver.h"
+#include "dnsquery.h"
 #include "user.h"
 
 // errno
@@ -30,6 +33,11 @@
 #include <time.h>
 
 
+// writeBufferFull() is true above this, and notifyWhenWritten() waits
+// for the buffer to shrink below a quarter of it.
+static const uint writeBufferLimit = 1024 * 1024;
+
+
 class ConnectionData
     : public Garbage
 {
@@ -57,6 +65,7 @@ public:
     bool pending;
     Endpoint self, peer;
     Connection::Event event;
+    List<EventHandler> writers;
 };
 
 
@@ -199,6 +208,8 @@ bool Connection::hasProperty( Property p ) const
     case RecorderServer:
     case GraphDumper:
     case EGDServer:
+    case DnsClient:
+    case Workers:
         if ( p == Internal )
             return true;
         break;
@@ -367,6 +378,12 @@ EString Connection::description() const
     case ManageSieveServer:
         r = "ManageSieve server";
         break;
+    case DnsClient:
+        r = "DNS client";
+        break;
+    case Workers:
+        r = "Worker thread pool";
+        break;
     }
     Endpoint her = peer();
     Endpoint me = self();
@@ -568,6 +585,43 @@ void Connection::write()
         d->wbt = 0;
         d->wbs = 0;
     }
+
+    if ( !d->writers.isEmpty() && wbs < writeBufferLimit / 4 ) {
+        List<EventHandler> writers;
+        while ( !d->writers.isEmpty() )
+            writers.append( d->writers.shift() );
+        List<EventHandler>::Iterator i( writers );
+        while ( i ) {
+            i->notify();
+            ++i;
+        }
+    }
+}
+
+
+/*! Returns true if the write buffer holds so much that producers
+    should stop adding to it for a while, and false if there's room.
+
+    A producer which finds the buffer full can call
+    notifyWhenWritten() to learn when to continue.
+*/
+
+bool Connection::writeBufferFull() const
+{
+    return d->w && d->w->size() > writeBufferLimit;
+}
+
+
+/*! Records that \a h should be notified once most of the write
+    buffer has been written. \a h is notified only once, and only if
+    the connection stays valid until then.
+*/
+
+void Connection::notifyWhenWritten( EventHandler * h )
+{
+    if ( !h || d->writers.find( h ) )
+        return;
+    d->writers.append( h );
 }
 
 
@@ -990,6 +1044,112 @@ public:
 };
 
 
+// Connects host to the first of names that works, using a
+// SerialConnector for each if there's more than one. Returns -1 if
+// none of them is a valid connection target.
+//
+// The EventLoop drops connections without a file descriptor, so a
+// host which waited for DnsQuery is no longer in the loop. When there
+// are several names, substitute() adds the host again; with only one,
+// we must.
+
+static int connectToAny( Connection * host,
+                         const EStringList & names, uint port )
+{
+    if ( names.count() == 1 ) {
+        int r = host->connect( Endpoint( *names.firstElement(), port ) );
+        if ( host->valid() )
+            EventLoop::global()->addConnection( host );
+        return r;
+    }
+
+    List<SerialConnector> * l = new List<SerialConnector>;
+
+    EStringList::Iterator it( names );
+    while ( it ) {
+        EString name( *it );
+        Endpoint e( name, port );
+        if ( e.valid() )
+            l->append( new SerialConnector( host, l, e ) );
+        ++it;
+    }
+
+    if ( l->count() == 0 )
+        return -1;
+
+    l->first()->connect();
+    return 0;
+}
+
+
+// Gives host an Error event, as if all connection attempts had failed.
+
+static void failConnect( Connection * host )
+{
+    List<SerialConnector> * l = new List<SerialConnector>;
+    SerialConnector * sc = new SerialConnector( host, l, Endpoint() );
+    l->append( sc );
+    sc->connect();
+}
+
+
+// A ConnectResolver looks up the addresses of a domain name using
+// DnsQuery, and then connects its host just like connect() does for
+// names which need no lookup. If nothing can be found, the host gets
+// an Error event, as it would if all the connection attempts failed.
+
+class ConnectResolver
+    : public EventHandler
+{
+public:
+    ConnectResolver( Connection * c, const EString & address, uint p )
+        : host( c ), name( address ), port( p ), q4( 0 ), q6( 0 )
+    {
+        if ( Configuration::toggle( Configuration::UseIPv6 ) ) {
+            q6 = new DnsQuery( name, DnsQuery::Aaaa, this );
+            q6->execute();
+        }
+        if ( Configuration::toggle( Configuration::UseIPv4 ) ) {
+            q4 = new DnsQuery( name, DnsQuery::A, this );
+            q4->execute();
+        }
+        execute();
+    }
+
+    void execute()
+    {
+        if ( !host )
+            return;
+        if ( ( q4 && !q4->done() ) || ( q6 && !q6->done() ) )
+            return;
+
+        EStringList names;
+        if ( q6 )
+            names.append( q6->answers() );
+        if ( q4 )
+            names.append( q4->answers() );
+        Connection * c = host;
+        host = 0;
+        if ( connectToAny( c, names, port ) >= 0 )
+            return;
+
+        if ( q4 && q4->failed() )
+            c->log( q4->error(), Log::Error );
+        else if ( q6 && q6->failed() )
+            c->log( q6->error(), Log::Error );
+        else
+            c->log( "Found no address for " + name, Log::Error );
+        failConnect( c );
+    }
+
+    Connection * host;
+    EString name;
+    uint port;
+    DnsQuery * q4;
+    DnsQuery * q6;
+};
+
+
 /*! \overload
     This form of connect() takes an \a address (e.g. "localhost") and
     \a port instead of an Endpoint. It tries to resolve that address
@@ -1003,8 +1163,14 @@ public:
     one address), this function just calls the usual form of connect()
     on the result.
 
+    If \a address is a domain name, it is looked up using DnsQuery,
+    so this function returns before the connection attempts start.
+    The connection needs no file descriptor until then.
+
     Returns -1 on failure (i.e. the name could not be resolved to any
-    valid connection targets), and 0 on (temporary) success.
+    valid connection targets), and 0 on (temporary) success. In case
+    of failure, the caller is also sent an Error event, just as if the
+    name had been looked up using DnsQuery and then failed.
 
     This function disregards RFC 3484 completely, and instead issues
     many (partially concurrent) TCP connections. We think many
@@ -1015,26 +1181,34 @@ public:
 
 int Connection::connect( const EString & address, uint port )
 {
-    EStringList names( Resolver::resolve( address ) );
-    if ( names.count() == 1 )
-        return connect( Endpoint( address, port ) );
+    if ( address[0] != '/' && address.lower() != "localhost" &&
+         !Endpoint( address, port ).valid() ) {
+        (void)new ConnectResolver( this, address, port );
+        return 0;
+    }
 
-    List<SerialConnector> * l = new List<SerialConnector>;
+    int r = connectToAny( this, Resolver::resolve( address ), port );
+    if ( r < 0 )
+        failConnect( this );
+    return r;
+}
 
-    EStringList::Iterator it( names );
-    while ( it ) {
-        EString name( *it );
-        Endpoint e( name, port );
-        if ( e.valid() )
-            l->append( new SerialConnector( this, l, e ) );
-        ++it;
-    }
 
-    if ( l->count() == 0 )
-        return -1;
+/*! Connects to the first of \a addresses which answers on \a port,
+    trying them in order. This is for callers which have already
+    looked up the addresses, e.g. the MX hosts of a domain, and care
+    about the order.
 
-    l->first()->connect();
-    return 0;
+    Returns -1 and sends the caller an Error event if \a addresses
+    contains no usable address, and 0 otherwise.
+*/
+
+int Connection::connect( const EStringList & addresses, uint port )
+{
+    int r = connectToAny( this, addresses, port );
+    if ( r < 0 )
+        failConnect( this );
+    return r;
 }
 
 
@@ -8,6 +8,7 @@
 
 class User;
 class Buffer;
+class EStringList;
 
 
 class Connection
@@ -33,7 +34,9 @@ public:
         Listener,
         Pipe,
         ManageSieveServer,
-        LdapRelay
+        LdapRelay,
+        DnsClient,
+        Workers
     };
     Connection();
     Connection( int, Type );
@@ -72,6 +75,9 @@ public:
 
     void enqueue( const EString & );
 
+    bool writeBufferFull() const;
+    void notifyWhenWritten( class EventHandler * );
+
     enum Event { Error, Connect, Read, Timeout, Close, Shutdown };
     virtual void react( Event ) = 0;
 
@@ -80,6 +86,7 @@ public:
     int listen( const Endpoint &, bool );
     int connect( const Endpoint & );
     int connect( const EString &, uint );
+    int connect( const EStringList &, uint );
     int accept();
     static void setAny6ListensTo4( bool );
     static bool any6ListensTo4();
@@ -0,0 +1,808 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "dnsquery.h"
+
+#include "dict.h"
+#include "file.h"
+#include "event.h"
+#include "scope.h"
+#include "buffer.h"
+#include "entropy.h"
+#include "endpoint.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "connection.h"
+#include "configuration.h"
+
+// socket, send, recv
+#include <sys/types.h>
+#include <sys/socket.h>
+// IPPROTO_UDP, sockaddr_in, sockaddr_in6
+#include <netinet/in.h>
+// memset
+#include <string.h>
+// time
+#include <time.h>
+
+
+static const uint maxAttempts = 3;
+static const uint maxCacheSize = 4096;
+
+
+class DnsReply
+    : public Garbage
+{
+public:
+    DnsReply()
+        : id( 0 ), rcode( 0 ), truncated( false ), ok( false ),
+          ttl( 86400 ), negativeTtl( 300 )
+    {}
+
+    uint id;
+    uint rcode;
+    bool truncated;
+    bool ok;
+    uint ttl;
+    uint negativeTtl;
+    EStringList answers;
+};
+
+
+class DnsMx
+    : public Garbage
+{
+public:
+    DnsMx( uint p, const EString & n ): preference( p ), name( n ) {}
+
+    uint preference;
+    EString name;
+};
+
+
+class DnsCacheEntry
+    : public Garbage
+{
+public:
+    DnsCacheEntry(): answers( 0 ), expires( 0 ) {}
+
+    EStringList * answers;
+    uint expires;
+};
+
+
+class DnsQueryData
+    : public Garbage
+{
+public:
+    DnsQueryData()
+        : type( DnsQuery::A ), owner( 0 ),
+          done( false ), failed( false ), answers( 0 ),
+          ttl( 0 ), attempts( 0 ), id( 0 ), deadline( 0 )
+    {}
+
+    EString name;
+    DnsQuery::Type type;
+    EventHandler * owner;
+    bool done;
+    bool failed;
+    EString error;
+    EStringList * answers;
+    uint ttl;
+    uint attempts;
+    uint id;
+    uint deadline;
+};
+
+
+static Dict<DnsCacheEntry> * cache = 0;
+static uint cacheSize = 0;
+static List<Endpoint> * servers = 0;
+
+
+static uint byte( const EString & p, uint i )
+{
+    return (unsigned char)p[i];
+}
+
+
+static uint word( const EString & p, uint i )
+{
+    return ( byte( p, i ) << 8 ) + byte( p, i+1 );
+}
+
+
+/*! Reads a possibly compressed domain name from \a p at offset \a i,
+    advancing \a i past it. Sets \a ok to false if the name is bad.
+*/
+
+static EString readName( const EString & p, uint & i, bool & ok )
+{
+    EString r;
+    uint jumps = 0;
+    uint j = i;
+    bool jumped = false;
+    while ( ok ) {
+        if ( j >= p.length() ) {
+            ok = false;
+        }
+        else if ( byte( p, j ) == 0 ) {
+            j++;
+            break;
+        }
+        else if ( byte( p, j ) >= 192 ) {
+            uint target = word( p, j ) & 0x3fff;
+            if ( !jumped )
+                i = j + 2;
+            jumped = true;
+            if ( ++jumps > 64 || target >= p.length() )
+                ok = false;
+            j = target;
+        }
+        else if ( byte( p, j ) < 64 ) {
+            uint l = byte( p, j );
+            if ( j + 1 + l > p.length() ) {
+                ok = false;
+            }
+            else {
+                if ( !r.isEmpty() )
+                    r.append( '.' );
+                r.append( p.mid( j + 1, l ) );
+                j += 1 + l;
+            }
+        }
+        else {
+            ok = false;
+        }
+    }
+    if ( !jumped )
+        i = j;
+    return r.lower();
+}
+
+
+/*! Parses the DNS reply \a p, which should answer \a q. The result's
+    ok member is false unless \a p is a response to the question \a q
+    asked.
+*/
+
+static DnsReply * parseReply( const EString & p, DnsQuery * q )
+{
+    DnsReply * r = new DnsReply;
+    if ( p.length() < 12 )
+        return r;
+
+    r->id = word( p, 0 );
+    uint flags = word( p, 2 );
+    if ( !( flags & 0x8000 ) )
+        return r;
+    r->truncated = ( flags & 0x0200 ) != 0;
+    r->rcode = flags & 0x000f;
+    uint qdcount = word( p, 4 );
+    uint ancount = word( p, 6 );
+    uint nscount = word( p, 8 );
+
+    // the question must be the one we asked
+
+    bool ok = true;
+    uint i = 12;
+    if ( qdcount != 1 )
+        return r;
+    EString qname = readName( p, i, ok );
+    if ( !ok || i + 4 > p.length() ||
+         qname != q->name() || word( p, i ) != (uint)q->type() )
+        return r;
+    i += 4;
+    r->ok = true;
+    if ( r->truncated )
+        return r;
+
+    // collect the answers of the right type. MX answers are sorted
+    // by preference as we go.
+
+    List<DnsMx> mx;
+    while ( ancount && ok ) {
+        (void)readName( p, i, ok );
+        if ( !ok || i + 10 > p.length() )
+            break;
+        uint type = word( p, i );
+        uint cls = word( p, i+2 );
+        uint ttl = ( word( p, i+4 ) << 16 ) + word( p, i+6 );
+        uint rdlength = word( p, i+8 );
+        i += 10;
+        uint rdata = i;
+        if ( i + rdlength > p.length() )
+            break;
+        EString a;
+        if ( type != (uint)q->type() || cls != 1 ) {
+            // a CNAME, or something we didn't ask for
+        }
+        else if ( type == DnsQuery::A && rdlength == 4 ) {
+            a = fn( byte( p, i ) ) + "." + fn( byte( p, i+1 ) ) + "." +
+                fn( byte( p, i+2 ) ) + "." + fn( byte( p, i+3 ) );
+        }
+        else if ( type == DnsQuery::Aaaa && rdlength == 16 ) {
+            uint n = 0;
+            while ( n < 16 ) {
+                if ( !a.isEmpty() )
+                    a.append( ':' );
+                a.append( fn( word( p, i+n ), 16 ) );
+                n += 2;
+            }
+            Endpoint e( a, 1 );
+            a = e.valid() ? e.address() : "";
+        }
+        else if ( type == DnsQuery::Mx && rdlength > 2 ) {
+            uint j = i + 2;
+            EString name = readName( p, j, ok );
+            if ( ok && !name.isEmpty() ) {
+                DnsMx * m = new DnsMx( word( p, i ), name );
+                List<DnsMx>::Iterator x( mx );
+                while ( x && x->preference <= m->preference )
+                    ++x;
+                mx.insert( x, m );
+            }
+        }
+        else if ( type == DnsQuery::Txt ) {
+            uint j = i;
+            while ( j < i + rdlength ) {
+                uint l = byte( p, j );
+                a.append( p.mid( j + 1, l ) );
+                j += 1 + l;
+            }
+        }
+        if ( type == (uint)q->type() && cls == 1 ) {
+            if ( !a.isEmpty() )
+                r->answers.append( a );
+            if ( ttl < r->ttl )
+                r->ttl = ttl;
+        }
+        i = rdata + rdlength;
+        ancount--;
+    }
+
+    List<DnsMx>::Iterator x( mx );
+    while ( x ) {
+        r->answers.append( x->name );
+        ++x;
+    }
+
+    // a SOA in the authority section tells us how long a negative
+    // answer may be cached (RFC 2308)
+
+    while ( nscount && ok && r->answers.isEmpty() ) {
+        (void)readName( p, i, ok );
+        if ( !ok || i + 10 > p.length() )
+            break;
+        uint type = word( p, i );
+        uint ttl = ( word( p, i+4 ) << 16 ) + word( p, i+6 );
+        uint rdlength = word( p, i+8 );
+        i += 10;
+        if ( type == 6 ) {
+            uint j = i;
+            (void)readName( p, j, ok );
+            (void)readName( p, j, ok );
+            if ( ok && j + 20 <= p.length() ) {
+                uint minimum = ( word( p, j+16 ) << 16 ) + word( p, j+18 );
+                r->negativeTtl = minimum < ttl ? minimum : ttl;
+            }
+        }
+        i += rdlength;
+        nscount--;
+    }
+
+    return r;
+}
+
+
+class DnsTcpClient
+    : public Connection
+{
+public:
+    DnsTcpClient( const Endpoint & e, DnsQuery * query )
+        : Connection( Connection::socket( e.protocol() ),
+                      Connection::DnsClient ),
+          q( query )
+    {
+        setTimeoutAfter( 10 );
+        connect( e );
+        EventLoop::global()->addConnection( this );
+    }
+
+    DnsQuery * q;
+
+    void react( Event e )
+    {
+        switch ( e ) {
+        case Connect:
+            {
+                EString p = q->packet( q->d->id );
+                EString l;
+                l.append( (char)( p.length() >> 8 ) );
+                l.append( (char)( p.length() & 0xff ) );
+                enqueue( l + p );
+            }
+            break;
+
+        case Read:
+            {
+                Buffer * r = readBuffer();
+                if ( r->size() < 2 )
+                    return;
+                uint n = ( (unsigned char)(*r)[0] << 8 ) +
+                         (unsigned char)(*r)[1];
+                if ( r->size() < n + 2 )
+                    return;
+                r->remove( 2 );
+                EString p = r->string( n );
+                r->remove( n );
+                DnsReply * reply = parseReply( p, q );
+                if ( reply->ok && reply->id == q->d->id )
+                    q->finish( reply );
+                else
+                    q->fail( "Bad DNS reply via TCP for " + q->name() );
+                setState( Closing );
+            }
+            break;
+
+        case Timeout:
+        case Error:
+        case Close:
+            if ( !q->done() )
+                q->fail( "DNS lookup via TCP failed for " + q->name() );
+            setState( Closing );
+            break;
+
+        case Shutdown:
+            break;
+        }
+    }
+};
+
+
+// Binds the UDP socket fd to a random port, so that someone forging
+// replies has to guess the port as well as the query's ID. If a few
+// ports are taken, the kernel's choice will have to do.
+
+static void bindRandomPort( int fd, const Endpoint & server )
+{
+    uint attempts = 0;
+    while ( attempts < 8 ) {
+        uint port = 1024 + Entropy::asNumber( 2 ) % ( 65536 - 1024 );
+        int r;
+        if ( server.protocol() == Endpoint::IPv6 ) {
+            struct sockaddr_in6 a;
+            memset( &a, 0, sizeof( a ) );
+            a.sin6_family = AF_INET6;
+            a.sin6_addr = in6addr_any;
+            a.sin6_port = htons( port );
+            r = ::bind( fd, (struct sockaddr *)&a, sizeof( a ) );
+        }
+        else {
+            struct sockaddr_in a;
+            memset( &a, 0, sizeof( a ) );
+            a.sin_family = AF_INET;
+            a.sin_addr.s_addr = htonl( INADDR_ANY );
+            a.sin_port = htons( port );
+            r = ::bind( fd, (struct sockaddr *)&a, sizeof( a ) );
+        }
+        if ( r >= 0 )
+            return;
+        attempts++;
+    }
+}
+
+
+// Sends one attempt of a query via UDP. Each attempt gets a new
+// socket on a random port, which is closed when the reply arrives or
+// the attempt times out, so the source port can't be learned from
+// one query and used to spoof the next.
+
+class DnsClient
+    : public Connection
+{
+public:
+    DnsClient( const Endpoint & e, DnsQuery * query )
+        : Connection( ::socket( e.protocol() == Endpoint::IPv6
+                                ? AF_INET6 : AF_INET,
+                                SOCK_DGRAM, IPPROTO_UDP ),
+                      Connection::DnsClient ),
+          server( e ), q( query )
+    {
+        if ( !valid() ) {
+            q = 0;
+            query->fail( "Could not open a socket to look up " +
+                         query->name() );
+            return;
+        }
+        bindRandomPort( fd(), server );
+        connect( e );
+        EventLoop::global()->addConnection( this );
+        send();
+    }
+
+    Endpoint server;
+    DnsQuery * q;
+    EStringList datagrams;
+
+    // Each datagram is a separate reply, so we can't let Buffer glue
+    // them together.
+
+    void read()
+    {
+        char buffer[65536];
+        while ( valid() ) {
+            int n = ::recv( fd(), buffer, sizeof( buffer ), 0 );
+            if ( n < 0 )
+                break;
+            datagrams.append( new EString( buffer, n ) );
+        }
+    }
+
+    void send()
+    {
+        q->d->id = Entropy::asNumber( 2 ) & 0xffff;
+        q->d->attempts++;
+        q->d->deadline = (uint)time( 0 ) + 2 * q->d->attempts;
+        setTimeout( q->d->deadline );
+
+        EString p = q->packet( q->d->id );
+        if ( ::send( fd(), p.data(), p.length(), 0 ) < 0 )
+            log( "Could not send DNS query to " + server.string(),
+                 Log::Debug );
+    }
+
+    void react( Event e )
+    {
+        switch ( e ) {
+        case Read:
+            while ( q && !datagrams.isEmpty() )
+                handle( *datagrams.shift() );
+            break;
+
+        case Timeout:
+        case Error:
+        case Close:
+            close();
+            break;
+
+        case Connect:
+        case Shutdown:
+            break;
+        }
+    }
+
+    void handle( const EString & p )
+    {
+        if ( p.length() < 2 || word( p, 0 ) != q->d->id )
+            return;
+
+        DnsReply * r = parseReply( p, q );
+        if ( !r->ok )
+            return; // garbage or spoofed; keep waiting
+
+        DnsQuery * query = q;
+        q = 0;
+        close();
+        if ( r->truncated )
+            (void)new DnsTcpClient( server, query );
+        else if ( r->rcode == 2 || r->rcode == 4 || r->rcode == 5 )
+            query->retry();
+        else
+            query->finish( r );
+    }
+
+    void close()
+    {
+        if ( valid() )
+            Connection::close();
+        DnsQuery * query = q;
+        q = 0;
+        if ( query )
+            query->retry();
+    }
+};
+
+
+/*! \class DnsQuery dnsquery.h
+
+    The DnsQuery class looks up a domain name without blocking the
+    EventLoop.
+
+    It speaks DNS to the name servers directly, using a new UDP
+    socket on a random port for each attempt and falling back to TCP
+    for truncated replies, and it retries with the next server when
+    one doesn't answer. Answers are
+    cached for as long as their TTL permits, and negative answers
+    (NXDOMAIN and empty answers) for as long as the zone's SOA says.
+
+    Usage is like Query: Create a DnsQuery, call execute(), and the
+    owner is notified when the query is done(). If the answer is
+    cached, the query is done() when execute() returns, and the owner
+    isn't notified.
+
+    A query which failed() couldn't be completed, and should be retried
+    later. A query which is done() and not failed() but has no
+    answers() means that the name doesn't exist, or has no records of
+    the requested type.
+
+    Resolver serves the lookups needed before the server chroots;
+    DnsQuery is for everything later.
+*/
+
+
+/*! Constructs a query for records of \a type for \a name, which will
+    notify \a owner when it's done. Nothing happens until execute() is
+    called.
+*/
+
+DnsQuery::DnsQuery( const EString & name, Type type, EventHandler * owner )
+    : d( new DnsQueryData )
+{
+    d->name = name.lower();
+    if ( d->name.endsWith( "." ) )
+        d->name.truncate( d->name.length() - 1 );
+    d->type = type;
+    d->owner = owner;
+}
+
+
+/*! Starts the lookup, or answers it from the cache. */
+
+void DnsQuery::execute()
+{
+    if ( d->done || d->attempts )
+        return;
+
+    uint now = (uint)time( 0 );
+    EString key = fn( d->type ) + " " + d->name;
+    DnsCacheEntry * c = 0;
+    if ( ::cache )
+        c = ::cache->find( key );
+    if ( c && c->expires > now ) {
+        d->answers = c->answers;
+        d->ttl = c->expires - now;
+        d->done = true;
+        return;
+    }
+
+    bool ok = !d->name.isEmpty() && d->name.length() < 254;
+    EStringList::Iterator l( EStringList::split( '.', d->name ) );
+    while ( l && ok ) {
+        if ( l->isEmpty() || l->length() > 63 )
+            ok = false;
+        ++l;
+    }
+    if ( !ok ) {
+        d->done = true;
+        d->failed = true;
+        d->error = "Bad domain name: " + d->name;
+        return;
+    }
+
+    if ( !::servers )
+        setup();
+    retry();
+}
+
+
+/*! Returns true if this query has completed, whether it failed or
+    not, and false if it's still waiting for the name servers.
+*/
+
+bool DnsQuery::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if the lookup could not be completed, e.g. because
+    the name servers did not answer. A name which does not exist is
+    not a failure.
+*/
+
+bool DnsQuery::failed() const
+{
+    return d->failed;
+}
+
+
+/*! Returns a description of the error if failed() is true, and an
+    empty string otherwise.
+*/
+
+EString DnsQuery::error() const
+{
+    return d->error;
+}
+
+
+/*! Returns the name looked up, in lower case and without any
+    trailing dot.
+*/
+
+EString DnsQuery::name() const
+{
+    return d->name;
+}
+
+
+/*! Returns the record type looked up, as specified to the
+    constructor.
+*/
+
+DnsQuery::Type DnsQuery::type() const
+{
+    return d->type;
+}
+
+
+/*! Returns the answers found. For A and AAAA queries these are
+    addresses, for MX queries host names in order of preference, and
+    for TXT queries the text of each record.
+*/
+
+EStringList DnsQuery::answers() const
+{
+    if ( !d->answers )
+        return EStringList();
+    return *d->answers;
+}
+
+
+/*! Returns the number of seconds for which the answers() may be
+    used, or 0 if the query isn't done().
+*/
+
+uint DnsQuery::ttl() const
+{
+    return d->ttl;
+}
+
+
+/*! Finds the name servers to use: The dns-server configuration
+    variable if it's set, and otherwise those listed in
+    /etc/resolv.conf, which must be read before the server chroots.
+*/
+
+void DnsQuery::setup()
+{
+    if ( !::servers ) {
+        ::servers = new List<Endpoint>;
+        Allocator::addEternal( ::servers, "DNS servers" );
+    }
+    ::servers->clear();
+
+    uint port = Configuration::scalar( Configuration::DnsPort );
+    EString s = Configuration::text( Configuration::DnsServer );
+    if ( !s.isEmpty() ) {
+        Endpoint * e = new Endpoint( s, port );
+        if ( e->valid() )
+            ::servers->append( e );
+        else
+            ::log( "Cannot parse dns-server: " + s, Log::Error );
+    }
+    else {
+        File f( "/etc/resolv.conf" );
+        EStringList::Iterator l( f.lines() );
+        while ( l ) {
+            EString line = l->simplified();
+            if ( line.lower().startsWith( "nameserver " ) ) {
+                Endpoint * e = new Endpoint( line.section( " ", 2 ), port );
+                if ( e->valid() )
+                    ::servers->append( e );
+            }
+            ++l;
+        }
+    }
+
+    if ( ::servers->isEmpty() )
+        ::servers->append( new Endpoint( "127.0.0.1", port ) );
+}
+
+
+/*! Returns a DNS query packet for this query, with ID \a id. */
+
+EString DnsQuery::packet( uint id ) const
+{
+    EString p;
+    p.append( (char)( id >> 8 ) );
+    p.append( (char)( id & 0xff ) );
+    p.append( (char)1 ); // RD
+    p.append( (char)0 );
+    p.append( (char)0 ); // QDCOUNT
+    p.append( (char)1 );
+    uint i = 0;
+    while ( i < 6 ) {
+        p.append( (char)0 );
+        i++;
+    }
+    EStringList::Iterator l( EStringList::split( '.', d->name ) );
+    while ( l ) {
+        p.append( (char)l->length() );
+        p.append( *l );
+        ++l;
+    }
+    p.append( (char)0 );
+    p.append( (char)( d->type >> 8 ) );
+    p.append( (char)( d->type & 0xff ) );
+    p.append( (char)0 ); // IN
+    p.append( (char)1 );
+    return p;
+}
+
+
+/*! Sends this query (again) to the next name server, or gives up if
+    it has been tried often enough.
+*/
+
+void DnsQuery::retry()
+{
+    if ( d->attempts >= maxAttempts ) {
+        fail( "DNS lookup timed out for " + d->name );
+        return;
+    }
+
+    uint n = d->attempts % ::servers->count();
+    List<Endpoint>::Iterator e( ::servers );
+    uint j = 0;
+    while ( e && j < n ) {
+        ++e;
+        j++;
+    }
+    (void)new DnsClient( *e, this );
+}
+
+
+/*! Records the answers in \a r, caches them and notifies the owner. */
+
+void DnsQuery::finish( DnsReply * r )
+{
+    if ( r->rcode != 0 && r->rcode != 3 ) {
+        fail( "DNS server returned error " + fn( r->rcode ) +
+              " for " + d->name );
+        return;
+    }
+
+    d->answers = &r->answers;
+    d->ttl = r->answers.isEmpty() ? r->negativeTtl : r->ttl;
+    if ( r->answers.isEmpty() && d->ttl > 3600 )
+        d->ttl = 3600;
+    else if ( d->ttl > 86400 )
+        d->ttl = 86400;
+
+    if ( !::cache || ::cacheSize >= maxCacheSize ) {
+        if ( !::cache ) {
+            ::cache = new Dict<DnsCacheEntry>;
+            Allocator::addEternal( ::cache, "DNS cache" );
+        }
+        ::cache->clear();
+        ::cacheSize = 0;
+    }
+    EString key = fn( d->type ) + " " + d->name;
+    DnsCacheEntry * c = new DnsCacheEntry;
+    c->answers = d->answers;
+    c->expires = (uint)time( 0 ) + d->ttl;
+    if ( !::cache->contains( key ) )
+        ::cacheSize++;
+    ::cache->insert( key, c );
+
+    d->done = true;
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+/*! Records that this query failed with \a error and notifies the
+    owner. Failures are not cached.
+*/
+
+void DnsQuery::fail( const EString & error )
+{
+    if ( d->done )
+        return;
+    d->done = true;
+    d->failed = true;
+    d->error = error;
+    if ( d->owner )
+        d->owner->notify();
+}
@@ -0,0 +1,45 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DNSQUERY_H
+#define DNSQUERY_H
+
+#include "estringlist.h"
+
+
+class EventHandler;
+
+
+class DnsQuery
+    : public Garbage
+{
+public:
+    enum Type { A = 1, Mx = 15, Txt = 16, Aaaa = 28 };
+
+    DnsQuery( const EString &, Type, EventHandler * );
+
+    void execute();
+
+    bool done() const;
+    bool failed() const;
+    EString error() const;
+
+    EString name() const;
+    Type type() const;
+    EStringList answers() const;
+    uint ttl() const;
+
+    static void setup();
+
+private:
+    class DnsQueryData * d;
+    friend class DnsClient;
+    friend class DnsTcpClient;
+
+    EString packet( uint ) const;
+    void retry();
+    void finish( class DnsReply * );
+    void fail( const EString & );
+};
+
+
+#endif
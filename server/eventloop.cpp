@@ -3,12 +3,14 @@
 #include "eventloop.h"
 
 #include "connection.h"
+#include "configuration.h"
 #include "allocator.h"
 #include "buffer.h"
 #include "estring.h"
 #include "server.h"
 #include "scope.h"
 #include "timer.h"
+#include "workpool.h"
 #include "graph.h"
 #include "event.h"
 #include "list.h"
@@ -45,7 +47,7 @@ class LoopData
 public:
     LoopData()
         : log( new Log ), startup( false ),
-          stop( false ), limit( 16 * 1024 * 1024 )
+          stop( false ), limit( 16 * 1024 * 1024 ), workPool( 0 )
     {}
 
     Log *log;
@@ -54,6 +56,7 @@ public:
     List< Connection > connections;
     List< Timer > timers;
     uint limit;
+    WorkPool * workPool;
 
     class Stopper
         : public EventHandler
@@ -717,6 +720,8 @@ void EventLoop::setConnectionCounts()
         case Connection::RecorderClient:
         case Connection::RecorderServer:
         case Connection::Pipe:
+        case Connection::DnsClient:
+        case Connection::Workers:
             internal++;
             break;
         case Connection::DatabaseClient:
@@ -813,3 +818,21 @@ uint EventLoop::memoryUsage() const
 {
     return d->limit;
 }
+
+
+/*! Returns the WorkPool attached to this event loop, creating it with
+    as many threads as the worker-threads configuration variable
+    specifies if necessary.
+
+    The pool is created on first use rather than at startup, so that
+    its threads belong to the process which uses them, not to a
+    process which then forks.
+*/
+
+WorkPool * EventLoop::workPool()
+{
+    if ( !d->workPool )
+        d->workPool = new WorkPool(
+            Configuration::scalar( Configuration::WorkerThreads ) );
+    return d->workPool;
+}
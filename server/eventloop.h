@@ -50,6 +50,8 @@ public:
 
     virtual void freeMemory();
 
+    class WorkPool * workPool();
+
 private:
     class LoopData *d;
 };
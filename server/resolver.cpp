@@ -45,6 +45,9 @@ public:
     remains empty, all is well and remains well until the end of the
     process.
 
+    Resolver blocks while it waits for the DNS server, so it should
+    only be used during startup. Later lookups should use DnsQuery.
+
     We need a class called Revolver.
 */
 
@@ -0,0 +1,1210 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "searchindex.h"
+
+#include "map.h"
+#include "list.h"
+#include "file.h"
+#include "timer.h"
+#include "event.h"
+#include "estring.h"
+#include "ustring.h"
+#include "mailbox.h"
+#include "workpool.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "query.h"
+#include "integerset.h"
+#include "configuration.h"
+#include "log.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+
+// documents larger than this are left to the database
+static const uint maxDocumentSize = 4 * 1024 * 1024;
+// write a segment when this many trigrams are pending for a user
+static const uint maxPendingTrigrams = 4 * 1024 * 1024;
+// compact when a user has this many segments
+static const uint compactionThreshold = 8;
+// and merge at most this many postings at a time
+static const uint maxCompactionPostings = 32 * 1024 * 1024;
+// how long to wait before writing pending documents
+static const uint flushDelay = 15;
+
+static const char magic[8] = { 'A', 'O', 'X', 'S', 'I', '0', '1', '\n' };
+
+typedef unsigned long long Posting;
+
+
+class SearchSegment
+    : public Garbage
+{
+public:
+    SearchSegment()
+        : Garbage(), base( 0 ), size( 0 ), docs( 0 ), grams( 0 ),
+          mailboxes( 0 ), uids( 0 ), table( 0 ), postings( 0 ),
+          npostings( 0 )
+    {}
+
+    EString name;
+    const char * base;
+    uint size;
+    uint docs;
+    uint grams;
+    const uint * mailboxes;
+    const uint * uids;
+    const uint * table;
+    const uint * postings;
+    uint npostings;
+    Map<IntegerSet> coverage;
+
+    const uint * find( uint, uint & ) const;
+    IntegerSet * covered( uint );
+};
+
+
+class PendingDocument
+    : public Garbage
+{
+public:
+    PendingDocument(): Garbage(), mailbox( 0 ), uid( 0 ), n( 0 ), grams( 0 ) {}
+
+    uint mailbox;
+    uint uid;
+    uint n;
+    uint * grams;
+};
+
+
+// The parts of a segment which a SearchIndexJob merges, copied so
+// that the worker thread needn't look at the SearchSegment.
+
+class SegmentSource
+    : public Garbage
+{
+public:
+    SegmentSource( const SearchSegment * s )
+        : Garbage(), docs( s->docs ), grams( s->grams ),
+          mailboxes( s->mailboxes ), uids( s->uids ),
+          table( s->table ), postings( s->postings )
+    {}
+
+    uint docs;
+    uint grams;
+    const uint * mailboxes;
+    const uint * uids;
+    const uint * table;
+    const uint * postings;
+};
+
+
+// Sorts the postings and writes a segment on a worker thread. For
+// compaction, it first merges the sources, dropping the documents
+// which aren't live.
+
+class SearchIndexJob
+    : public WorkItem
+{
+public:
+    SearchIndexJob( EventHandler * owner )
+        : WorkItem( owner ), docs( 0 ), mailboxes( 0 ), uids( 0 ),
+          p( 0 ), n( 0 ), live( 0 ), nlive( 0 ), dropped( 0 ),
+          ok( false )
+    {}
+
+    void work();
+    void merge();
+
+    EString tmp;
+    EString seg;
+    uint docs;
+    uint * mailboxes;
+    uint * uids;
+    Posting * p;
+    uint n;
+
+    List<SegmentSource> sources;
+    Posting * live;
+    uint nlive;
+    uint dropped;
+
+    bool ok;
+};
+
+
+class SearchIndexWatcher
+    : public EventHandler
+{
+public:
+    SearchIndexWatcher( SearchIndex * index )
+        : EventHandler(), i( index ) {
+        setLog( new Log );
+    }
+
+    void execute() {
+        i->finish();
+    }
+
+    SearchIndex * i;
+};
+
+
+class SearchIndexData
+    : public Garbage
+{
+public:
+    SearchIndexData()
+        : user( 0 ), mtime( 0 ), scanned( false ), pendingGrams( 0 ),
+          watcher( 0 ), job( 0 ), live( 0 ), keys( 0 ), nkeys( 0 ),
+          lock( -1 )
+    {}
+
+    uint user;
+    EString dir;
+    uint mtime;
+    bool scanned;
+    List<SearchSegment> segments;
+    List<PendingDocument> pending;
+    uint pendingGrams;
+
+    SearchIndexWatcher * watcher;
+    SearchIndexJob * job;
+    List<PendingDocument> writing;
+
+    // while compacting: the segments being merged, those of them
+    // refresh() has seen disappear, the query for live messages, the
+    // keys it has returned so far, and the lock file
+    List<SearchSegment> chosen;
+    List<SearchSegment> retired;
+    Query * live;
+    Posting * keys;
+    uint nkeys;
+    int lock;
+};
+
+
+class SearchIndexFlusher
+    : public EventHandler
+{
+public:
+    SearchIndexFlusher(): EventHandler(), t( 0 ) {
+        setLog( new Log );
+    }
+
+    void schedule() {
+        if ( !t )
+            t = new Timer( this, flushDelay );
+    }
+
+    void execute() {
+        t = 0;
+        SearchIndex::flush( false );
+    }
+
+    Timer * t;
+};
+
+
+static Map<SearchIndex> * indexes;
+static List<SearchIndex> * all;
+static SearchIndexFlusher * flusher;
+static uint sequence;
+
+
+static int compareUints( const void * a, const void * b )
+{
+    uint x = *(const uint *)a;
+    uint y = *(const uint *)b;
+    if ( x < y )
+        return -1;
+    if ( x > y )
+        return 1;
+    return 0;
+}
+
+
+static int comparePostings( const void * a, const void * b )
+{
+    Posting x = *(const Posting *)a;
+    Posting y = *(const Posting *)b;
+    if ( x < y )
+        return -1;
+    if ( x > y )
+        return 1;
+    return 0;
+}
+
+
+/*! Returns the sorted, unique trigrams in \a s, with ASCII letters
+    folded to lower case, and sets \a n to their number. The array is
+    allocated with Allocator::alloc() and may be 0 if \a n is 0.
+*/
+
+static uint * trigrams( const EString & s, uint & n )
+{
+    n = 0;
+    if ( s.length() < 3 )
+        return 0;
+
+    uint * r = (uint *)Allocator::alloc( sizeof(uint) * (s.length()-2), 0 );
+    uint g = 0;
+    uint i = 0;
+    while ( i < s.length() ) {
+        char c = s[i];
+        if ( c >= 'A' && c <= 'Z' )
+            c = c - 'A' + 'a';
+        g = ( ( g << 8 ) | (uint)c ) & 0xffffff;
+        i++;
+        if ( i >= 3 )
+            r[n++] = g;
+    }
+
+    qsort( r, n, sizeof(uint), compareUints );
+    uint u = 0;
+    i = 0;
+    while ( i < n ) {
+        if ( !u || r[u-1] != r[i] )
+            r[u++] = r[i];
+        i++;
+    }
+    n = u;
+    return r;
+}
+
+
+/*! Returns a pointer to the postings for trigram \a g, and sets \a n
+    to their number. Returns 0 if there are none.
+*/
+
+const uint * SearchSegment::find( uint g, uint & n ) const
+{
+    n = 0;
+    uint lo = 0;
+    uint hi = grams;
+    while ( lo < hi ) {
+        uint m = ( lo + hi ) / 2;
+        uint k = table[m*3];
+        if ( k < g ) {
+            lo = m + 1;
+        }
+        else if ( k > g ) {
+            hi = m;
+        }
+        else {
+            n = table[m*3+2];
+            return postings + table[m*3+1];
+        }
+    }
+    return 0;
+}
+
+
+/*! Returns the set of UIDs this segment contains for \a mailbox. */
+
+IntegerSet * SearchSegment::covered( uint mailbox )
+{
+    IntegerSet * s = coverage.find( mailbox );
+    if ( s )
+        return s;
+    s = new IntegerSet;
+    uint i = 0;
+    while ( i < docs ) {
+        if ( mailboxes[i] == mailbox )
+            s->add( uids[i] );
+        i++;
+    }
+    coverage.insert( mailbox, s );
+    return s;
+}
+
+
+/*! Maps the segment file \a name in \a dir and returns a
+    SearchSegment describing it, or 0 if the file isn't a valid
+    segment.
+*/
+
+static SearchSegment * load( const EString & dir, const EString & name )
+{
+    EString fn = File::chrooted( dir + "/" + name );
+    int fd = ::open( fn.cstr(), O_RDONLY );
+    if ( fd < 0 )
+        return 0;
+
+    struct stat st;
+    if ( fstat( fd, &st ) < 0 || st.st_size < 16 ) {
+        ::close( fd );
+        return 0;
+    }
+
+    void * p = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    ::close( fd );
+    if ( p == MAP_FAILED )
+        return 0;
+
+    SearchSegment * s = new SearchSegment;
+    s->name = name;
+    s->base = (const char *)p;
+    s->size = st.st_size;
+
+    const uint * h = (const uint *)( s->base + 8 );
+    s->docs = h[0];
+    s->grams = h[1];
+    uint words = ( s->size - 16 ) / sizeof(uint);
+    if ( memcmp( s->base, magic, 8 ) ||
+         (Posting)s->docs * 2 + (Posting)s->grams * 3 > words ) {
+        munmap( p, s->size );
+        return 0;
+    }
+    s->mailboxes = h + 2;
+    s->uids = s->mailboxes + s->docs;
+    s->table = s->uids + s->docs;
+    s->postings = s->table + s->grams * 3;
+    s->npostings = words - s->docs * 2 - s->grams * 3;
+
+    uint i = 0;
+    while ( i < s->grams ) {
+        if ( (Posting)s->table[i*3+1] + s->table[i*3+2] > s->npostings ) {
+            munmap( p, s->size );
+            return 0;
+        }
+        i++;
+    }
+    return s;
+}
+
+
+/*! Sets \a tmp and \a seg to the chrooted names of a new temporary
+    file and a new segment in \a dir.
+*/
+
+static void segmentNames( const EString & dir, EString & tmp, EString & seg )
+{
+    EString suffix;
+    suffix.appendNumber( (uint)getpid() );
+    suffix.append( "-" );
+    suffix.appendNumber( ++::sequence );
+    tmp = File::chrooted( dir + "/tmp-" + suffix );
+    seg = dir + "/seg-";
+    seg.appendNumber( (uint)time( 0 ) );
+    seg.append( "-" );
+    seg.append( suffix );
+    seg = File::chrooted( seg );
+    // terminate both now, so cstr() needn't allocate on the worker
+    tmp.cstr();
+    seg.cstr();
+}
+
+
+/*! Writes a segment with \a docs documents, whose mailboxes and UIDs
+    are in \a mailboxes and \a uids, and the \a n trigram postings in
+    \a p (which must be sorted) to \a tmp, and renames it to \a
+    seg. Returns true if all went well.
+
+    This is called on a worker thread, so it uses malloc() rather than
+    Allocator.
+*/
+
+static bool writeSegment( const EString & tmp, const EString & seg,
+                          uint docs,
+                          const uint * mailboxes, const uint * uids,
+                          const Posting * p, uint n )
+{
+    uint grams = 0;
+    uint i = 0;
+    while ( i < n ) {
+        if ( !i || ( p[i] >> 32 ) != ( p[i-1] >> 32 ) )
+            grams++;
+        i++;
+    }
+
+    uint words = 2 + docs * 2 + grams * 3 + n;
+    uint * buf = (uint *)malloc( 8 + words * sizeof(uint) );
+    if ( !buf )
+        return false;
+    memcpy( buf, magic, 8 );
+    uint * w = buf + 2;
+    w[0] = docs;
+    w[1] = grams;
+    memcpy( w + 2, mailboxes, docs * sizeof(uint) );
+    memcpy( w + 2 + docs, uids, docs * sizeof(uint) );
+    uint * table = w + 2 + docs * 2;
+    uint * postings = table + grams * 3;
+    uint g = 0;
+    i = 0;
+    while ( i < n ) {
+        uint k = (uint)( p[i] >> 32 );
+        if ( !i || k != table[(g-1)*3] ) {
+            table[g*3] = k;
+            table[g*3+1] = i;
+            table[g*3+2] = 0;
+            g++;
+        }
+        table[(g-1)*3+2]++;
+        postings[i] = (uint)p[i];
+        i++;
+    }
+
+    bool ok = false;
+    int fd = ::open( tmp.cstr(), O_WRONLY|O_CREAT|O_EXCL, 0600 );
+    if ( fd >= 0 ) {
+        const char * b = (const char *)buf;
+        uint size = 8 + words * sizeof(uint);
+        uint done = 0;
+        while ( done < size ) {
+            int r = ::write( fd, b + done, size - done );
+            if ( r < 0 && errno == EINTR )
+                continue;
+            if ( r <= 0 )
+                break;
+            done += r;
+        }
+        ok = ( done == size );
+        if ( ::close( fd ) < 0 )
+            ok = false;
+        if ( ok && ::rename( tmp.cstr(), seg.cstr() ) < 0 )
+            ok = false;
+        if ( !ok )
+            ::unlink( tmp.cstr() );
+    }
+    free( buf );
+    return ok;
+}
+
+
+/*! Merges the sources into one list of documents and postings,
+    leaving out the documents whose (mailbox, uid) isn't in the sorted
+    live list.
+*/
+
+void SearchIndexJob::merge()
+{
+    uint total = 0;
+    uint postings = 0;
+    List<SegmentSource>::Iterator s( sources );
+    while ( s ) {
+        total += s->docs;
+        uint g = 0;
+        while ( g < s->grams )
+            postings += s->table[g++*3+2];
+        ++s;
+    }
+
+    mailboxes = (uint *)malloc( ( total + 1 ) * sizeof(uint) );
+    uids = (uint *)malloc( ( total + 1 ) * sizeof(uint) );
+    p = (Posting *)malloc( ( postings + 1 ) * sizeof(Posting) );
+    uint * map = (uint *)malloc( ( total + 1 ) * sizeof(uint) );
+    if ( !mailboxes || !uids || !p || !map ) {
+        free( map );
+        return;
+    }
+
+    s = sources.first();
+    while ( s ) {
+        uint i = 0;
+        while ( i < s->docs ) {
+            Posting k = ( (Posting)s->mailboxes[i] << 32 ) | s->uids[i];
+            if ( bsearch( &k, live, nlive, sizeof(Posting),
+                          comparePostings ) ) {
+                map[i] = docs;
+                mailboxes[docs] = s->mailboxes[i];
+                uids[docs] = s->uids[i];
+                docs++;
+            }
+            else {
+                map[i] = UINT_MAX;
+                dropped++;
+            }
+            i++;
+        }
+        uint g = 0;
+        while ( g < s->grams ) {
+            Posting k = (Posting)s->table[g*3] << 32;
+            const uint * o = s->postings + s->table[g*3+1];
+            uint c = s->table[g*3+2];
+            uint j = 0;
+            while ( j < c ) {
+                if ( o[j] < s->docs && map[o[j]] != UINT_MAX )
+                    p[n++] = k | map[o[j]];
+                j++;
+            }
+            g++;
+        }
+        ++s;
+    }
+    free( map );
+    ok = true;
+}
+
+
+void SearchIndexJob::work()
+{
+    ok = sources.isEmpty();
+    if ( !ok )
+        merge();
+    if ( ok && docs ) {
+        qsort( p, n, sizeof(Posting), comparePostings );
+        ok = writeSegment( tmp, seg, docs, mailboxes, uids, p, n );
+    }
+    free( mailboxes );
+    free( uids );
+    free( p );
+    free( live );
+    mailboxes = 0;
+    uids = 0;
+    p = 0;
+    live = 0;
+}
+
+
+/*! \class SearchIndex searchindex.h
+
+    The SearchIndex class maintains an optional per-user search index
+    outside the database, so that body and header searches need not
+    touch the bodyparts shared with every other user.
+
+    Each user's index lives in a subdirectory of
+    search-index-directory and consists of immutable segment files,
+    which are memory-mapped when used. A segment holds a list of
+    (mailbox, uid) documents and, for each trigram of the documents'
+    (ASCII case-folded, UTF-8) text, a sorted posting list of the
+    documents containing it.
+
+    The Injector calls add() for each new message after its
+    transaction commits. The trigrams are kept in RAM for a few
+    seconds and then written as a new segment. When a user has too
+    many segments, the smaller ones are merged, and messages which
+    are no longer in mailbox_messages are left out of the merged
+    segment. Each process writes its own segments; a lock file
+    ensures that only one process compacts a given user's index at a
+    time.
+
+    Sorting, merging and writing are done on the WorkPool's threads,
+    so the event loop never waits for the disk. Each index has at
+    most one such job at a time.
+
+    Selector calls candidates() to learn which messages may match a
+    search. The index only narrows the search: the database still
+    checks each candidate, and messages the index doesn't cover (those
+    injected while the index was disabled, those not yet written, or
+    those too large to index) are always left to the database. Thus
+    the index never makes a search wrong, only faster. Expunged
+    messages remain in the segments until the next compaction; they
+    are harmless, since the database doesn't find them.
+*/
+
+
+/*! Constructs an empty index for the user with id \a user. */
+
+SearchIndex::SearchIndex( uint user )
+    : d( new SearchIndexData )
+{
+    d->user = user;
+    d->dir = Configuration::text( Configuration::SearchIndexDir );
+    d->dir.append( "/" );
+    d->dir.appendNumber( user );
+    d->watcher = new SearchIndexWatcher( this );
+}
+
+
+/*! Returns true if search-index-directory is set, and false if the
+    search index is not used.
+*/
+
+bool SearchIndex::enabled()
+{
+    return !Configuration::text( Configuration::SearchIndexDir ).isEmpty();
+}
+
+
+/*! Returns the index for user \a user, creating it if \a create is
+    true. Returns 0 if there is no such index and \a create is false.
+*/
+
+SearchIndex * SearchIndex::find( uint user, bool create )
+{
+    if ( !::indexes ) {
+        if ( !create )
+            return 0;
+        ::indexes = new Map<SearchIndex>;
+        Allocator::addEternal( ::indexes, "search indexes" );
+        ::all = new List<SearchIndex>;
+        Allocator::addEternal( ::all, "search indexes" );
+    }
+    SearchIndex * i = ::indexes->find( user );
+    if ( !i && create ) {
+        i = new SearchIndex( user );
+        ::indexes->insert( user, i );
+        ::all->append( i );
+    }
+    return i;
+}
+
+
+/*! Records that the message \a uid in \a mailbox contains \a text,
+    which must be UTF-8. The trigrams are written to disk a little
+    later. Does nothing unless the search index is enabled and \a
+    mailbox belongs to a user.
+*/
+
+void SearchIndex::add( Mailbox * mailbox, uint uid, const EString & text )
+{
+    if ( mailbox )
+        add( mailbox->owner(), mailbox->id(), uid, text );
+}
+
+
+/*! Records that the message \a uid in the mailbox with id \a mailbox,
+    which belongs to \a user, contains \a text. This is the same as
+    the other add(), for callers which have only the ids.
+*/
+
+void SearchIndex::add( uint user, uint mailbox, uint uid,
+                       const EString & text )
+{
+    if ( !enabled() || !mailbox || !user )
+        return;
+    if ( text.length() > maxDocumentSize )
+        return;
+
+    PendingDocument * p = new PendingDocument;
+    p->mailbox = mailbox;
+    p->uid = uid;
+    p->grams = trigrams( text, p->n );
+
+    SearchIndex * i = find( user, true );
+    i->d->pending.append( p );
+    i->d->pendingGrams += p->n;
+    if ( i->d->pendingGrams > maxPendingTrigrams )
+        i->write();
+
+    if ( !::flusher ) {
+        ::flusher = new SearchIndexFlusher;
+        Allocator::addEternal( ::flusher, "search index flusher" );
+    }
+    ::flusher->schedule();
+}
+
+
+/*! Adds the documents in \a l which belong to \a mailbox to \a
+    covered, and those which contain all \a n \a grams to \a matches.
+*/
+
+static void scan( List<PendingDocument> * l, uint mailbox,
+                  const uint * grams, uint n,
+                  IntegerSet & matches, IntegerSet & covered )
+{
+    List<PendingDocument>::Iterator p( l );
+    while ( p ) {
+        if ( p->mailbox == mailbox ) {
+            covered.add( p->uid );
+            uint g = 0;
+            while ( g < n &&
+                    bsearch( &grams[g], p->grams, p->n, sizeof(uint),
+                             compareUints ) )
+                g++;
+            if ( g == n )
+                matches.add( p->uid );
+        }
+        ++p;
+    }
+}
+
+
+/*! Looks for messages in \a mailbox which may contain \a text. Adds
+    those to \a matches, and adds every message the index knows about
+    to \a covered. Any message not in \a covered may or may not match.
+
+    Returns false if the index cannot help (e.g. because \a text is
+    too short, isn't ASCII, or because there is no index for \a
+    mailbox's owner), and true if it can.
+*/
+
+bool SearchIndex::candidates( Mailbox * mailbox, const UString & text,
+                              IntegerSet & matches, IntegerSet & covered )
+{
+    if ( !mailbox )
+        return false;
+    return candidates( mailbox->owner(), mailbox->id(), text,
+                       matches, covered );
+}
+
+
+/*! Looks for messages in the mailbox with id \a id, which belongs to
+    \a user, as the other candidates() does.
+*/
+
+bool SearchIndex::candidates( uint user, uint id, const UString & text,
+                              IntegerSet & matches, IntegerSet & covered )
+{
+    if ( !enabled() || !id || !user )
+        return false;
+    if ( !text.isAscii() || text.length() < 3 )
+        return false;
+
+    uint n = 0;
+    uint * grams = trigrams( text.ascii(), n );
+    if ( !n )
+        return false;
+
+    SearchIndex * i = find( user, true );
+    i->refresh();
+    if ( i->d->segments.isEmpty() && i->d->pending.isEmpty() &&
+         i->d->writing.isEmpty() )
+        return false;
+
+    List<SearchSegment>::Iterator s( i->d->segments );
+    while ( s ) {
+        covered.add( *s->covered( id ) );
+
+        // intersect the posting lists, starting with the shortest
+        uint shortest = 0;
+        uint min = UINT_MAX;
+        uint g = 0;
+        while ( g < n && min ) {
+            uint c = 0;
+            s->find( grams[g], c );
+            if ( c < min ) {
+                min = c;
+                shortest = g;
+            }
+            g++;
+        }
+        if ( min ) {
+            uint c = 0;
+            const uint * p = s->find( grams[shortest], c );
+            uint * r = (uint *)Allocator::alloc( sizeof(uint) * c, 0 );
+            memcpy( r, p, sizeof(uint) * c );
+            g = 0;
+            while ( g < n && c ) {
+                if ( g != shortest ) {
+                    uint m = 0;
+                    const uint * o = s->find( grams[g], m );
+                    uint a = 0;
+                    uint b = 0;
+                    uint k = 0;
+                    while ( a < c && b < m ) {
+                        if ( r[a] < o[b] )
+                            a++;
+                        else if ( r[a] > o[b] )
+                            b++;
+                        else
+                            r[k++] = r[a++];
+                    }
+                    c = k;
+                }
+                g++;
+            }
+            uint k = 0;
+            while ( k < c ) {
+                if ( r[k] < s->docs && s->mailboxes[r[k]] == id )
+                    matches.add( s->uids[r[k]] );
+                k++;
+            }
+        }
+        ++s;
+    }
+
+    scan( &i->d->pending, id, grams, n, matches, covered );
+    scan( &i->d->writing, id, grams, n, matches, covered );
+
+    return true;
+}
+
+
+/*! Finds the messages among \a messages, in the mailbox with id \a
+    id belonging to \a user, which a search for \a text must look at,
+    and puts them in \a restriction. Those are the ones the index
+    thinks may match, and those it doesn't know about.
+
+    Returns false if the index can't narrow the search enough to be
+    worth it, and true if it can. Messages with UIDs above
+    messages.largest() aren't in \a messages, so the caller must still
+    search those whatever the index says. Selector does that.
+*/
+
+bool SearchIndex::restrict( uint user, uint id, const UString & text,
+                            const IntegerSet & messages,
+                            IntegerSet & restriction )
+{
+    IntegerSet matches;
+    IntegerSet covered;
+    if ( messages.isEmpty() ||
+         !candidates( user, id, text, matches, covered ) )
+        return false;
+
+    restriction = messages;
+    restriction.remove( covered );
+    restriction.add( matches.intersection( messages ) );
+    return restriction.count() * 2 <= messages.count();
+}
+
+
+/*! Writes the pending documents of each index to disk. If \a
+    compaction is true, also compacts each index that has grown too
+    many segments, otherwise leaves that for later.
+*/
+
+void SearchIndex::flush( bool compaction )
+{
+    if ( !::all )
+        return;
+    List<SearchIndex>::Iterator i( ::all );
+    while ( i ) {
+        i->write();
+        if ( compaction )
+            i->compact();
+        ++i;
+    }
+}
+
+
+/*! Makes sure the list of segments matches what's on disk. Since
+    segments are immutable, only added and removed files need
+    attention.
+*/
+
+void SearchIndex::refresh()
+{
+    EString dir = File::chrooted( d->dir );
+    struct stat st;
+    if ( stat( dir.cstr(), &st ) < 0 ) {
+        d->scanned = true;
+        d->segments.clear();
+        return;
+    }
+
+    // rescan if the directory changed, or may have changed within
+    // the same second as our last look.
+    uint now = time( 0 );
+    if ( d->scanned && (uint)st.st_mtime == d->mtime &&
+         now > d->mtime + 1 )
+        return;
+    d->scanned = true;
+    d->mtime = st.st_mtime;
+
+    DIR * dp = opendir( dir.cstr() );
+    if ( !dp )
+        return;
+
+    List<SearchSegment> segments;
+    struct dirent * de;
+    while ( (de=readdir( dp )) != 0 ) {
+        EString name( de->d_name );
+        if ( !name.startsWith( "seg-" ) )
+            continue;
+        List<SearchSegment>::Iterator s( d->segments );
+        while ( s && s->name != name )
+            ++s;
+        if ( s ) {
+            segments.append( d->segments.take( s ) );
+        }
+        else {
+            SearchSegment * n = load( d->dir, name );
+            if ( n )
+                segments.append( n );
+        }
+    }
+    closedir( dp );
+
+    // whatever's left has been removed by compaction. if we are
+    // compacting, the job may still be reading it.
+    List<SearchSegment>::Iterator s( d->segments );
+    while ( s ) {
+        if ( d->chosen.find( s ) )
+            d->retired.append( s );
+        else
+            munmap( (void *)s->base, s->size );
+        ++s;
+    }
+    d->segments.clear();
+    s = segments.first();
+    while ( s ) {
+        d->segments.append( s );
+        ++s;
+    }
+}
+
+
+/*! Hands all pending documents to a SearchIndexJob, which writes them
+    as a new segment. Does nothing while another job or a compaction
+    is under way; finish() calls write() again when it's done.
+*/
+
+void SearchIndex::write()
+{
+    if ( d->pending.isEmpty() || d->job || d->live )
+        return;
+
+    ::mkdir( File::chrooted( d->dir ).cstr(), 0700 );
+
+    SearchIndexJob * j = new SearchIndexJob( d->watcher );
+    j->docs = d->pending.count();
+    j->mailboxes = (uint *)malloc( j->docs * sizeof(uint) );
+    j->uids = (uint *)malloc( j->docs * sizeof(uint) );
+    j->p = (Posting *)malloc( ( d->pendingGrams + 1 ) * sizeof(Posting) );
+    if ( !j->mailboxes || !j->uids || !j->p ) {
+        free( j->mailboxes );
+        free( j->uids );
+        free( j->p );
+        ::log( "Out of memory while writing search index for user " +
+               fn( d->user ), Log::Error );
+        return;
+    }
+
+    uint doc = 0;
+    List<PendingDocument>::Iterator i( d->pending );
+    while ( i ) {
+        j->mailboxes[doc] = i->mailbox;
+        j->uids[doc] = i->uid;
+        uint g = 0;
+        while ( g < i->n )
+            j->p[j->n++] = ( (Posting)i->grams[g++] << 32 ) | doc;
+        doc++;
+        d->writing.append( i );
+        ++i;
+    }
+    d->pending.clear();
+    d->pendingGrams = 0;
+
+    segmentNames( d->dir, j->tmp, j->seg );
+    submit( j );
+}
+
+
+/*! Starts merging the smaller segments into one, if there are many
+    and no other process is busy doing the same. This first selects
+    the messages still present in the segments' mailboxes; finish()
+    then hands the merge to a SearchIndexJob.
+*/
+
+void SearchIndex::compact()
+{
+    if ( d->job || d->live )
+        return;
+
+    refresh();
+    if ( d->segments.count() < compactionThreshold )
+        return;
+
+    EString lock = File::chrooted( d->dir + "/lock" );
+    int fd = ::open( lock.cstr(), O_RDWR|O_CREAT, 0600 );
+    if ( fd < 0 )
+        return;
+    if ( flock( fd, LOCK_EX|LOCK_NB ) < 0 ) {
+        ::close( fd );
+        return;
+    }
+
+    // another process may have compacted just before we got the lock
+    d->scanned = false;
+    refresh();
+
+    // pick the smallest segments, up to the posting limit
+    List<SearchSegment> chosen;
+    uint postings = 0;
+    bool more = true;
+    while ( more ) {
+        SearchSegment * best = 0;
+        List<SearchSegment>::Iterator s( d->segments );
+        while ( s ) {
+            SearchSegment * c = s;
+            if ( ( !best || c->npostings < best->npostings ) &&
+                 !chosen.find( c ) )
+                best = c;
+            ++s;
+        }
+        if ( best &&
+             postings + best->npostings <= maxCompactionPostings ) {
+            chosen.append( best );
+            postings += best->npostings;
+        }
+        else {
+            more = false;
+        }
+    }
+
+    if ( chosen.count() < 2 ) {
+        flock( fd, LOCK_UN );
+        ::close( fd );
+        return;
+    }
+
+    IntegerSet mailboxes;
+    List<SearchSegment>::Iterator s( chosen );
+    while ( s ) {
+        uint i = 0;
+        while ( i < s->docs )
+            mailboxes.add( s->mailboxes[i++] );
+        d->chosen.append( s );
+        ++s;
+    }
+
+    d->lock = fd;
+    d->live = new Query( "select mailbox, uid from mailbox_messages "
+                         "where mailbox=any($1)", d->watcher );
+    d->live->bind( 1, mailboxes );
+    d->live->execute();
+}
+
+
+/*! Submits \a j to the WorkPool, and calls finish() at once if the
+    pool did the work at once.
+*/
+
+void SearchIndex::submit( SearchIndexJob * j )
+{
+    d->job = j;
+    EventLoop::global()->workPool()->submit( j );
+    if ( j->done() )
+        finish();
+}
+
+
+/*! Collects the live messages for a compaction and starts the merge,
+    or cleans up after a SearchIndexJob has finished.
+*/
+
+void SearchIndex::finish()
+{
+    if ( d->live ) {
+        Row * r;
+        while ( (r=d->live->nextRow()) != 0 ) {
+            if ( !( d->nkeys & ( d->nkeys + 1 ) ) ) {
+                // nkeys+1 is a power of two, so the array is full
+                Posting * k = (Posting *)
+                    realloc( d->keys,
+                             ( d->nkeys + 1 ) * 2 * sizeof(Posting) );
+                if ( !k ) {
+                    d->live->cancel();
+                    d->live = 0;
+                    free( d->keys );
+                    d->keys = 0;
+                    d->nkeys = 0;
+                    endCompaction();
+                    return;
+                }
+                d->keys = k;
+            }
+            d->keys[d->nkeys++] =
+                ( (Posting)r->getInt( "mailbox" ) << 32 ) |
+                (uint)r->getInt( "uid" );
+        }
+        if ( !d->live->done() )
+            return;
+
+        bool failed = d->live->failed();
+        d->live = 0;
+        if ( failed ) {
+            free( d->keys );
+            d->keys = 0;
+            d->nkeys = 0;
+            endCompaction();
+            return;
+        }
+
+        SearchIndexJob * j = new SearchIndexJob( d->watcher );
+        qsort( d->keys, d->nkeys, sizeof(Posting), comparePostings );
+        j->live = d->keys;
+        j->nlive = d->nkeys;
+        d->keys = 0;
+        d->nkeys = 0;
+        List<SearchSegment>::Iterator s( d->chosen );
+        while ( s ) {
+            j->sources.append( new SegmentSource( s ) );
+            ++s;
+        }
+        segmentNames( d->dir, j->tmp, j->seg );
+        submit( j );
+        return;
+    }
+
+    if ( !d->job || !d->job->done() )
+        return;
+
+    SearchIndexJob * j = d->job;
+    d->job = 0;
+
+    if ( !j->sources.isEmpty() ) {
+        if ( j->ok ) {
+            List<SearchSegment>::Iterator s( d->chosen );
+            while ( s ) {
+                ::unlink( File::chrooted( d->dir + "/" + s->name ).cstr() );
+                ++s;
+            }
+            ::log( "Compacted " + fn( d->chosen.count() ) +
+                   " search index segments for user " + fn( d->user ) +
+                   ", dropping " + fn( j->dropped ) + " expunged messages",
+                   Log::Debug );
+        }
+        else {
+            ::log( "Could not compact search index for user " +
+                   fn( d->user ), Log::Error );
+        }
+        endCompaction();
+        write();
+    }
+    else if ( j->ok ) {
+        d->writing.clear();
+        refresh();
+        if ( d->segments.count() >= compactionThreshold )
+            compact();
+    }
+    else {
+        ::log( "Could not write search index segment in " +
+               Configuration::text( Configuration::SearchIndexDir ) +
+               " for user " + fn( d->user ), Log::Error );
+        // try again later, with the documents in their original order
+        List<PendingDocument>::Iterator i( d->pending );
+        while ( i ) {
+            d->writing.append( i );
+            ++i;
+        }
+        d->pending.clear();
+        d->pendingGrams = 0;
+        i = d->writing.first();
+        while ( i ) {
+            d->pending.append( i );
+            d->pendingGrams += i->n;
+            ++i;
+        }
+        d->writing.clear();
+    }
+
+    if ( j->ok && d->pendingGrams > maxPendingTrigrams )
+        write();
+}
+
+
+/*! Unmaps the segments a compaction has replaced and releases the
+    compaction lock.
+*/
+
+void SearchIndex::endCompaction()
+{
+    d->scanned = false;
+    refresh();
+    d->chosen.clear();
+    List<SearchSegment>::Iterator s( d->retired );
+    while ( s ) {
+        munmap( (void *)s->base, s->size );
+        ++s;
+    }
+    d->retired.clear();
+
+    flock( d->lock, LOCK_UN );
+    ::close( d->lock );
+    d->lock = -1;
+}
@@ -0,0 +1,49 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include "global.h"
+
+
+class EString;
+class UString;
+class Mailbox;
+class IntegerSet;
+
+
+class SearchIndex
+    : public Garbage
+{
+public:
+    static bool enabled();
+
+    static void add( Mailbox *, uint, const EString & );
+    static void add( uint, uint, uint, const EString & );
+    static bool candidates( Mailbox *, const UString &,
+                            IntegerSet &, IntegerSet & );
+    static bool candidates( uint, uint, const UString &,
+                            IntegerSet &, IntegerSet & );
+    static bool restrict( uint, uint, const UString &,
+                          const IntegerSet &, IntegerSet & );
+
+    static void flush( bool );
+
+private:
+    SearchIndex( uint );
+    static SearchIndex * find( uint, bool );
+
+    void refresh();
+    void write();
+    void compact();
+    void submit( class SearchIndexJob * );
+    void finish();
+    void endCompaction();
+
+    class SearchIndexData * d;
+    friend class SearchIndexFlusher;
+    friend class SearchIndexWatcher;
+};
+
+
+#endif
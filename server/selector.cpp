@@ -16,6 +16,8 @@
 #include "transaction.h"
 #include "annotation.h"
 #include "dbsignal.h"
+#include "postgres.h"
+#include "searchindex.h"
 #include "field.h"
 #include "user.h"
 
@@ -23,6 +25,9 @@
 
 
 static bool tsearchAvailable = false;
+static bool headerTsearchAvailable = false;
+static bool bodyTrigramsAvailable = false;
+static bool headerTrigramsAvailable = false;
 static bool retunerCreated = false;
 
 static EString * tsconfig;
@@ -34,10 +39,15 @@ class TuningDetector
 public:
     TuningDetector(): q( 0 ) {
         ::tsearchAvailable = false;
+        ::headerTsearchAvailable = false;
+        ::bodyTrigramsAvailable = false;
+        ::headerTrigramsAvailable = false;
         q = new Query(
-            "select indexdef from pg_indexes where "
-            "indexdef ilike '% USING gin (to_tsvector%'"
-            "and tablename='bodyparts' and schemaname=$1",
+            "select tablename::text, indexdef from pg_indexes where "
+            "(indexdef ilike '% USING gin (to_tsvector%' or "
+            "indexdef ilike '% USING gin (%gin_trgm_ops)%') "
+            "and tablename in ('bodyparts','header_fields') "
+            "and schemaname=$1",
             this
         );
         q->bind( 1, Configuration::text( Configuration::DbSchema ) );
@@ -46,10 +56,24 @@ public:
     void execute() {
         if ( !q->done() )
             return;
-        ::tsearchAvailable = q->hasResults();
-        Row * r = q->nextRow();
-        if ( r ) {
+        Row * r;
+        while ( (r=q->nextRow()) != 0 ) {
+            EString table( r->getEString( "tablename" ) );
             EString def( r->getEString( "indexdef" ) );
+            bool body = ( table == "bodyparts" );
+
+            if ( def.contains( "gin_trgm_ops" ) ) {
+                if ( body )
+                    ::bodyTrigramsAvailable = true;
+                else
+                    ::headerTrigramsAvailable = true;
+                continue;
+            }
+
+            if ( !body ) {
+                ::headerTsearchAvailable = true;
+                continue;
+            }
 
             uint n = 12 + def.find( "to_tsvector(" );
             def = def.mid( n, def.length()-n-1 ).section( ",", 1 );
@@ -57,11 +81,11 @@ public:
             if ( def[0] == '\'' && def.endsWith( "::regconfig" ) ) {
                 tsconfig = new EString( def );
                 Allocator::addEternal( tsconfig, "tsearch configuration" );
-            }
-            else {
-                ::tsearchAvailable = false;
+                ::tsearchAvailable = true;
             }
         }
+        if ( !::tsearchAvailable )
+            ::headerTsearchAvailable = false;
     }
     Query * q;
 };
@@ -870,7 +894,8 @@ static EString q( const UString & orig )
 }
 
 
-static EString matchTsvector( const EString & col, uint n )
+static EString matchTsvector( const EString & col, uint n,
+                              bool phrase = false )
 {
     EString s( "octet_length(" );
     s.append( col );
@@ -878,7 +903,14 @@ static EString matchTsvector( const EString & col, uint n )
     s.append( *tsconfig );
     s.append( ", " );
     s.append( col );
-    s.append( ") @@ plainto_tsquery($" );
+    if ( phrase ) {
+        s.append( ") @@ phraseto_tsquery(" );
+        s.append( *tsconfig );
+        s.append( ", $" );
+    }
+    else {
+        s.append( ") @@ plainto_tsquery($" );
+    }
     s.appendNumber( n );
     s.append( ")" );
     return s;
@@ -931,8 +963,8 @@ EString Selector::whereHeaderField()
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and hf" + jn + ".value=$" + fn( like ) );
     }
-    else if ( t == HeaderField::Subject &&
-              ::tsearchAvailable && sensibleWords( d->s16 ) ) {
+    else if ( t == HeaderField::Subject && !::headerTrigramsAvailable &&
+              ::headerTsearchAvailable && sensibleWords( d->s16 ) ) {
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and (" + matchTsvector( "hf" + jn + ".value", like ) + " "
                   "and hf" + jn + ".value ilike " + matchAny( like ) + ")" );
@@ -954,7 +986,7 @@ EString Selector::whereHeaderField()
     j.append( ")" );
     root()->d->leftJoins.append( j );
 
-    return "hf" + jn + ".field is not null";
+    return whereIndexed( "hf" + jn + ".field is not null" );
 }
 
 
@@ -1439,10 +1471,12 @@ EString Selector::whereHeader()
     pictures. (For some formats we search on the text part, because
     the injector sets bodyparts.text based on bodyparts.data.)
 
-    This function uses full-text search if available, but filters the
-    results with a plain 'ilike' in order to avoid overly liberal
-    stemming. (Perhaps we actually want liberal stemming. I don't
-    know. IMAP says not to do it, but do we listen?)
+    If "aox tune database full-text" has created a trigram index, this
+    function uses a plain 'ilike', which the index serves with the
+    substring semantics IMAP wants. Otherwise it uses full-text search
+    if available: a phrase query on PostgreSQL 9.6 and later, and on
+    older versions a word query whose results are filtered with a
+    plain 'ilike' in order to avoid overly liberal stemming.
 */
 
 EString Selector::whereBody()
@@ -1453,13 +1487,22 @@ EString Selector::whereBody()
 
     uint bt = placeHolder( q( d->s16 ) );
 
-    if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
-        s.append( "(" + matchTsvector( "bp.text", bt ) + " "
-                  "and bp.text ilike " + matchAny( bt ) + ")" );
+    if ( ::bodyTrigramsAvailable && d->s16.length() >= 3 )
+        // the trigram index serves ilike directly, with exact
+        // substring semantics.
+        s.append( "bp.text ilike " + matchAny( bt ) );
+    else if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
+        // the full-text index only narrows the candidates down: it
+        // stems and tokenises, while SEARCH BODY is a substring
+        // match, so ilike has to check each candidate. a phrase
+        // query keeps the word order and narrows it down further.
+        s.append( "(" + matchTsvector( "bp.text", bt,
+                                       Postgres::version() >= 90600 ) +
+                  " and bp.text ilike " + matchAny( bt ) + ")" );
     else
         s.append( "bp.text ilike " + matchAny( bt ) );
 
-    return s;
+    return whereIndexed( s );
 }
 
 
@@ -1557,6 +1600,33 @@ EString Selector::whereSet( const IntegerSet & s )
 }
 
 
+/*! Returns \a condition, possibly restricted to the messages the
+    SearchIndex thinks may contain this selector's string. The
+    restriction only helps the database; \a condition still decides.
+
+    Messages the index doesn't know about, and messages which arrived
+    after the session last looked, are always left to \a condition.
+*/
+
+EString Selector::whereIndexed( const EString & condition )
+{
+    Session * s = root()->d->session;
+    if ( !s || !s->mailbox() || s->messages().isEmpty() ||
+         !SearchIndex::enabled() )
+        return condition;
+
+    IntegerSet candidates;
+    if ( !SearchIndex::restrict( s->mailbox()->owner(), s->mailbox()->id(),
+                                 d->s16, s->messages(), candidates ) )
+        return condition;
+
+    uint l = placeHolder();
+    root()->d->query->bind( l, s->messages().largest() );
+    return "((" + mm() + ".uid>$" + fn( l ) + " or " +
+        whereSet( candidates ) + ") and " + condition + ")";
+}
+
+
 /*! This implements searches on whether a message has the right UID.
 */
 
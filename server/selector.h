@@ -119,6 +119,7 @@ private:
     EString m();
 
     EString whereSet( const IntegerSet & );
+    EString whereIndexed( const EString & );
 };
 
 
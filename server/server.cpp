@@ -46,6 +46,7 @@
 #include "eventloop.h"
 #include "allocator.h"
 #include "resolver.h"
+#include "dnsquery.h"
 #include "entropy.h"
 #include "query.h"
 
@@ -247,11 +248,13 @@ void Server::configuration()
 
 
 /*! Resolves any domain names used in the configuration file before we
-    chroot.
+    chroot, and finds the name servers DnsQuery will use later.
 */
 
 void Server::nameResolution()
 {
+    DnsQuery::setup();
+
     List<Configuration::Text>::Iterator i( Configuration::addressVariables() );
     while ( i ) {
         const EStringList & r
@@ -0,0 +1,322 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "workpool.h"
+
+#include "event.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "stringkernel.h"
+#include "buffer.h"
+#include "list.h"
+#include "log.h"
+
+// socketpair
+#include <sys/socket.h>
+// write
+#include <unistd.h>
+// errno
+#include <errno.h>
+// memcpy
+#include <string.h>
+// pthread_create etc.
+#include <pthread.h>
+
+
+/*! \class WorkItem workpool.h
+    A WorkItem is a piece of CPU-bound work which a WorkPool can do on
+    another thread.
+
+    Subclasses implement work(), which the WorkPool calls on one of its
+    threads. When work() returns, the WorkPool notes that the item is
+    done() and notifies its owner() on the event loop thread.
+
+    The worker threads call Allocator::enter() and Allocator::leave()
+    around work(), so work() may allocate memory, and
+    Allocator::free() waits until it returns. work() must follow
+    three rules:
+
+    1. It may use and modify the objects reachable from the WorkItem
+    (ie. pointed to by the subclass' members), but nothing on the
+    event loop thread may use those objects until the item is done().
+
+    2. Anything it allocates must be reachable from the WorkItem when
+    work() returns, or it will be freed.
+
+    3. It must not use objects shared with the event loop thread,
+    such as Log, Scope, Query or Cache. In particular, it may not call
+    log().
+
+    The WorkPool keeps each submitted WorkItem (and hence everything it
+    points to) alive until the owner has been notified.
+*/
+
+
+/*! Constructs a WorkItem which will notify \a owner when done. */
+
+WorkItem::WorkItem( EventHandler * owner )
+    : Garbage(), h( owner ), finished( false )
+{
+}
+
+
+/*! \fn void WorkItem::work()
+
+    This pure virtual function is called on a worker thread, and does
+    whatever work the WorkItem needs to do. It must follow the rules
+    in the class documentation.
+*/
+
+
+/*! Returns true if work() has been called and has returned, and false
+    otherwise.
+*/
+
+bool WorkItem::done() const
+{
+    return finished;
+}
+
+
+/*! Returns the EventHandler which is notified when this item is
+    done(), as set by the constructor.
+*/
+
+EventHandler * WorkItem::owner() const
+{
+    return h;
+}
+
+
+class WorkPoolData
+    : public Garbage
+{
+public:
+    WorkPoolData()
+        : threads( 0 ), wakeup( -1 ),
+          capacity( 0 ), queue( 0 ), first( 0 ), queued( 0 ),
+          completed( 0 ), finished( 0 )
+    {}
+
+    List<WorkItem> pending;
+    uint threads;
+    int wakeup;
+
+    // the rest is shared with the worker threads, and guarded by mutex
+
+    uint capacity;
+    WorkItem ** queue;
+    uint first;
+    uint queued;
+    WorkItem ** completed;
+    uint finished;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+
+/*! \class WorkPool workpool.h
+    A WorkPool runs WorkItem objects on a set of worker threads.
+
+    The pool is attached to the EventLoop (see EventLoop::workPool())
+    and is a Connection, so that it can be woken by its threads: The
+    threads write a byte to one end of a socket pair whenever they
+    finish an item, the EventLoop sees the other end become readable,
+    and react() then notifies the owners of the finished items on the
+    event loop thread.
+
+    The queues shared with the threads are arrays of pointers
+    allocated by the event loop thread with Allocator::alloc( size, 0
+    ), so that the threads never have to resize them. The List of
+    pending items keeps each WorkItem alive while it's in the queues.
+
+    If the pool has no threads, either because the worker-threads
+    configuration variable is 0 or because the threads could not be
+    started, submit() does the work at once.
+*/
+
+
+/*! Constructs a WorkPool and starts \a n worker threads. */
+
+WorkPool::WorkPool( uint n )
+    : Connection(), d( new WorkPoolData )
+{
+    setType( Workers );
+    if ( !n || EventLoop::global()->inShutdown() )
+        return;
+
+    int fds[2];
+    if ( ::socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 ) {
+        log( "Could not create socket pair for worker threads",
+             Log::Error );
+        return;
+    }
+    init( fds[0] );
+    setState( Connected );
+    d->wakeup = fds[1];
+
+    pthread_mutex_init( &d->mutex, 0 );
+    pthread_cond_init( &d->cond, 0 );
+
+    // the workers must not race to initialise this
+    StringKernel::setup();
+
+    while ( d->threads < n ) {
+        pthread_t thread;
+        int r = pthread_create( &thread, 0, run, (void*)d );
+        if ( r ) {
+            log( "pthread_create returned nonzero (" + fn( r ) + ")",
+                 Log::Error );
+            break;
+        }
+        pthread_detach( thread );
+        d->threads++;
+    }
+
+    EventLoop::global()->addConnection( this );
+}
+
+
+/*! Returns the number of worker threads, which may be 0. */
+
+uint WorkPool::threads() const
+{
+    return d->threads;
+}
+
+
+/*! Queues \a w to be done by one of the worker threads. When it is
+    done(), the WorkPool notifies its owner.
+
+    If there are no worker threads, submit() calls WorkItem::work() at
+    once and does not notify the owner. Callers should check
+    WorkItem::done() after submit() returns.
+*/
+
+void WorkPool::submit( WorkItem * w )
+{
+    if ( !d->threads || !valid() ) {
+        w->work();
+        w->finished = true;
+        return;
+    }
+
+    d->pending.append( w );
+
+    // completed is as large as queue, and neither can hold more than
+    // the pending items, so the worker threads never overflow either
+    uint n = d->pending.count();
+    WorkItem ** q = 0;
+    WorkItem ** c = 0;
+    if ( n > d->capacity ) {
+        n = Allocator::rounded( n * 2 * sizeof( WorkItem * ) ) /
+            sizeof( WorkItem * );
+        q = (WorkItem **)Allocator::alloc( n * sizeof( WorkItem * ), 0 );
+        c = (WorkItem **)Allocator::alloc( n * sizeof( WorkItem * ), 0 );
+    }
+
+    pthread_mutex_lock( &d->mutex );
+    if ( q ) {
+        uint i = 0;
+        while ( i < d->queued ) {
+            q[i] = d->queue[(d->first + i) % d->capacity];
+            i++;
+        }
+        if ( d->finished )
+            memcpy( c, d->completed, d->finished * sizeof( WorkItem * ) );
+        d->queue = q;
+        d->completed = c;
+        d->capacity = n;
+        d->first = 0;
+    }
+    d->queue[(d->first + d->queued) % d->capacity] = w;
+    d->queued++;
+    pthread_cond_signal( &d->cond );
+    pthread_mutex_unlock( &d->mutex );
+}
+
+
+/*! Reacts to the wakeup bytes written by the worker threads by
+    finishing the completed items. \a e is the event.
+*/
+
+void WorkPool::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        readBuffer()->remove( readBuffer()->size() );
+        finish();
+        break;
+
+    case Error:
+    case Close:
+        log( "Lost contact with the worker threads", Log::Error );
+        break;
+
+    case Connect:
+    case Timeout:
+    case Shutdown:
+        break;
+    }
+}
+
+
+/*! Takes the completed items from the worker threads, marks them as
+    done() and notifies their owners.
+*/
+
+void WorkPool::finish()
+{
+    List<WorkItem> done;
+
+    pthread_mutex_lock( &d->mutex );
+    uint i = 0;
+    while ( i < d->finished )
+        done.append( d->completed[i++] );
+    d->finished = 0;
+    pthread_mutex_unlock( &d->mutex );
+
+    List<WorkItem>::Iterator w( done );
+    while ( w ) {
+        d->pending.remove( w );
+        w->finished = true;
+        if ( w->owner() )
+            w->owner()->notify();
+        ++w;
+    }
+}
+
+
+/*! This static function is the main loop of each worker thread. \a
+    arg is the WorkPoolData of the pool.
+
+    It takes items from the queue, calls WorkItem::work() and moves the
+    items to the list of completed ones.
+*/
+
+void * WorkPool::run( void * arg )
+{
+    WorkPoolData * d = (WorkPoolData *)arg;
+    while ( true ) {
+        pthread_mutex_lock( &d->mutex );
+        while ( !d->queued )
+            pthread_cond_wait( &d->cond, &d->mutex );
+        WorkItem * w = d->queue[d->first];
+        d->first = ( d->first + 1 ) % d->capacity;
+        d->queued--;
+        pthread_mutex_unlock( &d->mutex );
+
+        Allocator::enter();
+        w->work();
+        Allocator::leave();
+
+        pthread_mutex_lock( &d->mutex );
+        d->completed[d->finished++] = w;
+        pthread_mutex_unlock( &d->mutex );
+
+        char c = 0;
+        while ( ::write( d->wakeup, &c, 1 ) < 0 && errno == EINTR )
+            ;
+    }
+    return 0;
+}
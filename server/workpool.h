@@ -0,0 +1,49 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "connection.h"
+
+
+class EventHandler;
+
+
+class WorkItem
+    : public Garbage
+{
+public:
+    WorkItem( EventHandler * );
+
+    virtual void work() = 0;
+
+    bool done() const;
+    EventHandler * owner() const;
+
+private:
+    friend class WorkPool;
+    EventHandler * h;
+    bool finished;
+};
+
+
+class WorkPool
+    : public Connection
+{
+public:
+    WorkPool( uint );
+
+    void submit( WorkItem * );
+    uint threads() const;
+
+    void react( Event );
+
+private:
+    class WorkPoolData * d;
+
+    void finish();
+    static void * run( void * );
+};
+
+
+#endif
@@ -23,10 +23,233 @@
 #include "sievescript.h"
 #include "sieveaction.h"
 #include "transaction.h"
+#include "helperrowcreator.h"
 #include "spoolmanager.h"
 #include "addressfield.h"
 #include "configuration.h"
 #include "sieveproduction.h"
+#include "sievematcher.h"
+#include "integerset.h"
+#include "allocator.h"
+#include "dbsignal.h"
+#include "postgres.h"
+#include "dict.h"
+#include "map.h"
+
+// time
+#include <time.h>
+
+
+// One row of the alias lookup done by Sieve::lookupRecipients().
+
+class SieveAlias
+    : public Garbage
+{
+public:
+    SieveAlias(): mailbox( 0 ), script( 0 ), revision( 0 ), userId( 0 ) {}
+
+    uint mailbox;
+    uint script;
+    uint revision;
+    UString prefix;
+    UString login;
+    uint userId;
+    UString name;
+    UString localpart;
+    UString domain;
+};
+
+
+// The results of recent alias lookups, keyed by SieveAlias::key() and
+// discarded whenever an alias, script or user changes.
+
+static Dict< List<SieveAlias> > * aliases = 0;
+static uint aliasesCached = 0;
+
+
+class SieveAliasInvalidator
+    : public EventHandler
+{
+public:
+    SieveAliasInvalidator(): EventHandler() {}
+    void execute() {
+        if ( ::aliases )
+            ::aliases->clear();
+        ::aliasesCached = 0;
+    }
+};
+
+
+// The autoresponses this process knows to have been sent recently,
+// keyed by autoresponseKey() and mapping to the time at which each
+// expires. The autoresponses table remains authoritative; this only
+// spares us most of the queries.
+
+class SieveAutoresponse
+    : public Garbage
+{
+public:
+    SieveAutoresponse( uint e ): expires( e ) {}
+
+    uint expires;
+};
+
+
+static Dict<SieveAutoresponse> * answered = 0;
+static uint answeredCached = 0;
+
+
+static EString autoresponseKey( SieveAction * a )
+{
+    EString k = a->handle().utf8();
+    k.append( "\n" );
+    k.append( a->senderAddress()->lpdomain().lower() );
+    k.append( "\n" );
+    k.append( a->recipientAddress()->lpdomain().lower() );
+    return k;
+}
+
+
+// Returns true if a response similar to a was sent and hasn't expired.
+
+static bool recentlyAnswered( SieveAction * a, uint now )
+{
+    if ( !::answered )
+        return false;
+    SieveAutoresponse * r = ::answered->find( autoresponseKey( a ) );
+    return r && r->expires > now;
+}
+
+
+// Records that a response similar to a was sent, and that others need
+// not be sent until expires.
+
+static void rememberAnswer( SieveAction * a, uint expires )
+{
+    if ( !::answered ) {
+        ::answered = new Dict<SieveAutoresponse>;
+        Allocator::addEternal( ::answered, "sieve autoresponse cache" );
+    }
+    if ( ::answeredCached >= 8192 ) {
+        ::answered->clear();
+        ::answeredCached = 0;
+    }
+    EString k = autoresponseKey( a );
+    SieveAutoresponse * r = ::answered->find( k );
+    if ( r ) {
+        if ( expires > r->expires )
+            r->expires = expires;
+    }
+    else {
+        ::answered->insert( k, new SieveAutoresponse( expires ) );
+        ::answeredCached++;
+    }
+}
+
+
+// Claims the right to send the autoresponse a by recording it in the
+// autoresponses table, as part of transaction t. The claim succeeds if
+// the table has no similar autoresponse, or only an expired one. The
+// row stays locked until t ends, so a concurrent claim for the same
+// autoresponse waits, and then fails if t commits.
+
+class SieveClaim
+    : public EventHandler
+{
+public:
+    SieveClaim( SieveAction * action, uint from, uint to,
+                Transaction * t, EventHandler * o )
+        : a( action ), expires( 0 ), owner( o ),
+          sub( 0 ), update( 0 ), insert( 0 ),
+          done( false ), claimed( false )
+    {
+        Date e;
+        e.setCurrentTime();
+        if ( a->expiry() )
+            e.setUnixTime( e.unixTime() + 86400 * a->expiry() );
+        else
+            e.setUnixTime( e.unixTime() + 180 );
+        expires = e.unixTime();
+
+        if ( Postgres::version() >= 90500 ) {
+            insert = new Query( "insert into autoresponses "
+                                "(sent_from, sent_to, expires_at, handle) "
+                                "values ($1, $2, $3, $4) "
+                                "on conflict (sent_from, sent_to, handle) "
+                                "do update set expires_at=$3 "
+                                "where autoresponses.expires_at"
+                                "<=current_timestamp "
+                                "returning id", this );
+            bind( insert, from, to, e );
+            t->enqueue( insert );
+            t->execute();
+            return;
+        }
+
+        // Without on conflict, two processes may both find no row
+        // and both insert one. The loser's insert violates ar_fth,
+        // so we use a subtransaction to survive that.
+        sub = t->subTransaction( this );
+        update = new Query( "update autoresponses set expires_at=$3 "
+                            "where sent_from=$1 and sent_to=$2 "
+                            "and handle=$4 "
+                            "and expires_at<=current_timestamp "
+                            "returning id", this );
+        bind( update, from, to, e );
+        sub->enqueue( update );
+        insert = new Query( "insert into autoresponses "
+                            "(sent_from, sent_to, expires_at, handle) "
+                            "select $1, $2, $3, $4 where not exists "
+                            "(select id from autoresponses "
+                            "where sent_from=$1 and sent_to=$2 "
+                            "and handle=$4) "
+                            "returning id", this );
+        bind( insert, from, to, e );
+        insert->allowFailure();
+        sub->enqueue( insert );
+        sub->execute();
+    }
+
+    void bind( Query * q, uint from, uint to, const Date & e )
+    {
+        q->bind( 1, from );
+        q->bind( 2, to );
+        q->bind( 3, e.isoDateTime() );
+        q->bind( 4, a->handle() );
+    }
+
+    void execute()
+    {
+        if ( done || !insert->done() )
+            return;
+        done = true;
+        if ( update && update->hasResults() )
+            claimed = true;
+        if ( insert->hasResults() )
+            claimed = true;
+        if ( sub ) {
+            if ( insert->failed() ) {
+                if ( !insert->error().contains( "ar_fth" ) )
+                    log( "Could not record autoresponse: " +
+                         insert->error() );
+                sub->rollback();
+            }
+            else {
+                sub->commit();
+            }
+        }
+        owner->execute();
+    }
+
+    SieveAction * a;
+    uint expires;
+    EventHandler * owner;
+    Transaction * sub;
+    Query * update;
+    Query * insert;
+    bool done;
+    bool claimed;
+};
 
 
 class SieveData
@@ -44,7 +267,11 @@ public:
           transaction( 0 ),
           injector( 0 ),
           vacations( 0 ),
-          softError( false )
+          addresses( 0 ),
+          claims( 0 ),
+          scripts( 0 ),
+          softError( false ),
+          unresolved( false )
     {}
 
     class Recipient
@@ -55,7 +282,8 @@ public:
             : d( data ), address( a ), mailbox( m ),
               done( false ), ok( true ),
               implicitKeep( true ), explicitKeep( false ),
-              sq( 0 ), script( new SieveScript ), user( 0 ), handler( 0 )
+              lookup( false ), sq( 0 ), cached( 0 ),
+              script( new SieveScript ), user( 0 ), handler( 0 )
         {
             d->recipients.append( this );
         }
@@ -70,7 +298,11 @@ public:
         EString result;
         List<SieveAction> actions;
         List<SieveCommand> pending;
+        bool lookup;
+        UString localpart;
+        EString key;
         Query * sq;
+        List<SieveAlias> * cached;
         SieveScript * script;
         EString error;
         UString prefix;
@@ -96,9 +328,18 @@ public:
     Transaction * transaction;
     Injector * injector;
     List<SieveAction> * vacations;
+    Dict<Address> * addresses;
+    List<SieveClaim> * claims;
+    Query * scripts;
+    IntegerSet wanted;
+    Map<SieveScript> fetched;
     bool softError;
+    bool unresolved;
 
     Recipient * recipient( Address * a );
+    bool scriptsKnown( List<SieveAlias> *, EventHandler * );
+    SieveScript * script( SieveAlias * );
+    void resolve( Recipient *, List<SieveAlias> * );
 };
 
 
@@ -128,6 +369,114 @@ SieveData::Recipient * SieveData::recipient( Address * a )
 }
 
 
+/*! Returns true if the scripts used by the aliases in \a l are
+    cached at their current revisions or have been fetched. If not,
+    starts fetching them, notifies \a owner when that's done and
+    returns false.
+*/
+
+bool SieveData::scriptsKnown( List<SieveAlias> * l, EventHandler * owner )
+{
+    if ( scripts ) {
+        if ( !scripts->done() )
+            return false;
+        Row * r;
+        while ( (r=scripts->nextRow()) != 0 ) {
+            EString source;
+            if ( !r->isNull( "script" ) )
+                source = r->getEString( "script" ).crlf();
+            uint id = r->getInt( "id" );
+            fetched.insert( id, SieveScript::add( id, r->getInt( "revision" ),
+                                                  source ) );
+        }
+        // any script deleted since the alias lookup does nothing
+        uint i = 1;
+        while ( i <= wanted.count() ) {
+            if ( !fetched.contains( wanted.value( i ) ) )
+                fetched.insert( wanted.value( i ), new SieveScript );
+            i++;
+        }
+        wanted.clear();
+        scripts = 0;
+    }
+
+    IntegerSet missing;
+    List<SieveAlias>::Iterator a( l );
+    while ( a ) {
+        if ( a->script && !script( a ) )
+            missing.add( a->script );
+        ++a;
+    }
+    if ( missing.isEmpty() )
+        return true;
+
+    wanted = missing;
+    scripts = new Query( "select id, revision, script from scripts "
+                         "where id=any($1)", owner );
+    scripts->bind( 1, missing );
+    scripts->execute();
+    return false;
+}
+
+
+/*! Returns the parsed script for \a a, or a null pointer if it has
+    to be fetched first.
+*/
+
+SieveScript * SieveData::script( SieveAlias * a )
+{
+    SieveScript * s = SieveScript::find( a->script, a->revision );
+    if ( !s )
+        s = fetched.find( a->script );
+    return s;
+}
+
+
+/*! Records the results of looking up \a r, one alias in \a l for
+    each mailbox \a r should be delivered to. Any aliases after the
+    first produce new Recipient objects.
+*/
+
+void SieveData::resolve( Recipient * r, List<SieveAlias> * l )
+{
+    Recipient * in = r;
+    List<SieveAlias>::Iterator a( l );
+    while ( a ) {
+        if ( a->mailbox )
+            in->mailbox = Mailbox::find( a->mailbox );
+        if ( a->script ) {
+            in->prefix = a->prefix;
+            in->user = new User;
+            in->user->setLogin( a->login );
+            in->user->setId( a->userId );
+            in->user->setAddress( new Address( a->name, a->localpart,
+                                               a->domain ) );
+            in->script = script( a );
+            EString errors = in->script->parseErrors();
+            if ( !errors.isEmpty() ) {
+                ::log( "Note: Sieve script for " +
+                       in->user->login().utf8() +
+                       "had parse errors.", Log::Error );
+                EStringList::Iterator i(
+                    EStringList::split( '\n', errors ) );
+                while ( i ) {
+                    ::log( "Sieve: " + *i, Log::Error );
+                    ++i;
+                }
+            }
+            List<SieveCommand>::Iterator c( in->script->topLevelCommands() );
+            while ( c ) {
+                in->pending.append( c );
+                ++c;
+            }
+        }
+        ++a;
+        if ( a )
+            in = new SieveData::Recipient( r->address, 0, this );
+    }
+}
+
+
 /*! \class Sieve sieve.h
 
     The Sieve class interprets the Sieve language, which processes
@@ -168,52 +517,63 @@ void Sieve::execute()
         bool wasReady = ready();
         List<SieveData::Recipient>::Iterator i( d->recipients );
         while ( i ) {
-            if ( i->sq && i->sq->hasResults() ) {
-                Row * r;
-                SieveData::Recipient *in = i;
-                for ( in = i ;
-                      (r = i->sq->nextRow()) ;
-                      in = new SieveData::Recipient( i->address, 0, d) ) {
-                    if ( !r->isNull( "mailbox" ) )
-                        in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
-                    if ( !r->isNull( "script" ) ) {
-                        in->prefix = r->getUString( "namespace" ) + "/" +
-                                    r->getUString( "login" ) + "/";
-                        in->user = new User;
-                        in->user->setLogin( r->getUString( "login" ) );
-                        in->user->setId( r->getInt( "userid" ) );
-                        in->user->setAddress( new Address(
-                                                 r->getUString( "name" ),
-                                                 r->getEString( "localpart" ),
-                                                 r->getEString( "domain" ) ) );
-                        in->script->parse( r->getEString( "script" ).crlf() );
-                        EString errors = in->script->parseErrors();
-                        if ( !errors.isEmpty() ) {
-                            log( "Note: Sieve script for " +
-                                 in->user->login().utf8() +
-                                 "had parse errors.", Log::Error );
-                            EString prefix = "Sieve script for " +
-                                            in->user->login().utf8();
-                            EStringList::Iterator i(
-                                EStringList::split( '\n', errors ) );
-                            while ( i ) {
-                                log( "Sieve: " + *i, Log::Error );
-                                ++i;
+            SieveData::Recipient * r = i;
+            ++i;
+            if ( r->sq && r->sq->done() ) {
+                // the query answers for all recipients which share it
+                Query * q = r->sq;
+                Dict< List<SieveAlias> > found;
+                Row * row;
+                while ( (row = q->nextRow()) ) {
+                    SieveAlias * a = new SieveAlias;
+                    if ( !row->isNull( "mailbox" ) )
+                        a->mailbox = row->getInt( "mailbox" );
+                    a->localpart = row->getUString( "localpart" );
+                    a->domain = row->getUString( "domain" );
+                    if ( !row->isNull( "scriptid" ) ) {
+                        a->script = row->getInt( "scriptid" );
+                        a->revision = row->getInt( "revision" );
+                        a->prefix = row->getUString( "namespace" ) + "/" +
+                                    row->getUString( "login" ) + "/";
+                        a->login = row->getUString( "login" );
+                        a->userId = row->getInt( "userid" );
+                        a->name = row->getUString( "name" );
+                    }
+                    EString k = a->localpart.titlecased().utf8() + "@" +
+                                a->domain.titlecased().utf8();
+                    List<SieveAlias> * l = found.find( k );
+                    if ( !l ) {
+                        l = new List<SieveAlias>;
+                        found.insert( k, l );
+                    }
+                    l->append( a );
+                }
+                List<SieveData::Recipient>::Iterator s( d->recipients );
+                while ( s ) {
+                    if ( s->sq == q ) {
+                        s->cached = found.find( s->key );
+                        if ( !s->cached )
+                            s->cached = new List<SieveAlias>;
+                        if ( !q->failed() ) {
+                            if ( ::aliasesCached >= 4096 ) {
+                                ::aliases->clear();
+                                ::aliasesCached = 0;
                             }
+                            if ( !::aliases->contains( s->key ) )
+                                ::aliasesCached++;
+                            ::aliases->insert( s->key, s->cached );
                         }
-                        List<SieveCommand>::Iterator
-                            c(in->script->topLevelCommands());
-                        while ( c ) {
-                            in->pending.append( c );
-                            ++c;
-                        }
+                        s->sq = 0;
                     }
+                    ++s;
                 }
-                i->sq = 0;
             }
-            if ( i->sq && i->sq->done() )
-                i->sq = 0;
-            ++i;
+            if ( r->lookup && !r->sq && r->cached &&
+                 d->scriptsKnown( r->cached, this ) ) {
+                r->lookup = false;
+                d->resolve( r, r->cached );
+                r->cached = 0;
+            }
         }
         if ( ready() && !wasReady ) {
             i = d->recipients.first();
@@ -239,21 +599,33 @@ void Sieve::execute()
 
         if ( !d->autoresponses ) {
             d->vacations = vacations();
+            uint now = (uint)::time( 0 );
+            List<SieveAction>::Iterator i( d->vacations );
+            while ( i ) {
+                if ( recentlyAnswered( i, now ) ) {
+                    log( "Suppressing vacation response to " +
+                         i->recipientAddress()->toString( false ) );
+                    d->vacations->take( i );
+                }
+                else {
+                    ++i;
+                }
+            }
             if ( d->vacations->isEmpty() ) {
                 d->state = 2;
             }
             else {
                 d->transaction = new Transaction( this );
                 d->injector->setTransaction( d->transaction );
-//              d->transaction->enqueue(
-//                  new Query( "lock autoresponses in exclusive mode",
-//                             this ) );
                 d->autoresponses = new Query( "", this );
-                EString s = "select handle from autoresponses "
+                EString s = "select handle, "
+                           "extract(epoch from expires_at)::bigint "
+                           "as expires "
+                           "from autoresponses "
                            "where expires_at > current_timestamp "
                            "and ( false ";
                 int n = 1;
-                List<SieveAction>::Iterator i( d->vacations );
+                i = d->vacations->first();
                 while ( i ) {
                     s.append( " or " );
                     s.append( "(handle=$" );
@@ -301,11 +673,70 @@ void Sieve::execute()
                 if ( i ) {
                     log( "Suppressing vacation response to " +
                          i->recipientAddress()->toString( false ) );
+                    rememberAnswer( i, (uint)r->getBigint( "expires" ) );
                     d->vacations->take( i );
                 }
             }
         }
 
+        // The rest are sent only if we can claim them. That needs the
+        // addresses' IDs.
+        if ( !d->vacations->isEmpty() && !d->addresses ) {
+            d->addresses = new Dict<Address>;
+            List<SieveAction>::Iterator i( d->vacations );
+            while ( i ) {
+                Address * a = i->senderAddress();
+                d->addresses->insert( AddressCreator::key( a ), a );
+                a = i->recipientAddress();
+                d->addresses->insert( AddressCreator::key( a ), a );
+                ++i;
+            }
+            AddressCreator * ac
+                = new AddressCreator( d->addresses, d->transaction );
+            ac->execute();
+        }
+
+        if ( !d->vacations->isEmpty() && !d->claims ) {
+            Dict<Address>::Iterator a( d->addresses );
+            while ( a && a->id() )
+                ++a;
+            if ( a && !d->transaction->failed() )
+                return;
+            if ( a ) {
+                log( "Could not look up autoresponse addresses: " +
+                     d->transaction->error() );
+                d->vacations->clear();
+            }
+            d->claims = new List<SieveClaim>;
+            List<SieveAction>::Iterator i( d->vacations );
+            while ( i ) {
+                Address * f = i->senderAddress();
+                Address * t = i->recipientAddress();
+                f = d->addresses->find( AddressCreator::key( f ) );
+                t = d->addresses->find( AddressCreator::key( t ) );
+                d->claims->append( new SieveClaim( i, f->id(), t->id(),
+                                                   d->transaction, this ) );
+                ++i;
+            }
+        }
+
+        if ( d->claims ) {
+            List<SieveClaim>::Iterator c( d->claims );
+            while ( c && c->done )
+                ++c;
+            if ( c )
+                return;
+            c = d->claims->first();
+            while ( c ) {
+                if ( !c->claimed ) {
+                    log( "Suppressing vacation response to " +
+                         c->a->recipientAddress()->toString( false ) );
+                    d->vacations->remove( c->a );
+                }
+                ++c;
+            }
+        }
+
         List<SieveAction>::Iterator i( d->vacations );
         while ( i ) {
             d->injector->addAddress( i->senderAddress() );
@@ -369,36 +800,33 @@ void Sieve::execute()
         d->state = 4;
     }
 
-    // 4: record what autoresponses were sent
+    // 4: commit, or roll back the autoresponses if they weren't sent
     if ( d->state == 4 ) {
-        List<SieveAction>::Iterator i( d->vacations );
-        while ( i ) {
-            Query * q
-                = new Query(
-                    "insert into autoresponses "
-                    "(sent_from, sent_to, expires_at, handle) "
-                    "values ($1, $2, $3, $4)", this );
-            q->bind( 1, d->injector->addressId( i->senderAddress() ) );
-            q->bind( 2, d->injector->addressId( i->recipientAddress() ) );
-            Date e;
-            e.setCurrentTime();
-            if( i->expiry() )
-                e.setUnixTime( e.unixTime() + 86400 * i->expiry() );
+        if ( d->transaction ) {
+            if ( d->injector->failed() )
+                d->transaction->rollback();
             else
-                e.setUnixTime( e.unixTime() + 180 );
-            q->bind( 3, e.isoDateTime() );
-            q->bind( 4, i->handle() );
-            d->transaction->enqueue( q );
-            ++i;
+                d->transaction->commit();
         }
 
-        if ( d->transaction )
-            d->transaction->commit();
-
         d->state = 5;
         if ( d->handler )
             d->handler->execute();
     }
+
+    // 5: once the claims are committed, remember them
+    if ( d->state == 5 && d->transaction && d->transaction->done() ) {
+        if ( d->claims && !d->injector->failed() &&
+             !d->transaction->failed() ) {
+            List<SieveClaim>::Iterator c( d->claims );
+            while ( c ) {
+                if ( c->claimed )
+                    rememberAnswer( c->a, c->expires );
+                ++c;
+            }
+        }
+        d->transaction = 0;
+    }
 }
 
 
@@ -465,10 +893,13 @@ void Sieve::addRecipient( Address * address, Mailbox * destination,
 }
 
 
-/*! Looks up \a address in the aliases table, finds the related sieve
-    script and other needed information so that delivery to \a address
+/*! Records that \a address is a recipient, whose alias, mailbox and
+    sieve script have to be looked up so that delivery to \a address
     can be evaluated. Calls \a user when the information is available.
 
+    The lookup starts when lookupRecipients() is called, so that all
+    the recipients of a message can be looked up together.
+
     If \a address is not a registered alias, Sieve will refuse mail to
     it.
 */
@@ -482,19 +913,9 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
     d->currentRecipient = r;
 
     r->handler = user;
+    r->lookup = true;
+    d->unresolved = true;
 
-    r->sq = new Query( "select al.mailbox, s.script, m.owner, "
-                       "n.name as namespace, u.id as userid, u.login, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from aliases al "
-                       "join addresses a on (al.address=a.id) "
-                       "join mailboxes m on (al.mailbox=m.id) "
-                       "left join scripts s on "
-                       " (s.owner=m.owner and s.active='t') "
-                       "left join users u on (s.owner=u.id) "
-                       "left join namespaces n on (u.parentspace=n.id) "
-                       "where m.deleted='f' and "
-                       "a.localpart=$1 and a.domain=$2", this );
     UString localpart( address->localpart() );
     if ( Configuration::toggle( Configuration::UseSubaddressing ) ) {
         EString sep( Configuration::text( Configuration::AddressSeparator ) );
@@ -516,9 +937,80 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
                 localpart = localpart.mid( 0, n );
         }
     }
-    r->sq->bind( 1, localpart );
-    r->sq->bind( 2, address->domain() );
-    r->sq->execute();
+    r->localpart = localpart;
+    r->key = localpart.titlecased().utf8() + "@" +
+             address->domain().titlecased().utf8();
+}
+
+
+/*! Looks up all the recipients added by addRecipient() since the last
+    call, using a single query for all those whose aliases aren't
+    known already.
+
+    Lookup results are cached until the database signals that an
+    alias, script or user has changed.
+*/
+
+void Sieve::lookupRecipients()
+{
+    if ( !d->unresolved )
+        return;
+    d->unresolved = false;
+
+    Scope x( log() );
+
+    if ( !::aliases ) {
+        ::aliases = new Dict< List<SieveAlias> >;
+        Allocator::addEternal( ::aliases, "sieve alias cache" );
+        (void)new DatabaseSignal( "aliases_updated",
+                                  new SieveAliasInvalidator );
+    }
+
+    Query * q = 0;
+    UStringList localparts;
+    UStringList domains;
+    bool known = false;
+    List<SieveData::Recipient>::Iterator r( d->recipients );
+    while ( r ) {
+        if ( r->lookup && !r->sq && !r->cached ) {
+            r->cached = ::aliases->find( r->key );
+            if ( r->cached ) {
+                known = true;
+            }
+            else {
+                if ( !q )
+                    q = new Query(
+                        "select al.mailbox, s.id as scriptid, s.revision, "
+                        "m.owner, "
+                        "n.name as namespace, u.id as userid, u.login, "
+                        "a.name, a.localpart::text, a.domain::text "
+                        "from aliases al "
+                        "join addresses a on (al.address=a.id) "
+                        "join mailboxes m on (al.mailbox=m.id) "
+                        "left join scripts s on "
+                        " (s.owner=m.owner and s.active='t') "
+                        "left join users u on (s.owner=u.id) "
+                        "left join namespaces n on (u.parentspace=n.id) "
+                        "where m.deleted='f' and "
+                        "a.localpart=any($1::citext[]) and "
+                        "a.domain=any($2::citext[])", this );
+                localparts.append( r->localpart );
+                domains.append( r->address->domain() );
+                r->sq = q;
+            }
+        }
+        ++r;
+    }
+
+    if ( q ) {
+        localparts.removeDuplicates();
+        domains.removeDuplicates();
+        q->bind( 1, localparts );
+        q->bind( 2, domains );
+        q->execute();
+    }
+    if ( known )
+        execute();
 }
 
 
@@ -1220,14 +1712,34 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         return r;
     }
     else if ( t->identifier() == "anyof" ) {
+        // the header tests which the matcher knows can all be
+        // evaluated with one pass over the header fields
+        SieveMatcher * m = t->matcher();
+        bool grouped = false;
+        if ( d->message &&
+             d->message->hasHeaders() && d->message->hasAddresses() ) {
+            grouped = true;
+            List<HeaderField>::Iterator hf( d->message->header()->fields() );
+            while ( hf ) {
+                IntegerSet ids( m->fields( hf->name() ) );
+                if ( !ids.isEmpty() && m->matches( hf->value(), ids ) )
+                    return True;
+                ++hf;
+            }
+        }
+
         Result r = False;
+        uint n = 0;
         List<SieveTest>::Iterator i( t->arguments()->tests() );
         while ( i ) {
-            Result ir = evaluate( i );
-            if ( ir == True )
-                return True;
-            else if ( ir == Undecidable )
-                r = Undecidable;
+            n++;
+            if ( !grouped || !m->handles( n ) ) {
+                Result ir = evaluate( i );
+                if ( ir == True )
+                    return True;
+                else if ( ir == Undecidable )
+                    r = Undecidable;
+            }
             ++i;
         }
         return r;
@@ -1548,6 +2060,15 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
     while ( h ) {
         UString s( *h );
 
+        if ( t->matchType() == SieveTest::Is ||
+             t->matchType() == SieveTest::Contains ||
+             t->matchType() == SieveTest::Matches ) {
+            if ( t->matcher()->matches( s ) )
+                return True;
+            ++h;
+            continue;
+        }
+
         UStringList::Iterator k( t->keys() );
         while ( k ) {
             UString g( *k );
@@ -1866,7 +2387,7 @@ bool Sieve::rejected() const
 bool Sieve::ready() const
 {
     List<SieveData::Recipient>::Iterator i( d->recipients );
-    while ( i && !i->sq )
+    while ( i && !i->lookup )
         ++i;
     if ( i )
         return false;
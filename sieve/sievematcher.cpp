@@ -0,0 +1,453 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sievematcher.h"
+
+#include "integerset.h"
+#include "collation.h"
+#include "mailbox.h"
+#include "dict.h"
+
+
+class SieveMatcherNode
+    : public Garbage
+{
+public:
+    SieveMatcherNode( uint ch )
+        : c( ch ), child( 0 ), sibling( 0 ), fail( 0 ), output( 0 ),
+          ids( 0 ) {}
+
+    SieveMatcherNode * next( uint ch ) const {
+        SieveMatcherNode * n = child;
+        while ( n && n->c != ch )
+            n = n->sibling;
+        return n;
+    }
+
+    uint c;
+    SieveMatcherNode * child;
+    SieveMatcherNode * sibling;
+    SieveMatcherNode * fail;
+    SieveMatcherNode * output;
+    IntegerSet * ids;
+};
+
+
+// An Aho-Corasick automaton: insert() adds keys, and scan() looks for
+// all of them in a single pass over the haystack.
+
+class SieveTrie
+    : public Garbage
+{
+public:
+    SieveTrie(): root( new SieveMatcherNode( 0 ) ), compiled( true ) {
+        uint i = 0;
+        while ( i < 128 )
+            ascii[i++] = 0;
+    }
+
+    void insert( const UString &, uint, Collation * );
+    bool scan( const UString &, Collation *, const IntegerSet * );
+
+private:
+    SieveMatcherNode * go( SieveMatcherNode * n, uint ch ) const {
+        if ( n == root && ch < 128 )
+            return ascii[ch];
+        return n->next( ch );
+    }
+    void compile();
+
+    SieveMatcherNode * root;
+    SieveMatcherNode * ascii[128];
+    bool compiled;
+};
+
+
+class SieveMatcherKey
+    : public Garbage
+{
+public:
+    SieveMatcherKey( const UString & k, SieveTest::MatchType t, uint i )
+        : key( k ), type( t ), id( i ) {}
+
+    UString key;
+    SieveTest::MatchType type;
+    uint id;
+};
+
+
+class SieveMatcherData
+    : public Garbage
+{
+public:
+    SieveMatcherData()
+        : c( 0 ), contains( 0 ), substrings( 0 ), is( 0 ), exact( 0 ),
+          fields( 0 )
+    {}
+
+    Collation * c;
+    SieveTrie * contains;
+    SieveTrie * substrings;
+    Dict<IntegerSet> * is;
+    Dict<IntegerSet> * exact;
+    IntegerSet always;
+    IntegerSet compiled;
+    List<SieveMatcherKey> slow;
+    Dict<IntegerSet> * fields;
+};
+
+
+// Returns true if any of ids is in filter, or if there's no filter.
+
+static bool hit( const IntegerSet * ids, const IntegerSet * filter )
+{
+    if ( !filter )
+        return true;
+    uint i = 1;
+    uint n = ids->count();
+    while ( i <= n ) {
+        if ( filter->contains( ids->value( i ) ) )
+            return true;
+        i++;
+    }
+    return false;
+}
+
+
+// Returns s with each character mapped by c.
+
+static UString folded( const UString & s, Collation * c )
+{
+    UString r;
+    r.reserve( s.length() );
+    uint i = 0;
+    while ( i < s.length() )
+        r.append( c->fold( s[i++] ) );
+    return r;
+}
+
+
+// Records that id is to be reported when s is seen in a haystack.
+
+static void addTo( Dict<IntegerSet> * d, const EString & s, uint id )
+{
+    IntegerSet * ids = d->find( s );
+    if ( !ids ) {
+        ids = new IntegerSet;
+        d->insert( s, ids );
+    }
+    ids->add( id );
+}
+
+
+void SieveTrie::insert( const UString & key, uint id, Collation * c )
+{
+    SieveMatcherNode * n = root;
+    uint i = 0;
+    while ( i < key.length() ) {
+        uint ch = key[i++];
+        if ( c )
+            ch = c->fold( ch );
+        SieveMatcherNode * g = go( n, ch );
+        if ( !g ) {
+            g = new SieveMatcherNode( ch );
+            g->sibling = n->child;
+            n->child = g;
+            if ( n == root && ch < 128 )
+                ascii[ch] = g;
+        }
+        n = g;
+    }
+    if ( !n->ids )
+        n->ids = new IntegerSet;
+    n->ids->add( id );
+    compiled = false;
+}
+
+
+// Computes the failure and output links, breadth first.
+
+void SieveTrie::compile()
+{
+    List<SieveMatcherNode> queue;
+    SieveMatcherNode * n = root->child;
+    while ( n ) {
+        n->fail = root;
+        n->output = 0;
+        queue.append( n );
+        n = n->sibling;
+    }
+    while ( !queue.isEmpty() ) {
+        SieveMatcherNode * u = queue.shift();
+        SieveMatcherNode * v = u->child;
+        while ( v ) {
+            SieveMatcherNode * f = u->fail;
+            SieveMatcherNode * g = go( f, v->c );
+            while ( !g && f != root ) {
+                f = f->fail;
+                g = go( f, v->c );
+            }
+            v->fail = g ? g : root;
+            v->output = v->fail->ids ? v->fail : v->fail->output;
+            queue.append( v );
+            v = v->sibling;
+        }
+    }
+    compiled = true;
+}
+
+
+// Returns true if any key whose id is in filter occurs in s.
+
+bool SieveTrie::scan( const UString & s, Collation * c,
+                      const IntegerSet * filter )
+{
+    if ( !compiled )
+        compile();
+    SieveMatcherNode * n = root;
+    uint i = 0;
+    uint l = s.length();
+    while ( i < l ) {
+        uint ch = s[i++];
+        if ( c )
+            ch = c->fold( ch );
+        SieveMatcherNode * g = go( n, ch );
+        while ( !g && n != root ) {
+            n = n->fail;
+            g = go( n, ch );
+        }
+        n = g ? g : root;
+        SieveMatcherNode * o = n->ids ? n : n->output;
+        while ( o ) {
+            if ( hit( o->ids, filter ) )
+                return true;
+            o = o->output;
+        }
+    }
+    return false;
+}
+
+
+/*! \class SieveMatcher sievematcher.h
+
+    The SieveMatcher class matches a string against many Sieve keys at
+    once.
+
+    SieveTest uses it so that a test with many keys needs only one
+    pass over each header field (or body part), and an anyof test
+    uses it to evaluate all its header tests in one pass over each
+    header field. In the latter case each key is added with the
+    number of its test, and addField() records which header fields
+    each test looks at.
+
+    :contains keys are compiled into an Aho-Corasick automaton and :is
+    keys into a dictionary, provided that the comparator
+    isCharacterwise(). :matches keys of the forms "*text*" and "text"
+    are handled the same way, and any other keys are matched one at a
+    time, as before.
+*/
+
+/*! Constructs an empty SieveMatcher which compares strings using \a
+    c.
+*/
+
+SieveMatcher::SieveMatcher( Collation * c )
+    : d( new SieveMatcherData )
+{
+    d->c = c;
+}
+
+
+/*! Adds \a key, which is to be matched as described by \a type, and
+    records that \a id matches if \a key does. Returns true if \a key
+    could be compiled, and false if it will be matched on its own.
+*/
+
+bool SieveMatcher::add( const UString & key, SieveTest::MatchType type,
+                        uint id )
+{
+    bool characterwise = d->c && d->c->isCharacterwise();
+
+    if ( type == SieveTest::Contains && characterwise ) {
+        if ( key.isEmpty() ) {
+            d->always.add( id );
+        }
+        else {
+            if ( !d->contains )
+                d->contains = new SieveTrie;
+            d->contains->insert( key, id, d->c );
+        }
+        d->compiled.add( id );
+        return true;
+    }
+
+    if ( type == SieveTest::Is && characterwise ) {
+        if ( !d->is )
+            d->is = new Dict<IntegerSet>;
+        addTo( d->is, folded( key, d->c ).utf8(), id );
+        d->compiled.add( id );
+        return true;
+    }
+
+    if ( type == SieveTest::Matches ) {
+        // Mailbox::match() is case sensitive and knows two wildcards
+        uint n = key.length();
+        uint wildcards = 0;
+        bool inner = false;
+        uint i = 0;
+        while ( i < n ) {
+            if ( key[i] == '*' || key[i] == '%' ) {
+                wildcards++;
+                if ( key[i] == '%' || ( i > 0 && i < n - 1 ) )
+                    inner = true;
+            }
+            i++;
+        }
+        if ( !wildcards ) {
+            if ( !d->exact )
+                d->exact = new Dict<IntegerSet>;
+            addTo( d->exact, key.utf8(), id );
+            d->compiled.add( id );
+            return true;
+        }
+        if ( wildcards == n && !key.contains( '%' ) ) {
+            d->always.add( id );
+            d->compiled.add( id );
+            return true;
+        }
+        if ( !inner && wildcards == 2 && key[0] == '*' && key[n-1] == '*' ) {
+            if ( !d->substrings )
+                d->substrings = new SieveTrie;
+            d->substrings->insert( key.mid( 1, n - 2 ), id, 0 );
+            d->compiled.add( id );
+            return true;
+        }
+    }
+
+    d->slow.append( new SieveMatcherKey( key, type, id ) );
+    return false;
+}
+
+
+/*! Returns true if every key given to add() was compiled, and false
+    if some have to be matched one at a time.
+*/
+
+bool SieveMatcher::isComplete() const
+{
+    return d->slow.isEmpty();
+}
+
+
+/*! Returns true if at least one key was added with \a id, and all
+    such keys were compiled.
+*/
+
+bool SieveMatcher::handles( uint id ) const
+{
+    if ( !d->compiled.contains( id ) )
+        return false;
+    List<SieveMatcherKey>::Iterator k( d->slow );
+    while ( k && k->id != id )
+        ++k;
+    return !k;
+}
+
+
+/*! Records that the test numbered \a id looks at the header fields
+    called \a name.
+*/
+
+void SieveMatcher::addField( const EString & name, uint id )
+{
+    if ( !d->fields )
+        d->fields = new Dict<IntegerSet>;
+    addTo( d->fields, name, id );
+}
+
+
+/*! Returns the numbers of the tests which look at header fields
+    called \a name, as recorded by addField().
+*/
+
+IntegerSet SieveMatcher::fields( const EString & name ) const
+{
+    if ( d->fields ) {
+        IntegerSet * ids = d->fields->find( name );
+        if ( ids )
+            return *ids;
+    }
+    return IntegerSet();
+}
+
+
+/*! Returns true if any key matches \a s, and false if none does. */
+
+bool SieveMatcher::matches( const UString & s ) const
+{
+    return scan( s, 0 );
+}
+
+
+/*! Returns true if any key added with an id in \a ids matches \a s,
+    and false otherwise.
+*/
+
+bool SieveMatcher::matches( const UString & s, const IntegerSet & ids ) const
+{
+    return scan( s, &ids );
+}
+
+
+/*! This private helper does the work for matches(), considering only
+    keys whose id is in \a filter, or all keys if \a filter is null.
+*/
+
+bool SieveMatcher::scan( const UString & s, const IntegerSet * filter ) const
+{
+    if ( !d->always.isEmpty() && hit( &d->always, filter ) )
+        return true;
+
+    if ( d->is ) {
+        IntegerSet * ids = d->is->find( folded( s, d->c ).utf8() );
+        if ( ids && hit( ids, filter ) )
+            return true;
+    }
+
+    if ( d->exact ) {
+        IntegerSet * ids = d->exact->find( s.utf8() );
+        if ( ids && hit( ids, filter ) )
+            return true;
+    }
+
+    if ( d->contains && d->contains->scan( s, d->c, filter ) )
+        return true;
+
+    if ( d->substrings && d->substrings->scan( s, 0, filter ) )
+        return true;
+
+    List<SieveMatcherKey>::Iterator k( d->slow );
+    while ( k ) {
+        if ( !filter || filter->contains( k->id ) ) {
+            switch ( k->type ) {
+            case SieveTest::Is:
+                if ( d->c->equals( s, k->key ) )
+                    return true;
+                break;
+            case SieveTest::Contains:
+                if ( d->c->contains( s, k->key ) )
+                    return true;
+                break;
+            case SieveTest::Matches:
+                if ( Mailbox::match( k->key, 0, s, 0 ) == 2 )
+                    return true;
+                break;
+            case SieveTest::Value:
+            case SieveTest::Count:
+                break;
+            }
+        }
+        ++k;
+    }
+
+    return false;
+}
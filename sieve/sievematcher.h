@@ -0,0 +1,36 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SIEVEMATCHER_H
+#define SIEVEMATCHER_H
+
+#include "sieveproduction.h"
+
+
+class Collation;
+class IntegerSet;
+
+
+class SieveMatcher
+    : public Garbage
+{
+public:
+    SieveMatcher( Collation * );
+
+    bool add( const UString &, SieveTest::MatchType, uint = 0 );
+    bool isComplete() const;
+    bool handles( uint ) const;
+
+    void addField( const EString &, uint );
+    IntegerSet fields( const EString & ) const;
+
+    bool matches( const UString & ) const;
+    bool matches( const UString &, const IntegerSet & ) const;
+
+private:
+    class SieveMatcherData * d;
+
+    bool scan( const UString &, const IntegerSet * ) const;
+};
+
+
+#endif
@@ -6,6 +6,7 @@
 #include "sieveparser.h"
 #include "estringlist.h"
 #include "sievenotify.h"
+#include "sievematcher.h"
 #include "collation.h"
 #include "bodypart.h"
 #include "mailbox.h"
@@ -1009,7 +1010,7 @@ public:
           bodyMatchType( SieveTest::Text ),
           headers( 0 ), envelopeParts( 0 ), keys( 0 ),
           contentTypes( 0 ),
-          sizeOver( false ), sizeLimit( 0 )
+          sizeOver( false ), sizeLimit( 0 ), matcher( 0 )
     {}
 
     EString identifier;
@@ -1030,6 +1031,7 @@ public:
     UString zone;
     bool sizeOver;
     uint sizeLimit;
+    SieveMatcher * matcher;
 };
 
 
@@ -1702,6 +1704,63 @@ SieveTest::AddressPart SieveTest::addressPart() const
 }
 
 
+/*! Returns a SieveMatcher for this test, which is created the first
+    time it's needed.
+
+    For most tests, the matcher holds the keys(), so that all keys can
+    be matched in one pass. For an anyof test, it holds the keys of
+    all the header tests in arguments() which use the default
+    comparator and can be compiled completely, each numbered by its
+    position in the list, so that all of them can be evaluated with
+    one pass over each header field.
+*/
+
+SieveMatcher * SieveTest::matcher() const
+{
+    if ( d->matcher )
+        return d->matcher;
+
+    Collation * c = d->comparator;
+    if ( !c )
+        c = Collation::create( us( "i;ascii-casemap" ) );
+    d->matcher = new SieveMatcher( c );
+
+    if ( d->identifier == "anyof" ) {
+        uint n = 0;
+        List<SieveTest>::Iterator i( d->arguments->tests() );
+        while ( i ) {
+            n++;
+            if ( i->identifier() == "header" && !i->comparator() &&
+                 ( i->matchType() == Is || i->matchType() == Contains ||
+                   i->matchType() == Matches ) &&
+                 i->matcher()->isComplete() ) {
+                UStringList::Iterator k( i->keys() );
+                while ( k ) {
+                    d->matcher->add( *k, i->matchType(), n );
+                    ++k;
+                }
+                UStringList::Iterator h( i->headers() );
+                while ( h ) {
+                    d->matcher->addField( h->ascii(), n );
+                    ++h;
+                }
+            }
+            ++i;
+        }
+    }
+    else if ( d->matchType == Is || d->matchType == Contains ||
+              d->matchType == Matches ) {
+        UStringList::Iterator k( d->keys );
+        while ( k ) {
+            d->matcher->add( *k, d->matchType );
+            ++k;
+        }
+    }
+
+    return d->matcher;
+}
+
+
 /*! Returns the comparator specified, or SieveTest::IAsciiCasemap if
     none has been.
 */
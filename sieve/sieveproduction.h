@@ -185,6 +185,8 @@ public:
     bool sizeOverLimit() const;
     uint sizeLimit() const;
 
+    class SieveMatcher * matcher() const;
+
 private:
     UStringList * takeHeaderFieldList( uint );
     void findComparator();
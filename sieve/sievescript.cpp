@@ -6,18 +6,24 @@
 #include "sieveparser.h"
 #include "ustringlist.h"
 #include "estringlist.h"
+#include "allocator.h"
+#include "map.h"
 
 
+static Map<SieveScript> * cache = 0;
+static uint cached = 0;
+
 
 class SieveScriptData
     : public Garbage
 {
 public:
-    SieveScriptData(): Garbage(), script( 0 ), errors( 0 ) {}
+    SieveScriptData(): Garbage(), script( 0 ), errors( 0 ), revision( 0 ) {}
 
     EString source;
     List<SieveCommand> * script;
     List<SieveProduction> * errors;
+    uint revision;
 };
 
 
@@ -210,3 +216,56 @@ List<SieveCommand> * SieveScript::topLevelCommands() const
 {
     return d->script;
 }
+
+
+/*! Returns the cached parsed script with database ID \a id, or a
+    null pointer if there is none, or if the cached copy isn't at
+    revision \a revision.
+
+    The parsed scripts are kept in a per-process cache. Evaluating a
+    script does not change it, so the same object can be used for any
+    number of recipients. The database increments scripts.revision
+    whenever a script's text changes, so comparing the revision is
+    enough to tell whether the cached copy is current, and the text
+    need only be fetched when it isn't.
+*/
+
+SieveScript * SieveScript::find( uint id, uint revision )
+{
+    if ( !::cache )
+        return 0;
+    SieveScript * s = ::cache->find( id );
+    if ( !s || s->d->revision != revision )
+        return 0;
+    return s;
+}
+
+
+/*! Parses \a source, which is revision \a revision of the script
+    with database ID \a id, adds it to the cache used by find(), and
+    returns it.
+*/
+
+SieveScript * SieveScript::add( uint id, uint revision,
+                                const EString & source )
+{
+    if ( !::cache ) {
+        ::cache = new Map<SieveScript>;
+        Allocator::addEternal( ::cache, "parsed sieve scripts" );
+    }
+
+    if ( ::cache->find( id ) )
+        ::cached--;
+
+    if ( ::cached >= 1024 ) {
+        ::cache->clear();
+        ::cached = 0;
+    }
+
+    SieveScript * s = new SieveScript;
+    s->parse( source );
+    s->d->revision = revision;
+    ::cache->insert( id, s );
+    ::cached++;
+    return s;
+}
@@ -22,6 +22,9 @@ public:
 
     List<SieveCommand> * topLevelCommands() const;
 
+    static SieveScript * find( uint, uint );
+    static SieveScript * add( uint, uint, const EString & );
+
 private:
     EString location( uint ) const;
 
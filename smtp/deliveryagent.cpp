@@ -3,12 +3,14 @@
 #include "deliveryagent.h"
 
 #include "spoolmanager.h"
+#include "configuration.h"
 #include "transaction.h"
 #include "estringlist.h"
 #include "smtpclient.h"
 #include "recipient.h"
 #include "injector.h"
 #include "address.h"
+#include "ustring.h"
 #include "fetcher.h"
 #include "message.h"
 #include "graph.h"
@@ -27,8 +29,8 @@ public:
     DeliveryAgentData()
         : messageId( 0 ), t( 0 ),
           qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), expired( false ),
-          dsn( 0 ), injector( 0 ), update( 0 ), client( 0 ),
-          updatedDelivery( false )
+          dsn( 0 ), injector( 0 ), update( 0 ),
+          updatedDelivery( false ), owner( 0 )
     {}
 
     uint messageId;
@@ -42,8 +44,9 @@ public:
     DSN * dsn;
     Injector * injector;
     Query * update;
-    SmtpClient * client;
+    List<SmtpClient> clients;
     bool updatedDelivery;
+    EventHandler * owner;
 };
 
 
@@ -53,12 +56,14 @@ public:
 */
 
 /*! Creates a new DeliveryAgent object to deliver the message with the
-    given \a id.
+    given \a id. \a owner is notified when the agent is no longer
+    working().
 */
 
-DeliveryAgent::DeliveryAgent( uint id )
+DeliveryAgent::DeliveryAgent( uint id, EventHandler * owner )
     : d( new DeliveryAgentData )
 {
+    d->owner = owner;
     setLog( new Log );
     Scope x( log() );
     log( "Attempting delivery for message " + fn( id ) );
@@ -80,8 +85,10 @@ void DeliveryAgent::execute()
 {
     // Fetch and lock the row in deliveries matching (mailbox,uid).
 
-    if ( !d->messageId )
+    if ( !d->messageId ) {
+        done();
         return;
+    }
 
     if ( !d->t ) {
         d->t = new Transaction( this );
@@ -128,8 +135,8 @@ void DeliveryAgent::execute()
     }
     else if ( !d->qs ) {
         d->t->rollback();
-        d->messageId = 0;
         log( "Could not find/lock deliveries row; aborting" );
+        done();
         return;
     }
 
@@ -149,16 +156,14 @@ void DeliveryAgent::execute()
 
         if ( !d->dsn->deliveriesPending() ) {
             d->t->rollback();
-            d->messageId = 0;
             log( "Delivery already completed; will do nothing", Log::Debug );
+            done();
             return;
         }
     }
 
-    if ( !d->client && d->dsn->deliveriesPending() ) {
-        d->client = SmtpClient::provide();
-        d->client->send( d->dsn, this );
-    }
+    if ( d->dsn->deliveriesPending() && !startClients() )
+        return; // we'll be notified when there's a free client
 
     // Once the SmtpClient has updated the action and status for each
     // recipient, we can decide whether or not to spool a bounce.
@@ -201,7 +206,15 @@ void DeliveryAgent::execute()
         return;
     }
 
-    if ( d->t->failed() && d->client && d->client->sent() ) {
+    bool sent = false;
+    List<SmtpClient>::Iterator c( d->clients );
+    while ( c && !sent ) {
+        if ( c->sent() )
+            sent = true;
+        ++c;
+    }
+
+    if ( d->t->failed() && sent ) {
         // We might end up resending copies of messages that we couldn't
         // update during this transaction.
         log( "Delivery attempt worked, but database could not be updated: " +
@@ -211,7 +224,90 @@ void DeliveryAgent::execute()
         SpoolManager::shutdown();
     }
 
+    done();
+}
+
+
+/*! Hands the DSN to one SmtpClient per destination, and returns true
+    if all the clients needed could be had, or false if some are busy
+    and this agent has to wait.
+
+    Normally there is just one destination, the smarthost. If
+    direct-delivery is enabled, each domain among the pending
+    recipients is a destination; recipients in domains which are
+    SmtpClient::backingOff() are delayed without an attempt.
+*/
+
+bool DeliveryAgent::startClients()
+{
+    bool direct = Configuration::toggle( Configuration::DirectDelivery );
+    if ( !direct && !d->clients.isEmpty() )
+        return true;
+
+    EStringList domains;
+    if ( direct ) {
+        List<Recipient>::Iterator i( d->dsn->recipients() );
+        while ( i ) {
+            if ( i->action() == Recipient::Unknown )
+                domains.append(
+                    i->finalRecipient()->domain().utf8().lower() );
+            ++i;
+        }
+        domains.removeDuplicates();
+    }
+    else {
+        domains.append( "" );
+    }
+
+    bool all = true;
+    EStringList::Iterator domain( domains );
+    while ( domain ) {
+        List<SmtpClient>::Iterator c( d->clients );
+        while ( c && c->domain() != *domain )
+            ++c;
+        if ( c ) {
+            // that one's already working on it
+        }
+        else if ( !domain->isEmpty() && SmtpClient::backingOff( *domain ) ) {
+            log( "Not trying " + *domain + " yet, since recent "
+                 "attempts failed" );
+            List<Recipient>::Iterator i( d->dsn->recipients() );
+            while ( i ) {
+                if ( i->action() == Recipient::Unknown &&
+                     i->finalRecipient()->domain().utf8().lower() ==
+                     *domain )
+                    i->setAction( Recipient::Delayed, "4.4.1" );
+                ++i;
+            }
+        }
+        else {
+            SmtpClient * client = SmtpClient::provide( this, *domain );
+            if ( client ) {
+                d->clients.append( client );
+                client->send( d->dsn, this );
+            }
+            else {
+                all = false;
+            }
+        }
+        ++domain;
+    }
+    return all;
+}
+
+
+/*! Records that this agent has finished its work, and notifies the
+    owner once the transaction is no longer working().
+*/
+
+void DeliveryAgent::done()
+{
     d->messageId = 0;
+    if ( d->owner && !working() ) {
+        EventHandler * owner = d->owner;
+        d->owner = 0;
+        owner->notify();
+    }
 }
 
 
@@ -403,6 +499,11 @@ void DeliveryAgent::updateDelivery()
             q->execute();
     }
 
+    // Tell the SpoolManager (in all processes) when to try again.
+    if ( d->t->state() == Transaction::Executing )
+        d->t->enqueue( new Query( "notify deliveries_updated, '" +
+                                  fn( d->messageId ) + "'", 0 ) );
+
     if ( d->dsn->allOk() ) {
         if ( handled )
             log( "Delivered message " + fn( d->messageId ) +
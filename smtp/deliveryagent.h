@@ -18,7 +18,7 @@ class DeliveryAgent
     : public EventHandler
 {
 public:
-    DeliveryAgent( uint );
+    DeliveryAgent( uint, EventHandler * );
 
     uint messageId() const;
 
@@ -35,6 +35,8 @@ private:
     void logDelivery( DSN * );
     Injector * injectBounce( DSN * );
     void updateDelivery();
+    bool startClients();
+    void done();
 };
 
 
@@ -42,6 +42,7 @@ public:
     List<Address> * permittedAddresses;
     List<SmtpRcptTo> * recipients;
     EString body;
+    EString trace;
     Date * now;
     EString id;
 
@@ -230,6 +231,10 @@ void SMTP::execute()
 
     // allow execute() to be called again
     d->executing = false;
+
+    // look up all the recipients given by RCPT TO at once
+    if ( d->sieve )
+        d->sieve->lookupRecipients();
 }
 
 
@@ -276,6 +281,7 @@ void SMTP::reset()
     d->sieve = 0;
     d->recipients = new List<SmtpRcptTo>;
     d->body.truncate();
+    d->trace.truncate();
     d->id.truncate();
     d->now = 0;
 }
@@ -410,6 +416,17 @@ void SMTP::setBody( const EString & b )
 }
 
 
+/*! Appends \a n bytes starting at \a s to what setBody() set. This
+    is cheaper than calling body() and setBody(), since it doesn't
+    need to copy the body so far.
+*/
+
+void SMTP::appendBody( const char * s, uint n )
+{
+    d->body.append( s, n );
+}
+
+
 /*! Returns what setBody() set. Used for SmtpBdat instances to
     coordinate the body.
 */
@@ -420,6 +437,26 @@ EString SMTP::body() const
 }
 
 
+/*! Records \a t as the trace fields for the current transaction.
+    reset() clears this.
+*/
+
+void SMTP::setTrace( const EString & t )
+{
+    d->trace = t;
+}
+
+
+/*! Returns what setTrace() set, or an empty string if setTrace() has
+    not been called since the last reset().
+*/
+
+EString SMTP::trace() const
+{
+    return d->trace;
+}
+
+
 /*! Returns true if \a c is the oldest command in the SMTP server's
     queue of outstanding commands, and false if the queue is empty or
     there is a command older than \a c in the queue.
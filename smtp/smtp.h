@@ -49,7 +49,10 @@ public:
     List<class SmtpRcptTo> * rcptTo() const;
 
     void setBody( const EString & );
+    void appendBody( const char *, uint );
     EString body() const;
+    void setTrace( const EString & );
+    EString trace() const;
 
     bool isFirstCommand( SmtpCommand * ) const;
 
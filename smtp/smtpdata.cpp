@@ -24,19 +24,24 @@
 #include "smtp.h"
 #include "user.h"
 
+#include <string.h> // memchr
+
 
 class SmtpDataData
     : public Garbage
 {
 public:
     SmtpDataData()
-        : state( 2 ), message( 0 ), ok( "OK" )
+        : state( 2 ), message( 0 ), ok( "OK" ),
+          bol( true ), lineLength( 0 )
     {}
 
     EString body;
     uint state;
     Injectee * message;
     EString ok;
+    bool bol;
+    uint lineLength;
 };
 
 
@@ -122,35 +127,16 @@ void SmtpData::execute()
         server()->enqueue( r );
         server()->setInputState( SMTP::Data );
         d->state = 1;
+
+        // the trace fields go first, so message() needn't copy the
+        // body to prepend them.
+        d->body.reserve( 65536 );
+        d->body.append( trace() );
     }
 
     // state 1: have sent 354, have not yet received CR LF "." CR LF.
-    while ( d->state == 1 ) {
-        Buffer * r = server()->readBuffer();
-        EString * line = r->removeLine( 262144 );
-        if ( !line && r->size() > 262144 ) {
-            respond( 500, "Line too long (legal maximum is 998 bytes)",
-                     "5.5.2" );
-            finish();
-            server()->setState( Connection::Closing );
-        }
-        if ( !line )
-            return;
-
-        if ( *line == "." ) {
-            d->state = 2;
-            server()->setInputState( SMTP::Command );
-            server()->setBody( d->body );
-        }
-        else if ( (*line)[0] == '.' ) {
-            d->body.append( line->mid( 1 ) );
-            d->body.append( "\r\n" );
-        }
-        else {
-            d->body.append( *line );
-            d->body.append( "\r\n" );
-        }
-    }
+    if ( d->state == 1 )
+        readData();
 
     // bdat/burl start at state 2.
 
@@ -393,21 +379,105 @@ void SmtpData::checkField( HeaderField::Type t )
 }
 
 
-/*! Parses \a body and returns a pointer to the parsed message,
-    including a prepended Received field.
+/*! Reads as much of the DATA body as is available, copying it to
+    the body with dot-stuffing removed and line endings made into CRLF,
+    and moves on to the next state when the final CR LF "." CR LF has
+    been seen.
 
-    This may also do some of the submission-time changes suggested by
-    RFC 4409.
+    Rather than reading a line at a time, this looks at the read
+    buffer in large chunks, and copies runs of ordinary lines in one
+    go. Only lines which start with a dot or end with a bare LF need
+    special treatment.
+*/
 
-    The prepended Received field uses the transmission information
-    specified by RFC 3848. In general it includes little information
-    if the message came from a logged-in user, much more if not.
+void SmtpData::readData()
+{
+    Buffer * r = server()->readBuffer();
+    while ( d->state == 1 ) {
+        uint n = 0;
+        const char * p = r->firstBytes( n );
+        if ( !n )
+            return;
+
+        uint i = 0;
+        uint run = 0;
+        bool more = false;
+        while ( i < n && d->state == 1 && !more ) {
+            if ( d->bol && p[i] == '.' ) {
+                d->body.append( p + run, i - run );
+                // we need to see what follows the dot
+                char c1 = (*r)[i+1];
+                char c2 = (*r)[i+2];
+                if ( i + 1 >= r->size() ||
+                     ( c1 == '\r' && i + 2 >= r->size() ) ) {
+                    r->remove( i );
+                    return;
+                }
+                if ( c1 == '\n' || ( c1 == '\r' && c2 == '\n' ) ) {
+                    r->remove( i + ( c1 == '\n' ? 2 : 3 ) );
+                    d->state = 2;
+                    server()->setInputState( SMTP::Command );
+                    server()->setBody( d->body );
+                    return;
+                }
+                i++;
+                run = i;
+                d->bol = false;
+                more = i >= n;
+            }
+            else {
+                const char * lf = (const char *)memchr( p + i, '\n', n - i );
+                uint e = n;
+                if ( lf )
+                    e = lf - p;
+                d->lineLength += e - i;
+                if ( d->lineLength > 262144 ) {
+                    respond( 500, "Line too long (legal maximum is 998 bytes)",
+                             "5.5.2" );
+                    finish();
+                    server()->setState( Connection::Closing );
+                    return;
+                }
+                if ( !lf ) {
+                    d->bol = false;
+                    i = n;
+                }
+                else {
+                    bool cr = false;
+                    if ( e > run )
+                        cr = p[e-1] == '\r';
+                    else if ( !d->body.isEmpty() )
+                        cr = d->body[d->body.length()-1] == '\r';
+                    if ( !cr ) {
+                        d->body.append( p + run, e - run );
+                        d->body.append( "\r\n", 2 );
+                        run = e + 1;
+                    }
+                    d->bol = true;
+                    d->lineLength = 0;
+                    i = e + 1;
+                }
+            }
+        }
+        d->body.append( p + run, i - run );
+        r->remove( i );
+    }
+}
+
+
+/*! Returns the trace fields this server adds to the message: a
+    Return-Path field if the sender is known, and a Received field.
+
+    The fields are built once per transaction and kept by the SMTP
+    server, so that DATA, each BDAT chunk and message() all see the
+    same text, even if the sender or the forwarding date changes in
+    the meantime.
 */
 
-Injectee * SmtpData::message( const EString & body )
+EString SmtpData::trace()
 {
-    if ( d->message )
-        return d->message;
+    if ( !server()->trace().isEmpty() )
+        return server()->trace();
 
     EString received( "Received: from " );
     if ( server()->user() ) {
@@ -469,7 +539,34 @@ Injectee * SmtpData::message( const EString & body )
              server()->sieve()->sender()->toString( false ) +
              "\r\n";
 
-    d->body = rp + received + body;
+    server()->setTrace( rp + received );
+    return server()->trace();
+}
+
+
+/*! Parses \a body and returns a pointer to the parsed message,
+    including a prepended Received field.
+
+    This may also do some of the submission-time changes suggested by
+    RFC 4409.
+
+    The prepended Received field uses the transmission information
+    specified by RFC 3848. In general it includes little information
+    if the message came from a logged-in user, much more if not.
+*/
+
+Injectee * SmtpData::message( const EString & body )
+{
+    if ( d->message )
+        return d->message;
+
+    // DATA and BDAT put the trace fields in place before the body
+    // arrives, which spares us a copy of the body here.
+    EString t = trace();
+    if ( body.startsWith( t ) )
+        d->body = body;
+    else
+        d->body = t + body;
     Injectee * m = new Injectee;
     m->parse( d->body );
     // if the sender is another dickhead specifying <> in From to
@@ -590,8 +687,29 @@ void SmtpBdat::execute()
         Buffer * r = server()->readBuffer();
         if ( r->size() < d->size )
             return;
-        d->chunk = r->string( d->size );
-        r->remove( d->size );
+        if ( server()->isFirstCommand( this ) ) {
+            // the common case: we can move the chunk straight from
+            // the read buffer to the body.
+            if ( server()->body().isEmpty() ) {
+                EString t = trace();
+                server()->appendBody( t.data(), t.length() );
+            }
+            uint left = d->size;
+            while ( left ) {
+                uint n = 0;
+                const char * p = r->firstBytes( n );
+                if ( n > left )
+                    n = left;
+                server()->appendBody( p, n );
+                r->remove( n );
+                left -= n;
+            }
+            d->chunk.truncate();
+        }
+        else {
+            d->chunk = r->string( d->size );
+            r->remove( d->size );
+        }
         server()->setInputState( SMTP::Command );
         d->read = true;
     }
@@ -599,9 +717,14 @@ void SmtpBdat::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b = server()->body();
-    b.append( d->chunk );
-    server()->setBody( b );
+    if ( !d->chunk.isEmpty() ) {
+        if ( server()->body().isEmpty() ) {
+            EString t = trace();
+            server()->appendBody( t.data(), t.length() );
+        }
+        server()->appendBody( d->chunk.data(), d->chunk.length() );
+        d->chunk.truncate();
+    }
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -687,9 +810,8 @@ void SmtpBurl::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b( server()->body() );
-    b.append( d->url->text() );
-    server()->setBody( b );
+    EString t = d->url->text();
+    server()->appendBody( t.data(), t.length() );
     if ( d->last ) {
         SmtpData::execute();
     }
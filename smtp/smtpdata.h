@@ -23,8 +23,13 @@ public:
     void checkField( HeaderField::Type );
     bool addressPermitted( Address * ) const;
 
+protected:
+    EString trace();
+
 private:
     class SmtpDataData * d;
+
+    void readData();
 };
 
 
@@ -14,37 +14,151 @@
 #include "smtpclient.h"
 #include "allocator.h"
 #include "scope.h"
+#include "map.h"
+
+#include <time.h>
 
 #define SPOOLINTERVAL    900
 #define SSPOOLINTERVAL  "900"  /* Keep this in sync with SPOOLINTERVAL */
+#define SPOOLRELOAD     3600
 
 
 static SpoolManager * sm;
 static bool shutdown;
 
 
+class SpoolDispatcher
+    : public EventHandler
+{
+public:
+    SpoolDispatcher(): EventHandler() {}
+    void execute() { if ( ::sm ) ::sm->dispatch(); }
+};
+
+
+class SpoolEntry
+    : public Garbage
+{
+public:
+    SpoolEntry( uint m, uint t ): message( m ), due( t ) {}
+
+    uint message;
+    uint due;
+};
+
+
+// A binary min-heap of SpoolEntry objects, ordered by due time.
+
+class SpoolHeap
+    : public Garbage
+{
+public:
+    SpoolHeap(): n( 0 ), size( 0 ), e( 0 ) {}
+
+    bool isEmpty() const { return n == 0; }
+    SpoolEntry * first() const { return n ? e[0] : 0; }
+
+    void insert( SpoolEntry * );
+    SpoolEntry * shift();
+    void clear() { n = 0; size = 0; e = 0; }
+
+private:
+    uint n;
+    uint size;
+    SpoolEntry ** e;
+};
+
+
+void SpoolHeap::insert( SpoolEntry * entry )
+{
+    if ( n == size ) {
+        uint ns = size ? size * 2 : 64;
+        SpoolEntry ** ne
+            = (SpoolEntry**)Allocator::alloc( ns * sizeof( SpoolEntry * ) );
+        uint i = 0;
+        while ( i < n ) {
+            ne[i] = e[i];
+            i++;
+        }
+        e = ne;
+        size = ns;
+    }
+
+    uint i = n++;
+    while ( i > 0 && e[(i-1)/2]->due > entry->due ) {
+        e[i] = e[(i-1)/2];
+        i = (i-1)/2;
+    }
+    e[i] = entry;
+}
+
+
+SpoolEntry * SpoolHeap::shift()
+{
+    if ( !n )
+        return 0;
+    SpoolEntry * r = e[0];
+    SpoolEntry * last = e[--n];
+    e[n] = 0;
+    if ( !n )
+        return r;
+
+    uint i = 0;
+    while ( 2*i + 1 < n ) {
+        uint c = 2*i + 1;
+        if ( c + 1 < n && e[c+1]->due < e[c]->due )
+            c++;
+        if ( last->due <= e[c]->due )
+            break;
+        e[i] = e[c];
+        i = c;
+    }
+    e[i] = last;
+    return r;
+}
+
+
 class SpoolManagerData
     : public Garbage
 {
 public:
     SpoolManagerData()
-        : q( 0 ), t( 0 ), again( false )
+        : q( 0 ), t( 0 ), reload( true ), loadedAt( 0 ),
+          dispatcher( new SpoolDispatcher )
     {}
 
     Query * q;
     Timer * t;
     List<DeliveryAgent> agents;
-    bool again;
+    IntegerSet queue;
+    SpoolHeap heap;
+    Map<SpoolEntry> entries;
+    IntegerSet changed;
+    bool reload;
+    uint loadedAt;
+    SpoolDispatcher * dispatcher;
 };
 
 
 /*! \class SpoolManager spoolmanager.h
 
-    This class periodically attempts to deliver mail from the
-    deliveries table to a smarthost using DeliveryAgent.
+    This class attempts to deliver mail from the deliveries table to a
+    smarthost using DeliveryAgent.
 
     Each archiveopteryx process has only one instance of this class,
     which is created by SpoolManager::setup().
+
+    The SpoolManager keeps the time of the next delivery attempt for
+    each spooled message in memory, in a heap. It loads the entire
+    queue from the database at startup (and once an hour, as a safety
+    net), and after that only looks at the messages named by the
+    deliveries_updated notifications sent by Injector and
+    DeliveryAgent. A Timer wakes it when the first message is due.
+
+    Deliverable messages are queued, and dispatch() keeps a limited
+    number of DeliveryAgent objects working on them. The limit is
+    twice smarthost-connections, so that each SmtpClient has a message
+    ready as soon as it's done with the previous one.
 */
 
 SpoolManager::SpoolManager()
@@ -69,122 +183,190 @@ SpoolManager::SpoolManager()
 
 void SpoolManager::execute()
 {
-    // Fetch a list of spooled messages, and the next time we can try
-    // to deliver each of them.
-
-    uint delay = UINT_MAX;
-
-    if ( !d->q ) {
-        IntegerSet have;
-        List<DeliveryAgent>::Iterator a( d->agents );
-        while ( a ) {
-            if ( a->working() ) {
-                have.add( a->messageId() );
-                delay = SPOOLINTERVAL;
-                ++a;
-            }
-            else {
-                d->agents.take( a );
-            }
-        }
+    if ( d->q && !d->q->done() )
+        return;
 
-        log( "Starting queue run" );
-        d->again = false;
-        reset();
-        EString s( "select d.message, "
-                   "extract(epoch from"
-                   " min(coalesce(dr.last_attempt+interval '"
-                   SSPOOLINTERVAL " s',"
-                   " d.deliver_after,"
-                   " current_timestamp)))::bigint"
-                   "-extract(epoch from current_timestamp)::bigint as delay "
-                   "from deliveries d "
-                   "join delivery_recipients dr on (d.id=dr.delivery) "
-                   "where (dr.action=$1 or dr.action=$2) " );
-        if ( !have.isEmpty() )
-            s.append( "and not d.message=any($3) " );
-        s.append( "group by d.message "
-                  "order by delay" );
-        d->q = new Query( s, this );
-        d->q->bind( 1, Recipient::Unknown );
-        d->q->bind( 2, Recipient::Delayed );
-        if ( !have.isEmpty() )
-            d->q->bind( 3, have );
-        d->q->execute();
+    uint now = (uint)::time( 0 );
+
+    // Record the next delivery attempt for each message we looked at.
+
+    if ( d->q ) {
+        while ( d->q->hasResults() ) {
+            Row * r = d->q->nextRow();
+            uint m = r->getInt( "message" );
+            int64 delay = r->getBigint( "delay" );
+            uint due = now;
+            if ( delay > 0 )
+                due += delay;
+            // if the message is already queued or being delivered, we
+            // look again later, in case the agent's transaction fails
+            // without telling us.
+            if ( ( d->queue.contains( m ) || working( m ) ) &&
+                 due < now + SPOOLINTERVAL )
+                due = now + SPOOLINTERVAL;
+            SpoolEntry * e = new SpoolEntry( m, due );
+            d->entries.insert( m, e );
+            d->heap.insert( e );
+        }
+        d->q = 0;
     }
 
-    if ( d->q && !d->q->done() )
+    if ( ::shutdown )
         return;
 
-    // Is there anything we might do?
+    // Look at the database again if something has changed there.
 
-    if ( d->q && !d->q->rows() ) {
-        // No. Just finish.
-        reset();
-        log( "Ending queue run" );
+    if ( d->reload || now >= d->loadedAt + SPOOLRELOAD ) {
+        log( "Loading the entire spool" );
+        d->reload = false;
+        d->loadedAt = now;
+        d->heap.clear();
+        d->entries.clear();
+        d->changed.clear();
+        d->q = query( 0 );
+        d->q->execute();
         return;
     }
 
-    // Yes. What?
-
-    if ( d->q ) {
-        while ( d->q->hasResults() ) {
-            Row * r = d->q->nextRow();
-            int64 deliverableAt = r->getBigint( "delay" );
-            if ( deliverableAt <= 0 ) {
-                DeliveryAgent * a
-                    = new DeliveryAgent( r->getInt( "message" ) );
-                (void)new Timer( a, d->agents.count() * 5 );
-                d->agents.append( a );
-            }
-            else if ( delay > deliverableAt )
-                delay = deliverableAt;
+    if ( !d->changed.isEmpty() ) {
+        IntegerSet * c = new IntegerSet( d->changed );
+        d->changed.clear();
+        uint i = 1;
+        while ( i <= c->count() ) {
+            d->entries.remove( c->value( i ) );
+            i++;
         }
-        if ( delay < UINT_MAX ) {
-            log( "Will process the queue again in " +
-                 fn( delay ) + " seconds" );
-            d->t = new Timer( this, delay );
+        d->q = query( c );
+        d->q->execute();
+        return;
+    }
+
+    // Queue the messages which are due now, discarding any heap
+    // entries which have been superseded.
+
+    while ( !d->heap.isEmpty() && d->heap.first()->due <= now ) {
+        SpoolEntry * e = d->heap.shift();
+        if ( d->entries.find( e->message ) == e ) {
+            d->entries.remove( e->message );
+            d->queue.add( e->message );
         }
-        d->q = 0;
     }
 
-    reset();
+    delete d->t;
+    d->t = 0;
+    if ( !d->heap.isEmpty() || !d->agents.isEmpty() ) {
+        uint delay = d->loadedAt + SPOOLRELOAD - now;
+        if ( !d->heap.isEmpty() && d->heap.first()->due - now < delay )
+            delay = d->heap.first()->due - now;
+        log( "Will process the queue again in " +
+             fn( delay ) + " seconds", Log::Debug );
+        d->t = new Timer( this, delay );
+    }
+
+    dispatch();
 }
 
 
-/*! This function is called whenever a new row is added to the
-    deliveries table, and updates the state machine so the message
-    will be delivered soon.
+/*! Returns a query to find the next delivery attempt for each message
+    in \a messages, or for every spooled message if \a messages is a
+    null pointer.
 */
 
-void SpoolManager::deliverNewMessage()
+Query * SpoolManager::query( IntegerSet * messages )
 {
-    if ( d->q ) {
-        d->again = true;
-        log( "New message added to spool while spool is being processed",
-             Log::Debug );
-        return;
-    }
-    else {
-        log( "New message added to spool; will deliver when possible" );
-        d->again = true;
-        reset();
+    EString s( "select d.message, "
+               "extract(epoch from"
+               " min(coalesce(dr.last_attempt+interval '"
+               SSPOOLINTERVAL " s',"
+               " d.deliver_after,"
+               " current_timestamp)))::bigint"
+               "-extract(epoch from current_timestamp)::bigint as delay "
+               "from deliveries d "
+               "join delivery_recipients dr on (d.id=dr.delivery) "
+               "where (dr.action=$1 or dr.action=$2) " );
+    if ( messages )
+        s.append( "and d.message=any($3) " );
+    s.append( "group by d.message" );
+    Query * q = new Query( s, this );
+    q->bind( 1, Recipient::Unknown );
+    q->bind( 2, Recipient::Delayed );
+    if ( messages )
+        q->bind( 3, *messages );
+    return q;
+}
+
+
+/*! Returns true if a DeliveryAgent is working on message \a m now, and
+    false if not.
+*/
+
+bool SpoolManager::working( uint m ) const
+{
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        if ( a->messageId() == m && a->working() )
+            return true;
+        ++a;
     }
+    return false;
 }
 
 
+/*! Discards the DeliveryAgent objects which have finished, and starts
+    new ones for queued messages, up to the concurrency limit. The
+    limit is twice the number of smarthost connections, or four times
+    if direct-delivery is enabled, since then the messages are spread
+    over many servers.
+*/
+
+void SpoolManager::dispatch()
+{
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        if ( a->working() )
+            ++a;
+        else
+            d->agents.take( a );
+    }
 
-/*! Resets the perishable state of this SpoolManager, i.e. all but the
-    Timer. Provided for convenience.
+    uint limit =
+        2 * Configuration::scalar( Configuration::SmartHostConnections );
+    if ( Configuration::toggle( Configuration::DirectDelivery ) )
+        limit = 2 * limit;
+    if ( limit < 2 )
+        limit = 2;
+
+    while ( !::shutdown && !d->queue.isEmpty() &&
+            d->agents.count() < limit ) {
+        uint m = d->queue.smallest();
+        d->queue.remove( m );
+        if ( working( m ) )
+            continue;
+        DeliveryAgent * a = new DeliveryAgent( m, d->dispatcher );
+        d->agents.append( a );
+        a->execute();
+    }
+}
+
+
+/*! This function is called whenever the deliveries table changes.
+    \a message is the ID of the message whose deliveries changed, or
+    0 if the change is unknown, in which case the entire spool is
+    loaded again.
 */
 
-void SpoolManager::reset()
+void SpoolManager::deliverNewMessage( uint message )
 {
-    delete d->t;
-    d->t = 0;
-    if ( d->again )
-        d->t = new Timer( this, 1 );
-    d->q = 0;
+    if ( message ) {
+        log( "Spool changed for message " + fn( message ), Log::Debug );
+        d->changed.add( message );
+    }
+    else {
+        log( "Spool changed; will reload it" );
+        d->reload = true;
+    }
+    if ( !d->q )
+        execute();
 }
 
 
@@ -193,7 +375,12 @@ class SpoolRunner
 {
 public:
     SpoolRunner(): EventHandler() {}
-    void execute() { if ( ::sm ) ::sm->deliverNewMessage(); }
+    void execute() {
+        bool ok = false;
+        uint m = DatabaseSignal::payload().number( &ok );
+        if ( ::sm )
+            ::sm->deliverNewMessage( ok ? m : 0 );
+    }
 };
 
 
@@ -225,6 +412,11 @@ void SpoolManager::shutdown()
         delete sm->d->t;
         sm->d->t = 0;
     }
+    if ( ::sm ) {
+        sm->d->queue.clear();
+        sm->d->heap.clear();
+        sm->d->entries.clear();
+    }
     ::sm = 0;
     ::shutdown = true;
     ::log( "Shutting down outgoing mail due to software problem. "
@@ -6,6 +6,9 @@
 #include "event.h"
 
 
+class Query;
+class IntegerSet;
+
 class SpoolManager
     : public EventHandler
 {
@@ -17,11 +20,14 @@ public:
     static void setup();
     static void shutdown();
 
-    void deliverNewMessage();
+    void deliverNewMessage( uint );
+    void dispatch();
 
 private:
     class SpoolManagerData * d;
-    void reset();
+
+    Query * query( IntegerSet * );
+    bool working( uint ) const;
 };
 
 
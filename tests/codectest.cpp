@@ -0,0 +1,185 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "codec.h"
+#include "ustring.h"
+#include "estringlist.h"
+
+
+// This checks that the codecs which copy runs of ASCII in bulk
+// decode a string just as they decode its characters one by one.
+//
+// Each input is made of random characters, each encoded separately
+// with the codec's own fromUnicode(). Runs of printable ASCII are
+// likely, and so are control characters and non-ASCII characters.
+// The result of decoding the whole input must equal the results of
+// decoding each character's bytes with a fresh codec, and the
+// codec's state must be the worst of theirs.
+//
+// The stateful ISO-2022 codecs, UTF-7 and UTF-16, and codecs which
+// don't map ASCII to itself, aren't tested.
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+// Returns a random code point, probably one many codecs support.
+
+static uint character()
+{
+    static const uint ranges[] = {
+        0x80, 0x180, // latin-1 and latin extended-a
+        0x370, 0x480, // greek and cyrillic
+        0x5d0, 0x650, // hebrew and arabic
+        0xe00, 0xe60, // thai
+        0x2010, 0x2130, // punctuation, currency, letterlike
+        0x3000, 0x3100, // cjk punctuation, kana
+        0x4e00, 0x5200, // cjk ideographs
+        0xac00, 0xad00, // hangul
+        0x1f600, 0x1f650, // emoji
+    };
+    uint k = random( 10 );
+    if ( k < 5 )
+        return 32 + random( 95 );
+    if ( k < 6 )
+        return "\t\r\n\001\033\177\000"[random( 7 )];
+    k = random( sizeof( ranges ) / sizeof( uint ) / 2 ) * 2;
+    return ranges[k] + random( ranges[k+1] - ranges[k] );
+}
+
+
+// Returns an input for the codec named n, as a list of pieces which
+// each decode the same way alone as in sequence.
+
+static EStringList * pieces( const EString & n )
+{
+    EStringList * l = new EStringList;
+    Codec * c = Codec::byName( n );
+    uint count = random( 200 );
+    while ( l->count() < count ) {
+        uint ch = character();
+        uint run = 1;
+        if ( ch >= 32 && ch < 127 )
+            run = 1 + random( 40 );
+        while ( run-- ) {
+            UString u;
+            u.append( ch );
+            l->append( c->fromUnicode( u ) );
+            ch = 32 + random( 95 );
+        }
+        if ( n == "utf-8" && !random( 20 ) ) {
+            // some malformed UTF-8: a byte which is never valid, a
+            // lead byte without its continuation byte and a lone
+            // leading surrogate
+            l->append( EString( "\377\303\355\240\200" ).mid( random( 3 ),
+                                                              1 ) );
+            if ( !random( 3 ) )
+                l->append( "\355\240\200" );
+        }
+    }
+    return l;
+}
+
+
+static void testCodec( const EString & n, uint rounds )
+{
+    uint bad = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        EStringList * l = pieces( n );
+
+        UString expected;
+        Codec::State worst = Codec::Valid;
+        EString input;
+        EStringList::Iterator p( l );
+        while ( p ) {
+            Codec * c = Codec::byName( n );
+            expected.append( c->toUnicode( *p ) );
+            if ( c->state() > worst )
+                worst = c->state();
+            input.append( *p );
+            ++p;
+        }
+
+        Codec * c = Codec::byName( n );
+        UString got = c->toUnicode( input );
+        if ( got == expected && c->state() == worst )
+            continue;
+        if ( !bad++ )
+            first = n + ": decoding " + input.quoted() + " gave " +
+                    got.utf8().quoted() + " (state " + fn( c->state() ) +
+                    "), one by one " + expected.utf8().quoted() +
+                    " (state " + fn( worst ) + ")";
+    }
+    Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+}
+
+
+// Times decoding a megabyte of text which is mostly ASCII with the
+// codec named n, and copying it into a UString a character at a time
+// as the codecs used to.
+
+static void benchmark( const EString & n )
+{
+    UString text;
+    while ( text.length() < 1024 * 1024 ) {
+        uint c = 32 + random( 95 );
+        if ( !random( 50 ) )
+            c = 0xe0 + random( 32 );
+        else if ( !random( 70 ) )
+            c = 10;
+        text.append( c );
+    }
+    EString s = Codec::byName( n )->fromUnicode( text );
+
+    int64 t = Tests::now();
+    uint i = 0;
+    while ( i < 100 ) {
+        Codec::byName( n )->toUnicode( s );
+        i++;
+    }
+    Tests::reportTime( n + ", 100MB", t );
+
+    t = Tests::now();
+    i = 0;
+    while ( i < 100 ) {
+        UString u;
+        u.reserve( s.length() );
+        uint j = 0;
+        while ( j < s.length() )
+            u.append( (uint)s[j++] );
+        i++;
+    }
+    Tests::reportTime( n + ", 100MB, one character at a time", t );
+}
+
+
+void testCodecs()
+{
+    UString a;
+    a.append( "A\t\r\n~" );
+    EStringList::Iterator n( Codec::allCodecNames() );
+    while ( n ) {
+        if ( !n->contains( "2022" ) && !n->startsWith( "utf-7" ) &&
+             !n->startsWith( "utf-16" ) &&
+             Codec::byName( *n )->fromUnicode( a ) == "A\t\r\n~" )
+            testCodec( *n, 100 );
+        ++n;
+    }
+
+    if ( Tests::benchmarking() ) {
+        benchmark( "utf-8" );
+        benchmark( "iso-8859-1" );
+        benchmark( "windows-1252" );
+        benchmark( "gbk" );
+    }
+}
@@ -0,0 +1,298 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "date.h"
+#include "list.h"
+#include "allocator.h"
+
+
+// This checks the two shortcuts Date takes.
+//
+// Date::setRfc822() recognises dates in the canonical form, "Tue, 1
+// Jul 2003 10:52:37 +0200", without using EmailParser. Each input is
+// parsed as it is, and again with a leading space, which the shortcut
+// rejects, so that the full parser handles it. Most inputs are
+// canonical; some are damaged so that they're invalid or only just
+// acceptable. Both must give the same date.
+//
+// rfc822() and imap() remember the latest rendering of a few hundred
+// dates. Many dates which differ only in one detail are rendered
+// again and again, and each rendering must match one built from the
+// date's parts.
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+static const char * weekdays[] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+
+static const char * months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+
+// Returns n as a string of at least width digits.
+
+static EString digits( uint n, uint width )
+{
+    EString r = fn( n );
+    while ( r.length() < width )
+        r = "0" + r;
+    return r;
+}
+
+
+// Returns a date, probably in canonical form.
+
+static EString date()
+{
+    EString r;
+    uint k = random( 10 );
+    if ( k < 6 )
+        r.append( weekdays[random( 7 )] );
+    else if ( k < 7 )
+        r.append( "xyz" );
+    if ( !r.isEmpty() )
+        r.append( ", " );
+
+    uint day = random( 33 );
+    if ( !random( 4 ) )
+        r.append( digits( day, 2 ) );
+    else
+        r.append( fn( day ) );
+    r.append( " " );
+
+    if ( random( 10 ) )
+        r.append( months[random( 12 )] );
+    else
+        r.append( EString( "janJULfooDEC" ).mid( random( 4 ) * 3, 3 ) );
+    r.append( " " );
+
+    uint year = 1590 + random( 600 );
+    if ( !random( 10 ) )
+        r.append( fn( year % 100 ) );
+    else
+        r.append( digits( year, 4 ) );
+
+    r.append( " " + digits( random( 26 ), 2 ) +
+              ":" + digits( random( 62 ), 2 ) +
+              ":" + digits( random( 62 ), 2 ) );
+    r.append( random( 3 ) ? " +" : " -" );
+    r.append( digits( random( 16 ), 2 ) + digits( random( 62 ), 2 ) );
+    if ( !random( 15 ) )
+        r.append( " (PDT)" );
+    else if ( !random( 20 ) )
+        r.append( " x" );
+
+    if ( !random( 10 ) ) {
+        uint i = random( r.length() );
+        r = r.mid( 0, i ) + EString( " :,+-0aZ9" ).mid( random( 9 ), 1 ) +
+            r.mid( i + 1 );
+    }
+    return r;
+}
+
+
+// Returns a description of d, for comparing it with another.
+
+static EString describe( Date & d )
+{
+    if ( !d.valid() )
+        return "invalid";
+    return d.rfc822() + " | " + d.imap() + " | " + fn( d.unixTime() ) +
+        " | " + fn( d.offset() );
+}
+
+
+static void testCanonical( uint rounds )
+{
+    uint bad = 0;
+    uint valid = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        EString s = date();
+        Date fast;
+        fast.setRfc822( s );
+        Date full;
+        full.setRfc822( " " + s );
+        if ( fast.valid() )
+            valid++;
+        EString a = describe( fast );
+        EString b = describe( full );
+        if ( a != b && !bad++ )
+            first = "parsing " + s.quoted() + " gave " + a.quoted() +
+                    ", the full parser " + b.quoted();
+    }
+    Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+    Tests::check( valid > rounds / 3 && valid < rounds,
+                  "Only " + fn( valid ) + " of " + fn( rounds ) +
+                  " dates were valid" );
+}
+
+
+class Rendering
+    : public Garbage
+{
+public:
+    Rendering(): date( 0 ) {}
+
+    Date * date;
+    EString rfc822;
+    EString imap;
+};
+
+
+// Checks that r->date renders as expected, and describes the first
+// mismatch in first.
+
+static uint check( Rendering * r, EString & first )
+{
+    EString a = r->date->rfc822();
+    EString b = r->date->imap();
+    if ( a == r->rfc822 && b == r->imap )
+        return 0;
+    if ( first.isEmpty() )
+        first = "rendered " + a.quoted() + " and " + b.quoted() +
+                ", expected " + r->rfc822.quoted() + " and " +
+                r->imap.quoted();
+    return 1;
+}
+
+
+static void testCache( uint rounds )
+{
+    List<Rendering> renderings;
+    uint bad = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        // few distinct times, so that many dates differ in one part
+        uint year = 2000 + random( 4 );
+        uint month = 1 + random( 12 );
+        uint day = 1 + random( 28 );
+        uint hour = random( 2 );
+        uint minute = random( 2 ) * 30;
+        uint second = random( 2 );
+        int zone = 0;
+        if ( random( 3 ) )
+            zone = ( (int)random( 25 ) - 12 ) * 60;
+
+        Date * d = new Date;
+        d->setDate( year, month, day, hour, minute, second, zone );
+
+        EString time = digits( hour, 2 ) + ":" + digits( minute, 2 ) +
+                       ":" + digits( second, 2 );
+        EString z = ( zone < 0 ? "-" : "+" ) +
+                    digits( ( zone < 0 ? -zone : zone ) / 60, 2 ) + "00";
+        EString canonical = fn( day ) + " " + months[month-1] + " " +
+                            fn( year ) + " " + time;
+
+        Rendering * x = new Rendering;
+        x->date = d;
+        x->rfc822 = EString( weekdays[d->weekday()] ) + ", " +
+                    canonical + " " + z;
+        x->imap = digits( day, 2 ) + "-" + months[month-1] + "-" +
+                  fn( year ) + " " + time + " " + z;
+        renderings.append( x );
+
+        if ( !zone ) {
+            // the same time, but -0000 or named
+            Rendering * y = new Rendering;
+            y->date = new Date;
+            if ( random( 2 ) ) {
+                y->date->setRfc822( canonical + " -0000" );
+                y->rfc822 = EString( weekdays[d->weekday()] ) + ", " +
+                            canonical + " -0000";
+                y->imap = x->imap.mid( 0, x->imap.length() - 5 ) +
+                          "-0000";
+            }
+            else {
+                y->date->setRfc822( canonical + " +0000 (GMT)" );
+                y->rfc822 = x->rfc822 + " (GMT)";
+                y->imap = x->imap;
+            }
+            renderings.append( y );
+            bad += check( y, first );
+        }
+
+        bad += check( x, first );
+        bad += check( x, first );
+    }
+
+    List<Rendering>::Iterator i( renderings );
+    while ( i ) {
+        bad += check( i, first );
+        ++i;
+    }
+
+    Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+}
+
+
+static volatile int sink;
+
+
+// Parses and renders each of dates 100000 times, and reports the time
+// as what. The garbage is freed every 1000 dates, since allocation
+// slows down as the heap grows, so no EString may live across the
+// loop.
+
+static void time( const char ** dates, const char * what )
+{
+    Allocator::free();
+    int64 t = Tests::now();
+    uint i = 0;
+    while ( i < 100000 ) {
+        Date d;
+        d.setRfc822( dates[i % 4] );
+        sink += d.rfc822().length() + d.imap().length();
+        i++;
+        if ( i % 1000 == 0 )
+            Allocator::free();
+    }
+    Tests::reportTime( EString( what ) + ", 100000 dates", t );
+}
+
+
+// Times a few common dates via the shortcut and via the full parser.
+
+static void benchmark()
+{
+    static const char * canonical[] = {
+        "Tue, 1 Jul 2003 10:52:37 +0200",
+        "Wed, 22 Oct 2008 16:02:11 -0700",
+        "1 Jan 2009 00:00:00 +0000",
+        "Fri, 13 Feb 2009 23:31:30 +0100"
+    };
+    static const char * spaced[] = {
+        " Tue, 1 Jul 2003 10:52:37 +0200",
+        " Wed, 22 Oct 2008 16:02:11 -0700",
+        " 1 Jan 2009 00:00:00 +0000",
+        " Fri, 13 Feb 2009 23:31:30 +0100"
+    };
+    time( canonical, "canonical" );
+    time( spaced, "full parser" );
+}
+
+
+void testDate()
+{
+    testCanonical( 20000 );
+    testCache( 5000 );
+
+    if ( Tests::benchmarking() )
+        benchmark();
+}
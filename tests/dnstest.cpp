@@ -0,0 +1,312 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "timer.h"
+#include "event.h"
+#include "buffer.h"
+#include "listener.h"
+#include "dnsquery.h"
+#include "endpoint.h"
+#include "estringlist.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "configuration.h"
+
+// socket, bind, getsockname, recvfrom, sendto
+#include <sys/types.h>
+#include <sys/socket.h>
+// sockaddr_in
+#include <netinet/in.h>
+// memset
+#include <string.h>
+
+
+// This tests DnsQuery and Connection::connect() against a stand-in
+// name server on 127.0.0.1, which knows these names:
+//
+// single.test: one A record, 127.0.0.1. Connecting to it reaches the
+// stand-in's own TCP port.
+//
+// truncated.test: via UDP, a truncated reply without answers; via
+// TCP, one A record, 127.0.0.2.
+//
+// compressed.test: two MX records, preference 20 and 10, whose names
+// are compressed relative to the question.
+//
+// Other names exist, but have no records.
+//
+// The stand-in also checks that no two UDP queries come from the same
+// source port.
+
+
+static uint word( const EString & p, uint i )
+{
+    return ( (uint)(unsigned char)p[i] << 8 ) + (unsigned char)p[i+1];
+}
+
+
+static void appendWord( EString & p, uint w )
+{
+    p.append( (char)( w >> 8 ) );
+    p.append( (char)( w & 0xff ) );
+}
+
+
+// Appends a resource record for the question's name, of the given
+// type and with the given data, to p.
+
+static void appendRecord( EString & p, uint type, const EString & data )
+{
+    appendWord( p, 0xc00c ); // the name in the question
+    appendWord( p, type );
+    appendWord( p, 1 ); // IN
+    appendWord( p, 0 );
+    appendWord( p, 60 ); // TTL
+    appendWord( p, data.length() );
+    p.append( data );
+}
+
+
+// Returns the stand-in's reply to the query q, which arrived via TCP
+// if tcp is true.
+
+static EString reply( const EString & q, bool tcp )
+{
+    if ( q.length() < 17 )
+        return "";
+
+    EString name;
+    uint i = 12;
+    while ( i < q.length() && q[i] ) {
+        if ( !name.isEmpty() )
+            name.append( '.' );
+        name.append( q.mid( i + 1, (unsigned char)q[i] ) );
+        i += 1 + (unsigned char)q[i];
+    }
+    uint type = word( q, i + 1 );
+    EString question = q.mid( 12, i + 5 - 12 );
+
+    EString answers;
+    uint n = 0;
+    bool truncated = false;
+    if ( name == "single.test" && type == DnsQuery::A ) {
+        appendRecord( answers, type, EString( "\177\0\0\1", 4 ) );
+        n++;
+    }
+    else if ( name == "truncated.test" && type == DnsQuery::A ) {
+        if ( tcp ) {
+            appendRecord( answers, type, EString( "\177\0\0\2", 4 ) );
+            n++;
+        }
+        else {
+            truncated = true;
+        }
+    }
+    else if ( name == "compressed.test" && type == DnsQuery::Mx ) {
+        EString mx;
+        appendWord( mx, 20 );
+        mx.append( "\003mx1" );
+        appendWord( mx, 0xc00c );
+        appendRecord( answers, type, mx );
+        mx.truncate();
+        appendWord( mx, 10 );
+        mx.append( "\003mx2" );
+        appendWord( mx, 0xc00c );
+        appendRecord( answers, type, mx );
+        n += 2;
+    }
+
+    EString r;
+    r.append( q.mid( 0, 2 ) );
+    appendWord( r, truncated ? 0x8380 : 0x8180 );
+    appendWord( r, 1 );
+    appendWord( r, n );
+    appendWord( r, 0 );
+    appendWord( r, 0 );
+    r.append( question );
+    r.append( answers );
+    return r;
+}
+
+
+class StandInTcp
+    : public Connection
+{
+public:
+    StandInTcp( int fd )
+        : Connection( fd, Connection::Client )
+    {
+        EventLoop::global()->addConnection( this );
+    }
+
+    void react( Event e )
+    {
+        if ( e != Read ) {
+            setState( Closing );
+            return;
+        }
+        Buffer * r = readBuffer();
+        if ( r->size() < 2 )
+            return;
+        uint n = ( (unsigned char)(*r)[0] << 8 ) + (unsigned char)(*r)[1];
+        if ( r->size() < n + 2 )
+            return;
+        r->remove( 2 );
+        EString p = reply( r->string( n ), true );
+        r->remove( n );
+        EString l;
+        appendWord( l, p.length() );
+        enqueue( l + p );
+    }
+};
+
+
+class StandIn
+    : public Connection
+{
+public:
+    StandIn()
+        : Connection( ::socket( AF_INET, SOCK_DGRAM, 0 ),
+                      Connection::Client ),
+          port( 0 ), received( 0 )
+    {
+        // any free port will do
+        struct sockaddr_in a;
+        memset( &a, 0, sizeof( a ) );
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        socklen_t l = sizeof( a );
+        if ( ::bind( fd(), (struct sockaddr *)&a, l ) < 0 ||
+             ::getsockname( fd(), (struct sockaddr *)&a, &l ) < 0 )
+            return;
+        port = ntohs( a.sin_port );
+        setState( Connected );
+        EventLoop::global()->addConnection( this );
+    }
+
+    uint port;
+    uint received;
+    EStringList sources;
+
+    void read()
+    {
+        char b[65536];
+        struct sockaddr_in a;
+        socklen_t l = sizeof( a );
+        int n;
+        while ( (n=::recvfrom( fd(), b, sizeof( b ), 0,
+                               (struct sockaddr *)&a, &l )) >= 0 ) {
+            received++;
+            EString source = fn( ntohs( a.sin_port ) );
+            if ( !sources.contains( source ) )
+                sources.append( source );
+            EString r = reply( EString( b, n ), false );
+            if ( !r.isEmpty() )
+                ::sendto( fd(), r.data(), r.length(), 0,
+                          (struct sockaddr *)&a, l );
+            l = sizeof( a );
+        }
+    }
+
+    void react( Event ) {}
+};
+
+
+// Connects to a domain name and records whether that succeeds.
+
+class Probe
+    : public Connection
+{
+public:
+    Probe( EventHandler * o, const EString & name, uint port )
+        : Connection(), owner( o ), connected( false ), finished( false )
+    {
+        connect( name, port );
+        // as SmtpClient does, before the name has been looked up
+        EventLoop::global()->addConnection( this );
+    }
+
+    EventHandler * owner;
+    bool connected;
+    bool finished;
+
+    void react( Event e )
+    {
+        if ( e == Connect )
+            connected = true;
+        finished = true;
+        setState( Closing );
+        owner->notify();
+    }
+};
+
+
+class DnsTest
+    : public EventHandler
+{
+public:
+    DnsTest( StandIn * s )
+        : udp( s ), single( 0 ), truncated( 0 ), compressed( 0 ),
+          probe( 0 ), timer( 0 )
+    {
+        timer = new Timer( this, 20 );
+        single = new DnsQuery( "single.test", DnsQuery::A, this );
+        truncated = new DnsQuery( "truncated.test", DnsQuery::A, this );
+        compressed = new DnsQuery( "compressed.test", DnsQuery::Mx, this );
+        single->execute();
+        truncated->execute();
+        compressed->execute();
+        probe = new Probe( this, "single.test", udp->port );
+    }
+
+    StandIn * udp;
+    DnsQuery * single;
+    DnsQuery * truncated;
+    DnsQuery * compressed;
+    Probe * probe;
+    Timer * timer;
+
+    void execute()
+    {
+        if ( timer->active() &&
+             ( !single->done() || !truncated->done() ||
+               !compressed->done() || !probe->finished ) )
+            return;
+
+        Tests::compare( single->answers().join( " " ), "127.0.0.1",
+                        "A record" );
+        Tests::compare( truncated->answers().join( " " ), "127.0.0.2",
+                        "A record after truncated UDP reply" );
+        Tests::compare( compressed->answers().join( " " ),
+                        "mx2.compressed.test mx1.compressed.test",
+                        "MX records with compressed names" );
+        Tests::check( probe->connected,
+                      "connect() to a name with one A record" );
+        Tests::check( udp->received >= 3 &&
+                      udp->sources.count() == udp->received,
+                      "Each UDP query from its own port (" +
+                      fn( udp->received ) + " queries from " +
+                      fn( udp->sources.count() ) + " ports)" );
+        EventLoop::global()->stop();
+    }
+};
+
+
+void testDnsQuery()
+{
+    StandIn * udp = new StandIn;
+    Tests::check( udp->port != 0, "stand-in name server started" );
+    if ( !udp->port )
+        return;
+    (void)new Listener<StandInTcp>( Endpoint( "127.0.0.1", udp->port ),
+                                    "stand-in name server" );
+
+    Configuration::add( "dns-server = 127.0.0.1" );
+    Configuration::add( "dns-port = " + fn( udp->port ) );
+    Configuration::add( "use-ipv6 = false" );
+    DnsQuery::setup();
+
+    (void)new DnsTest( udp );
+    EventLoop::global()->start();
+}
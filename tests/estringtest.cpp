@@ -0,0 +1,513 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "allocator.h"
+#include "estringlist.h"
+
+// strchr
+#include <string.h>
+
+
+// This checks EString's base64 and quoted-printable functions, which
+// use StringKernel for the bulk of their input, against the
+// character-at-a-time code they replaced, which is copied below.
+//
+// For base64, random binary strings are encoded with several line
+// lengths, including none, ones which aren't multiples of four, and
+// lengths which need each kind of padding. The encoding must equal
+// the old one, keep to the line length, and decode to the original.
+// Encodings damaged with white space, garbage, early padding and
+// truncation must decode as before.
+//
+// For quoted-printable, random text with long and short lines, bare
+// CR and LF, trailing white space, '=', 8-bit characters, "From " and
+// boundary-like lines is encoded in each of the four modes. The
+// encoding must equal the old one, have no line longer than 76
+// characters, and decode to the original. Random input with good,
+// bad and truncated escapes and soft line breaks must decode as
+// before.
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+static const char * to64 =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+// Returns the value of the base64 digit c, 64 for '=' and NUL, which
+// end the old de64(), and 99 for anything it ignores.
+
+static uint from64( uint c )
+{
+    if ( c == '=' || c == 0 )
+        return 64;
+    const char * p = c < 128 ? strchr( to64, c ) : 0;
+    if ( p )
+        return p - to64;
+    return 99;
+}
+
+
+static EString oldDe64( const EString & s )
+{
+    EString r;
+    uint decoded = 0;
+    uint m = 0;
+    uint p = 0;
+    bool done = false;
+    while ( p < s.length() && !done ) {
+        uint c = from64( (unsigned char)s[p++] );
+        if ( c < 64 ) {
+            switch ( m ) {
+            case 0:
+                decoded = c << 2;
+                break;
+            case 1:
+                decoded += ( (c & 0xf0) >> 4 );
+                r.append( (char)decoded );
+                decoded = (c & 15) << 4;
+                break;
+            case 2:
+                decoded += ( (c & 0xfc) >> 2 );
+                r.append( (char)decoded );
+                decoded = (c & 3) << 6;
+                break;
+            case 3:
+                decoded += c;
+                r.append( (char)decoded );
+                break;
+            }
+            m = (m+1)&3;
+        }
+        else if ( c == 64 ) {
+            done = true;
+        }
+    }
+    return r;
+}
+
+
+static EString oldE64( const EString & s, uint lineLength )
+{
+    uint l = s.length();
+    uint i = 0;
+    uint c = 0;
+    EString r;
+    while ( i + 3 <= l ) {
+        uint w = ( (unsigned char)s[i] << 16 ) |
+                 ( (unsigned char)s[i+1] << 8 ) | (unsigned char)s[i+2];
+        r.append( to64[w >> 18] );
+        r.append( to64[( w >> 12 ) & 63] );
+        r.append( to64[( w >> 6 ) & 63] );
+        r.append( to64[w & 63] );
+        i += 3;
+        c += 4;
+        if ( lineLength > 0 && c >= lineLength ) {
+            r.append( "\r\n" );
+            c = 0;
+        }
+    }
+    if ( i < l ) {
+        uint i0 = (unsigned char)s[i];
+        uint i1 = i+1 < l ? (unsigned char)s[i+1] : 0;
+        r.append( to64[i0 >> 2] );
+        r.append( to64[( ( i0 << 4 ) & 48 ) + ( i1 >> 4 )] );
+        if ( i+1 < l )
+            r.append( to64[( i1 << 2 ) & 60] );
+        else
+            r.append( '=' );
+        r.append( '=' );
+    }
+    if ( lineLength > 0 && c > 0 )
+        r.append( "\r\n" );
+    return r;
+}
+
+
+static EString oldDeQP( const EString & s, bool underscore )
+{
+    uint i = 0;
+    EString r;
+    uint l = s.length();
+    while ( i < l ) {
+        if ( s[i] != '=' ) {
+            char c = s[i++];
+            if ( underscore && c == '_' )
+                c = ' ';
+            r.append( c );
+        }
+        else {
+            bool ok = false;
+            uint c = 0;
+            bool eol = false;
+            uint j = i+1;
+            while ( j < l && ( s[j] == ' ' || s[j] == '\t' ) )
+                j++;
+            if ( j < l && s[j] == 10 ) {
+                eol = true;
+                j++;
+            }
+            else if ( j + 1 < l && s[j] == 13 && s[j+1] == 10 ) {
+                eol = true;
+                j = j + 2;
+            }
+            else if ( i + 2 < l ) {
+                c = s.mid( i+1, 2 ).number( &ok, 16 );
+            }
+
+            if ( eol ) {
+                i = j;
+            }
+            else if ( ok ) {
+                r.append( (char)c );
+                i = i + 3;
+            }
+            else {
+                r.append( s[i++] );
+            }
+        }
+    }
+    return r;
+}
+
+
+static bool maybeBoundary( const EString & s, uint i )
+{
+    if ( s.length() < i + 2 )
+        return false;
+    if ( s[i] != '-' || s[i+1] != '-' )
+        return false;
+    while ( i < s.length() && (unsigned char)s[i] >= ' ' ) {
+        char c = s[i];
+        if ( !( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+                ( c >= '0' && c <= '9' ) || c == ' ' ||
+                EString( "'()+_,-./:=?" ).contains( c ) ) )
+            return false;
+        ++i;
+    }
+    return true;
+}
+
+
+static const char * hex = "0123456789ABCDEF";
+
+
+// The old eQP(), which wrote into a buffer of six bytes per input
+// byte and moved the end of a line back when it broke it.
+
+static EString oldEQP( const EString & s, bool underscore, bool from )
+{
+    if ( s.isEmpty() )
+        return s;
+    uint l = s.length();
+    char * r = (char *)Allocator::alloc( l * 6, 0 );
+    uint n = 0;
+    uint c = 0;
+    uint i = 0;
+    while ( i < l ) {
+        unsigned char ch = s[i];
+        if ( ch == 10 || ( i + 1 < l && ch == 13 && s[i+1] == 10 ) ) {
+            if ( n > 0 && r[n-1] == ' ' ) {
+                r[n-1] = '=';
+                r[n++] = '2';
+                r[n++] = '0';
+            }
+            c = 0;
+            if ( ch == 13 )
+                r[n++] = s[i++];
+            r[n++] = 10;
+        }
+        else {
+            if ( c > 72 ) {
+                uint j = 1;
+                while ( j < 10 && r[n-j] != ' ' )
+                    j++;
+                if ( j >= 10 )
+                    j = 0;
+                else
+                    j--;
+                uint k = 1;
+                while ( k <= j ) {
+                    r[n - k + 3] = r[n - k];
+                    k++;
+                }
+                r[n++ - j] = '=';
+                r[n++ - j] = 13;
+                r[n++ - j] = 10;
+                c = j;
+            }
+
+            bool quote = false;
+            if ( underscore && ch == ' ' ) {
+                r[n++] = '_';
+                c++;
+            }
+            else if ( underscore &&
+                      !( ( ch >= '0' && ch <= '9' ) ||
+                         ( ch >= 'a' && ch <= 'z' ) ||
+                         ( ch >= 'A' && ch <= 'Z' ) ) ) {
+                quote = true;
+            }
+            else if ( from && c == 0 && maybeBoundary( s, i ) ) {
+                quote = true;
+            }
+            else if ( from && c == 0 && l >= i + 4 &&
+                      s.mid( i, 5 ) == "From " ) {
+                quote = true;
+            }
+            else if ( ( ch >= ' ' && ch < 127 && ch != '=' ) ||
+                      ch == '\t' ) {
+                r[n++] = ch;
+                c++;
+            }
+            else {
+                quote = true;
+            }
+            if ( quote ) {
+                r[n++] = '=';
+                r[n++] = hex[ch / 16];
+                r[n++] = hex[ch % 16];
+                c += 3;
+            }
+        }
+        i++;
+    }
+    return EString( r, n );
+}
+
+
+// Returns a random string of l bytes, sometimes all ASCII.
+
+static EString binary( uint l )
+{
+    EString r;
+    r.reserve( l );
+    bool ascii = random( 2 );
+    while ( r.length() < l ) {
+        if ( ascii )
+            r.append( (char)( 32 + random( 95 ) ) );
+        else
+            r.append( (char)random( 256 ) );
+    }
+    return r;
+}
+
+
+// Returns a copy of s with a few random insertions, replacements and
+// deletions.
+
+static EString damaged( const EString & s )
+{
+    static const char * junk[] = {
+        " ", "\r\n", "\t", "\n", "=", "==", "*", "%", "\377", "-"
+    };
+    EString r = s;
+    uint n = random( 4 );
+    while ( n-- && !r.isEmpty() ) {
+        uint i = random( r.length() );
+        uint k = random( 3 );
+        EString j( junk[random( 10 )] );
+        if ( k == 0 )
+            r = r.mid( 0, i ) + j + r.mid( i );
+        else if ( k == 1 )
+            r = r.mid( 0, i ) + j + r.mid( i + 1 );
+        else
+            r = r.mid( 0, i );
+    }
+    return r;
+}
+
+
+// Returns the length of the longest line in s, not counting CRLF or
+// LF.
+
+static uint longestLine( const EString & s )
+{
+    uint max = 0;
+    uint c = 0;
+    uint i = 0;
+    while ( i < s.length() ) {
+        if ( s[i] == 10 ) {
+            if ( c && s[i-1] == 13 )
+                c--;
+            if ( c > max )
+                max = c;
+            c = 0;
+        }
+        else {
+            c++;
+        }
+        i++;
+    }
+    if ( c > max )
+        max = c;
+    return max;
+}
+
+
+// Records the failures of one function, describing only the first.
+
+class Tally
+{
+public:
+    Tally( const EString & n ): name( n ), bad( 0 ) {}
+
+    void note( bool ok, const EString & input, const EString & what ) {
+        if ( ok )
+            return;
+        if ( !bad++ )
+            first = name + ": " + what + " for " + input.quoted();
+    }
+
+    void report() {
+        Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+    }
+
+    EString name;
+    uint bad;
+    EString first;
+};
+
+
+static void testBase64( uint rounds )
+{
+    Tally enc( "e64" ), dec( "de64" ), lines( "e64 line length" );
+    Tally pad( "e64 padding" ), round( "e64+de64" );
+
+    uint r = 0;
+    while ( r++ < rounds ) {
+        EString s = binary( random( 4 ) ? random( 100 ) : random( 1000 ) );
+
+        static const uint lengths[] = { 0, 76, 72, 4, 3, 1, 5, 64 };
+        uint ll = lengths[random( 8 )];
+        if ( !random( 4 ) )
+            ll = 1 + random( 100 );
+
+        EString e = s.e64( ll );
+        EString o = oldE64( s, ll );
+        enc.note( e == o, s, "gave " + e.quoted() + ", expected " +
+                  o.quoted() + " for line length " + fn( ll ) );
+
+        uint max = ll ? ( ll + 3 ) / 4 * 4 : e.length();
+        lines.note( longestLine( e ) <= max, s,
+                    "line length " + fn( ll ) + " gave " + e.quoted() );
+
+        // the digits, without line breaks
+        EString t;
+        uint i = 0;
+        while ( i < e.length() ) {
+            if ( e[i] != 13 && e[i] != 10 )
+                t.append( e[i] );
+            i++;
+        }
+        uint equals = 0;
+        while ( equals < t.length() && t[t.length() - 1 - equals] == '=' )
+            equals++;
+        pad.note( t.length() % 4 == 0 &&
+                  equals == ( 3 - s.length() % 3 ) % 3,
+                  s, "gave " + e.quoted() );
+
+        round.note( e.de64() == s, s, "decoded " + e.quoted() + " as " +
+                    e.de64().quoted() );
+
+        EString d = damaged( e );
+        dec.note( d.de64() == oldDe64( d ), d,
+                  "gave " + d.de64().quoted() + ", expected " +
+                  oldDe64( d ).quoted() );
+        d = binary( random( 40 ) );
+        dec.note( d.de64() == oldDe64( d ), d,
+                  "gave " + d.de64().quoted() + ", expected " +
+                  oldDe64( d ).quoted() );
+    }
+
+    enc.report();
+    dec.report();
+    lines.report();
+    pad.report();
+    round.report();
+}
+
+
+// Returns random text, some of which needs quoting.
+
+static EString text()
+{
+    static const char * pieces[] = {
+        "\r\n", "\n", "\r", " \r\n", "\t\n", "  \n", "=", "==41",
+        "From ", "From", "--boundary", "-- x", "_", "_x_",
+        "\351t\351", "\377", "\001", "\177", " ", "\t", "a", "."
+    };
+    EString r;
+    uint n = random( 40 );
+    while ( n-- ) {
+        uint k = random( 4 );
+        if ( k == 0 ) {
+            r.append( pieces[random( 22 )] );
+        }
+        else if ( k == 1 ) {
+            // a word, sometimes a very long one
+            uint l = random( 3 ) ? 1 + random( 12 ) : 60 + random( 60 );
+            while ( l-- )
+                r.append( (char)( 'a' + random( 26 ) ) );
+        }
+        else {
+            r.append( ' ' );
+        }
+    }
+    return r;
+}
+
+
+static void testQP( uint rounds )
+{
+    Tally enc( "eQP" ), dec( "deQP" ), lines( "eQP line length" );
+    Tally round( "eQP+deQP" );
+
+    uint r = 0;
+    while ( r++ < rounds ) {
+        EString s = text();
+        bool underscore = random( 4 ) == 0;
+        bool from = random( 2 );
+        EString mode = EString( underscore ? "underscore" : "" ) +
+                       ( from ? " from" : "" );
+
+        EString e = s.eQP( underscore, from );
+        EString o = oldEQP( s, underscore, from );
+        enc.note( e == o, s, "gave " + e.quoted() + ", expected " +
+                  o.quoted() + " in mode " + mode.quoted() );
+        lines.note( longestLine( e ) <= 76, s, "gave " + e.quoted() );
+        round.note( e.deQP( underscore ) == s, s,
+                    "decoded " + e.quoted() + " as " +
+                    e.deQP( underscore ).quoted() );
+
+        EString d = damaged( e );
+        if ( random( 2 ) ) {
+            EString escapes( "=\n=4=\r=A=a1= \r\n=  x" );
+            d.append( escapes.mid( random( escapes.length() ) ) );
+        }
+        dec.note( d.deQP( underscore ) == oldDeQP( d, underscore ), d,
+                  "gave " + d.deQP( underscore ).quoted() + ", expected " +
+                  oldDeQP( d, underscore ).quoted() );
+    }
+
+    enc.report();
+    dec.report();
+    lines.report();
+    round.report();
+}
+
+
+void testEString()
+{
+    testBase64( 20000 );
+    testQP( 20000 );
+}
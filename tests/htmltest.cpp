@@ -0,0 +1,184 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "html.h"
+#include "ustring.h"
+#include "entities.h"
+
+
+// This checks that HTML extracts the same text whether its input
+// arrives in one piece or in many, and that each entity name is found
+// in the hash table generated by mkentities.pl.
+//
+// The inputs are random mixtures of text, tags, comments, script and
+// style elements, and character references both good and bad. Each is
+// given to HTML::parse() in chunks split at random points, often
+// inside a tag, a reference or an end tag, and the result must equal
+// that of HTML::asText().
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+// Appends a random piece of HTML to h.
+
+static void append( UString & h )
+{
+    static const char * pieces[] = {
+        "<p>", "<br>", "<BR/>", "<body>", "</p>", "<b>", "</b>",
+        "<a href=\"x>y\">", "<img alt='a&amp;b' src=x>",
+        "<!-- a <b> comment -->", "<!-- -- -- -->", "<!DOCTYPE html>",
+        "<?xml version=\"1.0\"?>",
+        "<script>if ( a<b && c>d ) x = '</p>';</script>",
+        "<SCRIPT type=\"text/javascript\">y = 1;</SCRIPT >",
+        "<style>p { color: red }</style>", "<style\n>a{}</style\n>",
+        "<scripts>not skipped</scripts>", "</script>",
+        "&amp;", "&lt;", "&gt", "&nbsp;", "&eacute;", "&Eacute",
+        "&frac12;", "&notanentity;", "&#65;", "&#66", "&#x43;",
+        "&#X44", "&#xZ;", "&#;", "& ", "&&",
+        "&abcdefghijklmnopqrstuvwxyzabcdefghijkl;",
+        " ", "  ", "\t", "\r\n", "\n\n", "<", ">", "-", "--", "'", "\"",
+        "=", "text", "More text.", "x=y",
+    };
+    uint k = random( 10 );
+    if ( k < 6 ) {
+        h.append( pieces[random( sizeof( pieces ) / sizeof( char * ) )] );
+    }
+    else if ( k < 8 ) {
+        uint n = 1 + random( 20 );
+        while ( n-- )
+            h.append( 'a' + random( 26 ) );
+    }
+    else if ( k < 9 ) {
+        // some non-ASCII, a surrogate now and then
+        static const uint c[] = { 0xe9, 0x3b1, 0x4e2d, 0x1f600, 0xd800,
+                                  0xdc00 };
+        h.append( c[random( sizeof( c ) / sizeof( uint ) )] );
+    }
+    else {
+        // a long reference, or the start of an end tag
+        UString r;
+        r.append( random( 2 ) ? "&" : "</" );
+        uint n = random( 40 );
+        while ( n-- )
+            r.append( 'a' + random( 26 ) );
+        h.append( r );
+    }
+}
+
+
+// Returns the text extracted from h when it's given to HTML in
+// chunks of at most max characters.
+
+static UString chunked( const UString & h, uint max )
+{
+    HTML html;
+    uint i = 0;
+    while ( i < h.length() ) {
+        uint n = 1 + random( max );
+        html.parse( h.mid( i, n ) );
+        i += n;
+    }
+    html.finish();
+    return html.text();
+}
+
+
+static void testChunks( uint rounds )
+{
+    uint bad = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        UString h;
+        uint n = random( 300 );
+        while ( n-- )
+            append( h );
+
+        UString expected = HTML::asText( h );
+        UString got = chunked( h, random( 2 ) ? 8 : 200 );
+        if ( got == expected )
+            continue;
+        if ( !bad++ )
+            first = "HTML " + h.utf8().quoted() + " gave " +
+                    got.utf8().quoted() + " in chunks, " +
+                    expected.utf8().quoted() + " in one";
+    }
+    Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+}
+
+
+static void testEntities()
+{
+    uint bad = 0;
+    EString first;
+    int i = 0;
+    while ( i < ents ) {
+        UString h;
+        h.append( "&" );
+        h.append( entities[i].name );
+        h.append( ";" );
+        UString t = HTML::asText( h );
+        if ( t.length() != 1 || t[0] != (uint)entities[i].chr ) {
+            if ( !bad++ )
+                first = h.utf8() + " gave " + t.utf8().quoted();
+        }
+        i++;
+    }
+    Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+
+    UString h;
+    h.append( "&Amp; &ampx; &amp" );
+    Tests::compare( HTML::asText( h ).utf8(), " &", "Unknown entities" );
+}
+
+
+// Times extracting text from a megabyte of HTML ten times, in one
+// piece and in chunks of 4096 characters.
+
+static void benchmark()
+{
+    UString h;
+    while ( h.length() < 1024 * 1024 )
+        append( h );
+
+    int64 t = Tests::now();
+    uint i = 0;
+    while ( i < 10 ) {
+        HTML::asText( h );
+        i++;
+    }
+    Tests::reportTime( "asText(), 10MB", t );
+
+    t = Tests::now();
+    i = 0;
+    while ( i < 10 ) {
+        HTML html;
+        uint j = 0;
+        while ( j < h.length() ) {
+            html.parse( h.mid( j, 4096 ) );
+            j += 4096;
+        }
+        html.finish();
+        i++;
+    }
+    Tests::reportTime( "parse(), 10MB in 4096-character chunks", t );
+}
+
+
+void testHtml()
+{
+    testChunks( 2000 );
+    testEntities();
+
+    if ( Tests::benchmarking() )
+        benchmark();
+}
@@ -0,0 +1,271 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "file.h"
+#include "ustring.h"
+#include "eventloop.h"
+#include "integerset.h"
+#include "searchindex.h"
+#include "estringlist.h"
+#include "configuration.h"
+
+// mkdtemp
+#include <stdlib.h>
+// opendir, readdir
+#include <sys/types.h>
+#include <dirent.h>
+// mkdir
+#include <sys/stat.h>
+// rmdir
+#include <unistd.h>
+
+
+// This checks SearchIndex against a search-index-directory in /tmp,
+// with no worker threads, so that segments are written at once.
+//
+// User 1 has three messages in mailbox 1 and one in mailbox 2. Each
+// lookup must give the same matches and the same covered messages
+// before the documents are written and after, when they're read back
+// from a segment.
+//
+// Mailbox 3 is only partly covered: UIDs 1-10 and 15 are indexed, but
+// 11 and 12 aren't, and the visible messages are 1-12. restrict()
+// must keep the messages the index doesn't know about, and every
+// matching message must be either in the restriction or above the
+// largest visible UID, which Selector searches regardless.
+//
+// Lastly, user 2's directory is changed behind the index's back: A
+// copy of user 1's segment must be found, a corrupt segment ignored,
+// and a removed segment forgotten.
+
+
+// Looks for text in the mailbox, and checks that the index finds the
+// expected matches and covers the expected messages. what describes
+// the state of the index.
+
+static void lookup( uint user, uint mailbox, const char * text,
+                    const EString & matches, const EString & covered,
+                    const EString & what )
+{
+    UString t;
+    t.append( text );
+    IntegerSet m;
+    IntegerSet c;
+    EString d = EString( what ) + ": \"" + text + "\" in mailbox " +
+                fn( mailbox ) + " of user " + fn( user );
+    Tests::check( SearchIndex::candidates( user, mailbox, t, m, c ),
+                  d + " is indexed" );
+    Tests::compare( m.set(), matches, d + ", matches" );
+    Tests::compare( c.set(), covered, d + ", covered" );
+}
+
+
+// Returns the names of the segments in dir.
+
+static EStringList segments( const EString & dir )
+{
+    EStringList r;
+    DIR * dp = opendir( dir.cstr() );
+    if ( !dp )
+        return r;
+    struct dirent * de;
+    while ( (de=readdir( dp )) != 0 ) {
+        EString name( de->d_name );
+        if ( name.startsWith( "seg-" ) )
+            r.append( name );
+    }
+    closedir( dp );
+    return r;
+}
+
+
+// Returns the name of the segment written.
+
+static EString testLookups( const EString & directory )
+{
+    EString segment;
+    SearchIndex::add( 1, 1, 1, "The quick brown fox" );
+    SearchIndex::add( 1, 1, 2, "jumps over the lazy dog" );
+    SearchIndex::add( 1, 1, 3, "a QUICK, lazy dog" );
+    SearchIndex::add( 1, 2, 1, "quick" );
+
+    uint round = 0;
+    while ( round < 2 ) {
+        EString what = round ? "Written" : "Pending";
+        lookup( 1, 1, "quick", "1,3", "1:3", what );
+        lookup( 1, 1, "Lazy Dog", "2,3", "1:3", what );
+        lookup( 1, 1, "slow", "", "1:3", what );
+        lookup( 1, 2, "quick", "1", "1", what );
+        lookup( 1, 4, "quick", "", "", what );
+        if ( !round ) {
+            SearchIndex::flush( false );
+            EStringList s = segments( directory + "/1" );
+            Tests::check( s.count() == 1, "flush() wrote one segment" );
+            if ( !s.isEmpty() )
+                segment = *s.first();
+        }
+        round++;
+    }
+
+    IntegerSet m;
+    IntegerSet c;
+    UString t;
+    t.append( "qu" );
+    Tests::check( !SearchIndex::candidates( 1, 1, t, m, c ),
+                  "Two-character text isn't looked up" );
+    t.truncate();
+    t.append( 0xe9 );
+    t.append( "quick" );
+    Tests::check( !SearchIndex::candidates( 1, 1, t, m, c ),
+                  "Non-ASCII text isn't looked up" );
+    t.truncate();
+    t.append( "quick" );
+    Tests::check( !SearchIndex::candidates( 3, 1, t, m, c ),
+                  "A user without an index isn't looked up" );
+    return segment;
+}
+
+
+static void testPartialCoverage()
+{
+    uint i = 1;
+    while ( i <= 15 ) {
+        EString text = "message " + fn( i );
+        if ( i == 4 || i == 11 || i == 15 )
+            text.append( " with a needle" );
+        if ( i <= 10 || i == 15 )
+            SearchIndex::add( 1, 3, i, text );
+        i++;
+    }
+
+    // 11 and 15 contain the needle too: 11 isn't indexed, and 15 is,
+    // but isn't visible yet
+    IntegerSet matching;
+    matching.add( 4 );
+    matching.add( 11 );
+    matching.add( 15 );
+    IntegerSet messages;
+    messages.add( 1, 12 );
+
+    uint round = 0;
+    while ( round < 2 ) {
+        EString what = round ? "Written" : "Pending";
+        lookup( 1, 3, "needle", "4,15", "1:10,15", what );
+
+        UString t;
+        t.append( "needle" );
+        IntegerSet r;
+        Tests::check( SearchIndex::restrict( 1, 3, t, messages, r ),
+                      what + ": restrict() narrows the search" );
+        Tests::compare( r.set(), "4,11,12", what + ": restriction" );
+        i = 1;
+        while ( i <= matching.count() ) {
+            uint uid = matching.value( i );
+            Tests::check( uid > messages.largest() || r.contains( uid ),
+                          what + ": message " + fn( uid ) +
+                          " is searched" );
+            i++;
+        }
+
+        // every message contains "message", so that's left to the
+        // database
+        t.truncate();
+        t.append( "message" );
+        Tests::check( !SearchIndex::restrict( 1, 3, t, messages, r ),
+                      what + ": restrict() doesn't narrow \"message\"" );
+        Tests::check( !SearchIndex::restrict( 1, 3, t, IntegerSet(), r ),
+                      what + ": restrict() ignores an empty mailbox" );
+
+        if ( !round )
+            SearchIndex::flush( false );
+        round++;
+    }
+}
+
+
+static void testRefresh( const EString & directory, const EString & name )
+{
+    EString two = directory + "/2";
+    UString t;
+    t.append( "quick" );
+    IntegerSet m;
+    IntegerSet c;
+    Tests::check( !SearchIndex::candidates( 2, 1, t, m, c ),
+                  "User 2 has no index yet" );
+
+    // a copy of user 1's first segment
+    if ( name.isEmpty() )
+        return;
+    File original( directory + "/1/" + name );
+    Tests::check( ::mkdir( two.cstr(), 0700 ) == 0, "mkdir " + two );
+    {
+        File copy( two + "/" + name, File::ExclusiveWrite );
+        copy.write( original.contents() );
+    }
+    lookup( 2, 1, "quick", "1,3", "1:3", "Copied" );
+
+    {
+        File corrupt( two + "/seg-corrupt", File::ExclusiveWrite );
+        corrupt.write( "AOXSI00\n" + original.contents().mid( 8 ) );
+    }
+    lookup( 2, 1, "quick", "1,3", "1:3", "Corrupt segment added" );
+
+    File::unlink( two + "/" + name );
+    m.clear();
+    c.clear();
+    Tests::check( !SearchIndex::candidates( 2, 1, t, m, c ) &&
+                  m.isEmpty() && c.isEmpty(),
+                  "User 2's copied segment was removed" );
+}
+
+
+// Removes the files in each user's directory, and the directories.
+
+static void cleanUp( const EString & directory )
+{
+    uint user = 1;
+    while ( user <= 2 ) {
+        EString dir = directory + "/" + fn( user );
+        DIR * dp = opendir( dir.cstr() );
+        if ( dp ) {
+            EStringList names;
+            struct dirent * de;
+            while ( (de=readdir( dp )) != 0 ) {
+                EString name( de->d_name );
+                if ( name != "." && name != ".." )
+                    names.append( name );
+            }
+            closedir( dp );
+            EStringList::Iterator i( names );
+            while ( i ) {
+                File::unlink( dir + "/" + *i );
+                ++i;
+            }
+            ::rmdir( dir.cstr() );
+        }
+        user++;
+    }
+    ::rmdir( directory.cstr() );
+}
+
+
+void testSearchIndex()
+{
+    // a fresh loop, whose WorkPool does the work at once
+    EventLoop::setup();
+    Configuration::add( "worker-threads = 0" );
+
+    char name[] = "/tmp/searchindextest.XXXXXX";
+    Tests::check( mkdtemp( name ) != 0, "mkdtemp" );
+    EString directory( name );
+    Configuration::add( "search-index-directory = " + directory );
+    Tests::check( SearchIndex::enabled(), "SearchIndex is enabled" );
+    if ( !SearchIndex::enabled() )
+        return;
+
+    EString segment = testLookups( directory );
+    testPartialCoverage();
+    testRefresh( directory, segment );
+    cleanUp( directory );
+}
@@ -0,0 +1,203 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "mailbox.h"
+#include "ustring.h"
+#include "collation.h"
+#include "integerset.h"
+#include "sievematcher.h"
+
+
+// This checks that SieveMatcher gives the same answers as matching
+// each key on its own, the way SieveTest did before it had a matcher.
+//
+// Each round adds a few random :contains, :is and :matches keys to a
+// matcher using i;ascii-casemap, i;octet or i;ascii-numeric, and
+// matches random strings against them. The keys and strings are made
+// from a tiny alphabet with both cases and a non-ASCII letter, so
+// that keys often overlap, share prefixes and suffixes, and differ
+// only in case. Each key has one of a few ids, and matches() is also
+// checked with a random subset of the ids.
+//
+// The classic Aho-Corasick example, "he", "she", "his" and "hers",
+// is checked too.
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+// Returns a random string of at most max characters, with wildcards
+// if wild is true.
+
+static UString string( uint max, bool wild )
+{
+    static const uint c[] = {
+        'a', 'b', 'A', 'B', 0xe9, 0xc9, '1', '*', '%'
+    };
+    UString r;
+    uint n = random( max + 1 );
+    while ( n-- )
+        r.append( c[random( wild ? 9 : 7 )] );
+    return r;
+}
+
+
+// Returns true if key matches s as a :type key compared using c.
+
+static bool naive( const UString & s, const UString & key,
+                   SieveTest::MatchType type, Collation * c )
+{
+    switch ( type ) {
+    case SieveTest::Is:
+        return c->equals( s, key );
+    case SieveTest::Contains:
+        return c->contains( s, key );
+    case SieveTest::Matches:
+        return Mailbox::match( key, 0, s, 0 ) == 2;
+    case SieveTest::Value:
+    case SieveTest::Count:
+        break;
+    }
+    return false;
+}
+
+
+static void testRandom( uint rounds )
+{
+    static const char * collations[] = {
+        "i;ascii-casemap", "i;octet", "i;ascii-numeric"
+    };
+    static const SieveTest::MatchType types[] = {
+        SieveTest::Contains, SieveTest::Is, SieveTest::Matches
+    };
+    static const char * names[] = { ":contains", ":is", ":matches" };
+
+    uint bad = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        UString name;
+        name.append( collations[random( 3 )] );
+        Collation * c = Collation::create( name );
+        SieveMatcher m( c );
+
+        uint n = 1 + random( 8 );
+        UString keys[8];
+        uint type[8];
+        uint id[8];
+        EString description = name.utf8();
+        uint k = 0;
+        while ( k < n ) {
+            type[k] = random( 3 );
+            keys[k] = string( 4, types[type[k]] == SieveTest::Matches );
+            id[k] = 1 + random( 4 );
+            m.add( keys[k], types[type[k]], id[k] );
+            description.append( " " );
+            description.append( names[type[k]] );
+            description.append( " " + keys[k].utf8().quoted() );
+            description.append( "/" + fn( id[k] ) );
+            k++;
+        }
+
+        uint s = 0;
+        while ( s < 10 ) {
+            UString h = string( 12, random( 4 ) == 0 );
+            IntegerSet filter;
+            uint i = 1;
+            while ( i <= 4 ) {
+                if ( random( 2 ) )
+                    filter.add( i );
+                i++;
+            }
+
+            bool any = false;
+            bool filtered = false;
+            k = 0;
+            while ( k < n ) {
+                if ( naive( h, keys[k], types[type[k]], c ) ) {
+                    any = true;
+                    if ( filter.contains( id[k] ) )
+                        filtered = true;
+                }
+                k++;
+            }
+
+            EString problem;
+            if ( m.matches( h ) != any )
+                problem = "matches()";
+            else if ( m.matches( h, filter ) != filtered )
+                problem = "matches( " + filter.set() + " )";
+            if ( !problem.isEmpty() && !bad++ )
+                first = problem + " differs for " + h.utf8().quoted() +
+                        " and " + description;
+            s++;
+        }
+    }
+    Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+}
+
+
+static void testOverlaps()
+{
+    UString name;
+    name.append( "i;ascii-casemap" );
+    SieveMatcher m( Collation::create( name ) );
+    static const char * keys[] = { "he", "SHE", "his", "hers" };
+    uint i = 0;
+    while ( i < 4 ) {
+        UString k;
+        k.append( keys[i] );
+        Tests::check( m.add( k, SieveTest::Contains, i + 1 ),
+                      EString( keys[i] ) + " is compiled" );
+        i++;
+    }
+    Tests::check( m.isComplete() && m.handles( 1 ) && !m.handles( 5 ),
+                  "All keys are compiled" );
+
+    static const struct {
+        const char * haystack;
+        const char * ids;
+    } cases[] = {
+        { "usHers", "1,2,4" },
+        { "ahishe", "1,2,3" },
+        { "shis", "3" },
+        { "HERSHE", "1,2,4" },
+        { "h e r s", "" },
+        { "", "" },
+        { 0, 0 }
+    };
+    i = 0;
+    while ( cases[i].haystack ) {
+        UString h;
+        h.append( cases[i].haystack );
+        IntegerSet found;
+        uint id = 1;
+        while ( id <= 4 ) {
+            IntegerSet f;
+            f.add( id );
+            if ( m.matches( h, f ) )
+                found.add( id );
+            id++;
+        }
+        Tests::compare( found.csl(), cases[i].ids,
+                        EString( "Keys found in " ) + cases[i].haystack );
+        Tests::check( m.matches( h ) == !found.isEmpty(),
+                      EString( "matches( " ) + cases[i].haystack + " )" );
+        i++;
+    }
+}
+
+
+void testSieveMatcher()
+{
+    testRandom( 5000 );
+    testOverlaps();
+}
@@ -0,0 +1,177 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "dsn.h"
+#include "timer.h"
+#include "event.h"
+#include "buffer.h"
+#include "message.h"
+#include "address.h"
+#include "ustring.h"
+#include "listener.h"
+#include "endpoint.h"
+#include "recipient.h"
+#include "eventloop.h"
+#include "smtpclient.h"
+
+// getsockname, sockaddr
+#include <sys/types.h>
+#include <sys/socket.h>
+// sockaddr_in
+#include <netinet/in.h>
+// memset
+#include <string.h>
+
+
+// This sends a message to two recipients via SmtpClient, using a
+// stand-in server on 127.0.0.1 which offers PIPELINING, rejects every
+// RCPT TO, and yet accepts DATA, as RFC 2920 permits. The client must
+// end the empty message with a dot before it sends RSET, and must not
+// send RSET as the message body.
+//
+// The stand-in records each command verb it receives, and each line
+// of message body prefixed by "body:".
+
+
+class SmtpClientTest
+    : public EventHandler
+{
+public:
+    SmtpClientTest( uint port )
+        : dsn( 0 ), timer( 0 )
+    {
+        timer = new Timer( this, 20 );
+
+        Message * m = new Message;
+        m->parse( "From: sender@example.com\r\n"
+                  "To: a@example.com, b@example.com\r\n"
+                  "Subject: test\r\n"
+                  "\r\n"
+                  "Test.\r\n" );
+        dsn = new DSN;
+        dsn->setMessage( m );
+        dsn->setSender( new Address( UString(), "sender", "example.com" ) );
+        Recipient * r = new Recipient;
+        r->setFinalRecipient( new Address( UString(), "a", "example.com" ) );
+        dsn->addRecipient( r );
+        r = new Recipient;
+        r->setFinalRecipient( new Address( UString(), "b", "example.com" ) );
+        dsn->addRecipient( r );
+
+        SmtpClient * c = new SmtpClient( "127.0.0.1", port );
+        c->send( dsn, this );
+    }
+
+    DSN * dsn;
+    Timer * timer;
+    EString transcript;
+
+    void execute()
+    {
+        if ( timer->active() && !transcript.endsWith( "rset" ) )
+            return;
+
+        Tests::compare( transcript, "ehlo mail rcpt rcpt data . rset",
+                        "Commands after all RCPT TO were rejected" );
+        Tests::check( dsn->allFailed(),
+                      "Both recipients failed after 550" );
+        EventLoop::global()->stop();
+    }
+};
+
+
+// the stand-in's test; the timer keeps it from being collected
+static SmtpClientTest * test = 0;
+
+
+class StandInSmtp
+    : public Connection
+{
+public:
+    StandInSmtp( int fd )
+        : Connection( fd, Connection::Client ), data( false )
+    {
+        EventLoop::global()->addConnection( this );
+        enqueue( "220 stand-in\r\n" );
+    }
+
+    bool data;
+
+    void react( Event e )
+    {
+        if ( e != Read ) {
+            setState( Closing );
+            return;
+        }
+        if ( !test )
+            return;
+        EString * l;
+        while ( (l=readBuffer()->removeLine()) != 0 ) {
+            if ( !test->transcript.isEmpty() )
+                test->transcript.append( " " );
+            if ( data ) {
+                if ( *l == "." ) {
+                    test->transcript.append( "." );
+                    enqueue( "554 no valid recipients\r\n" );
+                    data = false;
+                }
+                else {
+                    test->transcript.append( "body:" + *l );
+                }
+                continue;
+            }
+            EString verb = l->section( " ", 1 ).lower();
+            test->transcript.append( verb );
+            if ( verb == "ehlo" ) {
+                enqueue( "250-stand-in\r\n250 PIPELINING\r\n" );
+            }
+            else if ( verb == "mail" ) {
+                enqueue( "250 ok\r\n" );
+            }
+            else if ( verb == "rcpt" ) {
+                enqueue( "550 no such user\r\n" );
+            }
+            else if ( verb == "data" ) {
+                enqueue( "354 go ahead\r\n" );
+                data = true;
+            }
+            else if ( verb == "rset" ) {
+                enqueue( "250 ok\r\n" );
+                test->notify();
+            }
+            else {
+                enqueue( "221 bye\r\n" );
+                setState( Closing );
+            }
+        }
+    }
+};
+
+
+void testSmtpClient()
+{
+    // a fresh loop, since an earlier driver may have stopped its own
+    EventLoop::setup();
+
+    // any free port will do, but Endpoint( address, port ) insists
+    // on a port, so this starts from a sockaddr
+    struct sockaddr_in a;
+    memset( &a, 0, sizeof( a ) );
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t n = sizeof( a );
+    Listener<StandInSmtp> * l
+        = new Listener<StandInSmtp>( Endpoint( (struct sockaddr *)&a, n ),
+                                     "stand-in smtp server" );
+    uint port = 0;
+    if ( l->valid() &&
+         ::getsockname( l->fd(), (struct sockaddr *)&a, &n ) >= 0 )
+        port = ntohs( a.sin_port );
+    Tests::check( port != 0, "stand-in SMTP server started" );
+    if ( !port )
+        return;
+
+    test = new SmtpClientTest( port );
+    EventLoop::global()->start();
+}
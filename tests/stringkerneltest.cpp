@@ -0,0 +1,492 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "allocator.h"
+#include "stringkernel.h"
+
+// memcmp, memcpy, memset
+#include <string.h>
+
+
+// This compares each StringKernel function with a plain loop which
+// looks at one byte or code point at a time, as the scalar fallback
+// does. The inputs are random, at every alignment and at lengths on
+// both sides of each vector width, so that the vector loops, their
+// tails and the fallback all get their turn. The matches are sparse,
+// so they land anywhere within a vector.
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+// Fills the l bytes at s with quiet, which the function being tested
+// passes over, sprinkled with a few of the bytes in noisy.
+
+static void fill( char * s, uint l, char quiet, const char * noisy )
+{
+    uint n = strlen( noisy );
+    uint odds = 1 + random( 64 );
+    uint i = 0;
+    while ( i < l ) {
+        if ( !random( odds ) )
+            s[i] = noisy[random( n )];
+        else
+            s[i] = quiet;
+        i++;
+    }
+}
+
+
+// Records the failures of one function, describing only the first.
+
+class Tally
+{
+public:
+    Tally( const EString & n ): name( n ), bad( 0 ) {}
+
+    void note( int got, int expected, const char * s, uint l ) {
+        if ( got == expected )
+            return;
+        if ( !bad++ )
+            first = name + ": got " + fn( got ) +
+                    ", expected " + fn( expected ) + " for " +
+                    EString( s, l ).quoted();
+    }
+
+    void report() {
+        Tests::check( !bad, first + " (" + fn( bad ) + " failures)" );
+    }
+
+    EString name;
+    uint bad;
+    EString first;
+};
+
+
+static int findByte( const char * s, uint l, char c )
+{
+    uint i = 0;
+    while ( i < l && s[i] != c )
+        i++;
+    return i < l ? (int)i : -1;
+}
+
+
+static int findString( const char * h, uint hl, const char * n, uint nl )
+{
+    if ( nl > hl )
+        return -1;
+    uint i = 0;
+    while ( i + nl <= hl ) {
+        if ( !memcmp( h + i, n, nl ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+static int findLineEnd( const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l && s[i] != 13 && s[i] != 10 )
+        i++;
+    return i < l ? (int)i : -1;
+}
+
+
+static int findWhitespace( const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l && s[i] != 9 && s[i] != 10 && s[i] != 13 && s[i] != 32 )
+        i++;
+    return i < l ? (int)i : -1;
+}
+
+
+static int findRange( const char * s, uint l, char a, char z )
+{
+    uint i = 0;
+    while ( i < l && ( s[i] < a || s[i] > z ) )
+        i++;
+    return i < l ? (int)i : -1;
+}
+
+
+static bool isPrintable( uint c )
+{
+    return ( c >= 32 && c < 128 ) || c == 9 || c == 10 || c == 13;
+}
+
+
+static uint asciiSpan( const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l && isPrintable( (unsigned char)s[i] ) )
+        i++;
+    return i;
+}
+
+
+static uint qpSafeSpan( const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l && ( ( (unsigned char)s[i] >= 32 &&
+                         (unsigned char)s[i] <= 126 && s[i] != '=' ) ||
+                       s[i] == 9 ) )
+        i++;
+    return i;
+}
+
+
+static bool is7Bit( const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l && !( s[i] & 0x80 ) )
+        i++;
+    return i == l;
+}
+
+
+static void lower( char * d, const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l ) {
+        d[i] = s[i];
+        if ( d[i] >= 'A' && d[i] <= 'Z' )
+            d[i] += 32;
+        i++;
+    }
+}
+
+
+static void upper( char * d, const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l ) {
+        d[i] = s[i];
+        if ( d[i] >= 'a' && d[i] <= 'z' )
+            d[i] -= 32;
+        i++;
+    }
+}
+
+
+static const char * base64 =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static uint decode64( char * d, const char * s, uint l )
+{
+    uint i = 0;
+    while ( i + 4 <= l ) {
+        uint w = 0;
+        uint j = 0;
+        while ( j < 4 ) {
+            const char * p = s[i+j] ? strchr( base64, s[i+j] ) : 0;
+            if ( !p )
+                return i;
+            w = ( w << 6 ) | ( p - base64 );
+            j++;
+        }
+        *d++ = w >> 16;
+        *d++ = w >> 8;
+        *d++ = w;
+        i += 4;
+    }
+    return i;
+}
+
+
+static void encode64( char * d, const char * s, uint l )
+{
+    uint i = 0;
+    while ( i < l ) {
+        uint w = ( (unsigned char)s[i] << 16 ) |
+                 ( (unsigned char)s[i+1] << 8 ) | (unsigned char)s[i+2];
+        *d++ = base64[w >> 18];
+        *d++ = base64[( w >> 12 ) & 63];
+        *d++ = base64[( w >> 6 ) & 63];
+        *d++ = base64[w & 63];
+        i += 3;
+    }
+}
+
+
+template<class T>
+static int findPoint( const T * s, uint l, uint c )
+{
+    uint i = 0;
+    while ( i < l && s[i] != c )
+        i++;
+    return i < l ? (int)i : -1;
+}
+
+
+template<class T>
+static int findPoints( const T * h, uint hl, const T * n, uint nl )
+{
+    if ( nl > hl )
+        return -1;
+    uint i = 0;
+    while ( i + nl <= hl ) {
+        if ( !memcmp( h + i, n, nl * sizeof( T ) ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+template<class T>
+static bool isAsciiPoints( const T * s, uint l )
+{
+    uint i = 0;
+    while ( i < l && isPrintable( s[i] ) )
+        i++;
+    return i == l;
+}
+
+
+static const uint Max = 160;
+
+
+// The benchmark adds its results here, so the compiler can't drop
+// the work.
+
+static volatile int sink;
+
+
+static void testBytes( uint rounds )
+{
+    Tally find1( "find(char)" ), findN( "find(char *)" );
+    Tally lineEnd( "findLineEnd" ), ws( "findWhitespace" );
+    Tally up( "findUpper" ), low( "findLower" );
+    Tally span( "asciiSpan" ), ascii( "isAscii(char *)" );
+    Tally qp( "qpSafeSpan" ), seven( "is7Bit" );
+    Tally lc( "lower" ), uc( "upper" );
+
+    char buf[Max + 64];
+    char a[Max + 64];
+    char b[Max + 64];
+    uint r = 0;
+    while ( r++ < rounds ) {
+        char * s = buf + random( 32 );
+        uint l = random( Max );
+
+        fill( s, l, 'a', "bab\r\n" );
+        find1.note( StringKernel::find( s, l, 'b' ),
+                    findByte( s, l, 'b' ), s, l );
+        lineEnd.note( StringKernel::findLineEnd( s, l ),
+                      findLineEnd( s, l ), s, l );
+        uint nl = 1 + random( 4 );
+        const char * n = "abab" + random( 5 - nl );
+        findN.note( StringKernel::find( s, l, n, nl ),
+                    findString( s, l, n, nl ), s, l );
+
+        fill( s, l, 'x', " \t\r\n\v\f\b" );
+        ws.note( StringKernel::findWhitespace( s, l ),
+                 findWhitespace( s, l ), s, l );
+
+        fill( s, l, '5', "aAzZ@[`{\300" );
+        up.note( StringKernel::findUpper( s, l ),
+                 findRange( s, l, 'A', 'Z' ), s, l );
+        low.note( StringKernel::findLower( s, l ),
+                  findRange( s, l, 'a', 'z' ), s, l );
+        StringKernel::lower( a, s, l );
+        lower( b, s, l );
+        lc.note( memcmp( a, b, l ), 0, s, l );
+        memcpy( a, s, l );
+        StringKernel::upper( a, a, l );
+        upper( b, s, l );
+        uc.note( memcmp( a, b, l ), 0, s, l );
+
+        fill( s, l, 'q', "\t\r\n\001\037\040\176\177\200\377=" );
+        span.note( StringKernel::asciiSpan( s, l ), asciiSpan( s, l ),
+                   s, l );
+        ascii.note( StringKernel::isAscii( s, l ),
+                    asciiSpan( s, l ) == l, s, l );
+        qp.note( StringKernel::qpSafeSpan( s, l ), qpSafeSpan( s, l ),
+                 s, l );
+        seven.note( StringKernel::is7Bit( s, l ), is7Bit( s, l ), s, l );
+    }
+
+    find1.report();
+    findN.report();
+    lineEnd.report();
+    ws.report();
+    up.report();
+    low.report();
+    lc.report();
+    uc.report();
+    span.report();
+    ascii.report();
+    qp.report();
+    seven.report();
+}
+
+
+static void testBase64( uint rounds )
+{
+    Tally dec( "decode64" ), enc( "encode64" ), round( "encode64+decode64" );
+
+    char buf[Max + 64];
+    char a[Max + 64];
+    char b[Max + 64];
+    uint r = 0;
+    while ( r++ < rounds ) {
+        char * s = buf + random( 32 );
+        uint l = random( Max );
+
+        uint i = 0;
+        while ( i < l )
+            s[i++] = base64[random( 64 )];
+        if ( l && !random( 2 ) )
+            s[random( l )] = "=\r\n %"[random( 5 )];
+        memset( a, 0, sizeof( a ) );
+        memset( b, 0, sizeof( b ) );
+        uint al = StringKernel::decode64( a, s, l );
+        uint bl = decode64( b, s, l );
+        dec.note( al, bl, s, l );
+        dec.note( memcmp( a, b, bl / 4 * 3 ), 0, s, l );
+
+        l = l / 3 * 3;
+        StringKernel::encode64( a, s, l );
+        encode64( b, s, l );
+        enc.note( memcmp( a, b, l / 3 * 4 ), 0, s, l );
+        round.note( StringKernel::decode64( b, a, l / 3 * 4 ), l / 3 * 4,
+                    s, l );
+        round.note( memcmp( b, s, l ), 0, s, l );
+    }
+
+    dec.report();
+    enc.report();
+    round.report();
+}
+
+
+template<class T>
+static void testPoints( const EString & type, uint rounds )
+{
+    Tally find1( "find(" + type + ", uint)" );
+    Tally findN( "find(" + type + ", " + type + ")" );
+    Tally ascii( "isAscii(" + type + ")" );
+    T buf[Max + 16];
+    uint r = 0;
+    while ( r++ < rounds ) {
+        T * s = buf + random( 8 );
+        uint l = random( Max );
+        uint odds = 1 + random( 64 );
+        static const uint noisy[] = { 0, 9, 10, 13, 31, 127, 128, 0xe9,
+                                      0x2028, 0xfffe, 0x1f600 };
+        uint i = 0;
+        while ( i < l ) {
+            uint c = 'a';
+            if ( !random( odds ) )
+                c = noisy[random( sizeof( noisy ) / sizeof( uint ) )];
+            s[i++] = (T)c;
+        }
+
+        uint c = noisy[random( sizeof( noisy ) / sizeof( uint ) )];
+        if ( c == (T)c )
+            find1.note( StringKernel::find( s, l, c ),
+                        findPoint( s, l, c ), "", 0 );
+        uint nl = 1 + random( 3 );
+        T n[3];
+        n[0] = (T)c;
+        n[1] = 'a';
+        n[2] = (T)c;
+        findN.note( StringKernel::find( s, l, n, nl ),
+                    findPoints( s, l, n, nl ), "", 0 );
+        ascii.note( StringKernel::isAscii( s, l ),
+                    isAsciiPoints( s, l ), "", 0 );
+    }
+
+    find1.report();
+    findN.report();
+    ascii.report();
+}
+
+
+// Times StringKernel and the plain loops on a megabyte without
+// matches, which is what the scans mostly see.
+
+static void benchmark()
+{
+    uint l = 1024 * 1024;
+    char * s = (char *)Allocator::alloc( l + 16, 0 );
+    char * d = (char *)Allocator::alloc( l + 16, 0 );
+    uint i = 0;
+    while ( i < l ) {
+        s[i] = base64[i % 61];
+        i++;
+    }
+    uint rounds = 100;
+    // every other round starts a little later, so that the compiler
+    // can't hoist the work out of the loop
+
+    int64 t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += StringKernel::findLineEnd( s + ( i & 1 ), l - 1 );
+    Tests::reportTime( "findLineEnd, 100MB", t );
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += findLineEnd( s + ( i & 1 ), l - 1 );
+    Tests::reportTime( "findLineEnd, 100MB, plain loop", t );
+
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += StringKernel::find( s + ( i & 1 ), l - 1, "=\r\n", 3 );
+    Tests::reportTime( "find(char *), 100MB", t );
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += findString( s + ( i & 1 ), l - 1, "=\r\n", 3 );
+    Tests::reportTime( "find(char *), 100MB, plain loop", t );
+
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += StringKernel::is7Bit( s + ( i & 1 ), l - 1 );
+    Tests::reportTime( "is7Bit, 100MB", t );
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += is7Bit( s + ( i & 1 ), l - 1 );
+    Tests::reportTime( "is7Bit, 100MB, plain loop", t );
+
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        StringKernel::lower( d, s + ( i & 1 ) * 4, l - 4 );
+    Tests::reportTime( "lower, 100MB", t );
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        lower( d, s + ( i & 1 ) * 4, l - 4 );
+    Tests::reportTime( "lower, 100MB, plain loop", t );
+
+    l = l / 4 * 4;
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += StringKernel::decode64( d, s + ( i & 1 ) * 4, l - 4 );
+    Tests::reportTime( "decode64, 100MB", t );
+    t = Tests::now();
+    for ( i = 0; i < rounds; i++ )
+        sink += decode64( d, s + ( i & 1 ) * 4, l - 4 );
+    Tests::reportTime( "decode64, 100MB, plain loop", t );
+}
+
+
+void testStringKernel()
+{
+    testBytes( 200000 );
+    testBase64( 100000 );
+    testPoints<ushort>( "ushort *", 100000 );
+    testPoints<uint>( "uint *", 100000 );
+    if ( Tests::benchmarking() )
+        benchmark();
+}
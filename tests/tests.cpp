@@ -0,0 +1,157 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "scope.h"
+#include "entropy.h"
+#include "allocator.h"
+#include "eventloop.h"
+#include "configuration.h"
+#include "stderrlogger.h"
+
+#include <stdio.h> // fprintf
+#include <string.h> // strcmp
+#include <sys/time.h> // gettimeofday
+
+
+static uint checks = 0;
+static uint failed = 0;
+static bool benchmarks = false;
+
+
+static const struct {
+    const char * name;
+    void (*run)();
+} tests[] = {
+    { "dnsquery", testDnsQuery },
+    { "stringkernel", testStringKernel },
+    { "codecs", testCodecs },
+    { "date", testDate },
+    { "html", testHtml },
+    { "smtpclient", testSmtpClient },
+    { "ustring", testUString },
+    { "searchindex", testSearchIndex },
+    { "sievematcher", testSieveMatcher },
+    { "estring", testEString },
+    { 0, 0 }
+};
+
+
+/*! \class Tests tests.h
+
+    The Tests class provides the little the test drivers in this
+    directory share: It counts checks and reports those which fail.
+
+    Each driver is a function which calls check() or compare() as it
+    goes. main() runs the drivers named on the command line, or all of
+    them, and exits with status 1 if any check failed.
+
+    If the first argument is -b, the drivers which can also time
+    their code do so, and print the results.
+*/
+
+
+/*! Records a check, which succeeded if \a ok is true. If not, \a what
+    is reported on stderr.
+*/
+
+void Tests::check( bool ok, const EString & what )
+{
+    checks++;
+    if ( ok )
+        return;
+    failed++;
+    fprintf( stderr, "Failed: %s\n", what.cstr() );
+}
+
+
+/*! Records a check that \a got equals \a expected, and reports both
+    and \a what if not.
+*/
+
+void Tests::compare( const EString & got, const EString & expected,
+                     const EString & what )
+{
+    check( got == expected,
+           what + ": expected " + expected.quoted() + ", got " +
+           got.quoted() );
+}
+
+
+/*! Returns the number of failed checks so far. */
+
+uint Tests::failures()
+{
+    return failed;
+}
+
+
+/*! Returns true if the drivers should time their code as well as
+    check it.
+*/
+
+bool Tests::benchmarking()
+{
+    return benchmarks;
+}
+
+
+/*! Returns the current time in microseconds, for use with
+    reportTime().
+*/
+
+int64 Tests::now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*! Prints \a what and the time elapsed since \a start, which now()
+    returned.
+*/
+
+void Tests::reportTime( const EString & what, int64 start )
+{
+    int64 us = now() - start;
+    fprintf( stdout, "    %s: %d.%03d ms\n", what.cstr(),
+             (int)( us / 1000 ), (int)( us % 1000 ) );
+}
+
+
+int main( int argc, char ** argv )
+{
+    Scope global;
+
+    Configuration::setup( "" );
+    Entropy::setup();
+    EventLoop::setup();
+    Log * l = new Log;
+    Allocator::addEternal( l, "tests log" );
+    global.setLog( l );
+    Allocator::addEternal( new StderrLogger( "tests", 0 ), "log object" );
+
+    int first = 1;
+    if ( argc > 1 && !strcmp( argv[1], "-b" ) ) {
+        benchmarks = true;
+        first = 2;
+    }
+
+    uint i = 0;
+    while ( tests[i].name ) {
+        int a = first;
+        while ( a < argc && strcmp( argv[a], tests[i].name ) )
+            a++;
+        if ( argc == first || a < argc ) {
+            uint before = failed;
+            tests[i].run();
+            fprintf( stdout, "%s: %s\n", tests[i].name,
+                     failed > before ? "failed" : "ok" );
+        }
+        i++;
+    }
+
+    fprintf( stdout, "%d checks, %d failed\n", checks, failed );
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,34 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TESTS_H
+#define TESTS_H
+
+#include "estring.h"
+
+
+class Tests
+{
+public:
+    static void check( bool, const EString & );
+    static void compare( const EString &, const EString &, const EString & );
+    static uint failures();
+
+    static bool benchmarking();
+    static int64 now();
+    static void reportTime( const EString &, int64 );
+};
+
+
+void testDnsQuery();
+void testStringKernel();
+void testCodecs();
+void testDate();
+void testHtml();
+void testSmtpClient();
+void testUString();
+void testSearchIndex();
+void testSieveMatcher();
+void testEString();
+
+
+#endif
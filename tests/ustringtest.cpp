@@ -0,0 +1,422 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tests.h"
+
+#include "dict.h"
+#include "ustring.h"
+
+
+// This checks that UString behaves the same however wide its storage
+// is. A string is stored one, two or four bytes per code point,
+// whichever its widest code point needs, but mid() and truncate() can
+// leave a string wider than that. Each random string is made in each
+// width it fits, and the copies must be ==, compare() equal to each
+// other, have the same key() and be found in a UDict under each
+// other's name. compare(), find(), startsWith(), endsWith() and
+// contains() are checked against loops over operator[], and
+// titlecased(), simplified() and trimmed() must give the same code
+// points in every width.
+//
+// Lastly, some strings whose storage contains the same bytes, such
+// as "AB" and U+4241 on a little-endian CPU, must have different
+// keys.
+
+
+static uint seed = 1;
+
+
+static uint random( uint n )
+{
+    seed = seed * 1103515245 + 12345;
+    return ( seed >> 8 ) % n;
+}
+
+
+// Returns a random string, and sets width to the narrowest width that
+// can store it.
+
+static UString string( uint & width )
+{
+    static const uint c[] = {
+        'a', 'b', 'A', 'B', 'z', '.', ' ', ' ', '\t', '\n', 0,
+        0xa0, 0xb5, 0xe9, 0xc9, 0xff, 0xfe,
+        0x178, 0x3b1, 0x391, 0x1680, 0x2002, 0x3000, 0xfeff, 0x4241,
+        0x10428, 0x10400, 0x1f600
+    };
+    UString r;
+    width = 1;
+    uint n = random( 12 );
+    // mostly Latin-1, sometimes BMP, now and then more
+    uint limit = sizeof( c ) / sizeof( uint );
+    uint k = random( 4 );
+    if ( k < 2 )
+        limit = 17;
+    else if ( k < 3 )
+        limit = 25;
+    while ( n-- ) {
+        uint cp = c[random( limit )];
+        if ( cp >= 0x10000 )
+            width = 4;
+        else if ( cp >= 0x100 && width < 2 )
+            width = 2;
+        r.append( cp );
+    }
+    return r;
+}
+
+
+// Returns a copy of s which is stored w bytes wide. w must be at
+// least as wide as s needs.
+
+static UString stored( const UString & s, uint w )
+{
+    if ( w == 1 )
+        return s;
+    UString r;
+    r.append( w == 2 ? 0x100 : 0x10000 );
+    r.append( s );
+    return r.mid( 1 );
+}
+
+
+// Returns a random width at least as wide as w.
+
+static uint wider( uint w )
+{
+    while ( w < 4 && random( 2 ) )
+        w *= 2;
+    return w;
+}
+
+
+// Returns the code points in s, for reporting.
+
+static EString describe( const UString & s )
+{
+    EString r;
+    uint i = 0;
+    while ( i < s.length() ) {
+        if ( i )
+            r.append( " " );
+        r.append( "U+" );
+        r.appendNumber( s[i], 16 );
+        i++;
+    }
+    return "(" + r + ")";
+}
+
+
+// Returns true if a and b contain the same code points, checked via
+// operator[].
+
+static bool same( const UString & a, const UString & b )
+{
+    if ( a.length() != b.length() )
+        return false;
+    uint i = 0;
+    while ( i < a.length() && a[i] == b[i] )
+        i++;
+    return i == a.length();
+}
+
+
+static int naiveCompare( const UString & a, const UString & b )
+{
+    uint i = 0;
+    while ( i < a.length() && i < b.length() && a[i] == b[i] )
+        i++;
+    if ( i == a.length() && i == b.length() )
+        return 0;
+    if ( i == a.length() )
+        return -1;
+    if ( i == b.length() || a[i] > b[i] )
+        return 1;
+    return -1;
+}
+
+
+static int naiveFind( const UString & h, const UString & n, uint from )
+{
+    uint i = from;
+    while ( i + n.length() <= h.length() ) {
+        uint j = 0;
+        while ( j < n.length() && h[i+j] == n[j] )
+            j++;
+        if ( j == n.length() )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
+// Reports the first of bad failures, if any.
+
+static void report( const char * what, uint bad, const EString & first )
+{
+    Tests::check( !bad, EString( what ) + ": " + first +
+                  " (" + fn( bad ) + " failures)" );
+}
+
+
+static void testWidths( uint rounds )
+{
+    uint bad = 0;
+    EString first;
+    UDict<UString> dict;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        uint w;
+        UString s = string( w );
+        UString copies[3];
+        uint n = 0;
+        while ( w <= 4 ) {
+            copies[n++] = stored( s, w );
+            w *= 2;
+        }
+        UString * value = new UString( s );
+        dict.insert( copies[random( n )], value );
+
+        uint i = 0;
+        while ( i < n ) {
+            uint j = 0;
+            while ( j < n ) {
+                const UString & a = copies[i];
+                const UString & b = copies[j];
+                EString problem;
+                if ( !( a == b ) || a != b )
+                    problem = "==";
+                else if ( a.compare( b ) || a < b || a > b )
+                    problem = "compare()";
+                else if ( a.key() != b.key() )
+                    problem = "key()";
+                else if ( dict.find( b ) != value )
+                    problem = "UDict";
+                else if ( !same( a.titlecased(), b.titlecased() ) )
+                    problem = "titlecased()";
+                else if ( !same( a.simplified(), b.simplified() ) )
+                    problem = "simplified()";
+                else if ( !same( a.trimmed(), b.trimmed() ) )
+                    problem = "trimmed()";
+                if ( !problem.isEmpty() && !bad++ )
+                    first = problem + " differs for " + describe( s );
+                j++;
+            }
+            i++;
+        }
+    }
+    report( "Same string in different widths", bad, first );
+}
+
+
+static void testComparisons( uint rounds )
+{
+    uint bad = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        uint aw, bw;
+        UString a = string( aw );
+        UString b = string( bw );
+        if ( random( 3 ) ) {
+            // often with a common prefix
+            b = a.mid( 0, random( a.length() + 1 ) ) + b;
+            if ( aw > bw )
+                bw = aw;
+        }
+        a = stored( a, wider( aw ) );
+        b = stored( b, wider( bw ) );
+
+        EString problem;
+        int c = a.compare( b );
+        if ( c != naiveCompare( a, b ) )
+            problem = "compare() gave " + fn( c );
+        else if ( ( a == b ) != ( c == 0 ) )
+            problem = "==";
+        else if ( ( a.key() == b.key() ) != ( c == 0 ) )
+            problem = "key()";
+        else if ( a.find( b ) != naiveFind( a, b, 0 ) )
+            problem = "find() gave " + fn( a.find( b ) );
+        else if ( b.find( a.mid( 1, 2 ), 1 ) !=
+                  ( a.length() < 2 ? 1 : naiveFind( b, a.mid( 1, 2 ), 1 ) ) )
+            problem = "find( mid(), 1 )";
+        else if ( b.startsWith( a ) != ( naiveFind( b.mid( 0, a.length() ),
+                                                    a, 0 ) == 0 ) )
+            problem = "startsWith()";
+        if ( !problem.isEmpty() && !bad++ )
+            first = problem + " for " + describe( a ) + " and " +
+                    describe( b );
+    }
+    report( "Comparisons", bad, first );
+}
+
+
+// Checks the functions which take a Latin-1 char *.
+
+static void testLatin1( uint rounds )
+{
+    uint bad = 0;
+    EString first;
+    uint r = 0;
+    while ( r++ < rounds ) {
+        uint w;
+        UString s = string( w );
+        s = stored( s, wider( w ) );
+        EString l;
+        uint n = random( 4 );
+        while ( n-- )
+            l.append( "ab .\xe9\xff"[random( 6 )] );
+        UString u;
+        uint i = 0;
+        while ( i < l.length() )
+            u.append( (uint)(unsigned char)l[i++] );
+
+        EString problem;
+        if ( s.startsWith( l.cstr() ) != ( naiveFind( s.mid( 0, u.length() ),
+                                                      u, 0 ) == 0 ) )
+            problem = "startsWith()";
+        else if ( s.endsWith( l.cstr() ) !=
+                  ( u.length() <= s.length() &&
+                    naiveFind( s, u, s.length() - u.length() ) >= 0 ) )
+            problem = "endsWith()";
+        else if ( s.contains( l.cstr() ) != ( naiveFind( s, u, 0 ) >= 0 ) )
+            problem = "contains()";
+        if ( !problem.isEmpty() && !bad++ )
+            first = problem + " for " + describe( s ) + " and " +
+                    l.quoted();
+    }
+    report( "Latin-1 arguments", bad, first );
+}
+
+
+static void testTitlecase()
+{
+    static const uint lower[] = { 'a', 0xe9, 0xff, 0xb5, 0x3b1, 0x10428 };
+    static const uint upper[] = { 'A', 0xc9, 0x178, 0x39c, 0x391, 0x10400 };
+    uint i = 0;
+    while ( i < 6 ) {
+        // each code point in a string of each width
+        uint w = 1;
+        while ( w <= 4 ) {
+            UString s;
+            s.append( "x" );
+            s.append( lower[i] );
+            s.append( 0xdf );
+            s = stored( s, w > 1 && lower[i] >= 0x10000 ? 4 : w );
+            UString t = s.titlecased();
+            UString e;
+            e.append( "X" );
+            e.append( upper[i] );
+            e.append( 0xdf );
+            Tests::check( same( t, e ),
+                          describe( s ) + ".titlecased() gave " +
+                          describe( t ) );
+            w *= 2;
+        }
+        i++;
+    }
+}
+
+
+static void testKeys()
+{
+    // the same bytes in memory, at least on little-endian CPUs
+    UString ab;
+    ab.append( "AB" );
+    UString u4241;
+    u4241.append( 0x4241 );
+    UString bytes;
+    bytes.append( 0u );
+    bytes.append( 0xf6 );
+    bytes.append( 0x01 );
+    bytes.append( 0u );
+    UString pair;
+    pair.append( 0xf600 );
+    pair.append( 0x0001 );
+    UString smiley;
+    smiley.append( 0x1f600 );
+
+    UString * all[] = { &ab, &u4241, &bytes, &pair, &smiley };
+    UDict<UString> dict;
+    uint i = 0;
+    while ( i < 5 ) {
+        dict.insert( *all[i], all[i] );
+        i++;
+    }
+    i = 0;
+    while ( i < 5 ) {
+        uint j = 0;
+        while ( j < 5 ) {
+            UString s = stored( *all[i], 4 );
+            if ( i != j )
+                Tests::check( s.key() != all[j]->key(),
+                              "key() for " + describe( s ) + " and " +
+                              describe( *all[j] ) );
+            j++;
+        }
+        Tests::check( dict.find( stored( *all[i], 4 ) ) == all[i],
+                      "UDict finds " + describe( *all[i] ) );
+        i++;
+    }
+
+    dict.remove( stored( u4241, 4 ) );
+    Tests::check( !dict.contains( u4241 ) && dict.contains( ab ),
+                  "UDict removes U+4241, but not \"AB\"" );
+}
+
+
+static volatile uint sink;
+
+
+// Looks each of the 256 names up in dict a million times in all, and
+// reports the time as what.
+
+static void time( const UDict<UString> & dict, const UString * names,
+                  const char * what )
+{
+    int64 t = Tests::now();
+    uint i = 0;
+    while ( i < 1000000 ) {
+        if ( dict.find( names[i % 256] ) )
+            sink++;
+        i++;
+    }
+    Tests::reportTime( EString( what ) + ", 1000000 lookups", t );
+}
+
+
+// Times UDict lookups of a few hundred names, stored in one and in
+// two bytes per code point.
+
+static void benchmark()
+{
+    UDict<UString> dict;
+    UString names[256];
+    UString wide[256];
+    uint i = 0;
+    while ( i < 256 ) {
+        names[i].append( "INBOX/" );
+        uint n = 4 + random( 20 );
+        while ( n-- )
+            names[i].append( 'a' + random( 26 ) );
+        dict.insert( names[i], names + i );
+        wide[i] = stored( names[i], 2 );
+        i++;
+    }
+
+    time( dict, names, "UDict::find(), one-byte names" );
+    time( dict, wide, "UDict::find(), two-byte names" );
+}
+
+
+void testUString()
+{
+    testWidths( 20000 );
+    testComparisons( 20000 );
+    testLatin1( 20000 );
+    testTitlecase();
+    testKeys();
+
+    if ( Tests::benchmarking() )
+        benchmark();
+}